@@ -0,0 +1,1832 @@
+/*********************************************************
+ * Copyright (C) 2016 VMware, Inc. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation version 2.1 and no later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the Lesser GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA.
+ *
+ *********************************************************/
+
+/*
+ * hgfsDirNotifyLinux.c --
+ *
+ *	Directory change notification support for Linux, built on inotify.
+ *
+ *	inotify watches are not recursive, so a recursive subscriber holds a
+ *	watch on every directory of its tree. Watches are shared by all the
+ *	subscribers of a directory and are reference counted.
+ *
+ *	A single thread reads the inotify events. It lets a burst of events
+ *	settle before reading it as one batch, merges the events of a batch
+ *	that refer to the same name, and replaces them with a single events
+ *	dropped notification when a subscriber gets too many of them. The
+ *	notifications are delivered without holding the notification lock.
+ *
+ *	Directory trees are walked without holding the notification lock
+ *	either; only the watches of the directories found are added under it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/poll.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "vmware.h"
+#include "vm_basic_types.h"
+#include "str.h"
+#include "util.h"
+#include "dbllnklst.h"
+#include "hashTable.h"
+#include "userlock.h"
+#include "mutexRankLib.h"
+
+#include "hgfsProto.h"
+#include "hgfsServer.h"
+#include "hgfsUtil.h"
+#include "hgfsDirNotify.h"
+
+#define LOGLEVEL_MODULE hgfs
+#include "loglevel_user.h"
+
+/* Time given to a burst of events to settle before it is read. */
+#define HGFS_NOTIFY_COALESCE_MSEC 50
+
+/* Size of the buffer the events of a batch are read into. */
+#define HGFS_NOTIFY_BUFFER_SIZE (64 * 1024)
+
+/*
+ * Maximum number of notifications sent to a subscriber for a batch of
+ * events. Beyond that the subscriber gets one events dropped notification.
+ */
+#define HGFS_NOTIFY_MAX_BATCH_EVENTS 64
+
+/* Maximum number of directories watched by all the subscribers. */
+#define HGFS_NOTIFY_MAX_WATCHES 8192
+
+/* Number of hash buckets for the watches index. */
+#define HGFS_NOTIFY_NUM_BUCKETS 1024
+
+#define HGFS_NOTIFY_WATCH_KEY(_wd) ((const void *)(uintptr_t)(_wd))
+
+/* HGFS events reporting a name change in a directory. */
+#define HGFS_NOTIFY_NAME_EVENTS (HGFS_NOTIFY_NAME |                           \
+                                 HGFS_NOTIFY_CREATE_FILE |                    \
+                                 HGFS_NOTIFY_CREATE_DIR |                     \
+                                 HGFS_NOTIFY_DELETE_FILE |                    \
+                                 HGFS_NOTIFY_DELETE_DIR |                     \
+                                 HGFS_NOTIFY_OLD_FILE_NAME |                  \
+                                 HGFS_NOTIFY_NEW_FILE_NAME |                  \
+                                 HGFS_NOTIFY_OLD_DIR_NAME |                   \
+                                 HGFS_NOTIFY_NEW_DIR_NAME)
+
+/* A shared folder subscribers can watch. */
+typedef struct HgfsNotifyFolder {
+   DblLnkLst_Links links;
+   HgfsSharedFolderHandle handle;
+   char *path;                      /* Share root, no trailing separator */
+   size_t pathLen;
+} HgfsNotifyFolder;
+
+/* A watched directory. */
+typedef struct HgfsNotifyWatch {
+   int wd;                          /* inotify watch descriptor */
+   char *path;                      /* Directory, no trailing separator */
+   uint32 refCount;                 /* Subscribers holding the watch */
+   Bool moved;                      /* Path updated, move self pending */
+} HgfsNotifyWatch;
+
+/* A client watching a directory or directory tree of a shared folder. */
+typedef struct HgfsNotifySubscriber {
+   DblLnkLst_Links links;
+   HgfsSubscriberHandle handle;
+   HgfsNotifyFolder *folder;
+   char *path;                      /* Watched directory, no trailing separator */
+   size_t pathLen;
+   uint32 eventFilter;              /* HGFS events the client asked for */
+   Bool recursive;                  /* Watch the subdirectories too */
+   HgfsNotifyEventReceiveCb *eventCb;
+   struct HgfsSessionInfo *session;
+   int *wds;                        /* Watches held by the subscriber */
+   uint32 numWds;
+   uint32 maxWds;
+   uint32 batchEvents;              /* Notifications queued for the batch */
+   Bool batchOverflow;              /* Too many notifications in the batch */
+} HgfsNotifySubscriber;
+
+/* A notification queued for delivery. */
+typedef struct HgfsNotifyEvent {
+   HgfsSubscriberHandle handle;
+   HgfsSharedFolderHandle folder;
+   HgfsNotifyEventReceiveCb *eventCb;
+   struct HgfsSessionInfo *session;
+   char *name;                      /* Share relative name */
+   uint32 mask;                     /* HGFS events, 0 if discarded */
+} HgfsNotifyEvent;
+
+/* Directories of a tree to watch, collected without the lock held. */
+typedef struct HgfsNotifyTree {
+   char **dirs;                     /* Tree root first */
+   uint32 numDirs;
+   uint32 maxDirs;
+} HgfsNotifyTree;
+
+/* A directory created in the tree of a recursive subscriber. */
+typedef struct HgfsNotifyNewDir {
+   HgfsSubscriberHandle handle;
+   char *path;
+} HgfsNotifyNewDir;
+
+/* Arguments for renaming the watches of a moved directory tree. */
+typedef struct HgfsNotifyRenameData {
+   const char *oldPath;
+   size_t oldPathLen;
+   const char *newPath;
+} HgfsNotifyRenameData;
+
+/* Watches of a directory tree, collected to be dropped. */
+typedef struct HgfsNotifyDropData {
+   const char *path;
+   size_t pathLen;
+   int *wds;
+   uint32 numWds;
+   uint32 maxWds;
+} HgfsNotifyDropData;
+
+/* A directory moved from a watched directory, waiting for its new name. */
+typedef struct HgfsNotifyMove {
+   uint32 cookie;
+   char *oldPath;                   /* NULL if there is none */
+} HgfsNotifyMove;
+
+/*
+ * The lock protects all of the following state. The condition variable
+ * signals the end of a delivery of notifications.
+ */
+static MXUserExclLock *gNotifyLock = NULL;
+static MXUserCondVar *gNotifyDispatchVar = NULL;
+
+static int gNotifyFd = -1;
+static int gNotifyExitPipe[2] = { -1, -1 };
+static pthread_t gNotifyThread;
+static Bool gNotifyThreadStarted = FALSE;
+
+/* Notifications are not generated while the server is synchronizing. */
+static Bool gNotifyActive = TRUE;
+
+/* Notifications are being delivered by the event thread. */
+static Bool gNotifyDispatching = FALSE;
+
+static DblLnkLst_Links gNotifyFolders;
+static DblLnkLst_Links gNotifySubscribers;
+static HashTable *gNotifyWatches = NULL;
+static uint32 gNotifyNumWatches = 0;
+static HgfsSharedFolderHandle gNotifyNextFolderHandle = 0;
+static HgfsSubscriberHandle gNotifyNextSubscriberHandle = 0;
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotifyFreeWatch --
+ *
+ *    Frees a watch when it is removed from the watches index.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsNotifyFreeWatch(void *data)   // IN: watch
+{
+   HgfsNotifyWatch *watch = data;
+
+   free(watch->path);
+   free(watch);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotifyDupPath --
+ *
+ *    Duplicates a directory path without its trailing separators.
+ *
+ * Results:
+ *    The allocated path, and its length.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static char *
+HgfsNotifyDupPath(const char *prefix,  // IN: directory
+                  const char *path,    // IN: relative path, optional
+                  size_t *pathLen)     // OUT: length of the result
+{
+   char *result;
+   size_t len;
+
+   if (NULL == path || '\0' == *path) {
+      result = Util_SafeStrdup(prefix);
+   } else {
+      result = Str_SafeAsprintf(NULL, "%s%s%s", prefix,
+                                (DIRSEPC == *path) ? "" : DIRSEPS, path);
+   }
+
+   len = strlen(result);
+   while (len > 0 && DIRSEPC == result[len - 1]) {
+      result[--len] = '\0';
+   }
+   *pathLen = len;
+
+   return result;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotifyInotifyMask --
+ *
+ *    Converts the HGFS events a client asked for to inotify events.
+ *
+ * Results:
+ *    The inotify events.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static uint32
+HgfsNotifyInotifyMask(uint32 eventFilter)   // IN: HGFS events
+{
+   uint32 mask = IN_DELETE_SELF | IN_MOVE_SELF;
+
+   if (0 != (eventFilter & (HGFS_NOTIFY_ACCESS | HGFS_NOTIFY_ATIME))) {
+      mask |= IN_ACCESS;
+   }
+   if (0 != (eventFilter & (HGFS_NOTIFY_ATTRIB | HGFS_NOTIFY_CTIME |
+                            HGFS_NOTIFY_CHANGE_EA |
+                            HGFS_NOTIFY_CHANGE_SECURITY))) {
+      mask |= IN_ATTRIB;
+   }
+   if (0 != (eventFilter & (HGFS_NOTIFY_SIZE | HGFS_NOTIFY_MTIME |
+                            HGFS_NOTIFY_MODIFY))) {
+      mask |= IN_MODIFY;
+   }
+   if (0 != (eventFilter & HGFS_NOTIFY_OPEN)) {
+      mask |= IN_OPEN;
+   }
+   if (0 != (eventFilter & HGFS_NOTIFY_CLOSE_WRITE)) {
+      mask |= IN_CLOSE_WRITE;
+   }
+   if (0 != (eventFilter & HGFS_NOTIFY_CLOSE_NOWRITE)) {
+      mask |= IN_CLOSE_NOWRITE;
+   }
+   if (0 != (eventFilter & HGFS_NOTIFY_NAME_EVENTS)) {
+      mask |= IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO;
+   }
+
+   return mask;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotifyEventMask --
+ *
+ *    Converts inotify events to HGFS events.
+ *
+ * Results:
+ *    The HGFS events.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static uint32
+HgfsNotifyEventMask(uint32 inMask)   // IN: inotify events
+{
+   Bool isDir = 0 != (inMask & IN_ISDIR);
+   uint32 mask = 0;
+
+   if (0 != (inMask & IN_ACCESS)) {
+      mask |= HGFS_NOTIFY_ACCESS;
+   }
+   if (0 != (inMask & IN_ATTRIB)) {
+      mask |= HGFS_NOTIFY_ATTRIB;
+   }
+   if (0 != (inMask & IN_MODIFY)) {
+      mask |= HGFS_NOTIFY_MODIFY;
+   }
+   if (0 != (inMask & IN_OPEN)) {
+      mask |= HGFS_NOTIFY_OPEN;
+   }
+   if (0 != (inMask & IN_CLOSE_WRITE)) {
+      mask |= HGFS_NOTIFY_CLOSE_WRITE;
+   }
+   if (0 != (inMask & IN_CLOSE_NOWRITE)) {
+      mask |= HGFS_NOTIFY_CLOSE_NOWRITE;
+   }
+   if (0 != (inMask & IN_CREATE)) {
+      mask |= isDir ? HGFS_NOTIFY_CREATE_DIR : HGFS_NOTIFY_CREATE_FILE;
+   }
+   if (0 != (inMask & IN_DELETE)) {
+      mask |= isDir ? HGFS_NOTIFY_DELETE_DIR : HGFS_NOTIFY_DELETE_FILE;
+   }
+   if (0 != (inMask & IN_MOVED_FROM)) {
+      mask |= isDir ? HGFS_NOTIFY_OLD_DIR_NAME : HGFS_NOTIFY_OLD_FILE_NAME;
+   }
+   if (0 != (inMask & IN_MOVED_TO)) {
+      mask |= isDir ? HGFS_NOTIFY_NEW_DIR_NAME : HGFS_NOTIFY_NEW_FILE_NAME;
+   }
+   if (0 != (inMask & IN_DELETE_SELF)) {
+      mask |= HGFS_NOTIFY_DELETE_SELF;
+   }
+   if (0 != (inMask & IN_MOVE_SELF)) {
+      mask |= HGFS_NOTIFY_MOVE_SELF;
+   }
+
+   return mask;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotifyRenameWatch --
+ *
+ *    HashTable_ForEach callback renaming a watch of a moved directory tree.
+ *
+ * Results:
+ *    0, to continue the iteration.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+HgfsNotifyRenameWatch(const char *key,    // IN: watch descriptor
+                      void *value,        // IN/OUT: watch
+                      void *clientData)   // IN: old and new paths
+{
+   HgfsNotifyWatch *watch = value;
+   HgfsNotifyRenameData *data = clientData;
+
+   if (0 == strncmp(watch->path, data->oldPath, data->oldPathLen) &&
+       ('\0' == watch->path[data->oldPathLen] ||
+        DIRSEPC == watch->path[data->oldPathLen])) {
+      char *newPath = Str_SafeAsprintf(NULL, "%s%s", data->newPath,
+                                       watch->path + data->oldPathLen);
+
+      /* The directory itself gets a move self event, keep its watch. */
+      if ('\0' == watch->path[data->oldPathLen]) {
+         watch->moved = TRUE;
+      }
+      free(watch->path);
+      watch->path = newPath;
+   }
+
+   return 0;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotifyRenameWatches --
+ *
+ *    Renames the watches of a directory tree moved within the watched
+ *    directories.
+ *
+ *    Called with the notification lock held.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsNotifyRenameWatches(const char *oldPath,   // IN: old directory
+                        const char *newPath)   // IN: new directory
+{
+   HgfsNotifyRenameData data;
+
+   /* The old path may be the path of a watch the walk replaces. */
+   data.oldPath = Util_SafeStrdup(oldPath);
+   data.oldPathLen = strlen(data.oldPath);
+   data.newPath = newPath;
+   HashTable_ForEach(gNotifyWatches, HgfsNotifyRenameWatch, &data);
+   free((char *)data.oldPath);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotifyCollectDropWatch --
+ *
+ *    HashTable_ForEach callback collecting the watches of a directory tree.
+ *
+ * Results:
+ *    0, to continue the iteration.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+HgfsNotifyCollectDropWatch(const char *key,    // IN: watch descriptor
+                           void *value,        // IN: watch
+                           void *clientData)   // IN/OUT: tree and watches
+{
+   HgfsNotifyWatch *watch = value;
+   HgfsNotifyDropData *data = clientData;
+
+   if (0 == strncmp(watch->path, data->path, data->pathLen) &&
+       ('\0' == watch->path[data->pathLen] ||
+        DIRSEPC == watch->path[data->pathLen])) {
+      if (data->numWds == data->maxWds) {
+         data->maxWds = MAX(data->maxWds * 2, 8);
+         data->wds = Util_SafeRealloc(data->wds,
+                                      data->maxWds * sizeof *data->wds);
+      }
+      data->wds[data->numWds++] = watch->wd;
+   }
+
+   return 0;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotifyAddWatch --
+ *
+ *    Adds a watch on a directory for a subscriber, or takes a reference
+ *    on the existing watch of the directory.
+ *
+ *    Called with the notification lock held.
+ *
+ * Results:
+ *    TRUE if the subscriber holds a watch on the directory, FALSE otherwise.
+ *
+ * Side effects:
+ *    A directory found watched under another path was moved, the paths of
+ *    the watches of its tree are updated.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+HgfsNotifyAddWatch(HgfsNotifySubscriber *subscriber, // IN/OUT: subscriber
+                   const char *path)                 // IN: directory
+{
+   HgfsNotifyWatch *watch = NULL;
+   uint32 mask;
+   uint32 i;
+   int wd;
+
+   if (gNotifyNumWatches >= HGFS_NOTIFY_MAX_WATCHES) {
+      LOG(4, ("%s: too many watches, not watching %s\n", __FUNCTION__, path));
+      return FALSE;
+   }
+
+   mask = HgfsNotifyInotifyMask(subscriber->eventFilter);
+   if (subscriber->recursive) {
+      /*
+       * New subdirectories need to be watched too, and the watches of the
+       * subdirectories moved within the tree follow them.
+       */
+      mask |= IN_CREATE | IN_MOVED_FROM | IN_MOVED_TO;
+   }
+
+   wd = inotify_add_watch(gNotifyFd, ('\0' == *path) ? DIRSEPS : path,
+                          mask | IN_MASK_ADD | IN_ONLYDIR);
+   if (wd < 0) {
+      LOG(4, ("%s: error watching %s: %d (%s)\n", __FUNCTION__, path,
+              errno, strerror(errno)));
+      return FALSE;
+   }
+
+   if (HashTable_Lookup(gNotifyWatches, HGFS_NOTIFY_WATCH_KEY(wd),
+                        (void **)&watch)) {
+      if (0 != strcmp(watch->path, path)) {
+         HgfsNotifyRenameWatches(watch->path, path);
+      }
+      for (i = 0; i < subscriber->numWds; i++) {
+         if (subscriber->wds[i] == wd) {
+            return TRUE;
+         }
+      }
+   } else {
+      watch = Util_SafeMalloc(sizeof *watch);
+      watch->wd = wd;
+      watch->path = Util_SafeStrdup(path);
+      watch->refCount = 0;
+      watch->moved = FALSE;
+      HashTable_Insert(gNotifyWatches, HGFS_NOTIFY_WATCH_KEY(wd), watch);
+      gNotifyNumWatches++;
+   }
+
+   if (subscriber->numWds == subscriber->maxWds) {
+      subscriber->maxWds = MAX(subscriber->maxWds * 2, 8);
+      subscriber->wds = Util_SafeRealloc(subscriber->wds,
+                                         subscriber->maxWds *
+                                         sizeof *subscriber->wds);
+   }
+   subscriber->wds[subscriber->numWds++] = wd;
+   watch->refCount++;
+
+   return TRUE;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotifyCollectTree --
+ *
+ *    Lists a directory and, if recursive, all the directories below it,
+ *    at most as many as can be watched. Symbolic links are not followed.
+ *
+ *    Called without the notification lock held, the walk may be long.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsNotifyCollectTree(const char *path,      // IN: directory
+                      Bool recursive,        // IN: list the subdirectories
+                      HgfsNotifyTree *tree)  // OUT: directories
+{
+   uint32 i;
+
+   tree->maxDirs = 8;
+   tree->dirs = Util_SafeMalloc(tree->maxDirs * sizeof *tree->dirs);
+   tree->dirs[0] = Util_SafeStrdup(path);
+   tree->numDirs = 1;
+
+   for (i = 0; recursive && i < tree->numDirs; i++) {
+      const char *dirPath = tree->dirs[i];
+      struct dirent *entry;
+      DIR *dir;
+
+      dir = opendir(('\0' == *dirPath) ? DIRSEPS : dirPath);
+      if (NULL == dir) {
+         LOG(4, ("%s: error in opendir %s: %d (%s)\n", __FUNCTION__, dirPath,
+                 errno, strerror(errno)));
+         continue;
+      }
+
+      while (NULL != (entry = readdir(dir)) &&
+             tree->numDirs < HGFS_NOTIFY_MAX_WATCHES) {
+         char *childPath;
+         Bool isDir;
+
+         if (0 == strcmp(entry->d_name, ".") || 0 == strcmp(entry->d_name, "..")) {
+            continue;
+         }
+
+         childPath = Str_SafeAsprintf(NULL, "%s%s%s", dirPath, DIRSEPS,
+                                      entry->d_name);
+         if (DT_UNKNOWN == entry->d_type) {
+            struct stat st;
+
+            isDir = lstat(childPath, &st) == 0 && S_ISDIR(st.st_mode);
+         } else {
+            isDir = DT_DIR == entry->d_type;
+         }
+         if (!isDir) {
+            free(childPath);
+            continue;
+         }
+
+         if (tree->numDirs == tree->maxDirs) {
+            tree->maxDirs *= 2;
+            tree->dirs = Util_SafeRealloc(tree->dirs,
+                                          tree->maxDirs * sizeof *tree->dirs);
+         }
+         tree->dirs[tree->numDirs++] = childPath;
+      }
+      closedir(dir);
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotifyFreeTree --
+ *
+ *    Frees the directories listed by HgfsNotifyCollectTree.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsNotifyFreeTree(HgfsNotifyTree *tree)  // IN/OUT: directories
+{
+   uint32 i;
+
+   for (i = 0; i < tree->numDirs; i++) {
+      free(tree->dirs[i]);
+   }
+   free(tree->dirs);
+   tree->dirs = NULL;
+   tree->numDirs = 0;
+   tree->maxDirs = 0;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotifyWatchTree --
+ *
+ *    Watches the directories listed by HgfsNotifyCollectTree for a
+ *    subscriber.
+ *
+ *    Called with the notification lock held.
+ *
+ * Results:
+ *    TRUE if the tree root is watched, FALSE otherwise.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+HgfsNotifyWatchTree(HgfsNotifySubscriber *subscriber, // IN/OUT: subscriber
+                    const HgfsNotifyTree *tree)       // IN: directories
+{
+   uint32 i;
+
+   if (!HgfsNotifyAddWatch(subscriber, tree->dirs[0])) {
+      return FALSE;
+   }
+
+   for (i = 1;
+        i < tree->numDirs && gNotifyNumWatches < HGFS_NOTIFY_MAX_WATCHES;
+        i++) {
+      HgfsNotifyAddWatch(subscriber, tree->dirs[i]);
+   }
+
+   return TRUE;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotifyReleaseWatches --
+ *
+ *    Drops the references of a subscriber on its watches, removing the
+ *    watches no other subscriber holds.
+ *
+ *    Called with the notification lock held.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsNotifyReleaseWatches(HgfsNotifySubscriber *subscriber) // IN/OUT: subscriber
+{
+   uint32 i;
+
+   for (i = 0; i < subscriber->numWds; i++) {
+      HgfsNotifyWatch *watch;
+      int wd = subscriber->wds[i];
+
+      if (!HashTable_Lookup(gNotifyWatches, HGFS_NOTIFY_WATCH_KEY(wd),
+                            (void **)&watch)) {
+         continue;
+      }
+      ASSERT(watch->refCount > 0);
+      if (--watch->refCount == 0) {
+         inotify_rm_watch(gNotifyFd, wd);
+         HashTable_Delete(gNotifyWatches, HGFS_NOTIFY_WATCH_KEY(wd));
+         gNotifyNumWatches--;
+      }
+   }
+   free(subscriber->wds);
+   subscriber->wds = NULL;
+   subscriber->numWds = 0;
+   subscriber->maxWds = 0;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotifyRemoveSubscriberInt --
+ *
+ *    Unlinks and frees a subscriber.
+ *
+ *    Called with the notification lock held.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsNotifyRemoveSubscriberInt(HgfsNotifySubscriber *subscriber) // IN: subscriber
+{
+   LOG(8, ("%s: removing subscriber %"FMT64"x\n", __FUNCTION__,
+           subscriber->handle));
+   HgfsNotifyReleaseWatches(subscriber);
+   DblLnkLst_Unlink1(&subscriber->links);
+   free(subscriber->path);
+   free(subscriber);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotifyForgetWatch --
+ *
+ *    Forgets a watch the kernel has removed, because its directory was
+ *    deleted or its file system unmounted.
+ *
+ *    Called with the notification lock held.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsNotifyForgetWatch(int wd)   // IN: watch descriptor
+{
+   DblLnkLst_Links *link;
+
+   if (!HashTable_Delete(gNotifyWatches, HGFS_NOTIFY_WATCH_KEY(wd))) {
+      return;
+   }
+   gNotifyNumWatches--;
+
+   DblLnkLst_ForEach(link, &gNotifySubscribers) {
+      HgfsNotifySubscriber *subscriber =
+         DblLnkLst_Container(link, HgfsNotifySubscriber, links);
+      uint32 i;
+
+      for (i = 0; i < subscriber->numWds; i++) {
+         if (subscriber->wds[i] == wd) {
+            subscriber->wds[i] = subscriber->wds[--subscriber->numWds];
+            break;
+         }
+      }
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotifyDropWatches --
+ *
+ *    Removes the watches of a directory tree moved to an unknown place,
+ *    whose paths are no longer known. Recursive subscribers watch the tree
+ *    again if it reappears in theirs.
+ *
+ *    Called with the notification lock held.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsNotifyDropWatches(const char *path)   // IN: moved directory
+{
+   HgfsNotifyDropData data;
+   uint32 i;
+
+   data.path = path;
+   data.pathLen = strlen(path);
+   data.wds = NULL;
+   data.numWds = 0;
+   data.maxWds = 0;
+   HashTable_ForEach(gNotifyWatches, HgfsNotifyCollectDropWatch, &data);
+
+   for (i = 0; i < data.numWds; i++) {
+      LOG(8, ("%s: dropping watch %d under moved %s\n", __FUNCTION__,
+              data.wds[i], path));
+      inotify_rm_watch(gNotifyFd, data.wds[i]);
+      HgfsNotifyForgetWatch(data.wds[i]);
+   }
+   free(data.wds);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotifySubscriberCovers --
+ *
+ *    Checks whether events in a directory concern a subscriber.
+ *
+ * Results:
+ *    TRUE if the directory is watched by the subscriber, FALSE otherwise.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+HgfsNotifySubscriberCovers(HgfsNotifySubscriber const *subscriber, // IN
+                           const char *dirPath)                    // IN
+{
+   if (0 != strncmp(dirPath, subscriber->path, subscriber->pathLen)) {
+      return FALSE;
+   }
+
+   return '\0' == dirPath[subscriber->pathLen] ||
+          (subscriber->recursive && DIRSEPC == dirPath[subscriber->pathLen]);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotifyQueueEvent --
+ *
+ *    Queues a notification for a subscriber, merging it with a queued
+ *    notification for the same name. A subscriber that gets too many
+ *    notifications in a batch has them replaced by a single events dropped
+ *    notification, telling the client to scan the directory again.
+ *
+ *    Called with the notification lock held.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsNotifyQueueEvent(HgfsNotifySubscriber *subscriber, // IN/OUT: subscriber
+                     const char *name,                 // IN: share relative name
+                     uint32 mask,                      // IN: HGFS events
+                     HgfsNotifyEvent **events,         // IN/OUT: queue
+                     size_t *numEvents,                // IN/OUT: queue length
+                     size_t *maxEvents)                // IN/OUT: queue size
+{
+   HgfsNotifyEvent *event;
+   size_t i;
+
+   if (subscriber->batchOverflow) {
+      return;
+   }
+
+   for (i = 0; i < *numEvents; i++) {
+      event = &(*events)[i];
+      if (event->handle == subscriber->handle && 0 == strcmp(event->name, name)) {
+         event->mask |= mask;
+         return;
+      }
+   }
+
+   if (subscriber->batchEvents >= HGFS_NOTIFY_MAX_BATCH_EVENTS) {
+      LOG(4, ("%s: too many events for subscriber %"FMT64"x\n", __FUNCTION__,
+              subscriber->handle));
+      subscriber->batchOverflow = TRUE;
+      for (i = 0; i < *numEvents; i++) {
+         if ((*events)[i].handle == subscriber->handle) {
+            (*events)[i].mask = 0;
+         }
+      }
+      return;
+   }
+
+   if (*numEvents == *maxEvents) {
+      *maxEvents = MAX(*maxEvents * 2, 16);
+      *events = Util_SafeRealloc(*events, *maxEvents * sizeof **events);
+   }
+   event = &(*events)[(*numEvents)++];
+   event->handle = subscriber->handle;
+   event->folder = subscriber->folder->handle;
+   event->eventCb = subscriber->eventCb;
+   event->session = subscriber->session;
+   event->name = Util_SafeStrdup(name);
+   event->mask = mask;
+   subscriber->batchEvents++;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotifyProcessEvent --
+ *
+ *    Queues the notifications of one inotify event for the subscribers it
+ *    concerns, and the new subdirectories of recursive subscribers to be
+ *    watched once the lock is dropped.
+ *
+ *    The watches of a directory moved within the watched directories are
+ *    renamed when its move to event follows its move from event. Those of
+ *    a directory moved elsewhere are dropped on its move self event.
+ *
+ *    Called with the notification lock held.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsNotifyProcessEvent(const struct inotify_event *inEvent, // IN: event
+                       HgfsNotifyEvent **events,            // IN/OUT: queue
+                       size_t *numEvents,                   // IN/OUT: queue length
+                       size_t *maxEvents,                   // IN/OUT: queue size
+                       HgfsNotifyNewDir **newDirs,          // IN/OUT: new dirs
+                       size_t *numNewDirs,                  // IN/OUT: new dirs count
+                       size_t *maxNewDirs,                  // IN/OUT: new dirs size
+                       HgfsNotifyMove *move)                // IN/OUT: pending move
+{
+   HgfsNotifyWatch *watch;
+   DblLnkLst_Links *link;
+   char *dirPath;
+   char *path;
+   uint32 mask;
+
+   if (0 != (inEvent->mask & IN_IGNORED)) {
+      HgfsNotifyForgetWatch(inEvent->wd);
+      return;
+   }
+
+   if (!HashTable_Lookup(gNotifyWatches, HGFS_NOTIFY_WATCH_KEY(inEvent->wd),
+                         (void **)&watch)) {
+      return;
+   }
+
+   dirPath = Util_SafeStrdup(watch->path);
+   if (inEvent->len > 0) {
+      path = Str_SafeAsprintf(NULL, "%s%s%s", dirPath, DIRSEPS, inEvent->name);
+   } else {
+      path = Util_SafeStrdup(dirPath);
+   }
+
+   if (0 != (inEvent->mask & IN_ISDIR) &&
+       0 != (inEvent->mask & IN_MOVED_TO) &&
+       NULL != move->oldPath && move->cookie == inEvent->cookie) {
+      HgfsNotifyRenameWatches(move->oldPath, path);
+   }
+   free(move->oldPath);
+   move->oldPath = NULL;
+   if (0 != (inEvent->mask & IN_ISDIR) && 0 != (inEvent->mask & IN_MOVED_FROM)) {
+      move->cookie = inEvent->cookie;
+      move->oldPath = Util_SafeStrdup(path);
+   }
+
+   mask = HgfsNotifyEventMask(inEvent->mask);
+
+   DblLnkLst_ForEach(link, &gNotifySubscribers) {
+      HgfsNotifySubscriber *subscriber =
+         DblLnkLst_Container(link, HgfsNotifySubscriber, links);
+      Bool isRoot;
+      uint32 subscriberMask;
+      const char *name;
+
+      if (!HgfsNotifySubscriberCovers(subscriber, dirPath)) {
+         continue;
+      }
+      isRoot = '\0' == dirPath[subscriber->pathLen];
+
+      if (subscriber->recursive &&
+          0 != (inEvent->mask & IN_ISDIR) &&
+          0 != (inEvent->mask & (IN_CREATE | IN_MOVED_TO))) {
+         if (*numNewDirs == *maxNewDirs) {
+            *maxNewDirs = MAX(*maxNewDirs * 2, 8);
+            *newDirs = Util_SafeRealloc(*newDirs, *maxNewDirs * sizeof **newDirs);
+         }
+         (*newDirs)[*numNewDirs].handle = subscriber->handle;
+         (*newDirs)[*numNewDirs].path = Util_SafeStrdup(path);
+         (*numNewDirs)++;
+      }
+
+      /*
+       * Self events of subdirectories duplicate the events of their parent
+       * directory, report them for the watched directory only.
+       */
+      if (0 != (inEvent->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) && !isRoot) {
+         continue;
+      }
+      if (0 == (inEvent->mask & HgfsNotifyInotifyMask(subscriber->eventFilter))) {
+         continue;
+      }
+
+      subscriberMask = mask;
+      if (0 != (inEvent->mask & IN_DELETE_SELF)) {
+         subscriberMask |= HGFS_NOTIFY_WATCH_DELETED;
+      }
+
+      name = path + subscriber->folder->pathLen;
+      if (DIRSEPC == *name) {
+         name++;
+      }
+      HgfsNotifyQueueEvent(subscriber, name, subscriberMask, events, numEvents,
+                           maxEvents);
+   }
+
+   if (0 != (inEvent->mask & IN_MOVE_SELF)) {
+      if (watch->moved) {
+         watch->moved = FALSE;
+      } else {
+         HgfsNotifyDropWatches(dirPath);
+      }
+   }
+
+   free(path);
+   free(dirPath);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotifyWatchNewDirs --
+ *
+ *    Watches the trees of the directories created or moved into the trees
+ *    of recursive subscribers. The trees are walked without the lock held,
+ *    subscribers removed in the meantime are skipped.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Frees the new directories.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsNotifyWatchNewDirs(HgfsNotifyNewDir *newDirs,   // IN: new directories
+                       size_t numNewDirs)           // IN: number of them
+{
+   size_t i;
+
+   for (i = 0; i < numNewDirs; i++) {
+      HgfsNotifyTree tree;
+      DblLnkLst_Links *link;
+
+      HgfsNotifyCollectTree(newDirs[i].path, TRUE, &tree);
+
+      MXUser_AcquireExclLock(gNotifyLock);
+      DblLnkLst_ForEach(link, &gNotifySubscribers) {
+         HgfsNotifySubscriber *subscriber =
+            DblLnkLst_Container(link, HgfsNotifySubscriber, links);
+
+         if (subscriber->handle == newDirs[i].handle) {
+            HgfsNotifyWatchTree(subscriber, &tree);
+            break;
+         }
+      }
+      MXUser_ReleaseExclLock(gNotifyLock);
+
+      HgfsNotifyFreeTree(&tree);
+      free(newDirs[i].path);
+   }
+   free(newDirs);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotifyProcessBatch --
+ *
+ *    Turns a batch of inotify events into notifications and delivers them
+ *    to the subscribers. New subdirectories are watched before, so that a
+ *    client told about a directory gets the events in it.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Calls the subscribers callbacks.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsNotifyProcessBatch(const char *buffer,   // IN: inotify events
+                       size_t size)          // IN: size of the events
+{
+   HgfsNotifyEvent *events = NULL;
+   size_t numEvents = 0;
+   size_t maxEvents = 0;
+   HgfsNotifyNewDir *newDirs = NULL;
+   size_t numNewDirs = 0;
+   size_t maxNewDirs = 0;
+   HgfsNotifyMove move = { 0, NULL };
+   DblLnkLst_Links *link;
+   size_t offset;
+   size_t i;
+
+   MXUser_AcquireExclLock(gNotifyLock);
+
+   if (!gNotifyActive) {
+      LOG(4, ("%s: notification inactive, dropping events\n", __FUNCTION__));
+      MXUser_ReleaseExclLock(gNotifyLock);
+      return;
+   }
+
+   DblLnkLst_ForEach(link, &gNotifySubscribers) {
+      HgfsNotifySubscriber *subscriber =
+         DblLnkLst_Container(link, HgfsNotifySubscriber, links);
+
+      subscriber->batchEvents = 0;
+      subscriber->batchOverflow = FALSE;
+   }
+
+   for (offset = 0; offset < size; ) {
+      const struct inotify_event *inEvent =
+         (const struct inotify_event *)(buffer + offset);
+
+      if (0 != (inEvent->mask & IN_Q_OVERFLOW)) {
+         LOG(4, ("%s: event queue overflow\n", __FUNCTION__));
+         DblLnkLst_ForEach(link, &gNotifySubscribers) {
+            DblLnkLst_Container(link, HgfsNotifySubscriber,
+                                links)->batchOverflow = TRUE;
+         }
+      } else {
+         HgfsNotifyProcessEvent(inEvent, &events, &numEvents, &maxEvents,
+                                &newDirs, &numNewDirs, &maxNewDirs, &move);
+      }
+      offset += sizeof *inEvent + inEvent->len;
+   }
+   free(move.oldPath);
+
+   DblLnkLst_ForEach(link, &gNotifySubscribers) {
+      HgfsNotifySubscriber *subscriber =
+         DblLnkLst_Container(link, HgfsNotifySubscriber, links);
+
+      if (subscriber->batchOverflow) {
+         subscriber->batchOverflow = FALSE;
+         subscriber->batchEvents = 0;
+         HgfsNotifyQueueEvent(subscriber, "", HGFS_NOTIFY_EVENTS_DROPPED,
+                              &events, &numEvents, &maxEvents);
+      }
+   }
+
+   gNotifyDispatching = TRUE;
+   MXUser_ReleaseExclLock(gNotifyLock);
+
+   HgfsNotifyWatchNewDirs(newDirs, numNewDirs);
+
+   for (i = 0; i < numEvents; i++) {
+      if (0 != events[i].mask) {
+         events[i].eventCb(events[i].folder, events[i].handle, events[i].name,
+                           events[i].mask, events[i].session);
+      }
+      free(events[i].name);
+   }
+   free(events);
+
+   MXUser_AcquireExclLock(gNotifyLock);
+   gNotifyDispatching = FALSE;
+   MXUser_BroadcastCondVar(gNotifyDispatchVar);
+   MXUser_ReleaseExclLock(gNotifyLock);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotifyThread --
+ *
+ *    Reads the inotify events in batches until the notification component
+ *    exits.
+ *
+ * Results:
+ *    NULL.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void *
+HgfsNotifyThread(void *data)   // IN: unused
+{
+   char *buffer = Util_SafeMalloc(HGFS_NOTIFY_BUFFER_SIZE);
+
+   for (;;) {
+      struct pollfd fds[2];
+      size_t size = 0;
+
+      fds[0].fd = gNotifyFd;
+      fds[0].events = POLLIN;
+      fds[0].revents = 0;
+      fds[1].fd = gNotifyExitPipe[0];
+      fds[1].events = POLLIN;
+      fds[1].revents = 0;
+
+      if (poll(fds, ARRAYSIZE(fds), -1) < 0) {
+         if (EINTR == errno) {
+            continue;
+         }
+         LOG(4, ("%s: error in poll: %d (%s)\n", __FUNCTION__, errno,
+                 strerror(errno)));
+         break;
+      }
+      if (0 != fds[1].revents) {
+         break;
+      }
+
+      /* Let a burst of events settle so it is read as one batch. */
+      if (poll(&fds[1], 1, HGFS_NOTIFY_COALESCE_MSEC) > 0) {
+         break;
+      }
+
+      /* Each read needs room for the largest event. */
+      while (HGFS_NOTIFY_BUFFER_SIZE - size >=
+             sizeof (struct inotify_event) + NAME_MAX + 1) {
+         ssize_t result = read(gNotifyFd, buffer + size,
+                               HGFS_NOTIFY_BUFFER_SIZE - size);
+         if (result <= 0) {
+            break;
+         }
+         size += result;
+      }
+
+      if (size > 0) {
+         HgfsNotifyProcessBatch(buffer, size);
+      }
+   }
+
+   free(buffer);
+   return NULL;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotify_Init --
+ *
+ *    Initialization for the notification component.
+ *
+ * Results:
+ *    HGFS_ERROR_SUCCESS if notification is available, an error otherwise.
+ *
+ * Side effects:
+ *    Starts the thread reading the inotify events.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+HgfsInternalStatus
+HgfsNotify_Init(void)
+{
+   HgfsInternalStatus status;
+   int result;
+
+   DblLnkLst_Init(&gNotifyFolders);
+   DblLnkLst_Init(&gNotifySubscribers);
+   gNotifyActive = TRUE;
+   gNotifyDispatching = FALSE;
+   gNotifyNumWatches = 0;
+
+   gNotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+   if (gNotifyFd < 0) {
+      status = errno;
+      LOG(4, ("%s: error in inotify_init1: %d (%s)\n", __FUNCTION__, status,
+              strerror(status)));
+      goto error;
+   }
+
+   if (pipe(gNotifyExitPipe) < 0) {
+      status = errno;
+      LOG(4, ("%s: error in pipe: %d (%s)\n", __FUNCTION__, status,
+              strerror(status)));
+      gNotifyExitPipe[0] = gNotifyExitPipe[1] = -1;
+      goto error;
+   }
+
+   gNotifyLock = MXUser_CreateExclLock("HgfsNotifyLock", RANK_hgfsNotifyLock);
+   gNotifyDispatchVar = MXUser_CreateCondVarExclLock(gNotifyLock);
+   gNotifyWatches = HashTable_Alloc(HGFS_NOTIFY_NUM_BUCKETS, HASH_INT_KEY,
+                                    HgfsNotifyFreeWatch);
+
+   result = pthread_create(&gNotifyThread, NULL, HgfsNotifyThread, NULL);
+   if (0 != result) {
+      status = result;
+      LOG(4, ("%s: error in pthread_create: %d (%s)\n", __FUNCTION__, status,
+              strerror(status)));
+      goto error;
+   }
+   gNotifyThreadStarted = TRUE;
+
+   return HGFS_ERROR_SUCCESS;
+
+error:
+   HgfsNotify_Exit();
+   return status;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotify_Exit --
+ *
+ *    Exit for the notification component.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Stops the thread reading the inotify events, removes all shared
+ *    folders and subscribers.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+HgfsNotify_Exit(void)
+{
+   DblLnkLst_Links *link, *nextLink;
+
+   if (gNotifyThreadStarted) {
+      if (write(gNotifyExitPipe[1], "", 1) < 0) {
+         LOG(4, ("%s: error in write: %d (%s)\n", __FUNCTION__, errno,
+                 strerror(errno)));
+      }
+      pthread_join(gNotifyThread, NULL);
+      gNotifyThreadStarted = FALSE;
+   }
+
+   if (NULL != gNotifyLock) {
+      DblLnkLst_ForEachSafe(link, nextLink, &gNotifySubscribers) {
+         HgfsNotifyRemoveSubscriberInt(DblLnkLst_Container(link,
+                                                           HgfsNotifySubscriber,
+                                                           links));
+      }
+      DblLnkLst_ForEachSafe(link, nextLink, &gNotifyFolders) {
+         HgfsNotifyFolder *folder =
+            DblLnkLst_Container(link, HgfsNotifyFolder, links);
+
+         DblLnkLst_Unlink1(&folder->links);
+         free(folder->path);
+         free(folder);
+      }
+      HashTable_Free(gNotifyWatches);
+      gNotifyWatches = NULL;
+      MXUser_DestroyCondVar(gNotifyDispatchVar);
+      gNotifyDispatchVar = NULL;
+      MXUser_DestroyExclLock(gNotifyLock);
+      gNotifyLock = NULL;
+   }
+
+   if (gNotifyExitPipe[0] >= 0) {
+      close(gNotifyExitPipe[0]);
+      close(gNotifyExitPipe[1]);
+      gNotifyExitPipe[0] = gNotifyExitPipe[1] = -1;
+   }
+   if (gNotifyFd >= 0) {
+      close(gNotifyFd);
+      gNotifyFd = -1;
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotify_Deactivate --
+ *
+ *    Deactivates generating file system change notifications.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Events occurring while deactivated are dropped.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+HgfsNotify_Deactivate(HgfsNotifyActivateReason reason) // IN: reason
+{
+   if (HGFS_NOTIFY_REASON_SERVER_SYNC == reason) {
+      MXUser_AcquireExclLock(gNotifyLock);
+      gNotifyActive = FALSE;
+      MXUser_ReleaseExclLock(gNotifyLock);
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotify_Activate --
+ *
+ *    Activates generating file system change notifications.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+HgfsNotify_Activate(HgfsNotifyActivateReason reason) // IN: reason
+{
+   if (HGFS_NOTIFY_REASON_SERVER_SYNC == reason) {
+      MXUser_AcquireExclLock(gNotifyLock);
+      gNotifyActive = TRUE;
+      MXUser_ReleaseExclLock(gNotifyLock);
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotifyFindFolder --
+ *
+ *    Looks up a shared folder by handle.
+ *
+ *    Called with the notification lock held.
+ *
+ * Results:
+ *    The shared folder or NULL.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static HgfsNotifyFolder *
+HgfsNotifyFindFolder(HgfsSharedFolderHandle sharedFolder) // IN: handle
+{
+   DblLnkLst_Links *link;
+
+   DblLnkLst_ForEach(link, &gNotifyFolders) {
+      HgfsNotifyFolder *folder = DblLnkLst_Container(link, HgfsNotifyFolder,
+                                                     links);
+
+      if (folder->handle == sharedFolder) {
+         return folder;
+      }
+   }
+
+   return NULL;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotify_AddSharedFolder --
+ *
+ *    Allocates memory and initializes new shared folder structure.
+ *
+ * Results:
+ *    Opaque subscriber handle for the new subscriber or HGFS_INVALID_FOLDER_HANDLE
+ *    if adding shared folder fails.
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+HgfsSharedFolderHandle
+HgfsNotify_AddSharedFolder(const char *path,       // IN: path in the host
+                           const char *shareName)  // IN: name of the shared folder
+{
+   HgfsNotifyFolder *folder;
+   HgfsSharedFolderHandle handle;
+
+   ASSERT(path);
+
+   folder = Util_SafeMalloc(sizeof *folder);
+   folder->path = HgfsNotifyDupPath(path, NULL, &folder->pathLen);
+   DblLnkLst_Init(&folder->links);
+
+   MXUser_AcquireExclLock(gNotifyLock);
+   if (HGFS_INVALID_FOLDER_HANDLE == gNotifyNextFolderHandle) {
+      gNotifyNextFolderHandle++;
+   }
+   handle = folder->handle = gNotifyNextFolderHandle++;
+   DblLnkLst_LinkLast(&gNotifyFolders, &folder->links);
+   MXUser_ReleaseExclLock(gNotifyLock);
+
+   LOG(8, ("%s: share %s path %s handle %#x\n", __FUNCTION__, shareName,
+           folder->path, handle));
+
+   return handle;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotify_AddSubscriber --
+ *
+ *    Allocates memory and initializes new subscriber structure.
+ *    Inserts allocated subscriber into corrspondent array.
+ *
+ * Results:
+ *    Opaque subscriber handle for the new subscriber or HGFS_INVALID_SUBSCRIBER_HANDLE
+ *    if adding subscriber fails.
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+HgfsSubscriberHandle
+HgfsNotify_AddSubscriber(HgfsSharedFolderHandle sharedFolder, // IN: shared folder handle
+                         const char *path,                    // IN: relative path
+                         uint32 eventFilter,                  // IN: event filter
+                         uint32 recursive,                    // IN: look in subfolders
+                         HgfsNotifyEventReceiveCb eventCb,    // IN notification callback
+                         struct HgfsSessionInfo *session)     // IN: server context
+{
+   HgfsSubscriberHandle handle = HGFS_INVALID_SUBSCRIBER_HANDLE;
+   HgfsNotifySubscriber *subscriber;
+   HgfsNotifyFolder *folder;
+   HgfsNotifyTree tree;
+   char *subscriberPath;
+   size_t subscriberPathLen;
+
+   MXUser_AcquireExclLock(gNotifyLock);
+   folder = HgfsNotifyFindFolder(sharedFolder);
+   subscriberPath = (NULL == folder) ? NULL :
+                    HgfsNotifyDupPath(folder->path, path, &subscriberPathLen);
+   MXUser_ReleaseExclLock(gNotifyLock);
+
+   if (NULL == subscriberPath) {
+      LOG(4, ("%s: no shared folder for handle %#x\n", __FUNCTION__,
+              sharedFolder));
+      return HGFS_INVALID_SUBSCRIBER_HANDLE;
+   }
+
+   /* Walk the tree unlocked, the folder may be removed meanwhile. */
+   HgfsNotifyCollectTree(subscriberPath, recursive != 0, &tree);
+
+   subscriber = Util_SafeCalloc(1, sizeof *subscriber);
+   DblLnkLst_Init(&subscriber->links);
+   subscriber->path = subscriberPath;
+   subscriber->pathLen = subscriberPathLen;
+   subscriber->eventFilter = eventFilter;
+   subscriber->recursive = recursive != 0;
+   subscriber->eventCb = eventCb;
+   subscriber->session = session;
+
+   MXUser_AcquireExclLock(gNotifyLock);
+
+   subscriber->folder = HgfsNotifyFindFolder(sharedFolder);
+   if (NULL == subscriber->folder ||
+       !HgfsNotifyWatchTree(subscriber, &tree)) {
+      HgfsNotifyReleaseWatches(subscriber);
+      free(subscriber->path);
+      free(subscriber);
+      goto exit;
+   }
+
+   if (HGFS_INVALID_SUBSCRIBER_HANDLE == gNotifyNextSubscriberHandle) {
+      gNotifyNextSubscriberHandle++;
+   }
+   handle = subscriber->handle = gNotifyNextSubscriberHandle++;
+   DblLnkLst_LinkLast(&gNotifySubscribers, &subscriber->links);
+
+   LOG(8, ("%s: subscriber %"FMT64"x on %s with %u watches\n", __FUNCTION__,
+           handle, subscriber->path, subscriber->numWds));
+
+exit:
+   MXUser_ReleaseExclLock(gNotifyLock);
+   HgfsNotifyFreeTree(&tree);
+
+   return handle;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotify_RemoveSharedFolder --
+ *
+ *    Deallcates memory used by shared folder and performs necessary cleanup.
+ *    Also deletes all subscribers that are defined for the shared folder.
+ *
+ * Results:
+ *    TRUE if the shared folder was found, FALSE otherwise.
+ *
+ * Side effects:
+ *    Removes all subscribers that correspond to the shared folder and invalidates
+ *    thier handles.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+Bool
+HgfsNotify_RemoveSharedFolder(HgfsSharedFolderHandle sharedFolder) // IN
+{
+   DblLnkLst_Links *link, *nextLink;
+   Bool found = FALSE;
+
+   MXUser_AcquireExclLock(gNotifyLock);
+
+   DblLnkLst_ForEachSafe(link, nextLink, &gNotifySubscribers) {
+      HgfsNotifySubscriber *subscriber =
+         DblLnkLst_Container(link, HgfsNotifySubscriber, links);
+
+      if (subscriber->folder->handle == sharedFolder) {
+         HgfsNotifyRemoveSubscriberInt(subscriber);
+      }
+   }
+
+   DblLnkLst_ForEach(link, &gNotifyFolders) {
+      HgfsNotifyFolder *folder = DblLnkLst_Container(link, HgfsNotifyFolder,
+                                                     links);
+
+      if (folder->handle == sharedFolder) {
+         DblLnkLst_Unlink1(&folder->links);
+         free(folder->path);
+         free(folder);
+         found = TRUE;
+         break;
+      }
+   }
+
+   MXUser_ReleaseExclLock(gNotifyLock);
+
+   return found;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotify_RemoveSubscriber --
+ *
+ *    Deallcates memory used by NotificationSubscriber and performs necessary cleanup.
+ *
+ * Results:
+ *    TRUE if the subscriber was found, FALSE otherwise.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+Bool
+HgfsNotify_RemoveSubscriber(HgfsSubscriberHandle subscriber) // IN
+{
+   DblLnkLst_Links *link;
+   Bool found = FALSE;
+
+   MXUser_AcquireExclLock(gNotifyLock);
+
+   DblLnkLst_ForEach(link, &gNotifySubscribers) {
+      HgfsNotifySubscriber *current =
+         DblLnkLst_Container(link, HgfsNotifySubscriber, links);
+
+      if (current->handle == subscriber) {
+         HgfsNotifyRemoveSubscriberInt(current);
+         found = TRUE;
+         break;
+      }
+   }
+
+   MXUser_ReleaseExclLock(gNotifyLock);
+
+   return found;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotify_RemoveSessionSubscribers --
+ *
+ *    Removes all entries that are related to a particular session.
+ *
+ *    Waits for notifications being delivered, which may refer to the
+ *    session, so the session can be torn down on return.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+HgfsNotify_RemoveSessionSubscribers(struct HgfsSessionInfo *session) // IN
+{
+   DblLnkLst_Links *link, *nextLink;
+
+   MXUser_AcquireExclLock(gNotifyLock);
+
+   DblLnkLst_ForEachSafe(link, nextLink, &gNotifySubscribers) {
+      HgfsNotifySubscriber *subscriber =
+         DblLnkLst_Container(link, HgfsNotifySubscriber, links);
+
+      if (subscriber->session == session) {
+         HgfsNotifyRemoveSubscriberInt(subscriber);
+      }
+   }
+
+   while (gNotifyDispatching &&
+          !(gNotifyThreadStarted && pthread_equal(pthread_self(), gNotifyThread))) {
+      MXUser_WaitCondVarExclLock(gNotifyLock, gNotifyDispatchVar);
+   }
+
+   MXUser_ReleaseExclLock(gNotifyLock);
+}
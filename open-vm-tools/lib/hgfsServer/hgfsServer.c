@@ -47,11 +47,15 @@
 #include "hgfsServerParameters.h"
 #include "hgfsServerOplock.h"
 #include "hgfsDirNotify.h"
+#include "hgfsThreadpool.h"
 #include "userlock.h"
 #include "poll.h"
 #include "mutexRankLib.h"
 #include "vm_basic_asm.h"
 #include "unicodeOperations.h"
+#include "hostinfo.h"
+#include "dynbuf.h"
+#include "strutil.h"
 
 #if defined(_WIN32)
 #include <io.h>
@@ -120,13 +124,57 @@
 #define HGFS_PATH_MAX HGFS_PACKET_MAX
 
 /*
- * Array of FileNodes for opening files.
+ * Number of FileNodes and searches in each slab allocated for a session.
  */
 #define NUM_FILE_NODES 100
 #define NUM_SEARCHES 100
 
-/* Default maximun number of open nodes that have server locks. */
-#define MAX_LOCKED_FILENODES 10
+#define HGFS_SESSION_NODE(_session, _i) \
+   (&(_session)->nodeSlabs[(_i) / NUM_FILE_NODES][(_i) % NUM_FILE_NODES])
+#define HGFS_SESSION_SEARCH(_session, _i) \
+   (&(_session)->searchSlabs[(_i) / NUM_SEARCHES][(_i) % NUM_SEARCHES])
+
+/*
+ * Maximum number of requests of a session processed asynchronously at once.
+ * Further requests are processed synchronously by the receiving thread
+ * which throttles the client until some replies are sent.
+ */
+#define MAX_SESSION_ASYNC_REQUESTS 16
+
+/*
+ * Number of hash buckets for the per-session node and search indices.
+ * The hash tables do not grow so this is sized for a few thousand opens.
+ */
+#define HGFS_INDEX_NUM_BUCKETS 1024
+
+/*
+ * Read pattern tracking. A file is streamed once HGFS_READAHEAD_MIN_RUN
+ * consecutive reads were contiguous; the readahead window then doubles on
+ * each further read up to the maximum. Pages far behind a long stream are
+ * dropped so that one large copy does not flush the host page cache.
+ */
+#define HGFS_READAHEAD_MIN_RUN      2
+#define HGFS_READAHEAD_MIN_WINDOW   (128 * 1024)
+#define HGFS_READAHEAD_MAX_WINDOW   (8 * 1024 * 1024)
+#define HGFS_DROPBEHIND_THRESHOLD   (CONST64U(64) * 1024 * 1024)
+#define HGFS_DROPBEHIND_CHUNK       (CONST64U(8) * 1024 * 1024)
+
+/*
+ * Node cache replacement (2Q). Nodes opened once may take up to
+ * 1/HGFS_NODE_CACHE_PROBATION_SHARE of the cache before they are evicted
+ * first. The cache size is adapted every HGFS_NODE_CACHE_EPOCH_LOOKUPS
+ * lookups: it grows when more than 1/HGFS_NODE_CACHE_THRASH_SHARE of them
+ * reopened an evicted node and shrinks to the nodes in use when none did.
+ * The largest size is also bounded by the process file descriptor limit.
+ */
+#define HGFS_NODE_CACHE_PROBATION_SHARE   4
+#define HGFS_NODE_CACHE_EPOCH_LOOKUPS     256
+#define HGFS_NODE_CACHE_THRASH_SHARE      16
+#define HGFS_NODE_CACHE_MIN_NODES         8
+#define HGFS_NODE_CACHE_MAX_NODES         1024
+
+#define HGFS_HANDLE_INDEX_KEY(_handle) ((const void *)(uintptr_t)(_handle))
+#define HGFS_FILEDESC_INDEX_KEY(_fd)   ((const void *)(uintptr_t)(_fd))
 
 
 struct HgfsTransportSessionInfo {
@@ -160,8 +208,20 @@ struct HgfsTransportSessionInfo {
    Atomic_uint32 refCount;    /* Reference count for session. */
 
    HgfsServerChannelData channelCapabilities;
+
+   /*
+    * Reply buffers for channels which do not supply them, created with the
+    * first reply that needs one (see HgfsServerTransportGetReplyPool).
+    */
+   Atomic_Ptr replyPool;
 };
 
+/* Result of a request embedded in a compound request. */
+typedef struct HgfsCompoundResult {
+   HgfsInternalStatus status;    /* Status of the embedded request */
+   size_t replyPayloadSize;      /* Size of the embedded request reply */
+} HgfsCompoundResult;
+
 /* The input request paramaters object. */
 typedef struct HgfsInputParam {
    const void *request;          /* Hgfs header followed by operation request */
@@ -175,6 +235,13 @@ typedef struct HgfsInputParam {
    HgfsOp op;                    /* Hgfs operation command code */
    uint32 id;                    /* Request ID to be matched with the reply */
    Bool sessionEnabled;          /* Requests have session enabled headers */
+   Bool replyOrdered;            /* Reply is sent in request arrival order */
+   uint32 replySeq;              /* Position of the reply in the session order */
+   Bool replySendable;           /* Reply is packed, send it in its turn */
+   DblLnkLst_Links replyLinks;   /* Link in the session parked replies */
+   Bool asyncAdmitted;           /* Counted in the session async requests */
+   HgfsCompoundResult *compoundResult; /* Set if embedded in a compound request */
+   VmTimeType startTime;         /* Arrival time in us, for the statistics */
 } HgfsInputParam;
 
 /*
@@ -183,7 +250,8 @@ typedef struct HgfsInputParam {
  */
 static HgfsServerConfig gHgfsCfgSettings = {
    (HGFS_CONFIG_NOTIFY_ENABLED | HGFS_CONFIG_VOL_INFO_MIN),
-   HGFS_MAX_CACHED_FILENODES
+   HGFS_MAX_CACHED_FILENODES,
+   HGFS_MAX_LOCKED_FILENODES
 };
 
 /*
@@ -199,8 +267,21 @@ static Atomic_uint32 gHgfsAsyncCounter = {0};
 static MXUserExclLock *gHgfsAsyncLock;
 static MXUserCondVar  *gHgfsAsyncVar;
 
+/*
+ * Whether the worker pool is available to process asynchronous requests.
+ * Only the guest uses the pool, the host dispatches through Poll_Callback.
+ */
+static Bool gHgfsThreadpoolActive = FALSE;
+
 static HgfsServerMgrCallbacks *gHgfsMgrData = NULL;
 
+/* Bounds of the adaptive node cache size, set from the configuration. */
+static uint32 gHgfsNodeCacheMinNodes = HGFS_MAX_CACHED_FILENODES;
+static uint32 gHgfsNodeCacheMaxNodes = HGFS_MAX_CACHED_FILENODES;
+
+/* Request counters of all the sessions, past and present. */
+static HgfsServerStats gHgfsServerStats;
+
 /*
  * Session usage and locking.
  *
@@ -236,6 +317,7 @@ static void HgfsServerSessionInvalidateObjects(void *clientData,
                                                DblLnkLst_Links *shares);
 static uint32 HgfsServerSessionInvalidateInactiveSessions(void *clientData);
 static void HgfsServerSessionSendComplete(HgfsPacket *packet, void *clientData);
+static char *HgfsServerSessionGetStats(void *clientData);
 static HgfsSharedFolderHandle HgfsServerRegisterShare(const char *shareName,
                                                       const char *sharePath,
                                                       Bool addFolder);
@@ -252,6 +334,7 @@ HgfsServerCallbacks gHgfsServerCBTable = {
       HgfsServerSessionInvalidateObjects,
       HgfsServerSessionInvalidateInactiveSessions,
       HgfsServerSessionSendComplete,
+      HgfsServerSessionGetStats,
    },
    HgfsServerRegisterShare,
 };
@@ -302,6 +385,7 @@ static Bool HgfsAddToCacheInternal(HgfsHandle handle,
 static Bool HgfsIsCachedInternal(HgfsHandle handle,
                                  HgfsSessionInfo *session);
 static Bool HgfsRemoveLruNode(HgfsSessionInfo *session);
+static void HgfsNodeCacheAdapt(HgfsSessionInfo *session);
 static Bool HgfsRemoveFromCacheInternal(HgfsHandle handle,
                                         HgfsSessionInfo *session);
 static void HgfsRemoveSearchInternal(HgfsSearch *search,
@@ -334,6 +418,8 @@ static HgfsFileNode *HgfsGetNewNode(HgfsSessionInfo *session);
 static HgfsHandle HgfsFileNode2Handle(HgfsFileNode const *fileNode);
 static HgfsFileNode *HgfsHandle2FileNode(HgfsHandle handle,
                                          HgfsSessionInfo *session);
+static HgfsFileNode *HgfsFileDesc2FileNode(fileDesc fd,
+                                           HgfsSessionInfo *session);
 static void HgfsServerExitSessionInternal(HgfsSessionInfo *session);
 static Bool HgfsIsShareRoot(char const *cpName, size_t cpNameSize);
 static void HgfsServerCompleteRequest(HgfsInternalStatus status,
@@ -383,6 +469,9 @@ static void HgfsServerClose(HgfsInputParam *input);
 static void HgfsServerSearchClose(HgfsInputParam *input);
 static void HgfsServerSetDirNotifyWatch(HgfsInputParam *input);
 static void HgfsServerRemoveDirNotifyWatch(HgfsInputParam *input);
+static void HgfsServerOplockBreakAck(HgfsInputParam *input);
+static void HgfsServerCompound(HgfsInputParam *input);
+static void HgfsServerCopyRange(HgfsInputParam *input);
 
 
 /*
@@ -409,6 +498,45 @@ HgfsServerSessionGet(HgfsSessionInfo *session)   // IN: session context
 }
 
 
+/*
+ *----------------------------------------------------------------------------
+ *
+ * HgfsServerSessionTryGet --
+ *
+ *      Increment session reference count unless the session is already
+ *      being torn down.
+ *
+ *      Used by server threads which find the session through their own
+ *      state rather than through a request of the session.
+ *
+ * Results:
+ *      TRUE if a reference was taken, FALSE if the count had dropped to zero.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+HgfsServerSessionTryGet(HgfsSessionInfo *session)   // IN: session context
+{
+   uint32 refCount;
+
+   ASSERT(session);
+
+   do {
+      refCount = Atomic_Read(&session->refCount);
+      if (refCount == 0) {
+         return FALSE;
+      }
+   } while (Atomic_ReadIfEqualWrite(&session->refCount, refCount,
+                                    refCount + 1) != refCount);
+
+   return TRUE;
+}
+
+
 /*
  *----------------------------------------------------------------------------
  *
@@ -427,7 +555,7 @@ HgfsServerSessionGet(HgfsSessionInfo *session)   // IN: session context
  *----------------------------------------------------------------------------
  */
 
-static void
+void
 HgfsServerSessionPut(HgfsSessionInfo *session)   // IN: session context
 {
    ASSERT(session);
@@ -486,6 +614,7 @@ HgfsServerTransportSessionPut(HgfsTransportSessionInfo *transportSession)   // I
    ASSERT(transportSession);
    if (Atomic_ReadDec32(&transportSession->refCount) == 1) {
       DblLnkLst_Links *curr, *next;
+      HgfsReplyPool *replyPool;
 
       MXUser_AcquireExclLock(transportSession->sessionArrayLock);
 
@@ -496,7 +625,68 @@ HgfsServerTransportSessionPut(HgfsTransportSessionInfo *transportSession)   // I
       }
 
       MXUser_ReleaseExclLock(transportSession->sessionArrayLock);
+
+      /* Replies still being sent keep the buffers pool alive. */
+      replyPool = Atomic_ReadPtr(&transportSession->replyPool);
+      if (replyPool != NULL) {
+         HSPU_DestroyReplyPool(replyPool);
+      }
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerTransportGetReplyPool --
+ *
+ *    Get the reply buffers pool for the reply to a packet. Only channels
+ *    which neither pass a reply buffer along with the request nor let the
+ *    server reply into guest memory need one, so the pool is created with
+ *    the first such reply.
+ *
+ * Results:
+ *    The reply buffers pool, NULL if the reply does not need one.
+ *
+ * Side effects:
+ *    The pool may be created.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static HgfsReplyPool *
+HgfsServerTransportGetReplyPool(HgfsTransportSessionInfo *transportSession, // IN: transport session
+                                HgfsPacket *packet)                         // IN: packet to reply to
+{
+   HgfsReplyPool *replyPool;
+   HgfsReplyPool *newPool;
+
+   if (packet->replyPacket != NULL ||
+       transportSession->channelCapabilities.maxPacketSize == 0 ||
+       (transportSession->channelCbTable != NULL &&
+        transportSession->channelCbTable->getWriteVa != NULL)) {
+      return NULL;
+   }
+
+   replyPool = Atomic_ReadPtr(&transportSession->replyPool);
+   if (replyPool != NULL) {
+      return replyPool;
+   }
+
+   /* Only the replies of negotiated huge I/O exceed the pooled size. */
+   newPool = HSPU_CreateReplyPool(
+                MIN(transportSession->channelCapabilities.maxPacketSize,
+                    HGFS_LARGE_PACKET_MAX));
+   replyPool = Atomic_ReadIfEqualWritePtr(&transportSession->replyPool, NULL,
+                                          newPool);
+   if (replyPool != NULL) {
+      /* Another reply created it first. */
+      HSPU_DestroyReplyPool(newPool);
+      return replyPool;
    }
+
+   LOG(4, ("%s: created the reply buffers pool\n", __FUNCTION__));
+   return newPool;
 }
 
 
@@ -596,19 +786,57 @@ static HgfsFileNode *
 HgfsHandle2FileNode(HgfsHandle handle,        // IN: Hgfs file handle
                     HgfsSessionInfo *session) // IN: Session info
 {
-   unsigned int i;
    HgfsFileNode *fileNode = NULL;
 
    ASSERT(session);
-   ASSERT(session->nodeArray);
 
-   /* XXX: This O(n) lookup can and should be optimized. */
-   for (i = 0; i < session->numNodes; i++) {
-      if (session->nodeArray[i].state != FILENODE_STATE_UNUSED &&
-          session->nodeArray[i].handle == handle) {
-         fileNode = &session->nodeArray[i];
-         break;
-      }
+   if (HashTable_Lookup(session->nodeHandleIndex,
+                        HGFS_HANDLE_INDEX_KEY(handle),
+                        (void **)&fileNode)) {
+      ASSERT(fileNode->state != FILENODE_STATE_UNUSED);
+      ASSERT(fileNode->handle == handle);
+   }
+
+   return fileNode;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsFileDesc2FileNode --
+ *
+ *    Retrieve the cached file node that owns an OS handle (file descriptor).
+ *
+ *    Only nodes in the FILENODE_STATE_IN_USE_CACHED state own a valid OS
+ *    handle, so only those are indexed by it.
+ *
+ *    The session's nodeArrayLock should be acquired prior to calling this
+ *    function.
+ *
+ * Results:
+ *    The file node if the OS handle belongs to a cached file node.
+ *    NULL otherwise.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static HgfsFileNode *
+HgfsFileDesc2FileNode(fileDesc fd,               // IN: OS handle (file descriptor)
+                      HgfsSessionInfo *session)  // IN: Session info
+{
+   HgfsFileNode *fileNode = NULL;
+
+   ASSERT(session);
+
+   if (HashTable_Lookup(session->nodeFileDescIndex,
+                        HGFS_FILEDESC_INDEX_KEY(fd),
+                        (void **)&fileNode)) {
+      ASSERT(fileNode->state == FILENODE_STATE_IN_USE_CACHED);
+      ASSERT(fileNode->fileDesc == fd);
    }
 
    return fileNode;
@@ -648,7 +876,7 @@ HgfsFileNode2Handle(HgfsFileNode const *fileNode) // IN
  *
  * HgfsDumpAllNodes --
  *
- *    Debugging routine; print all nodes in the nodeArray.
+ *    Debugging routine; print all nodes in the node slabs.
  *
  *    The session's nodeArrayLock should be acquired prior to calling this
  *    function.
@@ -668,16 +896,17 @@ HgfsDumpAllNodes(HgfsSessionInfo *session)  // IN: session info
    unsigned int i;
 
    ASSERT(session);
-   ASSERT(session->nodeArray);
 
    Log("Dumping all nodes\n");
    for (i = 0; i < session->numNodes; i++) {
+      HgfsFileNode *node = HGFS_SESSION_NODE(session, i);
+
       Log("handle %u, name \"%s\", localdev %"FMT64"u, localInum %"FMT64"u %u\n",
-          session->nodeArray[i].handle,
-          session->nodeArray[i].utf8Name ? session->nodeArray[i].utf8Name : "NULL",
-          session->nodeArray[i].localId.volumeId,
-          session->nodeArray[i].localId.fileId,
-          session->nodeArray[i].fileDesc);
+          node->handle,
+          node->utf8Name ? node->utf8Name : "NULL",
+          node->localId.volumeId,
+          node->localId.fileId,
+          node->fileDesc);
    }
    Log("Done\n");
 }
@@ -839,23 +1068,18 @@ HgfsFileDesc2Handle(fileDesc fd,              // IN: OS handle (file descriptor)
                     HgfsSessionInfo *session, // IN: Session info
                     HgfsHandle *handle)       // OUT: Hgfs file handle
 {
-   unsigned int i;
    Bool found = FALSE;
    HgfsFileNode *existingFileNode = NULL;
 
    ASSERT(session);
-   ASSERT(session->nodeArray);
+   ASSERT(session->nodeSlabs);
 
    MXUser_AcquireExclLock(session->nodeArrayLock);
 
-   for (i = 0; i < session->numNodes; i++) {
-      existingFileNode = &session->nodeArray[i];
-      if ((existingFileNode->state == FILENODE_STATE_IN_USE_CACHED) &&
-          (existingFileNode->fileDesc == fd)) {
-         *handle = HgfsFileNode2Handle(existingFileNode);
-         found = TRUE;
-         break;
-      }
+   existingFileNode = HgfsFileDesc2FileNode(fd, session);
+   if (existingFileNode != NULL) {
+      *handle = HgfsFileNode2Handle(existingFileNode);
+      found = TRUE;
    }
 
    MXUser_ReleaseExclLock(session->nodeArrayLock);
@@ -1115,6 +1339,7 @@ HgfsGetNodeCopy(HgfsHandle handle,        // IN: Hgfs file handle
    copy->state = original->state;
    copy->handle = original->handle;
    copy->fileCtx = original->fileCtx;
+   copy->serverLock = original->serverLock;
    found = TRUE;
 
 exit:
@@ -1168,6 +1393,151 @@ exit:
 }
 
 
+/*
+ *----------------------------------------------------------------------------
+ *
+ * HgfsReadPatternUpdate --
+ *
+ *    Accounts a read in the read pattern of a file and works out the
+ *    readahead and drop behind ranges the host should be advised of.
+ *
+ * Results:
+ *    None. advice is filled in.
+ *
+ * Side effects:
+ *    Updates the read pattern.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+HgfsReadPatternUpdate(HgfsReadPattern *pattern, // IN/OUT: read pattern
+                      uint64 offset,            // IN: read offset
+                      uint32 size,              // IN: read length
+                      Bool sequentialOpen,      // IN: opened for sequential I/O
+                      HgfsReadAdvice *advice)   // OUT: hints for the host
+{
+   uint64 end = offset + size;
+   uint64 target;
+
+   memset(advice, 0, sizeof *advice);
+
+   if (size == 0) {
+      return;
+   }
+
+   if (sequentialOpen || offset == pattern->nextOffset) {
+      pattern->sequentialReads++;
+      if (offset < pattern->nextOffset) {
+         /*
+          * A sequential open seeking backwards stays sequential, but the
+          * stream ranges lie past the new offset: restart them from here.
+          */
+         pattern->streamStart = offset;
+         pattern->prefetchEnd = offset;
+         pattern->dropEnd = offset;
+         pattern->window = 0;
+      }
+   } else {
+      if (pattern->sequentialReads >= HGFS_READAHEAD_MIN_RUN) {
+         advice->hint = HGFS_READ_HINT_NORMAL;
+      }
+      pattern->sequentialReads = 1;
+      pattern->streamStart = offset;
+      pattern->prefetchEnd = offset;
+      pattern->dropEnd = offset;
+      pattern->window = 0;
+   }
+   pattern->nextOffset = end;
+
+   if (pattern->sequentialReads < HGFS_READAHEAD_MIN_RUN) {
+      return;
+   }
+
+   if (pattern->sequentialReads == HGFS_READAHEAD_MIN_RUN) {
+      advice->hint = HGFS_READ_HINT_SEQUENTIAL;
+   }
+
+   if (pattern->window == 0) {
+      pattern->window = MAX(HGFS_READAHEAD_MIN_WINDOW, 2 * size);
+   } else {
+      pattern->window *= 2;
+   }
+   pattern->window = MIN(pattern->window, HGFS_READAHEAD_MAX_WINDOW);
+
+   /*
+    * Keep the prefetched range a window ahead of the client, topping it up
+    * only once half a window was consumed to limit the number of hints.
+    */
+   pattern->prefetchEnd = MAX(pattern->prefetchEnd, end);
+   target = end + pattern->window;
+   if (target >= pattern->prefetchEnd + pattern->window / 2) {
+      advice->prefetchOffset = pattern->prefetchEnd;
+      advice->prefetchLength = target - pattern->prefetchEnd;
+      pattern->prefetchEnd = target;
+   }
+
+   /* Drop what the client read long ago, a chunk behind the current read. */
+   if (offset >= pattern->streamStart + HGFS_DROPBEHIND_THRESHOLD &&
+       offset >= pattern->dropEnd + 2 * HGFS_DROPBEHIND_CHUNK) {
+      advice->dropOffset = pattern->dropEnd;
+      advice->dropLength = offset - HGFS_DROPBEHIND_CHUNK - pattern->dropEnd;
+      pattern->dropEnd += advice->dropLength;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * HgfsFileDescTrackRead --
+ *
+ *    Given an OS handle/fd, find if the open was sequential and account
+ *    the read about to be done in the read pattern of the node.
+ *
+ * Results:
+ *    TRUE on success, FALSE on failure.  sequentialOpen and advice are
+ *    filled in on success.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+HgfsFileDescTrackRead(fileDesc fd,               // IN: OS handle (file descriptor)
+                      HgfsSessionInfo *session,  // IN: Session info
+                      uint64 offset,             // IN: read offset
+                      uint32 size,               // IN: read length
+                      Bool *sequentialOpen,      // OUT: If open was sequential
+                      HgfsReadAdvice *advice)    // OUT: hints for the host
+{
+   HgfsFileNode *node;
+   Bool success = FALSE;
+
+   ASSERT(sequentialOpen);
+   ASSERT(advice);
+
+   MXUser_AcquireExclLock(session->nodeArrayLock);
+
+   node = HgfsFileDesc2FileNode(fd, session);
+   if (node == NULL) {
+      goto exit;
+   }
+
+   *sequentialOpen = (node->flags & HGFS_FILE_NODE_SEQUENTIAL_FL) != 0;
+   HgfsReadPatternUpdate(&node->readPattern, offset, size, *sequentialOpen,
+                         advice);
+   success = TRUE;
+
+exit:
+   MXUser_ReleaseExclLock(session->nodeArrayLock);
+
+   return success;
+}
+
+
 /*
  *----------------------------------------------------------------------------
  *
@@ -1246,6 +1616,14 @@ HgfsUpdateNodeFileDesc(HgfsHandle handle,        // IN: Hgfs file handle
       goto exit;
    }
 
+   if (node->state == FILENODE_STATE_IN_USE_CACHED) {
+      HashTable_Delete(session->nodeFileDescIndex,
+                       HGFS_FILEDESC_INDEX_KEY(node->fileDesc));
+      HashTable_ReplaceOrInsert(session->nodeFileDescIndex,
+                                HGFS_FILEDESC_INDEX_KEY(fd),
+                                node);
+   }
+
    node->fileDesc = fd;
    node->fileCtx = fileCtx;
    updated = TRUE;
@@ -1280,24 +1658,28 @@ HgfsUpdateNodeServerLock(fileDesc fd,                // IN: OS handle
                          HgfsSessionInfo *session,   // IN: Session info
                          HgfsLockType serverLock)    // IN: new oplock
 {
-   unsigned int i;
    HgfsFileNode *existingFileNode = NULL;
    Bool updated = FALSE;
 
    ASSERT(session);
-   ASSERT(session->nodeArray);
+   ASSERT(session->nodeSlabs);
 
    MXUser_AcquireExclLock(session->nodeArrayLock);
 
-   for (i = 0; i < session->numNodes; i++) {
-      existingFileNode = &session->nodeArray[i];
-      if (existingFileNode->state != FILENODE_STATE_UNUSED) {
-         if (existingFileNode->fileDesc == fd) {
-            existingFileNode->serverLock = serverLock;
-            updated = TRUE;
-            break;
-         }
+   /* Nodes holding server locks are always kept in the cache. */
+   existingFileNode = HgfsFileDesc2FileNode(fd, session);
+   if (existingFileNode != NULL) {
+      /* Keep the count of locked nodes HgfsIsServerLockAllowed checks. */
+      if (existingFileNode->serverLock == HGFS_LOCK_NONE &&
+          serverLock != HGFS_LOCK_NONE) {
+         session->numCachedLockedNodes++;
+      } else if (existingFileNode->serverLock != HGFS_LOCK_NONE &&
+                 serverLock == HGFS_LOCK_NONE) {
+         ASSERT(session->numCachedLockedNodes > 0);
+         session->numCachedLockedNodes--;
       }
+      existingFileNode->serverLock = serverLock;
+      updated = TRUE;
    }
 
    MXUser_ReleaseExclLock(session->nodeArrayLock);
@@ -1428,7 +1810,7 @@ exit:
  *
  * HgfsDumpAllSearches --
  *
- *    Debugging routine; print all searches in the searchArray.
+ *    Debugging routine; print all searches in the search slabs.
  *
  *    Caller should hold the session's searchArrayLock.
  *
@@ -1447,14 +1829,14 @@ HgfsDumpAllSearches(HgfsSessionInfo *session)   // IN: session info
    unsigned int i;
 
    ASSERT(session);
-   ASSERT(session->searchArray);
 
    Log("Dumping all searches\n");
    for (i = 0; i < session->numSearches; i++) {
+      HgfsSearch *search = HGFS_SESSION_SEARCH(session, i);
+
       Log("handle %u, baseDir \"%s\"\n",
-          session->searchArray[i].handle,
-          session->searchArray[i].utf8Dir ?
-          session->searchArray[i].utf8Dir : "(NULL)");
+          search->handle,
+          search->utf8Dir ? search->utf8Dir : "(NULL)");
    }
    Log("Done\n");
 }
@@ -1463,125 +1845,105 @@ HgfsDumpAllSearches(HgfsSessionInfo *session)   // IN: session info
 /*
  *-----------------------------------------------------------------------------
  *
- * HgfsGetNewNode --
+ * HgfsAddNodeSlab --
  *
- *    Remove a node from the free list and return it. Nodes on
- *    the free list should already be initialized.
+ *    Allocate a new slab of file nodes, initialize them and add them to the
+ *    free list.
  *
- *    If the free list is empty, reallocates more memory,
- *    initializes it appropriately, adds the new entries to the
- *    free list, and then returns one off the free list.
+ *    Existing nodes are never moved, so this does not touch any node that is
+ *    in use and costs the same regardless of the number of open nodes.
  *
  *    The session's nodeArrayLock should be acquired prior to calling this
  *    function.
  *
  * Results:
- *    An unused file node on success
- *    NULL on failure
+ *    TRUE on success
+ *    FALSE on failure
  *
  * Side effects:
- *    Memory allocation (potentially).
+ *    Memory allocation.
  *
  *-----------------------------------------------------------------------------
  */
 
-static HgfsFileNode *
-HgfsGetNewNode(HgfsSessionInfo *session)  // IN: session info
+static Bool
+HgfsAddNodeSlab(HgfsSessionInfo *session)  // IN: session info
 {
-   HgfsFileNode *node;
-   HgfsFileNode *newMem;
-   unsigned int newNumNodes;
+   HgfsFileNode **newSlabs;
+   HgfsFileNode *slab;
    unsigned int i;
 
    ASSERT(session);
-   ASSERT(session->nodeArray);
-
-   LOG(4, ("%s: entered\n", __FUNCTION__));
 
-   if (!DblLnkLst_IsLinked(&session->nodeFreeList)) {
-      /*
-       * This has to be unsigned and with maximum bit length. This is
-       * required to take care of "negative" differences as well.
-       */
-      uintptr_t ptrDiff;
+   newSlabs = realloc(session->nodeSlabs,
+                      (session->numNodeSlabs + 1) * sizeof *newSlabs);
+   if (newSlabs == NULL) {
+      LOG(4, ("%s: can't grow the node slab array\n", __FUNCTION__));
 
-      if (DOLOG(4)) {
-         Log("Dumping nodes before realloc\n");
-         HgfsDumpAllNodes(session);
-      }
-
-      /* Try to get twice as much memory as we had */
-      newNumNodes = 2 * session->numNodes;
-      newMem = (HgfsFileNode *)realloc(session->nodeArray,
-                                       newNumNodes * sizeof *(session->nodeArray));
-      if (!newMem) {
-         LOG(4, ("%s: can't realloc more nodes\n", __FUNCTION__));
-
-         return NULL;
-      }
+      return FALSE;
+   }
+   session->nodeSlabs = newSlabs;
 
-      ptrDiff = (char *)newMem - (char *)session->nodeArray;
-      if (ptrDiff) {
-         size_t const oldSize = session->numNodes * sizeof *(session->nodeArray);
+   slab = calloc(NUM_FILE_NODES, sizeof *slab);
+   if (slab == NULL) {
+      LOG(4, ("%s: can't allocate more nodes\n", __FUNCTION__));
 
-         /*
-          * The portion of memory that contains all our file nodes moved.
-          * All pointers that pointed inside the previous portion of memory
-          * must be updated to point to the new portion of memory.
-          *
-          * We'll need to lock this if we multithread.
-          */
+      return FALSE;
+   }
 
-         LOG(4, ("Rebasing pointers, diff is %"FMTSZ"u, sizeof node is "
-                  "%"FMTSZ"u\n", ptrDiff, sizeof(HgfsFileNode)));
-         LOG(4, ("old: %p new: %p\n", session->nodeArray, newMem));
-         ASSERT(newMem == (HgfsFileNode *)((char*)session->nodeArray + ptrDiff));
+   LOG(4, ("numNodes was %u, now is %u\n", session->numNodes,
+           session->numNodes + NUM_FILE_NODES));
+   for (i = 0; i < NUM_FILE_NODES; i++) {
+      DblLnkLst_Init(&slab[i].links);
+      slab[i].state = FILENODE_STATE_UNUSED;
 
-#define HgfsServerRebase(_ptr, _type)                                   \
-   if ((size_t)((char *)_ptr - (char *)session->nodeArray) < oldSize) { \
-      _ptr = (_type *)((char *)_ptr + ptrDiff);                         \
+      /* Append at the end of the list */
+      DblLnkLst_LinkLast(&session->nodeFreeList, &slab[i].links);
    }
 
-         /*
-          * Rebase the links of all file nodes
-          */
-         for (i = 0; i < session->numNodes; i++) {
-            HgfsServerRebase(newMem[i].links.prev, DblLnkLst_Links)
-            HgfsServerRebase(newMem[i].links.next, DblLnkLst_Links)
-         }
+   session->nodeSlabs[session->numNodeSlabs++] = slab;
+   session->numNodes += NUM_FILE_NODES;
 
-         /*
-          * There is no need to rebase the anchor of the file node free list
-          * because if we are here, it is empty.
-          */
+   return TRUE;
+}
 
-         /* Rebase the anchor of the cached file nodes list. */
-         HgfsServerRebase(session->nodeCachedList.prev, DblLnkLst_Links)
-         HgfsServerRebase(session->nodeCachedList.next, DblLnkLst_Links)
 
-#undef HgfsServerRebase
-      }
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsGetNewNode --
+ *
+ *    Remove a node from the free list and return it. Nodes on
+ *    the free list should already be initialized.
+ *
+ *    If the free list is empty, allocates another slab of nodes,
+ *    and then returns one off the free list.
+ *
+ *    The session's nodeArrayLock should be acquired prior to calling this
+ *    function.
+ *
+ * Results:
+ *    An unused file node on success
+ *    NULL on failure
+ *
+ * Side effects:
+ *    Memory allocation (potentially).
+ *
+ *-----------------------------------------------------------------------------
+ */
 
-      /* Initialize the new nodes */
-      LOG(4, ("numNodes was %u, now is %u\n", session->numNodes, newNumNodes));
-      for (i = session->numNodes; i < newNumNodes; i++) {
-         DblLnkLst_Init(&newMem[i].links);
+static HgfsFileNode *
+HgfsGetNewNode(HgfsSessionInfo *session)  // IN: session info
+{
+   HgfsFileNode *node;
 
-         newMem[i].state = FILENODE_STATE_UNUSED;
-         newMem[i].utf8Name = NULL;
-         newMem[i].utf8NameLen = 0;
-         newMem[i].fileCtx = NULL;
+   ASSERT(session);
 
-         /* Append at the end of the list */
-         DblLnkLst_LinkLast(&session->nodeFreeList, &newMem[i].links);
-      }
-      session->nodeArray = newMem;
-      session->numNodes = newNumNodes;
+   LOG(4, ("%s: entered\n", __FUNCTION__));
 
-      if (DOLOG(4)) {
-         Log("Dumping nodes after pointer changes\n");
-         HgfsDumpAllNodes(session);
-      }
+   if (!DblLnkLst_IsLinked(&session->nodeFreeList) &&
+       !HgfsAddNodeSlab(session)) {
+      return NULL;
    }
 
    /* Remove the first item from the list */
@@ -1621,6 +1983,13 @@ HgfsRemoveFileNode(HgfsFileNode *node,        // IN: file node
    LOG(4, ("%s: handle %u, name %s, fileId %"FMT64"u\n", __FUNCTION__,
            HgfsFileNode2Handle(node), node->utf8Name, node->localId.fileId));
 
+   /* Nodes that failed initialization were never indexed. */
+   if (node->state != FILENODE_STATE_UNUSED) {
+      ASSERT(node->state != FILENODE_STATE_IN_USE_CACHED);
+      HashTable_Delete(session->nodeHandleIndex,
+                       HGFS_HANDLE_INDEX_KEY(HgfsFileNode2Handle(node)));
+   }
+
    if (node->shareName) {
       free(node->shareName);
       node->shareName = NULL;
@@ -1810,6 +2179,16 @@ HgfsAddNewFileNode(HgfsFileOpenInfo *openInfo,  // IN: open info struct
    }
 
    newNode->serverLock = openInfo->acquiredLock;
+   memset(&newNode->readPattern, 0, sizeof newNode->readPattern);
+
+   if (!HashTable_Insert(session->nodeHandleIndex,
+                         HGFS_HANDLE_INDEX_KEY(newNode->handle),
+                         newNode)) {
+      LOG(4, ("%s: handle %u already in use\n", __FUNCTION__, newNode->handle));
+      HgfsRemoveFileNode(newNode, session);
+      return NULL;
+   }
+
    newNode->state = FILENODE_STATE_IN_USE_NOT_CACHED;
    newNode->shareInfo.readPermissions = openInfo->shareInfo.readPermissions;
    newNode->shareInfo.writePermissions = openInfo->shareInfo.writePermissions;
@@ -1826,9 +2205,13 @@ HgfsAddNewFileNode(HgfsFileOpenInfo *openInfo,  // IN: open info struct
  *
  * HgfsAddToCacheInternal --
  *
- *    Adds the node to cache. If the number of nodes in the cache exceed
- *    the maximum number of entries then the first node is removed. The
- *    first node should be the least recently used.
+ *    Adds the node to cache. If the cache is at its target size then a node
+ *    is evicted first, see HgfsRemoveLruNode.
+ *
+ *    The cache is a 2Q cache: newly opened nodes go to the FIFO list of
+ *    nodes seen once, so that a scan over many files only cycles through
+ *    that part of the cache. A node reopened after it was evicted is part
+ *    of the working set and goes to the LRU hot list.
  *
  *    The session's nodeArrayLock should be acquired prior to calling this
  *    function.
@@ -1856,9 +2239,15 @@ HgfsAddToCacheInternal(HgfsHandle handle,         // IN: HGFS file handle
       return TRUE;
    }
 
-   /* Remove the LRU node if the list is full. */
-   if (session->numCachedOpenNodes == gHgfsCfgSettings.maxCachedOpenNodes) {
+   /*
+    * Make room if the cache is at its target size. Nodes which cannot be
+    * evicted may take the cache over the target up to the largest size.
+    */
+   while (session->numCachedOpenNodes >= session->nodeCacheTarget) {
       if (!HgfsRemoveLruNode(session)) {
+         if (session->numCachedOpenNodes < gHgfsNodeCacheMaxNodes) {
+            break;
+         }
          LOG(4, ("%s: Unable to remove LRU node from cache.\n",
                  __FUNCTION__));
 
@@ -1866,13 +2255,24 @@ HgfsAddToCacheInternal(HgfsHandle handle,         // IN: HGFS file handle
       }
    }
 
-   ASSERT(session->numCachedOpenNodes < gHgfsCfgSettings.maxCachedOpenNodes);
-
    node = HgfsHandle2FileNode(handle, session);
    ASSERT(node);
-   /* Append at the end of the list. */
-   DblLnkLst_LinkLast(&session->nodeCachedList, &node->links);
+   if (0 != (node->flags & HGFS_FILE_NODE_CACHE_EVICTED_FL)) {
+      node->flags &= ~HGFS_FILE_NODE_CACHE_EVICTED_FL;
+      node->flags |= HGFS_FILE_NODE_CACHE_HOT_FL;
+      DblLnkLst_LinkLast(&session->nodeCachedHotList, &node->links);
+      session->numCachedHotNodes++;
+      session->nodeCacheStats.misses++;
+      session->nodeCacheEpochReopens++;
+   } else {
+      DblLnkLst_LinkLast(&session->nodeCachedList, &node->links);
+      session->nodeCacheStats.opens++;
+   }
+   node->flags |= HGFS_FILE_NODE_CACHE_REFERENCED_FL;
 
+   HashTable_ReplaceOrInsert(session->nodeFileDescIndex,
+                             HGFS_FILEDESC_INDEX_KEY(node->fileDesc),
+                             node);
    node->state = FILENODE_STATE_IN_USE_CACHED;
    session->numCachedOpenNodes++;
 
@@ -1933,8 +2333,19 @@ HgfsRemoveFromCacheInternal(HgfsHandle handle,        // IN: Hgfs handle to the
    if (node->state == FILENODE_STATE_IN_USE_CACHED) {
       /* Unlink the node from the list of cached fileNodes. */
       DblLnkLst_Unlink1(&node->links);
+      HashTable_Delete(session->nodeFileDescIndex,
+                       HGFS_FILEDESC_INDEX_KEY(node->fileDesc));
       node->state = FILENODE_STATE_IN_USE_NOT_CACHED;
       session->numCachedOpenNodes--;
+      if (0 != (node->flags & HGFS_FILE_NODE_CACHE_HOT_FL)) {
+         ASSERT(session->numCachedHotNodes > 0);
+         session->numCachedHotNodes--;
+         node->flags &= ~HGFS_FILE_NODE_CACHE_HOT_FL;
+      }
+      if (node->serverLock != HGFS_LOCK_NONE) {
+         ASSERT(session->numCachedLockedNodes > 0);
+         session->numCachedLockedNodes--;
+      }
       LOG(4, ("%s: cache entries %u remove node %s id %"FMT64"u fd %u .\n",
               __FUNCTION__, session->numCachedOpenNodes, node->utf8Name,
               node->localId.fileId, node->fileDesc));
@@ -1964,7 +2375,7 @@ HgfsRemoveFromCacheInternal(HgfsHandle handle,        // IN: Hgfs handle to the
       * we have a problem (see bug 36244).
       */
 
-      ASSERT(session->numCachedOpenNodes < gHgfsCfgSettings.maxCachedOpenNodes);
+      ASSERT(session->numCachedOpenNodes < gHgfsNodeCacheMaxNodes);
    }
 
    return TRUE;
@@ -1976,9 +2387,10 @@ HgfsRemoveFromCacheInternal(HgfsHandle handle,        // IN: Hgfs handle to the
  *
  * HgfsIsCachedInternal --
  *
- *    Check if the node exists in the cache. If the node is found in
- *    the cache then move it to the end of the list. Most recently
- *    used nodes move towards the end of the list.
+ *    Check if the node exists in the cache. If the node is found in the
+ *    hot list then move it to the end of the list, most recently used nodes
+ *    move towards the end of the list. Nodes seen once keep their place so
+ *    that the burst of requests following an open does not make it hot.
  *
  *    The session nodeArrayLock should be acquired prior to calling this
  *    function.
@@ -2009,11 +2421,11 @@ HgfsIsCachedInternal(HgfsHandle handle,         // IN: Structure representing fi
    }
 
    if (node->state == FILENODE_STATE_IN_USE_CACHED) {
-      /*
-       * Move this node to the end of the list.
-       */
-      DblLnkLst_Unlink1(&node->links);
-      DblLnkLst_LinkLast(&session->nodeCachedList, &node->links);
+      if (0 != (node->flags & HGFS_FILE_NODE_CACHE_HOT_FL)) {
+         DblLnkLst_Unlink1(&node->links);
+         DblLnkLst_LinkLast(&session->nodeCachedHotList, &node->links);
+      }
+      node->flags |= HGFS_FILE_NODE_CACHE_REFERENCED_FL;
 
       return TRUE;
    }
@@ -2032,10 +2444,13 @@ HgfsIsCachedInternal(HgfsHandle handle,         // IN: Structure representing fi
  *    then the file will be opened without the lock even if the client
  *    asked for the lock.
  *
+ *    Server locks are only granted to sessions which negotiated them and
+ *    whose channel can carry the server's oplock break requests. Otherwise
+ *    the client could never learn that its lock was broken.
  *
  * Results:
- *    TRUE if the node is found in the cache.
- *    FALSE if the node is not in the cache.
+ *    TRUE if a server lock can be granted to the session.
+ *    FALSE otherwise.
  *
  * Side effects:
  *    None
@@ -2048,8 +2463,17 @@ HgfsIsServerLockAllowed(HgfsSessionInfo *session)  // IN: session info
 {
    Bool allowed;
 
+   ASSERT(session);
+
+   if (0 == (session->flags & HGFS_SESSION_OPLOCK_ENABLED) ||
+       0 == (session->transportSession->channelCapabilities.flags &
+             HGFS_CHANNEL_ASYNC)) {
+      return FALSE;
+   }
+
    MXUser_AcquireExclLock(session->nodeArrayLock);
-   allowed = session->numCachedLockedNodes < MAX_LOCKED_FILENODES;
+   allowed = session->numCachedLockedNodes <
+             gHgfsCfgSettings.maxCachedLockedNodes;
    MXUser_ReleaseExclLock(session->nodeArrayLock);
 
    return allowed;
@@ -2059,125 +2483,101 @@ HgfsIsServerLockAllowed(HgfsSessionInfo *session)  // IN: session info
 /*
  *-----------------------------------------------------------------------------
  *
- * HgfsGetNewSearch --
+ * HgfsAddSearchSlab --
  *
- *    Remove a search from the free list and return it. Searches on
- *    the free list should already be initialized.
+ *    Allocate a new slab of searches, initialize them and add them to the
+ *    free list.
  *
- *    If the free list is empty, reallocates more memory,
- *    initializes it appropriately, adds the new entries to the
- *    free list, and then returns one off the free list.
+ *    Existing searches are never moved.
  *
  *    Caller should hold the session's searchArrayLock.
  *
  * Results:
- *    An unused search on success
- *    NULL on failure
+ *    TRUE on success
+ *    FALSE on failure
  *
  * Side effects:
- *    None
+ *    Memory allocation.
  *
  *-----------------------------------------------------------------------------
  */
 
-static HgfsSearch *
-HgfsGetNewSearch(HgfsSessionInfo *session)  // IN: session info
+static Bool
+HgfsAddSearchSlab(HgfsSessionInfo *session)  // IN: session info
 {
-   HgfsSearch *search;
-   HgfsSearch *newMem;
-   unsigned int newNumSearches;
+   HgfsSearch **newSlabs;
+   HgfsSearch *slab;
    unsigned int i;
 
    ASSERT(session);
-   ASSERT(session->searchArray);
-
-   LOG(4, ("%s: entered\n", __FUNCTION__));
-
-   if (!DblLnkLst_IsLinked(&session->searchFreeList)) {
-      /*
-       * This has to be unsigned and with maximum bit length. This is
-       * required to take care of "negative" differences as well.
-       */
-
-      uintptr_t ptrDiff;
-
-      if (DOLOG(4)) {
-         Log("Dumping searches before realloc\n");
-         HgfsDumpAllSearches(session);
-      }
 
-      /* Try to get twice as much memory as we had */
-      newNumSearches = 2 * session->numSearches;
-      newMem = (HgfsSearch *)realloc(session->searchArray,
-                                     newNumSearches * sizeof *(session->searchArray));
-      if (!newMem) {
-         LOG(4, ("%s: can't realloc more searches\n", __FUNCTION__));
+   newSlabs = realloc(session->searchSlabs,
+                      (session->numSearchSlabs + 1) * sizeof *newSlabs);
+   if (newSlabs == NULL) {
+      LOG(4, ("%s: can't grow the search slab array\n", __FUNCTION__));
 
-         return NULL;
-      }
+      return FALSE;
+   }
+   session->searchSlabs = newSlabs;
 
-      ptrDiff = (char *)newMem - (char *)session->searchArray;
-      if (ptrDiff) {
-         size_t const oldSize = session->numSearches * sizeof *(session->searchArray);
+   slab = calloc(NUM_SEARCHES, sizeof *slab);
+   if (slab == NULL) {
+      LOG(4, ("%s: can't allocate more searches\n", __FUNCTION__));
 
-         /*
-          * The portion of memory that contains all our searches moved.
-          * All pointers that pointed inside the previous portion of memory
-          * must be updated to point to the new portion of memory.
-          */
+      return FALSE;
+   }
 
-         LOG(4, ("Rebasing pointers, diff is %"FMTSZ"u, sizeof search is "
-                 "%"FMTSZ"u\n", ptrDiff, sizeof(HgfsSearch)));
-         LOG(4, ("old: %p new: %p\n", session->searchArray, newMem));
-         ASSERT(newMem == (HgfsSearch*)((char*)session->searchArray + ptrDiff));
+   LOG(4, ("numSearches was %u, now is %u\n", session->numSearches,
+           session->numSearches + NUM_SEARCHES));
+   for (i = 0; i < NUM_SEARCHES; i++) {
+      DblLnkLst_Init(&slab[i].links);
 
-#define HgfsServerRebase(_ptr, _type)                                     \
-   if ((size_t)((char *)_ptr - (char *)session->searchArray) < oldSize) { \
-      _ptr = (_type *)((char *)_ptr + ptrDiff);                           \
+      /* Append at the end of the list */
+      DblLnkLst_LinkLast(&session->searchFreeList, &slab[i].links);
    }
 
-         /*
-          * Rebase the links of all searches
-          */
+   session->searchSlabs[session->numSearchSlabs++] = slab;
+   session->numSearches += NUM_SEARCHES;
 
-         for (i = 0; i < session->numSearches; i++) {
-            HgfsServerRebase(newMem[i].links.prev, DblLnkLst_Links)
-            HgfsServerRebase(newMem[i].links.next, DblLnkLst_Links)
-         }
+   return TRUE;
+}
 
-         /*
-          * There is no need to rebase the links of the search free list
-          * because if we are here, it is empty
-          */
 
-#undef HgfsServerRebase
-      }
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsGetNewSearch --
+ *
+ *    Remove a search from the free list and return it. Searches on
+ *    the free list should already be initialized.
+ *
+ *    If the free list is empty, allocates another slab of searches,
+ *    and then returns one off the free list.
+ *
+ *    Caller should hold the session's searchArrayLock.
+ *
+ * Results:
+ *    An unused search on success
+ *    NULL on failure
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
 
-      /* Initialize the new searches */
-      LOG(4, ("numSearches was %u, now is %u\n", session->numSearches,
-               newNumSearches));
+static HgfsSearch *
+HgfsGetNewSearch(HgfsSessionInfo *session)  // IN: session info
+{
+   HgfsSearch *search;
 
-      for (i = session->numSearches; i < newNumSearches; i++) {
-         DblLnkLst_Init(&newMem[i].links);
-         newMem[i].utf8Dir = NULL;
-         newMem[i].utf8DirLen = 0;
-         newMem[i].utf8ShareName = NULL;
-         newMem[i].utf8ShareNameLen = 0;
-         newMem[i].shareInfo.rootDir = NULL;
-         newMem[i].shareInfo.rootDirLen = 0;
-         newMem[i].dents = NULL;
-         newMem[i].numDents = 0;
+   ASSERT(session);
 
-         /* Append at the end of the list */
-         DblLnkLst_LinkLast(&session->searchFreeList, &newMem[i].links);
-      }
-      session->searchArray = newMem;
-      session->numSearches = newNumSearches;
+   LOG(4, ("%s: entered\n", __FUNCTION__));
 
-      if (DOLOG(4)) {
-         Log("Dumping searches after pointer changes\n");
-         HgfsDumpAllSearches(session);
-      }
+   if (!DblLnkLst_IsLinked(&session->searchFreeList) &&
+       !HgfsAddSearchSlab(session)) {
+      return NULL;
    }
 
    /* Remove the first item from the list */
@@ -2298,9 +2698,11 @@ HgfsGetSearchCopy(HgfsHandle handle,        // IN: Hgfs search handle
    /* No dents for the copy, they consume too much memory and aren't needed. */
    copy->dents = NULL;
    copy->numDents = 0;
+   copy->dentsArena = NULL;
 
    copy->handle = original->handle;
    copy->type = original->type;
+   copy->dirFd = (fileDesc)-1;
    found = TRUE;
 
 exit:
@@ -2351,10 +2753,21 @@ HgfsAddNewSearch(char const *utf8Dir,       // IN: UTF8 name of dir to search in
 
    newSearch->dents = NULL;
    newSearch->numDents = 0;
+   newSearch->dentsArena = NULL;
+   newSearch->dirFd = (fileDesc)-1;
    newSearch->flags = 0;
    newSearch->type = type;
    newSearch->handle = HgfsServerGetNextHandleCounter();
 
+   if (!HashTable_Insert(session->searchHandleIndex,
+                         HGFS_HANDLE_INDEX_KEY(newSearch->handle),
+                         newSearch)) {
+      LOG(4, ("%s: handle %u already in use\n", __FUNCTION__,
+              newSearch->handle));
+      DblLnkLst_LinkFirst(&session->searchFreeList, &newSearch->links);
+      return NULL;
+   }
+
    newSearch->utf8DirLen = strlen(utf8Dir);
    newSearch->utf8Dir = Util_SafeStrdup(utf8Dir);
 
@@ -2375,7 +2788,8 @@ HgfsAddNewSearch(char const *utf8Dir,       // IN: UTF8 name of dir to search in
  *
  * HgfsFreeSearchDirents --
  *
- *    Frees all dirents and dirents pointer array.
+ *    Frees all dirents, or the arena they are packed in, and dirents
+ *    pointer array.
  *
  *    Caller should hold the session's searchArrayLock.
  *
@@ -2394,13 +2808,17 @@ HgfsFreeSearchDirents(HgfsSearch *search)       // IN/OUT: search
    unsigned int i;
 
    if (NULL != search->dents) {
-      for (i = 0; i < search->numDents; i++) {
-         free(search->dents[i]);
-         search->dents[i] = NULL;
+      if (NULL == search->dentsArena) {
+         for (i = 0; i < search->numDents; i++) {
+            free(search->dents[i]);
+            search->dents[i] = NULL;
+         }
       }
       free(search->dents);
       search->dents = NULL;
    }
+   free(search->dentsArena);
+   search->dentsArena = NULL;
 }
 
 
@@ -2432,6 +2850,8 @@ HgfsRemoveSearchInternal(HgfsSearch *search,       // IN: search
    LOG(4, ("%s: handle %u, dir %s\n", __FUNCTION__,
            HgfsSearch2SearchHandle(search), search->utf8Dir));
 
+   HashTable_Delete(session->searchHandleIndex,
+                    HGFS_HANDLE_INDEX_KEY(HgfsSearch2SearchHandle(search)));
    HgfsFreeSearchDirents(search);
    free(search->utf8Dir);
    free(search->utf8ShareName);
@@ -2652,19 +3072,15 @@ HgfsSearch *
 HgfsSearchHandle2Search(HgfsHandle handle,         // IN: handle
                         HgfsSessionInfo *session)  // IN: session info
 {
-   unsigned int i;
    HgfsSearch *search = NULL;
 
    ASSERT(session);
-   ASSERT(session->searchArray);
 
-   /* XXX: This O(n) lookup can and should be optimized. */
-   for (i = 0; i < session->numSearches; i++) {
-      if (!DblLnkLst_IsLinked(&session->searchArray[i].links) &&
-          session->searchArray[i].handle == handle) {
-         search = &session->searchArray[i];
-         break;
-      }
+   if (HashTable_Lookup(session->searchHandleIndex,
+                        HGFS_HANDLE_INDEX_KEY(handle),
+                        (void **)&search)) {
+      ASSERT(!DblLnkLst_IsLinked(&search->links));
+      ASSERT(search->handle == handle);
    }
 
    return search;
@@ -2702,14 +3118,13 @@ HgfsUpdateNodeNames(const char *oldLocalName,  // IN: Name of file to look for
    ASSERT(oldLocalName);
    ASSERT(newLocalName);
    ASSERT(session);
-   ASSERT(session->nodeArray);
 
    newBufferLen = strlen(newLocalName);
 
    MXUser_AcquireExclLock(session->nodeArrayLock);
 
    for (i = 0; i < session->numNodes; i++) {
-      fileNode = &session->nodeArray[i];
+      fileNode = HGFS_SESSION_NODE(session, i);
 
       /* If the node is on the free list, skip it. */
       if (fileNode->state == FILENODE_STATE_UNUSED) {
@@ -2874,11 +3289,11 @@ static struct {
    { HgfsServerRename,           sizeof (HgfsRequestRenameV2),          REQ_SYNC },
 
    { HgfsServerOpen,             HGFS_SIZEOF_OP(HgfsRequestOpenV3),             REQ_SYNC },
-   { HgfsServerRead,             HGFS_SIZEOF_OP(HgfsRequestReadV3),             REQ_SYNC },
-   { HgfsServerWrite,            HGFS_SIZEOF_OP(HgfsRequestWriteV3),            REQ_SYNC },
+   { HgfsServerRead,             HGFS_SIZEOF_OP(HgfsRequestReadV3),             REQ_ASYNC },
+   { HgfsServerWrite,            HGFS_SIZEOF_OP(HgfsRequestWriteV3),            REQ_ASYNC },
    { HgfsServerClose,            HGFS_SIZEOF_OP(HgfsRequestCloseV3),            REQ_SYNC },
-   { HgfsServerSearchOpen,       HGFS_SIZEOF_OP(HgfsRequestSearchOpenV3),       REQ_SYNC },
-   { HgfsServerSearchRead,       HGFS_SIZEOF_OP(HgfsRequestSearchReadV3),       REQ_SYNC },
+   { HgfsServerSearchOpen,       HGFS_SIZEOF_OP(HgfsRequestSearchOpenV3),       REQ_ASYNC },
+   { HgfsServerSearchRead,       HGFS_SIZEOF_OP(HgfsRequestSearchReadV3),       REQ_ASYNC },
    { HgfsServerSearchClose,      HGFS_SIZEOF_OP(HgfsRequestSearchCloseV3),      REQ_SYNC },
    { HgfsServerGetattr,          HGFS_SIZEOF_OP(HgfsRequestGetattrV3),          REQ_SYNC },
    { HgfsServerSetattr,          HGFS_SIZEOF_OP(HgfsRequestSetattrV3),          REQ_SYNC },
@@ -2897,12 +3312,30 @@ static struct {
     */
    { HgfsServerCreateSession,    sizeof (HgfsRequestCreateSessionV4),              REQ_SYNC},
    { HgfsServerDestroySession,   sizeof (HgfsRequestDestroySessionV4),             REQ_SYNC},
-   { HgfsServerRead,             sizeof (HgfsRequestReadV3),                       REQ_SYNC},
-   { HgfsServerWrite,            sizeof (HgfsRequestWriteV3),                      REQ_SYNC},
+   { HgfsServerRead,             sizeof (HgfsRequestReadV3),                       REQ_ASYNC},
+   { HgfsServerWrite,            sizeof (HgfsRequestWriteV3),                      REQ_ASYNC},
    { HgfsServerSetDirNotifyWatch,    sizeof (HgfsRequestSetWatchV4),               REQ_SYNC},
    { HgfsServerRemoveDirNotifyWatch, sizeof (HgfsRequestRemoveWatchV4),            REQ_SYNC},
    { NULL,                       0,                                                REQ_SYNC}, // No Op notify
-   { HgfsServerSearchRead,       sizeof (HgfsRequestSearchReadV4),                 REQ_SYNC},
+   { HgfsServerSearchRead,       sizeof (HgfsRequestSearchReadV4),                 REQ_ASYNC},
+   { NULL,                       0,                                                REQ_SYNC}, // No Op open V4
+   { NULL,                       0,                                                REQ_SYNC}, // No Op enumerate streams V4
+   { NULL,                       0,                                                REQ_SYNC}, // No Op getattr V4
+   { NULL,                       0,                                                REQ_SYNC}, // No Op setattr V4
+   { NULL,                       0,                                                REQ_SYNC}, // No Op delete V4
+   { NULL,                       0,                                                REQ_SYNC}, // No Op linkmove V4
+   { NULL,                       0,                                                REQ_SYNC}, // No Op fsctl V4
+   { NULL,                       0,                                                REQ_SYNC}, // No Op access check V4
+   { NULL,                       0,                                                REQ_SYNC}, // No Op fsync V4
+   { NULL,                       0,                                                REQ_SYNC}, // No Op query volume V4
+   { NULL,                       0,                                                REQ_SYNC}, // No Op oplock acquire V4
+   { HgfsServerOplockBreakAck,   sizeof (HgfsReplyOplockBreakV4),                  REQ_SYNC},
+   { NULL,                       0,                                                REQ_SYNC}, // No Op lock byte range V4
+   { NULL,                       0,                                                REQ_SYNC}, // No Op unlock byte range V4
+   { NULL,                       0,                                                REQ_SYNC}, // No Op query EAs V4
+   { NULL,                       0,                                                REQ_SYNC}, // No Op set EAs V4
+   { HgfsServerCompound,         sizeof (HgfsRequestCompoundV4),                   REQ_ASYNC},
+   { HgfsServerCopyRange,        sizeof (HgfsRequestCopyRangeV4),                  REQ_ASYNC},
 
 };
 
@@ -2950,6 +3383,7 @@ HgfsServerInputAllocInit(HgfsPacket *packet,                        // IN: packe
    localParams->op = requestOp;
    localParams->payload = requestOpArgs;
    localParams->payloadSize = requestOpArgsSize;
+   localParams->startTime = Hostinfo_SystemTimerUS();
 
    if (NULL != localParams->payload) {
       localParams->payloadOffset = (char *)localParams->payload -
@@ -3179,6 +3613,250 @@ HgfsServerGetReplyHeaderSize(Bool sessionEnabled,     // IN: session based reque
 }
 
 
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerAsyncRequestStart --
+ *
+ *    Gives the request its place in the reply order of the session and,
+ *    if the request is to be processed asynchronously, checks it against
+ *    the session limit of requests in flight.
+ *
+ *    Replies are only ordered when the worker pool is used, as requests
+ *    of a session are then completed by different threads. Replies of
+ *    synchronous requests are ordered too so that they do not overtake
+ *    the replies of the asynchronous requests received before them.
+ *
+ * Results:
+ *    TRUE if the request can be processed asynchronously, FALSE if it
+ *    must be processed by the caller.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+HgfsServerAsyncRequestStart(HgfsInputParam *input, // IN/OUT: request context
+                            Bool isAsync)          // IN: request marked async
+{
+   HgfsSessionInfo *session = input->session;
+
+   if (!gHgfsThreadpoolActive ||
+       NULL == session ||
+       0 == (input->transportSession->channelCapabilities.flags &
+             HGFS_CHANNEL_ASYNC)) {
+      return isAsync;
+   }
+
+   MXUser_AcquireExclLock(session->asyncRequestLock);
+   input->replyOrdered = TRUE;
+   input->replySeq = session->nextRequestSeq++;
+   if (isAsync && session->numAsyncRequests < MAX_SESSION_ASYNC_REQUESTS) {
+      session->numAsyncRequests++;
+      input->asyncAdmitted = TRUE;
+   }
+   MXUser_ReleaseExclLock(session->asyncRequestLock);
+
+   return input->asyncAdmitted;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerReplySend --
+ *
+ *    Sends the reply of a request and frees the request context.
+ *
+ *    An ordered reply whose turn has not come is parked in the session
+ *    and the call returns at once, so that the receive thread completing
+ *    a synchronous request never waits for a slow asynchronous one. The
+ *    thread sending the reply before it sends it, and any parked replies
+ *    following, once their turn comes. A parked reply is sent after the
+ *    request was received like an asynchronous reply.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    May send the parked replies of other requests of the session.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsServerReplySend(HgfsInputParam *input, // IN: request context
+                    Bool sendable)         // IN: reply is packed
+{
+   HgfsSessionInfo *session = input->session;
+
+   input->replySendable = sendable;
+
+   if (input->replyOrdered) {
+      MXUser_AcquireExclLock(session->asyncRequestLock);
+      if (session->nextReplySeq != input->replySeq) {
+         if (sendable && 0 == (input->packet->state & HGFS_STATE_ASYNC_REQUEST)) {
+            input->packet->state |= HGFS_STATE_ASYNC_REQUEST;
+            Atomic_Inc(&gHgfsAsyncCounter);
+         }
+         DblLnkLst_Init(&input->replyLinks);
+         DblLnkLst_LinkLast(&session->parkedReplies, &input->replyLinks);
+         MXUser_ReleaseExclLock(session->asyncRequestLock);
+         return;
+      }
+      MXUser_ReleaseExclLock(session->asyncRequestLock);
+   }
+
+   while (NULL != input) {
+      HgfsInputParam *next = NULL;
+
+      if (input->replySendable &&
+          !HgfsPacketSend(input->packet, input->transportSession, 0)) {
+         /* Send failed. Drop the reply. */
+         Log("%s: Error sending reply\n", __FUNCTION__);
+      }
+
+      if (input->replyOrdered) {
+         DblLnkLst_Links *link;
+
+         /* The session is held by input until it is freed below. */
+         MXUser_AcquireExclLock(session->asyncRequestLock);
+         session->nextReplySeq++;
+         if (input->asyncAdmitted) {
+            ASSERT(session->numAsyncRequests > 0);
+            session->numAsyncRequests--;
+         }
+         DblLnkLst_ForEach(link, &session->parkedReplies) {
+            HgfsInputParam *parked =
+               DblLnkLst_Container(link, HgfsInputParam, replyLinks);
+
+            if (parked->replySeq == session->nextReplySeq) {
+               DblLnkLst_Unlink1(link);
+               next = parked;
+               break;
+            }
+         }
+         MXUser_ReleaseExclLock(session->asyncRequestLock);
+      }
+
+      HgfsServerInputExit(input);
+      input = next;
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerStatsAddRequest --
+ *
+ *    Adds a completed request to the counters of its opcode.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsServerStatsAddRequest(HgfsOpStats *opStats,        // IN/OUT: opcode counters
+                          HgfsInternalStatus status,   // IN: request status
+                          uint64 latencyUS,            // IN: request latency
+                          uint32 bucket)               // IN: histogram bucket
+{
+   Atomic_Inc64(&opStats->count);
+   if (HGFS_ERROR_SUCCESS != status) {
+      Atomic_Inc64(&opStats->errors);
+   }
+   Atomic_Add64(&opStats->totalUS, latencyUS);
+   Atomic_Inc64(&opStats->latency[bucket]);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerStatsRecordRequest --
+ *
+ *    Records a completed request in the server and session counters.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsServerStatsRecordRequest(HgfsInternalStatus status,   // IN: request status
+                             HgfsInputParam *input)       // IN: request context
+{
+   VmTimeType latencyUS = Hostinfo_SystemTimerUS() - input->startTime;
+   uint32 bucket = 0;
+
+   if (input->op >= HGFS_OP_MAX) {
+      /* Unknown opcodes are rejected before any processing. */
+      return;
+   }
+
+   if (latencyUS < 0) {
+      latencyUS = 0;
+   }
+   while (bucket < HGFS_STATS_LATENCY_BUCKETS - 1 &&
+          (uint64)latencyUS >= CONST64U(1) << bucket) {
+      bucket++;
+   }
+
+   HgfsServerStatsAddRequest(&gHgfsServerStats.ops[input->op], status,
+                             latencyUS, bucket);
+   if (NULL != input->session) {
+      HgfsServerStatsAddRequest(&input->session->stats.ops[input->op], status,
+                                latencyUS, bucket);
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerStatsAddBytes --
+ *
+ *    Adds the file data moved by a request to the server and session
+ *    counters.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsServerStatsAddBytes(HgfsSessionInfo *session,   // IN: session
+                        uint64 bytesRead,           // IN: data read
+                        uint64 bytesWritten,        // IN: data written
+                        uint64 bytesCopied)         // IN: data copied
+{
+   HgfsServerStats *stats[] = { &gHgfsServerStats, &session->stats };
+   uint32 i;
+
+   for (i = 0; i < ARRAYSIZE(stats); i++) {
+      Atomic_Add64(&stats[i]->bytesRead, bytesRead);
+      Atomic_Add64(&stats[i]->bytesWritten, bytesWritten);
+      Atomic_Add64(&stats[i]->bytesCopied, bytesCopied);
+   }
+}
+
+
 /*
  *-----------------------------------------------------------------------------
  *
@@ -3189,6 +3867,9 @@ HgfsServerGetReplyHeaderSize(Bool sessionEnabled,     // IN: session based reque
  *       2. Release allocated objects, mapped guest memory.
  *       3. Dereference objects that were referenced.
  *
+ *    Requests embedded in a compound request only record their result, the
+ *    compound request sends the reply for all of them.
+ *
  * Results:
  *    None.
  *
@@ -3208,6 +3889,7 @@ HgfsServerCompleteRequest(HgfsInternalStatus status,   // IN: Status of the requ
    size_t replyTotalSize;
    size_t replyHeaderSize;
    uint64 replySessionId;
+   Bool sendable;
 
    if (HGFS_ERROR_SUCCESS == status) {
       HGFS_ASSERT_INPUT(input);
@@ -3215,6 +3897,14 @@ HgfsServerCompleteRequest(HgfsInternalStatus status,   // IN: Status of the requ
       ASSERT(input);
    }
 
+   HgfsServerStatsRecordRequest(status, input);
+
+   if (NULL != input->compoundResult) {
+      input->compoundResult->status = status;
+      input->compoundResult->replyPayloadSize = replyPayloadSize;
+      return;
+   }
+
    replySessionId =  (NULL != input->session) ? input->session->sessionId
                                               : HGFS_INVALID_SESSION_ID;
    replyHeaderSize = HgfsServerGetReplyHeaderSize(input->sessionEnabled,
@@ -3236,24 +3926,20 @@ HgfsServerCompleteRequest(HgfsInternalStatus status,   // IN: Status of the requ
 
    reply = HSPU_GetReplyPacket(input->packet,
                                input->transportSession->channelCbTable,
+                               HgfsServerTransportGetReplyPool(
+                                  input->transportSession, input->packet),
                                replySize,
                                &replyTotalSize);
 
    ASSERT(reply && (replySize <= replyTotalSize));
-   if (!HgfsPackReplyHeader(status, replyPayloadSize, input->sessionEnabled, replySessionId,
-                           input->id, input->op, HGFS_PACKET_FLAG_REPLY, replyTotalSize,
-                           reply)) {
+   sendable = HgfsPackReplyHeader(status, replyPayloadSize, input->sessionEnabled,
+                                  replySessionId, input->id, input->op,
+                                  HGFS_PACKET_FLAG_REPLY, replyTotalSize, reply);
+   if (!sendable) {
       Log("%s: Error packing header!\n", __FUNCTION__);
-      goto exit;
-   }
-
-   if (!HgfsPacketSend(input->packet, input->transportSession, 0)) {
-      /* Send failed. Drop the reply. */
-      Log("%s: Error sending reply\n", __FUNCTION__);
    }
 
-exit:
-   HgfsServerInputExit(input);
+   HgfsServerReplySend(input, sendable);
 }
 
 
@@ -3356,9 +4042,14 @@ HgfsServerSessionReceive(HgfsPacket *packet,      // IN: Hgfs Packet
              (transportSession->channelCapabilities.flags & HGFS_CHANNEL_ASYNC)) {
              packet->state |= HGFS_STATE_ASYNC_REQUEST;
          }
+         if (!HgfsServerAsyncRequestStart(input,
+                                          0 != (packet->state &
+                                                HGFS_STATE_ASYNC_REQUEST))) {
+            /* Process it here, e.g. the session has too many in flight. */
+            packet->state &= ~HGFS_STATE_ASYNC_REQUEST;
+         }
          if (0 != (packet->state & HGFS_STATE_ASYNC_REQUEST)) {
             LOG(4, ("%s: %d: @@Async\n", __FUNCTION__, __LINE__));
-#ifndef VMX86_TOOLS
             /*
              * Asynchronous processing is supported by the transport.
              * We can release mappings here and reacquire when needed.
@@ -3367,6 +4058,7 @@ HgfsServerSessionReceive(HgfsPacket *packet,      // IN: Hgfs Packet
             input->request = NULL;
             Atomic_Inc(&gHgfsAsyncCounter);
 
+#ifndef VMX86_TOOLS
             /* Remove pending requests during poweroff. */
             Poll_Callback(POLL_CS_MAIN,
                           POLL_FLAG_REMOVE_AT_POWEROFF,
@@ -3376,8 +4068,10 @@ HgfsServerSessionReceive(HgfsPacket *packet,      // IN: Hgfs Packet
                           1000,
                           NULL);
 #else
-            /* Tools code should never process request async. */
-            ASSERT(0);
+            if (!HgfsThreadpool_QueueWorkItem(HgfsServerProcessRequest, input)) {
+               /* No worker could take it, process the request here. */
+               HgfsServerProcessRequest(input);
+            }
 #endif
          } else {
             LOG(4, ("%s: %d: ##Sync\n", __FUNCTION__, __LINE__));
@@ -3841,6 +4535,36 @@ HgfsServer_InitState(HgfsServerCallbacks **callbackTable,         // IN/OUT: our
       gHgfsCfgSettings = *serverCfgData;
    }
 
+   /*
+    * Locked nodes are never evicted from the node cache, so there must always
+    * be room left in it for a node without a server lock.
+    */
+   if (gHgfsCfgSettings.maxCachedLockedNodes >=
+       gHgfsCfgSettings.maxCachedOpenNodes) {
+      gHgfsCfgSettings.maxCachedLockedNodes =
+         gHgfsCfgSettings.maxCachedOpenNodes > 0 ?
+         gHgfsCfgSettings.maxCachedOpenNodes - 1 : 0;
+      LOG(4, ("%s: limiting locked nodes to %u\n", __FUNCTION__,
+              gHgfsCfgSettings.maxCachedLockedNodes));
+   }
+
+   /*
+    * The configured node cache size is where sessions start, the cache
+    * then adapts within the bounds below. It never shrinks below room for
+    * the locked nodes plus one and may grow to a share of the descriptors
+    * the process can open.
+    */
+   gHgfsNodeCacheMinNodes =
+      MIN(gHgfsCfgSettings.maxCachedOpenNodes,
+          MAX(HGFS_NODE_CACHE_MIN_NODES,
+              gHgfsCfgSettings.maxCachedLockedNodes + 1));
+   gHgfsNodeCacheMaxNodes =
+      MAX(gHgfsCfgSettings.maxCachedOpenNodes,
+          MIN(HGFS_NODE_CACHE_MAX_NODES, HgfsPlatformGetMaxOpenFiles() / 4));
+   LOG(4, ("%s: node cache %u nodes, adapting within %u - %u\n", __FUNCTION__,
+           gHgfsCfgSettings.maxCachedOpenNodes, gHgfsNodeCacheMinNodes,
+           gHgfsNodeCacheMaxNodes));
+
    /*
     * Initialize the globals for handling the active shared folders.
     */
@@ -3875,6 +4599,11 @@ HgfsServer_InitState(HgfsServerCallbacks **callbackTable,         // IN/OUT: our
             gHgfsCfgSettings.flags &= ~HGFS_CONFIG_OPLOCK_ENABLED;
          }
       }
+#ifdef VMX86_TOOLS
+      gHgfsThreadpoolActive = HgfsThreadpool_Init() == HGFS_ERROR_SUCCESS;
+      Log("%s: initialized threadpool %s.\n", __FUNCTION__,
+          (gHgfsThreadpoolActive ? "active" : "inactive"));
+#endif
       gHgfsInitialized = TRUE;
    } else {
       HgfsServer_ExitState(); // Cleanup partially initialized state
@@ -3909,6 +4638,13 @@ HgfsServer_ExitState(void)
 {
    gHgfsInitialized = FALSE;
 
+#ifdef VMX86_TOOLS
+   if (gHgfsThreadpoolActive) {
+      HgfsThreadpool_Exit();
+      gHgfsThreadpoolActive = FALSE;
+      Log("%s: exit threadpool - inactive.\n", __FUNCTION__);
+   }
+#endif
    if (0 != (gHgfsCfgSettings.flags & HGFS_CONFIG_OPLOCK_ENABLED)) {
       HgfsServerOplockDestroy();
    }
@@ -4258,6 +4994,7 @@ HgfsServerSessionConnect(void *transportData,                         // IN: tra
    transportSession->state = HGFS_SESSION_STATE_OPEN;
    transportSession->channelCapabilities = *channelCapabilities;
    transportSession->numSessions = 0;
+   Atomic_WritePtr(&transportSession->replyPool, NULL);
 
    transportSession->sessionArrayLock =
          MXUser_CreateExclLock("HgfsSessionArrayLock",
@@ -4284,8 +5021,8 @@ HgfsServerSessionConnect(void *transportData,                         // IN: tra
  *
  *    Initialize a new Hgfs session.
  *
- *    Allocate HgfsSessionInfo and initialize it. Create the nodeArray and
- *    searchArray for the session.
+ *    Allocate HgfsSessionInfo and initialize it. Create the first node and
+ *    search slabs for the session.
  *
  * Results:
  *    TRUE on success, FALSE otherwise.
@@ -4300,8 +5037,8 @@ static Bool
 HgfsServerAllocateSession(HgfsTransportSessionInfo *transportSession, // IN:
                           HgfsSessionInfo **sessionData)              // OUT:
 {
-   int i;
    HgfsSessionInfo *session;
+   unsigned int i;
 
    LOG(8, ("%s: entered\n", __FUNCTION__));
 
@@ -4322,10 +5059,16 @@ HgfsServerAllocateSession(HgfsTransportSessionInfo *transportSession, // IN:
    session->searchArrayLock = MXUser_CreateExclLock("HgfsSearchArrayLock",
                                                     RANK_hgfsSearchArrayLock);
 
+   session->asyncRequestLock = MXUser_CreateExclLock("HgfsAsyncRequestLock",
+                                                     RANK_hgfsAsyncRequestLock);
+   DblLnkLst_Init(&session->parkedReplies);
+
    session->sessionId = HgfsGenerateSessionId();
    session->state = HGFS_SESSION_STATE_OPEN;
    DblLnkLst_Init(&session->links);
-   session->maxPacketSize = transportSession->channelCapabilities.maxPacketSize;
+   /* Packets larger than the legacy maximum must be negotiated. */
+   session->maxPacketSize = MIN(transportSession->channelCapabilities.maxPacketSize,
+                                HGFS_LARGE_PACKET_MAX);
    session->flags |= HGFS_SESSION_MAXPACKETSIZE_VALID;
    session->isInactive = TRUE;
    session->transportSession = transportSession;
@@ -4337,18 +5080,20 @@ HgfsServerAllocateSession(HgfsTransportSessionInfo *transportSession, // IN:
 
    DblLnkLst_Init(&session->nodeFreeList);
    DblLnkLst_Init(&session->nodeCachedList);
+   DblLnkLst_Init(&session->nodeCachedHotList);
 
-   /* Allocate array of FileNodes and add them to free list. */
-   session->numNodes = NUM_FILE_NODES;
-   session->nodeArray = Util_SafeCalloc(session->numNodes,
-                                        sizeof (HgfsFileNode));
    session->numCachedOpenNodes = 0;
+   session->numCachedHotNodes = 0;
    session->numCachedLockedNodes = 0;
-
-   for (i = 0; i < session->numNodes; i++) {
-      DblLnkLst_Init(&session->nodeArray[i].links);
-      /* Append at the end of the list. */
-      DblLnkLst_LinkLast(&session->nodeFreeList, &session->nodeArray[i].links);
+   session->nodeCacheTarget = gHgfsCfgSettings.maxCachedOpenNodes;
+   session->nodeHandleIndex = HashTable_Alloc(HGFS_INDEX_NUM_BUCKETS,
+                                              HASH_INT_KEY, NULL);
+   session->nodeFileDescIndex = HashTable_Alloc(HGFS_INDEX_NUM_BUCKETS,
+                                                HASH_INT_KEY, NULL);
+
+   /* Allocate the first slab of FileNodes and add them to free list. */
+   if (!HgfsAddNodeSlab(session)) {
+      goto error;
    }
 
    /*
@@ -4357,24 +5102,19 @@ HgfsServerAllocateSession(HgfsTransportSessionInfo *transportSession, // IN:
 
    /* Initialize search freelist. */
    DblLnkLst_Init(&session->searchFreeList);
+   session->searchHandleIndex = HashTable_Alloc(HGFS_INDEX_NUM_BUCKETS,
+                                                HASH_INT_KEY, NULL);
 
-   Atomic_Write(&session->refCount, 0);
-
-   /* Give our session a reference to hold while we are open. */
-   HgfsServerSessionGet(session);
-
-   /* Allocate array of searches and add them to free list. */
-   session->numSearches = NUM_SEARCHES;
-   session->searchArray = Util_SafeCalloc(session->numSearches,
-                                          sizeof (HgfsSearch));
-
-   for (i = 0; i < session->numSearches; i++) {
-      DblLnkLst_Init(&session->searchArray[i].links);
-      /* Append at the end of the list. */
-      DblLnkLst_LinkLast(&session->searchFreeList,
-                         &session->searchArray[i].links);
+   /* Allocate the first slab of searches and add them to free list. */
+   if (!HgfsAddSearchSlab(session)) {
+      goto error;
    }
 
+   Atomic_Write(&session->refCount, 0);
+
+   /* Give our session a reference to hold while we are open. */
+   HgfsServerSessionGet(session);
+
    /* Get common to all sessions capabiities. */
    HgfsServerGetDefaultCapabilities(session->hgfsSessionCapabilities,
                                     &session->numberOfCapabilities);
@@ -4410,6 +5150,29 @@ HgfsServerAllocateSession(HgfsTransportSessionInfo *transportSession, // IN:
 
    Log("%s: init session %p id %"FMT64"x\n", __FUNCTION__, session, session->sessionId);
    return TRUE;
+
+error:
+   LOG(4, ("%s: out of memory\n", __FUNCTION__));
+   for (i = 0; i < session->numNodeSlabs; i++) {
+      free(session->nodeSlabs[i]);
+   }
+   free(session->nodeSlabs);
+   for (i = 0; i < session->numSearchSlabs; i++) {
+      free(session->searchSlabs[i]);
+   }
+   free(session->searchSlabs);
+   HashTable_Free(session->nodeHandleIndex);
+   HashTable_Free(session->nodeFileDescIndex);
+   if (session->searchHandleIndex != NULL) {
+      HashTable_Free(session->searchHandleIndex);
+   }
+   MXUser_DestroyExclLock(session->nodeArrayLock);
+   MXUser_DestroyExclLock(session->searchArrayLock);
+   MXUser_DestroyExclLock(session->fileIOLock);
+   MXUser_DestroyExclLock(session->asyncRequestLock);
+   free(session);
+
+   return FALSE;
 }
 
 
@@ -4439,8 +5202,8 @@ HgfsDisconnectSessionInt(HgfsSessionInfo *session)    // IN: session context
    LOG(8, ("%s: entered\n", __FUNCTION__));
 
    ASSERT(session);
-   ASSERT(session->nodeArray);
-   ASSERT(session->searchArray);
+   ASSERT(session->nodeSlabs);
+   ASSERT(session->searchSlabs);
 
    session->state = HGFS_SESSION_STATE_CLOSED;
    LOG(8, ("%s: exit\n", __FUNCTION__));
@@ -4499,7 +5262,7 @@ HgfsServerSessionDisconnect(void *clientData)    // IN: session context
  *
  *    Closes a client session.
  *
- *    Remvoing the final reference will free the session's nodeArray
+ *    Remvoing the final reference will free the session's node slabs
  *    and seachArrary, and finally free the session object.
  *
  * Results:
@@ -4531,7 +5294,7 @@ HgfsServerSessionClose(void *clientData)    // IN: session context
  *
  *    Destroys a session.
  *
- *    Free the session's nodeArray and seachArrary. Free the session.
+ *    Free the session's node and search slabs. Free the session.
  *
  *    The caller must have previously acquired the global sessions lock.
  *
@@ -4550,8 +5313,8 @@ HgfsServerExitSessionInternal(HgfsSessionInfo *session)    // IN: session contex
    int i;
 
    ASSERT(session);
-   ASSERT(session->nodeArray);
-   ASSERT(session->searchArray);
+   ASSERT(session->nodeSlabs);
+   ASSERT(session->searchSlabs);
 
    ASSERT(session->state == HGFS_SESSION_STATE_CLOSED);
 
@@ -4576,16 +5339,23 @@ HgfsServerExitSessionInternal(HgfsSessionInfo *session)    // IN: session contex
    for (i = 0; i < session->numNodes; i++) {
       HgfsHandle handle;
 
-      if (session->nodeArray[i].state == FILENODE_STATE_UNUSED) {
+      if (HGFS_SESSION_NODE(session, i)->state == FILENODE_STATE_UNUSED) {
          continue;
       }
 
-      handle = HgfsFileNode2Handle(&session->nodeArray[i]);
+      handle = HgfsFileNode2Handle(HGFS_SESSION_NODE(session, i));
       HgfsRemoveFromCacheInternal(handle, session);
       HgfsFreeFileNodeInternal(handle, session);
    }
-   free(session->nodeArray);
-   session->nodeArray = NULL;
+   for (i = 0; i < session->numNodeSlabs; i++) {
+      free(session->nodeSlabs[i]);
+   }
+   free(session->nodeSlabs);
+   session->nodeSlabs = NULL;
+   HashTable_Free(session->nodeHandleIndex);
+   session->nodeHandleIndex = NULL;
+   HashTable_Free(session->nodeFileDescIndex);
+   session->nodeFileDescIndex = NULL;
 
    MXUser_ReleaseExclLock(session->nodeArrayLock);
 
@@ -4597,13 +5367,18 @@ HgfsServerExitSessionInternal(HgfsSessionInfo *session)    // IN: session contex
    MXUser_AcquireExclLock(session->searchArrayLock);
 
    for (i = 0; i < session->numSearches; i++) {
-      if (DblLnkLst_IsLinked(&session->searchArray[i].links)) {
+      if (DblLnkLst_IsLinked(&HGFS_SESSION_SEARCH(session, i)->links)) {
          continue;
       }
-      HgfsRemoveSearchInternal(&session->searchArray[i], session);
+      HgfsRemoveSearchInternal(HGFS_SESSION_SEARCH(session, i), session);
+   }
+   for (i = 0; i < session->numSearchSlabs; i++) {
+      free(session->searchSlabs[i]);
    }
-   free(session->searchArray);
-   session->searchArray = NULL;
+   free(session->searchSlabs);
+   session->searchSlabs = NULL;
+   HashTable_Free(session->searchHandleIndex);
+   session->searchHandleIndex = NULL;
 
    MXUser_ReleaseExclLock(session->searchArrayLock);
 
@@ -4611,6 +5386,9 @@ HgfsServerExitSessionInternal(HgfsSessionInfo *session)    // IN: session contex
    MXUser_DestroyExclLock(session->nodeArrayLock);
    MXUser_DestroyExclLock(session->searchArrayLock);
    MXUser_DestroyExclLock(session->fileIOLock);
+   ASSERT(session->numAsyncRequests == 0);
+   ASSERT(!DblLnkLst_IsLinked(&session->parkedReplies));
+   MXUser_DestroyExclLock(session->asyncRequestLock);
 
    free(session);
 }
@@ -4690,7 +5468,8 @@ HgfsServerSessionSendComplete(HgfsPacket *packet,   // IN/OUT: Hgfs packet
 
    if (0 != (packet->state & HGFS_STATE_CLIENT_REQUEST)) {
       HSPU_PutMetaPacket(packet, transportSession->channelCbTable);
-      HSPU_PutReplyPacket(packet, transportSession->channelCbTable);
+      HSPU_PutReplyPacket(packet, transportSession->channelCbTable,
+                          Atomic_ReadPtr(&transportSession->replyPool));
       HSPU_PutDataPacketBuf(packet, transportSession->channelCbTable);
    } else {
       if (packet->metaPacketIsAllocated) {
@@ -4845,8 +5624,8 @@ HgfsInvalidateSessionObjects(DblLnkLst_Links *shares,  // IN: List of new shares
 
    ASSERT(shares);
    ASSERT(session);
-   ASSERT(session->nodeArray);
-   ASSERT(session->searchArray);
+   ASSERT(session->nodeSlabs);
+   ASSERT(session->searchSlabs);
    LOG(4, ("%s: Beginning\n", __FUNCTION__));
 
    MXUser_AcquireExclLock(session->nodeArrayLock);
@@ -4856,16 +5635,17 @@ HgfsInvalidateSessionObjects(DblLnkLst_Links *shares,  // IN: List of new shares
     * if its filename is no longer within a share, remove it.
     */
    for (i = 0; i < session->numNodes; i++) {
+      HgfsFileNode *node = HGFS_SESSION_NODE(session, i);
       HgfsHandle handle;
       DblLnkLst_Links *l;
 
-      if (session->nodeArray[i].state == FILENODE_STATE_UNUSED) {
+      if (node->state == FILENODE_STATE_UNUSED) {
          continue;
       }
 
-      handle = HgfsFileNode2Handle(&session->nodeArray[i]);
+      handle = HgfsFileNode2Handle(node);
       LOG(4, ("%s: Examining node with fd %d (%s)\n", __FUNCTION__,
-              handle, session->nodeArray[i].utf8Name));
+              handle, node->utf8Name));
 
       /* For each share, is the node within the share? */
       for (l = shares->next; l != shares; l = l->next) {
@@ -4873,7 +5653,7 @@ HgfsInvalidateSessionObjects(DblLnkLst_Links *shares,  // IN: List of new shares
 
          share = DblLnkLst_Container(l, HgfsSharedFolder, links);
          ASSERT(share);
-         if (strcmp(session->nodeArray[i].shareInfo.rootDir, share->path) == 0) {
+         if (strcmp(node->shareInfo.rootDir, share->path) == 0) {
             LOG(4, ("%s: Node is still valid\n", __FUNCTION__));
             break;
          }
@@ -4900,19 +5680,20 @@ HgfsInvalidateSessionObjects(DblLnkLst_Links *shares,  // IN: List of new shares
     * each search, if its base name is no longer within a share, remove it.
     */
    for (i = 0; i < session->numSearches; i++) {
+      HgfsSearch *search = HGFS_SESSION_SEARCH(session, i);
       DblLnkLst_Links *l;
 
-      if (DblLnkLst_IsLinked(&session->searchArray[i].links)) {
+      if (DblLnkLst_IsLinked(&search->links)) {
          continue;
       }
 
-      if (HgfsSearchIsBaseNameSpace(&session->searchArray[i])) {
+      if (HgfsSearchIsBaseNameSpace(search)) {
          /* Skip search of the base name space. Maybe stale but it is okay. */
          continue;
       }
 
       LOG(4, ("%s: Examining search (%s)\n", __FUNCTION__,
-              session->searchArray[i].utf8Dir));
+              search->utf8Dir));
 
       /* For each share, is the search within the share? */
       for (l = shares->next; l != shares; l = l->next) {
@@ -4920,7 +5701,7 @@ HgfsInvalidateSessionObjects(DblLnkLst_Links *shares,  // IN: List of new shares
 
          share = DblLnkLst_Container(l, HgfsSharedFolder, links);
          ASSERT(share);
-         if (strcmp(session->searchArray[i].shareInfo.rootDir, share->path) == 0) {
+         if (strcmp(search->shareInfo.rootDir, share->path) == 0) {
             LOG(4, ("%s: Search is still valid\n", __FUNCTION__));
             break;
          }
@@ -4929,7 +5710,7 @@ HgfsInvalidateSessionObjects(DblLnkLst_Links *shares,  // IN: List of new shares
       /* If the node wasn't found in any share, remove it. */
       if (l == shares) {
          LOG(4, ("%s: Search is invalid, removing\n", __FUNCTION__));
-         HgfsRemoveSearchInternal(&session->searchArray[i], session);
+         HgfsRemoveSearchInternal(search, session);
       }
    }
 
@@ -5062,6 +5843,177 @@ HgfsServerSessionInvalidateInactiveSessions(void *clientData)         // IN:
 }
 
 
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerStatsPercentile --
+ *
+ *    Estimates a latency percentile of an opcode from its histogram.
+ *
+ * Results:
+ *    Upper bound in us of the bucket holding the percentile.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static uint64
+HgfsServerStatsPercentile(const uint64 *latency,   // IN: histogram snapshot
+                          uint64 count,            // IN: requests in histogram
+                          uint32 percent)          // IN: percentile
+{
+   uint64 rank = (count * percent + 99) / 100;
+   uint64 seen = 0;
+   uint32 bucket;
+
+   for (bucket = 0; bucket < HGFS_STATS_LATENCY_BUCKETS - 1; bucket++) {
+      seen += latency[bucket];
+      if (seen >= rank) {
+         break;
+      }
+   }
+   return CONST64U(1) << bucket;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerStatsPrint --
+ *
+ *    Appends request counters as text, one line for the data moved and
+ *    one per opcode used:
+ *
+ *    bytes read <n> written <n> copied <n>
+ *    op <opcode> count <n> errors <n> avg_us <n> p50_us <n> p99_us <n>
+ *       hist <bucket>:<n> ...
+ *
+ *    where histogram bucket b counts requests slower than 2^(b-1) us and
+ *    only non empty buckets are listed.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsServerStatsPrint(DynBuf *buf,                    // IN/OUT: text
+                     const HgfsServerStats *stats)   // IN: counters
+{
+   HgfsOp op;
+
+   StrUtil_SafeDynBufPrintf(buf, "bytes read %"FMT64"u written %"FMT64"u "
+                            "copied %"FMT64"u\n",
+                            Atomic_Read64(&stats->bytesRead),
+                            Atomic_Read64(&stats->bytesWritten),
+                            Atomic_Read64(&stats->bytesCopied));
+
+   for (op = 0; op < HGFS_OP_MAX; op++) {
+      const HgfsOpStats *opStats = &stats->ops[op];
+      uint64 latency[HGFS_STATS_LATENCY_BUCKETS];
+      uint64 count = 0;
+      uint32 bucket;
+
+      /* Count from the histogram snapshot so the percentiles are consistent. */
+      for (bucket = 0; bucket < HGFS_STATS_LATENCY_BUCKETS; bucket++) {
+         latency[bucket] = Atomic_Read64(&opStats->latency[bucket]);
+         count += latency[bucket];
+      }
+      if (0 == count) {
+         continue;
+      }
+
+      StrUtil_SafeDynBufPrintf(buf, "op %d count %"FMT64"u errors %"FMT64"u "
+                               "avg_us %"FMT64"u p50_us %"FMT64"u "
+                               "p99_us %"FMT64"u hist",
+                               op, count, Atomic_Read64(&opStats->errors),
+                               Atomic_Read64(&opStats->totalUS) / count,
+                               HgfsServerStatsPercentile(latency, count, 50),
+                               HgfsServerStatsPercentile(latency, count, 99));
+      for (bucket = 0; bucket < HGFS_STATS_LATENCY_BUCKETS; bucket++) {
+         if (0 != latency[bucket]) {
+            StrUtil_SafeDynBufPrintf(buf, " %u:%"FMT64"u", bucket,
+                                     latency[bucket]);
+         }
+      }
+      StrUtil_SafeDynBufPrintf(buf, "\n");
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerSessionGetStats --
+ *
+ *      Formats the request counters of the whole server followed by those
+ *      of each session of the transport session, with the node cache
+ *      counters of the session, as text (see HgfsServerStatsPrint).
+ *
+ * Results:
+ *      NUL terminated text allocated with malloc, the caller frees it.
+ *
+ * Side effects:
+ *      None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static char *
+HgfsServerSessionGetStats(void *clientData)   // IN: transport session
+{
+   HgfsTransportSessionInfo *transportSession = clientData;
+   DblLnkLst_Links *curr;
+   DynBuf buf;
+
+   ASSERT(transportSession);
+
+   DynBuf_Init(&buf);
+   StrUtil_SafeDynBufPrintf(&buf, "server\n");
+   HgfsServerStatsPrint(&buf, &gHgfsServerStats);
+
+   MXUser_AcquireExclLock(transportSession->sessionArrayLock);
+
+   DblLnkLst_ForEach(curr, &transportSession->sessionArray) {
+      HgfsSessionInfo *session = DblLnkLst_Container(curr, HgfsSessionInfo,
+                                                     links);
+      HgfsNodeCacheStats cacheStats;
+      uint32 numCachedNodes;
+      uint32 hitPercent = 0;
+
+      MXUser_AcquireExclLock(session->nodeArrayLock);
+      cacheStats = session->nodeCacheStats;
+      numCachedNodes = session->numCachedOpenNodes;
+      MXUser_ReleaseExclLock(session->nodeArrayLock);
+
+      if (0 != cacheStats.hits + cacheStats.misses) {
+         hitPercent = (uint32)(cacheStats.hits * 100 /
+                               (cacheStats.hits + cacheStats.misses));
+      }
+
+      StrUtil_SafeDynBufPrintf(&buf, "session %"FMT64"x\n", session->sessionId);
+      StrUtil_SafeDynBufPrintf(&buf, "nodecache cached %u hits %"FMT64"u "
+                               "misses %"FMT64"u opens %"FMT64"u "
+                               "evictions %"FMT64"u hit_pct %u\n",
+                               numCachedNodes, cacheStats.hits,
+                               cacheStats.misses, cacheStats.opens,
+                               cacheStats.evictions, hitPercent);
+      HgfsServerStatsPrint(&buf, &session->stats);
+   }
+
+   MXUser_ReleaseExclLock(transportSession->sessionArrayLock);
+
+   DynBuf_SafeAppend(&buf, "", 1);
+   return DynBuf_Detach(&buf);
+}
+
+
 /*
  *-----------------------------------------------------------------------------
  *
@@ -5569,7 +6521,8 @@ HgfsServerSearchRealDir(char const *baseDir,      // IN: Directory to search
                                                       HGFS_SHARE_FOLLOW_SYMLINKS);
 
    status = HgfsPlatformScandir(baseDir, baseDirLen, followSymlinks,
-                                &search->dents, &search->numDents);
+                                &search->dents, &search->numDents,
+                                &search->dentsArena);
    if (HGFS_ERROR_SUCCESS != status) {
       LOG(4, ("%s: couldn't scandir\n", __FUNCTION__));
       HgfsRemoveSearchInternal(search, session);
@@ -5758,7 +6711,8 @@ HgfsRemoveFromCache(HgfsHandle handle,	      // IN: Hgfs handle to the node
  *
  * HgfsIsCached --
  *
- *    Grab a lock and call HgfsIsCachedInternal.
+ *    Grab a lock and call HgfsIsCachedInternal. This is the lookup made
+ *    for every file I/O so it also accounts for the node cache adaptation.
  *
  * Results:
  *    TRUE if the node is found in the cache.
@@ -5777,7 +6731,14 @@ HgfsIsCached(HgfsHandle handle,         // IN: Structure representing file node
    Bool cached = FALSE;
 
    MXUser_AcquireExclLock(session->nodeArrayLock);
+   /* Adapt first so that the node looked up is not evicted under the caller. */
+   if (++session->nodeCacheEpochLookups >= HGFS_NODE_CACHE_EPOCH_LOOKUPS) {
+      HgfsNodeCacheAdapt(session);
+   }
    cached = HgfsIsCachedInternal(handle, session);
+   if (cached) {
+      session->nodeCacheStats.hits++;
+   }
    MXUser_ReleaseExclLock(session->nodeArrayLock);
 
    return cached;
@@ -5787,17 +6748,61 @@ HgfsIsCached(HgfsHandle handle,         // IN: Structure representing file node
 /*
  *-----------------------------------------------------------------------------
  *
- * HgfsRemoveLruNode--
+ * HgfsNodeCacheFindVictim --
  *
- *    Removes the least recently used node in the cache. The first node is
- *    removed since most recently used nodes are moved to the end of the
- *    list.
+ *    Finds the first node of a node cache list which can be closed. Nodes
+ *    with a server lock or a file context are skipped, as are files opened
+ *    in HGFS_FILE_NODE_SEQUENTIAL_FL mode: on some platforms this mode does
+ *    not allow files to be closed/re-opened (eg: When restoring a file into
+ *    a Windows guest you cannot use BackupWrite, then close and re-open the
+ *    file and continue to use BackupWrite.
  *
  *    XXX: Right now we do not remove nodes that have server locks on them
  *         This is not correct and should be fixed before the release.
  *         Instead we should cancel the server lock (by calling IoCancel)
  *         notify client of the lock break, and close the file.
  *
+ *    The session's nodeArrayLock should be acquired prior to calling this
+ *    function.
+ *
+ * Results:
+ *    The node to evict or NULL if there is none.
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static HgfsFileNode *
+HgfsNodeCacheFindVictim(DblLnkLst_Links *list)   // IN: node cache list
+{
+   DblLnkLst_Links *link;
+
+   DblLnkLst_ForEach(link, list) {
+      HgfsFileNode *node = DblLnkLst_Container(link, HgfsFileNode, links);
+
+      ASSERT(node->state == FILENODE_STATE_IN_USE_CACHED);
+      if (node->serverLock == HGFS_LOCK_NONE && node->fileCtx == NULL &&
+          (node->flags & HGFS_FILE_NODE_SEQUENTIAL_FL) == 0) {
+         return node;
+      }
+   }
+   return NULL;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsRemoveLruNode--
+ *
+ *    Evicts a node from the cache. Nodes seen once are evicted first, in
+ *    the order they were opened, as long as they take more than their share
+ *    of the cache. Otherwise the least recently used hot node is evicted.
+ *
+ *    The node is marked as evicted so that reopening it makes it hot.
+ *
  *    Assumes that there is at least one node in the cache.
  *
  *    The session's nodeArrayLock should be acquired prior to calling this
@@ -5816,54 +6821,116 @@ HgfsIsCached(HgfsHandle handle,         // IN: Structure representing file node
 Bool
 HgfsRemoveLruNode(HgfsSessionInfo *session)   // IN: session info
 {
-   HgfsFileNode *lruNode = NULL;
-   HgfsHandle handle;
-   Bool found = FALSE;
-   uint32 numOpenNodes = session->numCachedOpenNodes;
+   HgfsFileNode *victim;
+   DblLnkLst_Links *first = &session->nodeCachedList;
+   DblLnkLst_Links *second = &session->nodeCachedHotList;
+   uint32 numOnce;
 
    ASSERT(session);
    ASSERT(session->numCachedOpenNodes > 0);
 
-   /*
-    * Remove the first item from the list that does not have a server lock,
-    * file context or is open in sequential mode.
-    */
-   while (!found && (numOpenNodes-- > 0)) {
-      lruNode = DblLnkLst_Container(session->nodeCachedList.next,
-                                    HgfsFileNode, links);
+   numOnce = session->numCachedOpenNodes - session->numCachedHotNodes;
+   if (numOnce <= session->nodeCacheTarget / HGFS_NODE_CACHE_PROBATION_SHARE &&
+       session->numCachedHotNodes > 0) {
+      first = &session->nodeCachedHotList;
+      second = &session->nodeCachedList;
+   }
 
-      ASSERT(lruNode->state == FILENODE_STATE_IN_USE_CACHED);
-      if (lruNode->serverLock != HGFS_LOCK_NONE || lruNode->fileCtx != NULL
-          || (lruNode->flags & HGFS_FILE_NODE_SEQUENTIAL_FL) != 0) {
-         /*
-	  * Move this node with the server lock to the beginning of the list.
-	  * Also, prevent files opened in HGFS_FILE_NODE_SEQUENTIAL_FL mode
-	  * from being closed. -- On some platforms, this mode does not
-	  * allow files to be closed/re-opened (eg: When restoring a file
-	  * into a Windows guest you cannot use BackupWrite, then close and
-	  * re-open the file and continue to use BackupWrite.
-	  */
-         DblLnkLst_Unlink1(&lruNode->links);
-         DblLnkLst_LinkLast(&session->nodeCachedList, &lruNode->links);
-      } else {
-         found = TRUE;
-      }
+   victim = HgfsNodeCacheFindVictim(first);
+   if (NULL == victim) {
+      victim = HgfsNodeCacheFindVictim(second);
    }
-   if (found) {
-      handle = HgfsFileNode2Handle(lruNode);
-      if (!HgfsRemoveFromCacheInternal(handle, session)) {
-         LOG(4, ("%s: Could not remove the node from cache.\n", __FUNCTION__));
-         return FALSE;
-      }
-   } else {
+   if (NULL == victim) {
       LOG(4, ("%s: Could not find a node to remove from cache.\n", __FUNCTION__));
       return FALSE;
    }
 
+   if (!HgfsRemoveFromCacheInternal(HgfsFileNode2Handle(victim), session)) {
+      LOG(4, ("%s: Could not remove the node from cache.\n", __FUNCTION__));
+      return FALSE;
+   }
+   victim->flags |= HGFS_FILE_NODE_CACHE_EVICTED_FL;
+   session->nodeCacheStats.evictions++;
+
    return TRUE;
 }
 
 
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNodeCacheAdapt --
+ *
+ *    Ends a node cache adaptation epoch and adapts the cache size to it.
+ *
+ *    If reopens of evicted nodes were frequent the working set does not
+ *    fit and the cache grows. If there were none the cache shrinks toward
+ *    the nodes used in the epoch, closing descriptors nobody uses.
+ *
+ *    The session's nodeArrayLock should be acquired prior to calling this
+ *    function.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    Nodes may be evicted.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsNodeCacheAdapt(HgfsSessionInfo *session)   // IN: session info
+{
+   DblLnkLst_Links *lists[] = { &session->nodeCachedList,
+                                &session->nodeCachedHotList };
+   uint32 target = session->nodeCacheTarget;
+   uint32 numReferenced = 0;
+   uint32 i;
+
+   for (i = 0; i < ARRAYSIZE(lists); i++) {
+      DblLnkLst_Links *link;
+
+      DblLnkLst_ForEach(link, lists[i]) {
+         HgfsFileNode *node = DblLnkLst_Container(link, HgfsFileNode, links);
+
+         if (0 != (node->flags & HGFS_FILE_NODE_CACHE_REFERENCED_FL)) {
+            node->flags &= ~HGFS_FILE_NODE_CACHE_REFERENCED_FL;
+            numReferenced++;
+         }
+      }
+   }
+
+   if (session->nodeCacheEpochReopens * HGFS_NODE_CACHE_THRASH_SHARE >
+       session->nodeCacheEpochLookups) {
+      target = MIN(target + MAX(target / 4, 1), gHgfsNodeCacheMaxNodes);
+   } else if (0 == session->nodeCacheEpochReopens) {
+      target = MIN(target, numReferenced + numReferenced / 4 + 1);
+      target = MAX(target, gHgfsNodeCacheMinNodes);
+   }
+
+   if (target != session->nodeCacheTarget) {
+      LOG(4, ("%s: target %u -> %u, %u reopens in %u lookups, %u in use\n",
+              __FUNCTION__, session->nodeCacheTarget, target,
+              session->nodeCacheEpochReopens, session->nodeCacheEpochLookups,
+              numReferenced));
+      session->nodeCacheTarget = target;
+   }
+   LOG(4, ("%s: %u cached, hits %"FMT64"u misses %"FMT64"u opens %"FMT64"u "
+           "evictions %"FMT64"u\n", __FUNCTION__, session->numCachedOpenNodes,
+           session->nodeCacheStats.hits, session->nodeCacheStats.misses,
+           session->nodeCacheStats.opens, session->nodeCacheStats.evictions));
+
+   while (session->numCachedOpenNodes > session->nodeCacheTarget &&
+          HgfsRemoveLruNode(session)) {
+      continue;
+   }
+
+   session->nodeCacheEpochLookups = 0;
+   session->nodeCacheEpochReopens = 0;
+}
+
+
 /*
  *-----------------------------------------------------------------------------
  *
@@ -6027,6 +7094,8 @@ HgfsAllocInitReply(HgfsPacket *packet,           // IN/OUT: Hgfs Packet
    }
    replyHeader = HSPU_GetReplyPacket(packet,
                                      session->transportSession->channelCbTable,
+                                     HgfsServerTransportGetReplyPool(
+                                        session->transportSession, packet),
                                      headerSize + replyDataSize,
                                      &replyPacketSize);
 
@@ -6044,6 +7113,32 @@ HgfsAllocInitReply(HgfsPacket *packet,           // IN/OUT: Hgfs Packet
 }
 
 
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerSessionPacketFits --
+ *
+ *    Checks a packet with inline data against the maximum packet size of
+ *    the session, which is HGFS_LARGE_PACKET_MAX unless the client
+ *    negotiated a different size when creating the session.
+ *
+ * Results:
+ *    TRUE if the packet size is within the session maximum.
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+HgfsServerSessionPacketFits(HgfsSessionInfo *session,  // IN: session
+                            size_t packetSize)         // IN: packet size
+{
+   return 0 == session->maxPacketSize || packetSize <= session->maxPacketSize;
+}
+
+
 /*
  *-----------------------------------------------------------------------------
  *
@@ -6116,7 +7211,11 @@ HgfsServerValidateRead(HgfsInputParam *input,  // IN: Input params
                                      replyReadHeaderSize,
                                      replyReadResultSize,
                                      replyReadResultDataSize,
-                                     useMappedBuffer)) {
+                                     useMappedBuffer) ||
+       !HgfsServerSessionPacketFits(input->session,
+                                    replyReadHeaderSize +
+                                    replyReadResultSize +
+                                    replyReadResultDataSize)) {
       status = HGFS_ERROR_INVALID_PARAMETER;
       LOG(4, ("%s: Error: arg validation read size -> %d.\n",
                __FUNCTION__, status));
@@ -6206,6 +7305,8 @@ HgfsServerRead(HgfsInputParam *input)  // IN: Input params
    case HGFS_OP_READ_FAST_V4:
    case HGFS_OP_READ_V3: {
          HgfsReplyReadV3 *reply = replyRead;
+         HgfsVmxIov *payloadIov = NULL;
+         uint32 payloadIovCount = 0;
          void *payload;
          Bool readUseDataBuffer = replyReadDataSize != 0;
 
@@ -6213,18 +7314,31 @@ HgfsServerRead(HgfsInputParam *input)  // IN: Input params
           * The read data size holds the size of the data to read which will be read
           * into the separate data packet buffer. Zero indicates data is read into the
           * same buffer as the reply arguments.
+          *
+          * The separate data packet is read into in place, scattered over the
+          * transport's mapped pages.
           */
          if (readUseDataBuffer) {
-            payload = HSPU_GetDataPacketBuf(input->packet, BUF_WRITEABLE,
-                                            input->transportSession->channelCbTable);
+            payloadIov = HSPU_GetDataPacketIov(input->packet, BUF_WRITEABLE,
+                                               input->transportSession->channelCbTable,
+                                               &payloadIovCount);
+            payload = payloadIov;
          } else {
             payload = &reply->payload[0];
          }
          if (payload) {
-            status = HgfsPlatformReadFile(readFd, input->session, offset,
-                                          requiredSize, payload,
-                                          &reply->actualSize);
+            if (payloadIov != NULL) {
+               status = HgfsPlatformReadFileIov(readFd, input->session, offset,
+                                                requiredSize, payloadIov,
+                                                payloadIovCount,
+                                                &reply->actualSize);
+            } else {
+               status = HgfsPlatformReadFile(readFd, input->session, offset,
+                                             requiredSize, payload,
+                                             &reply->actualSize);
+            }
             if (HGFS_ERROR_SUCCESS == status) {
+               HgfsServerStatsAddBytes(input->session, reply->actualSize, 0, 0);
                reply->reserved = 0;
                replyPayloadSize = sizeof *reply;
 
@@ -6246,6 +7360,7 @@ HgfsServerRead(HgfsInputParam *input)  // IN: Input params
          status = HgfsPlatformReadFile(readFd, input->session, offset, requiredSize,
                                        reply->payload, &reply->actualSize);
          if (HGFS_ERROR_SUCCESS == status) {
+            HgfsServerStatsAddBytes(input->session, reply->actualSize, 0, 0);
             replyPayloadSize = sizeof *reply + reply->actualSize;
          } else {
             LOG(4, ("%s: V1 Failed to read-> %d.\n", __FUNCTION__, status));
@@ -6375,7 +7490,11 @@ HgfsServerValidateWrite(HgfsInputParam *input,     // IN: Input params
        !HSPU_ValidateRequestPacketSize(input->packet,
                                        requestWriteHeaderSize,
                                        requestWritePacketSize,
-                                       requestWritePacketDataSize)) {
+                                       requestWritePacketDataSize) ||
+       !HgfsServerSessionPacketFits(input->session,
+                                    requestWriteHeaderSize +
+                                    requestWritePacketSize +
+                                    requestWritePacketDataSize)) {
       status = HGFS_ERROR_INVALID_PARAMETER;
       LOG(4, ("%s: Error: write data size pkt %"FMTSZ"u data %"FMTSZ"u\n",
                __FUNCTION__, requestWritePacketDataSize, requestWriteDataSize));
@@ -6480,30 +7599,51 @@ HgfsServerWrite(HgfsInputParam *input)  // IN: Input params
    }
 
    if (writeSize > 0) {
+      HgfsVmxIov *writeIov = NULL;
+      uint32 writeIovCount = 0;
+
       if (NULL == writeData) {
-         /* No inline data to write, get it from the transport shared memory. */
+         /*
+          * No inline data to write, write it in place from the transport
+          * shared memory.
+          */
          HSPU_SetDataPacketSize(input->packet, writeSize);
-         writeData = HSPU_GetDataPacketBuf(input->packet, BUF_READABLE,
-                                           input->transportSession->channelCbTable);
-         if (NULL == writeData) {
+         writeIov = HSPU_GetDataPacketIov(input->packet, BUF_READABLE,
+                                          input->transportSession->channelCbTable,
+                                          &writeIovCount);
+         if (NULL == writeIov) {
             LOG(4, ("%s: Error: Op %d mapping write data buffer\n", __FUNCTION__, input->op));
             status = HGFS_ERROR_PROTOCOL;
             goto exit;
          }
       }
 
-      status = HgfsPlatformWriteFile(writeFd,
-                                     input->session,
-                                     writeOffset,
-                                     writeSize,
-                                     writeFlags,
-                                     writeSequential,
-                                     writeAppend,
-                                     writeData,
-                                     &writtenSize);
+      if (NULL != writeIov) {
+         status = HgfsPlatformWriteFileIov(writeFd,
+                                           input->session,
+                                           writeOffset,
+                                           writeSize,
+                                           writeFlags,
+                                           writeSequential,
+                                           writeAppend,
+                                           writeIov,
+                                           writeIovCount,
+                                           &writtenSize);
+      } else {
+         status = HgfsPlatformWriteFile(writeFd,
+                                        input->session,
+                                        writeOffset,
+                                        writeSize,
+                                        writeFlags,
+                                        writeSequential,
+                                        writeAppend,
+                                        writeData,
+                                        &writtenSize);
+      }
       if (HGFS_ERROR_SUCCESS != status) {
          goto exit;
       }
+      HgfsServerStatsAddBytes(input->session, 0, writtenSize, 0);
    }
 
    if (!HgfsPackWriteReply(input->packet, input->request, input->op,
@@ -6516,6 +7656,87 @@ exit:
 }
 
 
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerCopyRange --
+ *
+ *    Handle a Copy range request: copy data between two open files of the
+ *    session within the server.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsServerCopyRange(HgfsInputParam *input)  // IN: Input params
+{
+   HgfsInternalStatus status;
+   HgfsHandle srcFile;
+   HgfsHandle dstFile;
+   uint64 srcOffset;
+   uint64 dstOffset;
+   uint64 length;
+   uint64 copiedSize = 0;
+   fileDesc srcFd;
+   fileDesc dstFd;
+   Bool sequentialOpen;
+   size_t replyPayloadSize = 0;
+
+   HGFS_ASSERT_INPUT(input);
+
+   if (!HgfsUnpackCopyRangeRequest(input->payload, input->payloadSize, input->op,
+                                   &srcFile, &srcOffset, &dstFile, &dstOffset,
+                                   &length)) {
+      LOG(4, ("%s: Failed to unpack a valid packet -> PROTOCOL_ERROR.\n", __FUNCTION__));
+      status = HGFS_ERROR_PROTOCOL;
+      goto exit;
+   }
+
+   LOG(4, ("%s: copy %u@%"FMT64"u -> %u@%"FMT64"u, %"FMT64"u bytes\n",
+           __FUNCTION__, srcFile, srcOffset, dstFile, dstOffset, length));
+
+   /* The copy is positional which sequential only handles cannot do. */
+   if (!HgfsHandleIsSequentialOpen(srcFile, input->session, &sequentialOpen) ||
+       sequentialOpen ||
+       !HgfsHandleIsSequentialOpen(dstFile, input->session, &sequentialOpen) ||
+       sequentialOpen) {
+      status = HGFS_ERROR_INVALID_HANDLE;
+      LOG(4, ("%s: Error: handles not valid for positional copy\n", __FUNCTION__));
+      goto exit;
+   }
+
+   status = HgfsPlatformGetFd(srcFile, input->session, FALSE, &srcFd);
+   if (HGFS_ERROR_SUCCESS == status) {
+      status = HgfsPlatformGetFd(dstFile, input->session, FALSE, &dstFd);
+   }
+   if (HGFS_ERROR_SUCCESS != status) {
+      LOG(4, ("%s: Error: arg validation handle -> %d.\n", __FUNCTION__, status));
+      goto exit;
+   }
+
+   status = HgfsPlatformCopyRange(srcFd, srcOffset, dstFd, dstOffset, length,
+                                  &copiedSize);
+   if (HGFS_ERROR_SUCCESS != status) {
+      goto exit;
+   }
+   HgfsServerStatsAddBytes(input->session, 0, 0, copiedSize);
+
+   if (!HgfsPackCopyRangeReply(input->packet, input->request, input->op,
+                               copiedSize, &replyPayloadSize, input->session)) {
+      status = HGFS_ERROR_INTERNAL;
+   }
+
+exit:
+   HgfsServerCompleteRequest(status, replyPayloadSize, input);
+}
+
+
 /*
  *-----------------------------------------------------------------------------
  *
@@ -7783,6 +9004,47 @@ HgfsServerRemoveDirNotifyWatch(HgfsInputParam *input)  // IN: Input params
 }
 
 
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerOplockBreakAck --
+ *
+ *    Handle the client's acknowledgement of an oplock break request, which
+ *    carries the lock the client kept on the file. The break is completed
+ *    on the host FS only now, once the client flushed its cached data.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsServerOplockBreakAck(HgfsInputParam *input)  // IN: Input params
+{
+   HgfsHandle file;
+   HgfsLockType replyLock;
+   HgfsInternalStatus status;
+
+   HGFS_ASSERT_INPUT(input);
+
+   if (!HgfsUnpackOplockBreakAckReply(input->payload, input->payloadSize,
+                                      input->op, &file, &replyLock)) {
+      status = HGFS_ERROR_PROTOCOL;
+   } else if (HgfsServerOplockBreakReply(file, input->session, replyLock)) {
+      status = HGFS_ERROR_SUCCESS;
+   } else {
+      /* No break is waiting: the file was closed, or the ack came too late. */
+      status = HGFS_ERROR_INVALID_HANDLE;
+   }
+
+   HgfsServerCompleteRequest(status, 0, input);
+}
+
+
 /*
  *-----------------------------------------------------------------------------
  *
@@ -8372,7 +9634,7 @@ HgfsGetDirEntry(HgfsHandle hgfsSearchHandle,     // IN: ID for search data
                                     configOptions,
                                     session,
                                     dent,
-                                    getAttrs,
+                                    getAttrs ? infoRequested : 0,
                                     entryAttr,
                                     entryName,
                                     entryNameLength);
@@ -8628,6 +9890,13 @@ HgfsServerSearchRead(HgfsInputParam *input)  // IN: Input params
             }
 
             if (HGFS_ERROR_SUCCESS == status) {
+               /*
+                * Reading many entries at once, keep the directory open for
+                * getting their attributes.
+                */
+               if (0 == (info.flags & HGFS_SEARCH_READ_SINGLE_ENTRY)) {
+                  HgfsPlatformOpenSearchDir(&search, configOptions);
+               }
                status = HgfsDoSearchRead(hgfsSearchHandle,
                                           &search,
                                           configOptions,
@@ -8635,6 +9904,7 @@ HgfsServerSearchRead(HgfsInputParam *input)  // IN: Input params
                                           &info,
                                           &replyInfoSize,
                                           &replyDirentSize);
+               HgfsPlatformCloseSearchDir(&search);
             }
 
             if (HGFS_ERROR_SUCCESS == status) {
@@ -8705,9 +9975,14 @@ HgfsServerCreateSession(HgfsInputParam *input)  // IN: Input params
          }
       }
 
-      if (info.maxPacketSize < session->maxPacketSize) {
-         session->maxPacketSize = info.maxPacketSize;
-      }
+      /*
+       * The client may ask for packets up to what the channel supports,
+       * including sizes beyond the legacy large packet for bulk I/O.
+       */
+      session->maxPacketSize =
+         MIN(info.maxPacketSize,
+             input->transportSession->channelCapabilities.maxPacketSize);
+      LOG(4, ("%s: max packet size %u\n", __FUNCTION__, session->maxPacketSize));
 
       /*
        * If the server is enabled for processing oplocks and the client
@@ -8717,6 +9992,13 @@ HgfsServerCreateSession(HgfsInputParam *input)  // IN: Input params
       if ((0 != (info.flags & HGFS_SESSION_OPLOCK_ENABLED)) &&
           (0 != (gHgfsCfgSettings.flags & HGFS_CONFIG_OPLOCK_ENABLED))) {
          session->flags |= HGFS_SESSION_OPLOCK_ENABLED;
+
+         /* Only async channels carry the breaks the client acknowledges. */
+         if (0 != (input->transportSession->channelCapabilities.flags &
+                   HGFS_CHANNEL_ASYNC)) {
+            HgfsServerSetSessionCapability(HGFS_OP_OPLOCK_BREAK_V4,
+                                           HGFS_REQUEST_SUPPORTED, session);
+         }
       }
 
       if (HgfsPackCreateSessionReply(input->packet, input->request,
@@ -8791,6 +10073,417 @@ HgfsServerDestroySession(HgfsInputParam *input)  // IN: Input params
 }
 
 
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerCompoundOpValid --
+ *
+ *    Checks whether a request can be embedded in a compound request.
+ *    Only V3 requests which carry all their data inline in the packet
+ *    are allowed.
+ *
+ * Results:
+ *    TRUE if the request is allowed, FALSE otherwise.
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+HgfsServerCompoundOpValid(uint32 op)  // IN: embedded request op
+{
+   switch (op) {
+   case HGFS_OP_OPEN_V3:
+   case HGFS_OP_READ_V3:
+   case HGFS_OP_WRITE_V3:
+   case HGFS_OP_CLOSE_V3:
+   case HGFS_OP_SEARCH_OPEN_V3:
+   case HGFS_OP_SEARCH_READ_V3:
+   case HGFS_OP_SEARCH_CLOSE_V3:
+   case HGFS_OP_GETATTR_V3:
+   case HGFS_OP_SETATTR_V3:
+   case HGFS_OP_CREATE_DIR_V3:
+   case HGFS_OP_DELETE_FILE_V3:
+   case HGFS_OP_DELETE_DIR_V3:
+   case HGFS_OP_RENAME_V3:
+   case HGFS_OP_QUERY_VOLUME_INFO_V3:
+   case HGFS_OP_CREATE_SYMLINK_V3:
+      return TRUE;
+   default:
+      return FALSE;
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerCompoundSetHandle --
+ *
+ *    Replaces the file or search handle in the arguments of an embedded
+ *    request that has HGFS_COMPOUND_ENTRY_FLAG_LAST_HANDLE set with the
+ *    handle returned by the last open or search open request of the
+ *    compound request.
+ *
+ *    The arguments size is already validated against the request minimum.
+ *
+ * Results:
+ *    FALSE if the flag is set but the request has no handle to replace or
+ *    there is no handle to use.
+ *    TRUE otherwise.
+ *
+ * Side effects:
+ *    The request arguments may be modified.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+HgfsServerCompoundSetHandle(const HgfsCompoundEntryV4 *entry, // IN: embedded request
+                            void *args,             // IN/OUT: request arguments
+                            HgfsHandle lastFile,    // IN: last opened file
+                            HgfsHandle lastSearch)  // IN: last opened search
+{
+   HgfsHandle lastHandle = lastFile;
+
+   if (0 == (entry->flags & HGFS_COMPOUND_ENTRY_FLAG_LAST_HANDLE)) {
+      return TRUE;
+   }
+
+   if (HGFS_OP_SEARCH_READ_V3 == entry->op ||
+       HGFS_OP_SEARCH_CLOSE_V3 == entry->op) {
+      lastHandle = lastSearch;
+   }
+   if (HGFS_INVALID_HANDLE == lastHandle) {
+      return FALSE;
+   }
+
+   /*
+    * The requests are packed, so the handles are stored through the
+    * request types rather than through pointers to their fields.
+    */
+   switch (entry->op) {
+   case HGFS_OP_READ_V3:
+      ((HgfsRequestReadV3 *)args)->file = lastHandle;
+      break;
+   case HGFS_OP_WRITE_V3:
+      ((HgfsRequestWriteV3 *)args)->file = lastHandle;
+      break;
+   case HGFS_OP_CLOSE_V3:
+      ((HgfsRequestCloseV3 *)args)->file = lastHandle;
+      break;
+   case HGFS_OP_SEARCH_READ_V3:
+      ((HgfsRequestSearchReadV3 *)args)->search = lastHandle;
+      break;
+   case HGFS_OP_SEARCH_CLOSE_V3:
+      ((HgfsRequestSearchCloseV3 *)args)->search = lastHandle;
+      break;
+   case HGFS_OP_GETATTR_V3: {
+      HgfsRequestGetattrV3 *request = args;
+
+      if (0 == (request->fileName.flags & HGFS_FILE_NAME_USE_FILE_DESC)) {
+         return FALSE;
+      }
+      request->fileName.fid = lastHandle;
+      break;
+   }
+   case HGFS_OP_SETATTR_V3: {
+      HgfsRequestSetattrV3 *request = args;
+
+      if (0 == (request->fileName.flags & HGFS_FILE_NAME_USE_FILE_DESC)) {
+         return FALSE;
+      }
+      request->fileName.fid = lastHandle;
+      break;
+   }
+   default:
+      return FALSE;
+   }
+
+   return TRUE;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerCompoundReplyMax --
+ *
+ *    Finds the space available for the compound reply payload: the reply
+ *    must fit in the negotiated packet size and in the reply buffer of the
+ *    channel if it supplies one.
+ *
+ * Results:
+ *    Maximum size of the compound reply payload.
+ *    replyInRequest is set if the reply is built in the request buffer.
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static size_t
+HgfsServerCompoundReplyMax(HgfsInputParam *input,  // IN: Input params
+                           Bool *replyInRequest)   // OUT: reply reuses request
+{
+   size_t packetSize = input->session->maxPacketSize;
+
+   *replyInRequest = FALSE;
+   if (0 == packetSize) {
+      packetSize = HGFS_LARGE_PACKET_MAX;
+   }
+   if (NULL != input->packet->replyPacket) {
+      packetSize = MIN(packetSize, input->packet->replyPacketSize);
+   } else if (NULL != input->transportSession->channelCbTable->getWriteVa) {
+      /* The reply reuses the meta packet buffer. */
+      packetSize = MIN(packetSize, input->packet->metaPacketSize);
+      *replyInRequest = TRUE;
+   }
+   return packetSize > sizeof (HgfsHeader) ? packetSize - sizeof (HgfsHeader) : 0;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerCompound --
+ *
+ *    Handle a compound request: process each embedded request in order
+ *    with its own handler and pack all the replies into one reply.
+ *
+ *    The compound reply is allocated once and each embedded request is
+ *    given a private packet whose reply buffer is its entry in the compound
+ *    reply, so the handler packs its reply in place. The header the handler
+ *    initializes in front of its reply overlays the previous entries and is
+ *    restored afterwards. Near the end of the reply buffer a bounce buffer
+ *    of the legacy packet size is used instead, which holds any reply of the
+ *    allowed requests as reads are shortened to the space left.
+ *
+ *    The embedded request arguments are used and patched in place, they are
+ *    only copied when the channel builds the reply in the request buffer.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    The request arguments may be modified.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsServerCompound(HgfsInputParam *input)  // IN: Input params
+{
+   const HgfsRequestCompoundV4 *request;
+   HgfsReplyCompoundV4 *reply;
+   size_t entryOffsets[HGFS_COMPOUND_MAX_REQUESTS];
+   const void *requestHeader = input->request;
+   char *requestArgs;
+   char *requestCopy = NULL;
+   char *bounce = NULL;
+   Bool replyInRequest;
+   size_t replyMax;
+   size_t replySize = 0;
+   size_t offset;
+   HgfsHandle lastFile = HGFS_INVALID_HANDLE;
+   HgfsHandle lastSearch = HGFS_INVALID_HANDLE;
+   HgfsInternalStatus status = HGFS_ERROR_SUCCESS;
+   uint32 numReplies = 0;
+   uint32 i;
+
+   HGFS_ASSERT_INPUT(input);
+   ASSERT_ON_COMPILE(ARRAYSIZE(handlers) > HGFS_OP_COMPOUND_V4);
+
+   if (!input->sessionEnabled || input->payloadSize < sizeof *request) {
+      status = HGFS_ERROR_PROTOCOL;
+      goto exit;
+   }
+
+   replyMax = HgfsServerCompoundReplyMax(input, &replyInRequest);
+   if (replyMax < sizeof *reply) {
+      status = HGFS_ERROR_INTERNAL;
+      goto exit;
+   }
+
+   requestArgs = (char *)input->payload;
+   if (replyInRequest) {
+      /* Embedded requests also use the header of the compound request. */
+      requestCopy = Util_SafeMalloc(sizeof (HgfsHeader) + input->payloadSize);
+      memcpy(requestCopy, input->request, sizeof (HgfsHeader));
+      memcpy(requestCopy + sizeof (HgfsHeader), input->payload,
+             input->payloadSize);
+      requestHeader = requestCopy;
+      requestArgs = requestCopy + sizeof (HgfsHeader);
+   }
+   request = (const HgfsRequestCompoundV4 *)requestArgs;
+
+   if (0 == request->numRequests ||
+       request->numRequests > HGFS_COMPOUND_MAX_REQUESTS) {
+      LOG(4, ("%s: invalid number of requests %u\n", __FUNCTION__,
+              request->numRequests));
+      status = HGFS_ERROR_PROTOCOL;
+      goto exit;
+   }
+
+   /* Validate all the embedded requests before processing any of them. */
+   offset = sizeof *request;
+   for (i = 0; i < request->numRequests; i++) {
+      const HgfsCompoundEntryV4 *entry;
+
+      if (offset > input->payloadSize ||
+          input->payloadSize - offset < sizeof *entry) {
+         status = HGFS_ERROR_PROTOCOL;
+         goto exit;
+      }
+      entry = (const HgfsCompoundEntryV4 *)(requestArgs + offset);
+      if (entry->size > input->payloadSize - offset - sizeof *entry ||
+          !HgfsServerCompoundOpValid(entry->op) ||
+          entry->size + sizeof (HgfsRequest) < handlers[entry->op].minReqSize) {
+         LOG(4, ("%s: invalid request %u op %u size %u\n", __FUNCTION__, i,
+                 entry->op, entry->size));
+         status = HGFS_ERROR_PROTOCOL;
+         goto exit;
+      }
+      entryOffsets[i] = offset;
+      offset = ROUNDUP(offset + sizeof *entry + entry->size,
+                       HGFS_COMPOUND_ENTRY_ALIGN);
+   }
+
+   reply = HgfsAllocInitReply(input->packet, input->request, replyMax,
+                              input->session);
+   replySize = sizeof *reply;
+
+   for (i = 0; i < request->numRequests; i++) {
+      const HgfsCompoundEntryV4 *entry;
+      HgfsCompoundEntryV4 *replyEntry;
+      void *subArgs;
+      char *subPayload;
+      char *subReply;
+      char savedHeader[sizeof (HgfsHeader)];
+      HgfsCompoundResult result;
+      HgfsInputParam subInput;
+      HgfsPacket subPacket;
+      size_t space;
+
+      if (replyMax - replySize < sizeof *replyEntry) {
+         LOG(4, ("%s: reply full after %u requests\n", __FUNCTION__, i));
+         break;
+      }
+      space = replyMax - replySize - sizeof *replyEntry;
+      replyEntry = (HgfsCompoundEntryV4 *)((char *)reply + replySize);
+      subPayload = (char *)(replyEntry + 1);
+
+      entry = (const HgfsCompoundEntryV4 *)(requestArgs + entryOffsets[i]);
+      subArgs = (char *)(entry + 1);
+
+      /*
+       * Search read V3 always asks for the legacy packet maximum even though
+       * it returns a single entry, the actual reply size is checked below.
+       */
+      if (space >= HGFS_PACKET_MAX) {
+         subReply = subPayload - sizeof (HgfsHeader);
+         memcpy(savedHeader, subReply, sizeof savedHeader);
+      } else {
+         if (NULL == bounce) {
+            bounce = Util_SafeMalloc(sizeof (HgfsHeader) + HGFS_PACKET_MAX);
+         }
+         subReply = bounce;
+      }
+
+      result.status = HGFS_ERROR_INTERNAL;
+      result.replyPayloadSize = 0;
+
+      if (!HgfsServerCompoundSetHandle(entry, subArgs, lastFile, lastSearch)) {
+         result.status = HGFS_ERROR_INVALID_HANDLE;
+      } else {
+         if (HGFS_OP_READ_V3 == entry->op) {
+            /* Shorten the read to what is left of the compound reply. */
+            HgfsRequestReadV3 *read = subArgs;
+            size_t readMax = space > sizeof (HgfsReplyReadV3) ?
+                             space - sizeof (HgfsReplyReadV3) : 0;
+
+            read->requiredSize = MIN(read->requiredSize, readMax);
+         }
+
+         memset(&subPacket, 0, sizeof subPacket);
+         subPacket.replyPacket = subReply;
+         subPacket.replyPacketSize = sizeof (HgfsHeader) +
+                                     (subReply == bounce ? HGFS_PACKET_MAX : space);
+
+         memset(&subInput, 0, sizeof subInput);
+         subInput.request = requestHeader;
+         subInput.requestSize = sizeof (HgfsHeader) + entry->size;
+         subInput.session = input->session;
+         subInput.transportSession = input->transportSession;
+         subInput.packet = &subPacket;
+         subInput.payload = subArgs;
+         subInput.payloadOffset = sizeof (HgfsHeader);
+         subInput.payloadSize = entry->size;
+         subInput.op = entry->op;
+         subInput.id = input->id;
+         subInput.sessionEnabled = TRUE;
+         subInput.startTime = Hostinfo_SystemTimerUS();
+         subInput.compoundResult = &result;
+
+         (*handlers[entry->op].handler)(&subInput);
+
+         if (HGFS_ERROR_SUCCESS == result.status &&
+             result.replyPayloadSize > space) {
+            LOG(4, ("%s: reply of request %u op %u too big %"FMTSZ"u\n",
+                    __FUNCTION__, i, entry->op, result.replyPayloadSize));
+            result.status = HGFS_ERROR_NOT_ENOUGH_MEMORY;
+         }
+      }
+
+      if (subReply != bounce) {
+         memcpy(subReply, savedHeader, sizeof savedHeader);
+      }
+
+      replyEntry->op = entry->op;
+      replyEntry->status = HgfsConvertFromInternalStatus(result.status);
+      replyEntry->size = 0;
+      replyEntry->flags = 0;
+      if (HGFS_ERROR_SUCCESS == result.status) {
+         replyEntry->size = result.replyPayloadSize;
+         if (subReply == bounce) {
+            memcpy(subPayload, bounce + sizeof (HgfsHeader),
+                   result.replyPayloadSize);
+         }
+
+         if (HGFS_OP_OPEN_V3 == entry->op) {
+            lastFile = ((const HgfsReplyOpenV3 *)subPayload)->file;
+         } else if (HGFS_OP_SEARCH_OPEN_V3 == entry->op) {
+            lastSearch = ((const HgfsReplySearchOpenV3 *)subPayload)->search;
+         }
+      }
+      replySize = MIN(ROUNDUP(replySize + sizeof *replyEntry + replyEntry->size,
+                              HGFS_COMPOUND_ENTRY_ALIGN),
+                      replyMax);
+      numReplies++;
+
+      if (HGFS_ERROR_SUCCESS != result.status &&
+          0 != (request->flags & HGFS_COMPOUND_FLAG_STOP_ON_ERROR)) {
+         break;
+      }
+   }
+
+   LOG(4, ("%s: processed %u of %u requests, reply %"FMTSZ"u bytes\n",
+           __FUNCTION__, numReplies, request->numRequests, replySize));
+
+   reply->numReplies = numReplies;
+
+exit:
+   free(bounce);
+   free(requestCopy);
+   HgfsServerCompleteRequest(status,
+                             HGFS_ERROR_SUCCESS == status ? replySize : 0,
+                             input);
+}
+
+
 /*
  *-----------------------------------------------------------------------------
  *
@@ -8987,6 +10680,74 @@ exit:
 }
 
 
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerSendOplockBreak --
+ *
+ *    Sends an oplock break request to the client holding a server lock on the
+ *    file. The client is told the lock it holds from now on.
+ *
+ *    Like the change notifications, the request is sent without waiting for
+ *    the client. The client flushes any data it cached that the new lock no
+ *    longer covers, then acknowledges the break (see HgfsServerOplockBreakAck).
+ *
+ * Results:
+ *    TRUE if the request was queued to the transport, FALSE otherwise.
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+Bool
+HgfsServerSendOplockBreak(HgfsSessionInfo *session,  // IN: session info
+                          HgfsHandle file,           // IN: file handle
+                          HgfsLockType serverLock)   // IN: new lock
+{
+   HgfsPacket *packet;
+   HgfsHeader *packetHeader;
+   size_t sizeNeeded;
+
+   ASSERT(session);
+
+   if (session->state == HGFS_SESSION_STATE_CLOSED) {
+      LOG(4, ("%s: session has been closed drop the oplock break %"FMT64"x\n",
+              __FUNCTION__, session->sessionId));
+      return FALSE;
+   }
+
+   sizeNeeded = HgfsPackGetOplockBreakSize();
+
+   /* As for notifications, packet and metapacket share a single buffer. */
+   packet = Util_SafeCalloc(1, sizeof *packet + sizeNeeded);
+   packetHeader = (HgfsHeader *)((char *)packet + sizeof *packet);
+   packet->metaPacketSize = sizeNeeded;
+   packet->metaPacketDataSize = packet->metaPacketSize;
+   packet->metaPacket = packetHeader;
+
+   if (!HgfsPackOplockBreakRequest(packetHeader, file, serverLock,
+                                   session->sessionId, &sizeNeeded)) {
+      LOG(4, ("%s: failed to pack oplock break request\n", __FUNCTION__));
+      free(packet);
+      return FALSE;
+   }
+
+   if (!HgfsPacketSend(packet, session->transportSession, 0)) {
+      LOG(4, ("%s: failed to send oplock break to the client\n", __FUNCTION__));
+      free(packet);
+      return FALSE;
+   }
+
+   /* The transport will call the server send complete callback to release the packets. */
+   LOG(4, ("%s: Sent oplock break for handle %u lock %d\n", __FUNCTION__,
+           file, serverLock));
+
+   return TRUE;
+}
+
+
 /*
  *-----------------------------------------------------------------------------
  *
@@ -38,12 +38,47 @@ struct DirectoryEntry;
 #include "hgfsUtil.h"   // for HgfsInternalStatus
 #include "vm_atomic.h"
 #include "userlock.h"
+#include "hashTable.h"
 #include "hgfsServer.h" // for the server public types
 
 #define HGFS_DEBUG_ASYNC   (0)
 
 typedef struct HgfsTransportSessionInfo HgfsTransportSessionInfo;
 
+/* Pool of reply buffers of a transport session (see HSPU_GetReplyPacket). */
+typedef struct HgfsReplyPool HgfsReplyPool;
+
+/* Node cache counters of a session. */
+typedef struct HgfsNodeCacheStats {
+   uint64 hits;        /* Lookups finding the node open */
+   uint64 misses;      /* Lookups reopening an evicted node */
+   uint64 opens;       /* Nodes added by an open request */
+   uint64 evictions;   /* Nodes closed to make room in the cache */
+} HgfsNodeCacheStats;
+
+/*
+ * Request latency histogram: bucket 0 counts requests completed in less
+ * than 1us, bucket i those completed in [2^(i-1), 2^i) us. The last bucket
+ * also holds anything slower.
+ */
+#define HGFS_STATS_LATENCY_BUCKETS 24
+
+/* Counters of one request opcode. */
+typedef struct HgfsOpStats {
+   Atomic_uint64 count;       /* Requests completed */
+   Atomic_uint64 errors;      /* Requests completed with an error */
+   Atomic_uint64 totalUS;     /* Sum of the request latencies */
+   Atomic_uint64 latency[HGFS_STATS_LATENCY_BUCKETS];
+} HgfsOpStats;
+
+/* Request counters, kept per session and for the whole server. */
+typedef struct HgfsServerStats {
+   HgfsOpStats ops[HGFS_OP_MAX];
+   Atomic_uint64 bytesRead;      /* File data returned by reads */
+   Atomic_uint64 bytesWritten;   /* File data written */
+   Atomic_uint64 bytesCopied;    /* File data copied within the server */
+} HgfsServerStats;
+
 /* Identifier for a local file */
 typedef struct HgfsLocalId {
    uint64 volumeId;
@@ -111,6 +146,47 @@ typedef struct HgfsShareInfo {
    HgfsSharedFolderHandle handle;
 } HgfsShareInfo;
 
+/*
+ * Read access pattern of an open file, used to drive the host readahead.
+ */
+typedef struct HgfsReadPattern {
+   /* Offset just past the last read. */
+   uint64 nextOffset;
+
+   /* Offset the current sequential run started at. */
+   uint64 streamStart;
+
+   /* End of the range already advised for readahead. */
+   uint64 prefetchEnd;
+
+   /* End of the range already dropped from the page cache. */
+   uint64 dropEnd;
+
+   /* Readahead window, grows while the run lasts. */
+   uint32 window;
+
+   /* Number of contiguous reads in the current run. */
+   uint32 sequentialReads;
+} HgfsReadPattern;
+
+typedef enum {
+   HGFS_READ_HINT_NONE,        /* Access pattern unchanged. */
+   HGFS_READ_HINT_SEQUENTIAL,  /* Sequential run just detected. */
+   HGFS_READ_HINT_NORMAL,      /* Sequential run just broken. */
+} HgfsReadHint;
+
+/*
+ * Hints derived from the read pattern for the platform code to pass on
+ * to the host. A zero length means there is nothing to do for the range.
+ */
+typedef struct HgfsReadAdvice {
+   HgfsReadHint hint;
+   uint64 prefetchOffset;
+   uint64 prefetchLength;
+   uint64 dropOffset;
+   uint64 dropLength;
+} HgfsReadAdvice;
+
 /*
  * This struct represents a file on the local filesystem that has been
  * opened by a remote client. We store the name of the local file and
@@ -163,6 +239,9 @@ typedef struct HgfsFileNode {
    /* File flags - see below. */
    uint32 flags;
 
+   /* Read pattern of the open, reset when the node is reused. */
+   HgfsReadPattern readPattern;
+
    /*
     * Context as required by some file operations. Eg: BackupWrite on
     * Windows: BackupWrite requires the caller to hold on to a pointer
@@ -184,6 +263,12 @@ typedef struct HgfsFileNode {
 #define HGFS_FILE_NODE_SEQUENTIAL_FL           (1 << 1)
 /* Whether this a shared folder open. */
 #define HGFS_FILE_NODE_SHARED_FOLDER_OPEN_FL   (1 << 2)
+/* Whether the node is in the hot part of the node cache. */
+#define HGFS_FILE_NODE_CACHE_HOT_FL            (1 << 3)
+/* Whether the node was closed by a node cache eviction. */
+#define HGFS_FILE_NODE_CACHE_EVICTED_FL        (1 << 4)
+/* Whether the node was used in the current node cache epoch. */
+#define HGFS_FILE_NODE_CACHE_REFERENCED_FL     (1 << 5)
 
 /*
  * This struct represents a file search that a client initiated.
@@ -220,6 +305,12 @@ typedef struct HgfsSearch {
    /* Number of dents */
    uint32 numDents;
 
+   /*
+    * Storage the dents are packed in, freed at once with the dents array.
+    * NULL if each dent is allocated separately.
+    */
+   void *dentsArena;
+
    /*
     * What type of search is this (what objects does it track)? This is
     * important to know so we can do the right kind of stat operation later
@@ -229,6 +320,12 @@ typedef struct HgfsSearch {
 
    /* Parameters associated with the share. */
    HgfsShareInfo shareInfo;
+
+   /*
+    * Directory the entry attributes are read relative to, only open in the
+    * copy of the search used by a search read. See HgfsPlatformOpenSearchDir.
+    */
+   fileDesc dirFd;
 } HgfsSearch;
 
 /* HgfsSearch flags. */
@@ -279,53 +376,115 @@ typedef struct HgfsSessionInfo {
    /*
     ** START NODE ARRAY **************************************************
     *
-    * Lock for the following 6 fields: the node array,
-    * counters and lists for this session.
+    * Lock for the following 9 fields: the node slabs,
+    * counters, lists and indices for this session.
     */
    MXUserExclLock *nodeArrayLock;
 
-   /* Open file nodes of this session. */
-   HgfsFileNode *nodeArray;
+   /*
+    * Open file nodes of this session, allocated in fixed size slabs.
+    * Nodes never move once allocated.
+    */
+   HgfsFileNode **nodeSlabs;
+
+   /* Number of slabs in nodeSlabs. */
+   uint32 numNodeSlabs;
 
-   /* Number of nodes in the nodeArray. */
+   /* Number of nodes in all the node slabs. */
    uint32 numNodes;
 
+   /* Index of in use nodes keyed by HGFS handle. */
+   HashTable *nodeHandleIndex;
+
+   /* Index of cached nodes keyed by OS file handle (file descriptor). */
+   HashTable *nodeFileDescIndex;
+
    /* Free list of file nodes. LIFO to be cache-friendly. */
    DblLnkLst_Links nodeFreeList;
 
-   /* List of cached open nodes. */
+   /*
+    * Cached open nodes, see HgfsAddToCacheInternal. Nodes opened once are
+    * kept in FIFO order in nodeCachedList, nodes reopened after an eviction
+    * are kept in LRU order in nodeCachedHotList.
+    */
    DblLnkLst_Links nodeCachedList;
+   DblLnkLst_Links nodeCachedHotList;
 
    /* Current number of open nodes. */
    unsigned int numCachedOpenNodes;
 
+   /* Number of open nodes in the hot list. */
+   unsigned int numCachedHotNodes;
+
    /* Number of open nodes having server locks. */
    unsigned int numCachedLockedNodes;
+
+   /* Number of open nodes the cache adapts to, see HgfsNodeCacheAdapt. */
+   unsigned int nodeCacheTarget;
+
+   /* Lookups and reopens in the current adaptation epoch. */
+   uint32 nodeCacheEpochLookups;
+   uint32 nodeCacheEpochReopens;
+
+   HgfsNodeCacheStats nodeCacheStats;
    /** END NODE ARRAY ****************************************************/
 
    /*
     ** START SEARCH ARRAY ************************************************
     *
-    * Lock for the following three fields: for the search array
-    * and it's counter and list, for this session.
+    * Lock for the following five fields: for the search slabs
+    * and their counters, list and index, for this session.
     */
    MXUserExclLock *searchArrayLock;
 
-   /* Directory entry cache for this session. */
-   HgfsSearch *searchArray;
+   /*
+    * Directory entry cache for this session, allocated in fixed size slabs.
+    * Searches never move once allocated.
+    */
+   HgfsSearch **searchSlabs;
+
+   /* Number of slabs in searchSlabs. */
+   uint32 numSearchSlabs;
 
-   /* Number of entries in searchArray. */
+   /* Number of searches in all the search slabs. */
    uint32 numSearches;
 
+   /* Index of in use searches keyed by HGFS handle. */
+   HashTable *searchHandleIndex;
+
    /* Free list of searches. LIFO. */
    DblLnkLst_Links searchFreeList;
    /** END SEARCH ARRAY ****************************************************/
 
+   /*
+    ** START ASYNC REQUESTS **********************************************
+    *
+    * Lock for the following fields: the in-flight count, the sequence
+    * numbers keeping replies in order and the replies waiting their turn.
+    */
+   MXUserExclLock *asyncRequestLock;
+
+   /* Number of requests of this session being processed asynchronously. */
+   uint32 numAsyncRequests;
+
+   /* Sequence number given to the next ordered request received. */
+   uint32 nextRequestSeq;
+
+   /* Sequence number of the next reply allowed to be sent. */
+   uint32 nextReplySeq;
+
+   /* Replies completed before their turn, sent by the reply before them. */
+   DblLnkLst_Links parkedReplies;
+   /** END ASYNC REQUESTS ************************************************/
+
    /* Array of session specific capabiities. */
    HgfsCapability hgfsSessionCapabilities[HGFS_OP_MAX];
 
    uint32 numberOfCapabilities;
 
+   /* Request counters of the session. */
+   HgfsServerStats stats;
+
 } HgfsSessionInfo;
 
 /*
@@ -546,6 +705,18 @@ HgfsServerRestartSearchVirtualDir(HgfsServerResEnumGetFunc getName,      // IN:
                                   HgfsSessionInfo *session,              // IN: Session info
                                   HgfsHandle searchHandle);              // IN: search to restart
 
+/* Session references and requests for server initiated work. */
+
+Bool
+HgfsServerSessionTryGet(HgfsSessionInfo *session);   // IN: session context
+
+void
+HgfsServerSessionPut(HgfsSessionInfo *session);      // IN: session context
+
+Bool
+HgfsServerSendOplockBreak(HgfsSessionInfo *session,  // IN: session info
+                          HgfsHandle file,           // IN: file handle
+                          HgfsLockType serverLock);  // IN: new lock
 
 void *
 HgfsAllocInitReply(HgfsPacket *packet,           // IN/OUT: Hgfs Packet
@@ -636,6 +807,14 @@ HgfsHandleIsSequentialOpen(HgfsHandle handle,        // IN:  Hgfs file handle
                            HgfsSessionInfo *session, // IN: session info
                            Bool *sequentialOpen);    // OUT: If open was sequential
 
+Bool
+HgfsFileDescTrackRead(fileDesc fd,               // IN: OS handle (file descriptor)
+                      HgfsSessionInfo *session,  // IN: session info
+                      uint64 offset,             // IN: read offset
+                      uint32 size,               // IN: read length
+                      Bool *sequentialOpen,      // OUT: If open was sequential
+                      HgfsReadAdvice *advice);   // OUT: hints for the host
+
 Bool
 HgfsHandleIsSharedFolderOpen(HgfsHandle handle,        // IN:  Hgfs file handle
                              HgfsSessionInfo *session, // IN: session info
@@ -662,6 +841,8 @@ HgfsServerCheckOpenFlagsForShare(HgfsFileOpenInfo *openInfo, // IN: Hgfs file ha
 /* Platform specific exports. */
 Bool
 HgfsPlatformInit(void);
+uint32
+HgfsPlatformGetMaxOpenFiles(void);
 void
 HgfsPlatformDestroy(void);
 HgfsInternalStatus
@@ -704,16 +885,22 @@ HgfsPlatformSetDirEntry(HgfsSearch *search,              // IN: search
                         HgfsShareOptions configOptions,  // IN: share configuration settings
                         HgfsSessionInfo *session,        // IN: session info
                         struct DirectoryEntry *dirEntry, // IN: the indexed dirent
-                        Bool getAttr,                    // IN: get the entry attributes
+                        HgfsSearchReadMask attrMask,     // IN: attributes wanted, if any
                         HgfsFileAttrInfo *entryAttr,     // OUT: entry attributes, optional
                         char **entryName,                // OUT: entry name
                         uint32 *entryNameLength);        // OUT: entry name length
+void
+HgfsPlatformOpenSearchDir(HgfsSearch *search,              // IN/OUT: search copy
+                          HgfsShareOptions configOptions); // IN: share config options
+void
+HgfsPlatformCloseSearchDir(HgfsSearch *search);            // IN/OUT: search copy
 HgfsInternalStatus
 HgfsPlatformScandir(char const *baseDir,             // IN: Directory to search in
                     size_t baseDirLen,               // IN: Length of directory
                     Bool followSymlinks,             // IN: followSymlinks config option
                     struct DirectoryEntry ***dents,  // OUT: Array of DirectoryEntrys
-                    int *numDents);                  // OUT: Number of DirectoryEntrys
+                    int *numDents,                   // OUT: Number of DirectoryEntrys
+                    void **dentsArena);              // OUT: Storage of the dents
 HgfsInternalStatus
 HgfsPlatformScanvdir(HgfsServerResEnumGetFunc enumNamesGet,   // IN: Function to get name
                      HgfsServerResEnumInitFunc enumNamesInit, // IN: Setup function
@@ -758,6 +945,32 @@ HgfsPlatformWriteFile(fileDesc writeFile,          // IN: file descriptor
                       const void *writeData,       // IN: data to be written
                       uint32 *writtenSize);        // OUT: byte length written
 HgfsInternalStatus
+HgfsPlatformCopyRange(fileDesc srcFile,            // IN: source file descriptor
+                      uint64 srcOffset,            // IN: source offset
+                      fileDesc dstFile,            // IN: destination file descriptor
+                      uint64 dstOffset,            // IN: destination offset
+                      uint64 length,               // IN: bytes to copy
+                      uint64 *copiedSize);         // OUT: bytes copied
+HgfsInternalStatus
+HgfsPlatformReadFileIov(fileDesc readFile,           // IN: file descriptor
+                        HgfsSessionInfo *session,    // IN: session info
+                        uint64 offset,               // IN: file offset to read from
+                        uint32 requiredSize,         // IN: length of data to read
+                        HgfsVmxIov *iov,             // IN: mapped buffers for the data
+                        uint32 iovCount,             // IN: number of buffers
+                        uint32 *actualSize);         // OUT: actual length read
+HgfsInternalStatus
+HgfsPlatformWriteFileIov(fileDesc writeFile,          // IN: file descriptor
+                         HgfsSessionInfo *session,    // IN: session info
+                         uint64 writeOffset,          // IN: file offset to write to
+                         uint32 writeDataSize,        // IN: length of data to write
+                         HgfsWriteFlags writeFlags,   // IN: write flags
+                         Bool writeSequential,        // IN: write is sequential
+                         Bool writeAppend,            // IN: write is appended
+                         HgfsVmxIov *iov,             // IN: mapped buffers of the data
+                         uint32 iovCount,             // IN: number of buffers
+                         uint32 *writtenSize);        // OUT: byte length written
+HgfsInternalStatus
 HgfsPlatformWriteWin32Stream(HgfsHandle file,           // IN: packet header
                              char *dataToWrite,         // IN: data to write
                              size_t requiredSize,       // IN: data size
@@ -847,6 +1060,12 @@ HSPU_GetDataPacketBuf(HgfsPacket *packet,                   // IN/OUT: Hgfs Pack
                       MappingType mappingType,              // IN: Readable/ Writeable ?
                       HgfsServerChannelCallbacks *chanCb);  // IN: Channel callbacks
 
+HgfsVmxIov *
+HSPU_GetDataPacketIov(HgfsPacket *packet,                   // IN/OUT: Hgfs Packet
+                      MappingType mappingType,              // IN: Readable/ Writeable ?
+                      HgfsServerChannelCallbacks *chanCb,   // IN: Channel callbacks
+                      uint32 *iovCount);                    // OUT: Mapped iov count
+
 void
 HSPU_SetDataPacketSize(HgfsPacket *packet,            // IN/OUT: Hgfs Packet
                        size_t dataSize);              // IN: data size
@@ -875,10 +1094,18 @@ HSPU_ValidateReplyPacketSize(HgfsPacket *packet,         // IN: Hgfs Packet
 void *
 HSPU_GetReplyPacket(HgfsPacket *packet,                  // IN/OUT: Hgfs Packet
                     HgfsServerChannelCallbacks *chanCb,  // IN: Channel callbacks
+                    HgfsReplyPool *replyPool,            // IN: Reply buffers pool
                     size_t replyDataSize,                // IN: Size of reply data
                     size_t *replyPacketSize);            // OUT: Size of reply Packet
 
 void
 HSPU_PutReplyPacket(HgfsPacket *packet,                  // IN/OUT: Hgfs Packet
-                    HgfsServerChannelCallbacks *chanCb); // IN: Channel callbacks
+                    HgfsServerChannelCallbacks *chanCb,  // IN: Channel callbacks
+                    HgfsReplyPool *replyPool);           // IN: Reply buffers pool
+
+HgfsReplyPool *
+HSPU_CreateReplyPool(size_t bufSize);                    // IN: Size of a buffer
+
+void
+HSPU_DestroyReplyPool(HgfsReplyPool *replyPool);         // IN: Reply buffers pool
 #endif /* __HGFS_SERVER_INT_H__ */
@@ -44,6 +44,7 @@
 #include <sys/types.h>
 #include <dirent.h>
 #include <sys/resource.h> // for getrlimit
+#include <sys/uio.h>      // for preadv/pwritev
 
 #if defined(__FreeBSD__)
 #   include <sys/param.h>
@@ -66,7 +67,9 @@
 #include "su.h"
 #include "codeset.h"
 #include "unicodeOperations.h"
+#include "unicodeTransforms.h"
 #include "userlock.h"
+#include "mutexRankLib.h"
 
 #if defined(linux) && !defined(SYS_getdents64)
 /* For DT_UNKNOWN */
@@ -80,6 +83,45 @@
 #define LOGLEVEL_MODULE hgfs
 #include "loglevel_user.h"
 
+/*
+ * Case insensitive lookup cache: bounds on the directory listings kept.
+ * A directory modified within HGFS_CASE_CACHE_RACY_SECS is not cached as
+ * a further change in the same second would leave its mtime unchanged.
+ */
+#define HGFS_CASE_CACHE_MAX_NAMES       65536
+#define HGFS_CASE_CACHE_MAX_DIR_NAMES   (HGFS_CASE_CACHE_MAX_NAMES / 4)
+#define HGFS_CASE_CACHE_NUM_BUCKETS     256
+#define HGFS_CASE_CACHE_RACY_SECS       2
+
+#if defined(__linux__) && defined(SYS_openat2)
+#include <linux/openat2.h>
+/*
+ * Share roots are held open so that a client path can be checked to stay
+ * within its share with a single openat2 walk relative to the root.
+ */
+#define HGFS_HAVE_OPENAT2
+#define HGFS_MAX_SHARE_ROOTS            64
+/* Interval at which a share path is checked to still name its open root. */
+#define HGFS_SHARE_ROOT_CHECK_SECS      1
+#endif
+
+#if defined(__linux__)
+/* Maximum number of buffers passed to a single vectored read or write. */
+#define HGFS_FILE_IOV_BATCH 64
+#endif
+
+#if defined(__linux__) && defined(SYS_copy_file_range)
+#define HGFS_HAVE_COPY_FILE_RANGE
+#endif
+
+/*
+ * Copy range: maximum data copied by one request, so that a request does
+ * not hold a worker for too long, and the buffer of the copy loop used
+ * when the kernel cannot copy the data itself.
+ */
+#define HGFS_COPY_RANGE_MAX             (64 * 1024 * 1024)
+#define HGFS_COPY_RANGE_BUF_SIZE        (64 * 1024)
+
 #if defined(__APPLE__)
 #include <CoreServices/CoreServices.h> // for the alias manager
 #include <CoreFoundation/CoreFoundation.h> // for CFString and CFURL
@@ -106,6 +148,29 @@ typedef struct DirectoryEntry {
 } DirectoryEntry;
 #endif
 
+/*
+ * Sizes of the buffer passed to getdents by HgfsPlatformScandir. The buffer
+ * starts small and doubles while directory reads fill more than half of it.
+ */
+#define HGFS_SCANDIR_BUFFER_MIN (32 * 1024)
+#define HGFS_SCANDIR_BUFFER_MAX (256 * 1024)
+
+/* Alignment of the dents packed in a scandir arena. */
+#define HGFS_SCANDIR_ALIGN 8
+
+/* Initial number of dent pointers allocated for a scandir. */
+#define HGFS_SCANDIR_MIN_DENTS 64
+
+/* The dents of a directory scan packed in a single allocation. */
+typedef struct HgfsScandirArena {
+   char *base;              /* Packed dents */
+   size_t size;             /* Bytes used in base */
+   size_t capacity;         /* Bytes allocated for base */
+   DirectoryEntry **dents;  /* Dent offsets in base while scanning */
+   size_t numDents;         /* Number of dents */
+   size_t maxDents;         /* Number of entries allocated for dents */
+} HgfsScandirArena;
+
 /*
  * ALLPERMS (mode 07777) and ACCESSPERMS (mode 0777) are not defined in the
  * Solaris version of <sys/stat.h>.
@@ -335,6 +400,30 @@ static void HgfsGetSequentialOnlyFlagFromName(const char *fileName,
 static void HgfsGetSequentialOnlyFlagFromFd(int fd,
                                             HgfsFileAttrInfo *attr);
 
+#if defined(__linux__)
+static void HgfsGetSequentialOnlyFlagAt(int dirFd,
+                                        const char *entryName,
+                                        Bool followSymlinks,
+                                        HgfsFileAttrInfo *attr);
+#endif
+
+static HgfsInternalStatus HgfsGetattrFromNameAt(int dirFd,
+                                                const char *entryName,
+                                                char *fileName,
+                                                HgfsShareOptions configOptions,
+                                                char *shareName,
+                                                Bool getFlags,
+                                                HgfsFileAttrInfo *attr,
+                                                char **targetName);
+
+static Bool HgfsCaseCacheInit(void);
+static void HgfsCaseCacheDestroy(void);
+
+#if defined(HGFS_HAVE_OPENAT2)
+static Bool HgfsShareRootsInit(void);
+static void HgfsShareRootsDestroy(void);
+#endif
+
 static int HgfsConvertComponentCase(char *currentComponent,
                                     const char *dirPath,
                                     const char **convertedComponent,
@@ -375,6 +464,11 @@ static HgfsInternalStatus HgfsSetHiddenXAttr(char const *fileName,
 static HgfsInternalStatus HgfsEffectivePermissions(char *fileName,
                                                    Bool readOnlyShare,
                                                    uint32 *permissions);
+static HgfsInternalStatus HgfsEffectivePermissionsAt(int dirFd,
+                                                     const char *entryName,
+                                                     char *fileName,
+                                                     Bool readOnlyShare,
+                                                     uint32 *permissions);
 static uint64 HgfsGetCreationTime(const struct stat *stats);
 
 #if !defined(sun)
@@ -555,6 +649,15 @@ HgfsServerGetOpenFlags(HgfsOpenFlags flagsIn, // IN
 Bool
 HgfsPlatformInit(void)
 {
+   if (!HgfsCaseCacheInit()) {
+      return FALSE;
+   }
+#if defined(HGFS_HAVE_OPENAT2)
+   if (!HgfsShareRootsInit()) {
+      HgfsCaseCacheDestroy();
+      return FALSE;
+   }
+#endif
    return TRUE;
 }
 
@@ -578,6 +681,42 @@ HgfsPlatformInit(void)
 void
 HgfsPlatformDestroy(void)
 {
+#if defined(HGFS_HAVE_OPENAT2)
+   HgfsShareRootsDestroy();
+#endif
+   HgfsCaseCacheDestroy();
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsPlatformGetMaxOpenFiles --
+ *
+ *      Get the number of files the server process may have open at once.
+ *
+ * Results:
+ *      The soft limit on open file descriptors.
+ *
+ * Side effects:
+ *      None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+uint32
+HgfsPlatformGetMaxOpenFiles(void)
+{
+   struct rlimit openFiles;
+
+   if (getrlimit(RLIMIT_NOFILE, &openFiles) < 0) {
+      LOG(4, ("%s: getrlimit failed: %s\n", __FUNCTION__, strerror(errno)));
+      return HGFS_MAX_CACHED_FILENODES;
+   }
+   if (openFiles.rlim_cur == RLIM_INFINITY || openFiles.rlim_cur > MAX_UINT32) {
+      return MAX_UINT32;
+   }
+   return (uint32)openFiles.rlim_cur;
 }
 
 
@@ -654,6 +793,9 @@ HgfsInternalStatus
 HgfsPlatformCloseFile(fileDesc fileDesc, // IN: File descriptor
                       void *fileCtx)     // IN: File context
 {
+   /* The fd must not be found leased once it is closed and reused. */
+   HgfsReleaseServerLock(fileDesc);
+
    if (close(fileDesc) != 0) {
       int error = errno;
 
@@ -1396,222 +1538,568 @@ HgfsGetHiddenAttr(char const *fileName,         // IN:  Input filename
 }
 
 
+/*
+ * Listing of a directory cached for case insensitive lookups: the names
+ * of its entries indexed by their case folded form. A name that is not in
+ * the listing is a negative lookup result, valid as long as the listing is.
+ */
+typedef struct HgfsCaseCacheDir {
+   DblLnkLst_Links links;   // On the LRU list
+   char *dirPath;           // Case converted path of the directory
+   dev_t dev;               // Identity and change time of the directory
+   ino_t ino;               //   when it was read
+   time_t mtime;
+   uint32 numNames;
+   HashTable *names;        // Folded name -> entry name
+} HgfsCaseCacheDir;
+
+typedef struct HgfsCaseCache {
+   MXUserExclLock *lock;
+   HashTable *dirs;         // Directory path -> HgfsCaseCacheDir
+   DblLnkLst_Links lru;     // Most recently used first
+   uint32 numNames;         // Names in all the listings
+} HgfsCaseCache;
+
+static HgfsCaseCache gCaseCache;
+
+
 /*
  *-----------------------------------------------------------------------------
  *
- * HgfsConvertComponentCase --
+ * HgfsCaseCacheFreeDir --
  *
- *    Do a case insensitive search of a directory for the specified entry. If
- *    a matching entry is found, return it in the convertedComponent argument.
+ *    Frees a cached directory listing.
  *
  * Results:
- *    On Success:
- *    Returns 0 and the converted component name in the argument convertedComponent.
- *    The length for the convertedComponent is returned in convertedComponentSize.
+ *    None.
  *
- *    On Failure:
- *    Non-zero errno return, with convertedComponent and convertedComponentSize
- *    set to NULL and 0 respectively.
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsCaseCacheFreeDir(HgfsCaseCacheDir *dir)  // IN: listing
+{
+   if (dir != NULL) {
+      HashTable_Free(dir->names);
+      free(dir->dirPath);
+      free(dir);
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsCaseCacheRemoveDir --
+ *
+ *    Removes a directory listing from the cache and frees it.
+ *    The cache lock must be held.
+ *
+ * Results:
+ *    None.
  *
  * Side effects:
- *    On success, allocated memory is returned in convertedComponent and needs
- *    to be freed.
+ *    None.
  *
  *-----------------------------------------------------------------------------
  */
 
-static int
-HgfsConvertComponentCase(char *currentComponent,           // IN
-                         const char *dirPath,              // IN
-                         const char **convertedComponent,  // OUT
-                         size_t *convertedComponentSize)   // OUT
+static void
+HgfsCaseCacheRemoveDir(HgfsCaseCacheDir *dir)  // IN: listing
 {
-   struct dirent *dirent;
-   DIR *dir = NULL;
-   char *dentryName;
-   size_t dentryNameLen;
-   char *myConvertedComponent = NULL;
-   size_t myConvertedComponentSize;
-   int ret;
+   ASSERT(MXUser_IsCurThreadHoldingExclLock(gCaseCache.lock));
 
-   ASSERT(currentComponent);
-   ASSERT(dirPath);
-   ASSERT(convertedComponent);
-   ASSERT(convertedComponentSize);
+   HashTable_Delete(gCaseCache.dirs, dir->dirPath);
+   DblLnkLst_Unlink1(&dir->links);
+   gCaseCache.numNames -= dir->numNames;
+   HgfsCaseCacheFreeDir(dir);
+}
 
-   /* Open the specified directory. */
-   dir = Posix_OpenDir(dirPath);
-   if (!dir) {
-      ret = errno;
-      goto exit;
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsCaseCacheInit --
+ *
+ *    Sets up the case insensitive lookup cache.
+ *
+ * Results:
+ *    TRUE on success, FALSE otherwise.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+HgfsCaseCacheInit(void)
+{
+   gCaseCache.lock = MXUser_CreateExclLock("HgfsCaseCacheLock",
+                                           RANK_hgfsCaseCacheLock);
+   if (gCaseCache.lock == NULL) {
+      LOG(4, ("%s: failed to create the case cache lock\n", __FUNCTION__));
+      return FALSE;
    }
+   gCaseCache.dirs = HashTable_Alloc(HGFS_CASE_CACHE_NUM_BUCKETS,
+                                     HASH_STRING_KEY, NULL);
+   DblLnkLst_Init(&gCaseCache.lru);
+   gCaseCache.numNames = 0;
 
-   /*
-    * Unicode_CompareIgnoreCase crashes with invalid unicode strings,
-    * validate it before passing it to Unicode_* functions.
-    */
-   if (!Unicode_IsBufferValid(currentComponent, -1, STRING_ENCODING_UTF8)) {
-      /* Invalid unicode string, return failure. */
-      ret = EINVAL;
-      goto exit;
+   return TRUE;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsCaseCacheDestroy --
+ *
+ *    Tears down the case insensitive lookup cache.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsCaseCacheDestroy(void)
+{
+   if (gCaseCache.lock == NULL) {
+      return;
    }
 
-   /*
-    * Read all of the directory entries. For each one, convert the name
-    * to lower case and then compare it to the lower case component.
-    */
-   while ((dirent = readdir(dir))) {
-      char *dentryNameU;
-      int cmpResult;
+   MXUser_AcquireExclLock(gCaseCache.lock);
+   while (DblLnkLst_IsLinked(&gCaseCache.lru)) {
+      HgfsCaseCacheRemoveDir(DblLnkLst_Container(gCaseCache.lru.next,
+                                                 HgfsCaseCacheDir, links));
+   }
+   ASSERT(gCaseCache.numNames == 0);
+   MXUser_ReleaseExclLock(gCaseCache.lock);
 
-      dentryName = dirent->d_name;
-      dentryNameLen = strlen(dentryName);
+   HashTable_Free(gCaseCache.dirs);
+   gCaseCache.dirs = NULL;
+   MXUser_DestroyExclLock(gCaseCache.lock);
+   gCaseCache.lock = NULL;
+}
 
-      /*
-       * Unicode_CompareIgnoreCase crashes with invalid unicode strings,
-       * validate and convert it appropriately before passing it to Unicode_*
-       * functions.
-       */
 
-      if (!Unicode_IsBufferValid(dentryName, dentryNameLen,
-                                 STRING_ENCODING_DEFAULT)) {
-         /* Invalid unicode string, skip the entry. */
-         continue;
-      }
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsCaseCacheLookup --
+ *
+ *    Looks up a folded name in the cached listing of a directory, provided
+ *    the directory did not change since it was read.
+ *
+ * Results:
+ *    TRUE if the directory listing is cached: convertedComponent is the
+ *    allocated matching entry name, or NULL if there is no such entry.
+ *    FALSE if the directory needs to be read.
+ *
+ * Side effects:
+ *    A stale listing is dropped.
+ *
+ *-----------------------------------------------------------------------------
+ */
 
-      dentryNameU = Unicode_Alloc(dentryName, STRING_ENCODING_DEFAULT);
+static Bool
+HgfsCaseCacheLookup(const char *dirPath,           // IN: directory
+                    const struct stat *dirStat,    // IN: its current stat
+                    const char *foldedName,        // IN: folded component
+                    char **convertedComponent)     // OUT: entry name
+{
+   HgfsCaseCacheDir *dir;
+   const char *name;
+   Bool cached = FALSE;
 
-      cmpResult = Unicode_CompareIgnoreCase(currentComponent, dentryNameU);
-      free(dentryNameU);
+   *convertedComponent = NULL;
 
-      if (cmpResult == 0) {
-         /*
-          * The current directory entry is a case insensitive match to
-          * the specified component. Malloc and copy the current directory entry.
-          */
-         myConvertedComponentSize = dentryNameLen + 1;
-         myConvertedComponent = malloc(myConvertedComponentSize);
-         if (myConvertedComponent == NULL) {
-            ret = errno;
-            LOG(4, ("%s: failed to malloc myConvertedComponent.\n",
-                    __FUNCTION__));
-            goto exit;
-         }
-         Str_Strcpy(myConvertedComponent, dentryName, myConvertedComponentSize);
+   MXUser_AcquireExclLock(gCaseCache.lock);
 
-         /* Success. Cleanup and exit. */
-         ret = 0;
-         *convertedComponentSize = myConvertedComponentSize;
-         *convertedComponent = myConvertedComponent;
-         goto exit;
-      }
+   if (!HashTable_Lookup(gCaseCache.dirs, dirPath, (void **)&dir)) {
+      goto exit;
    }
 
-   /* We didn't find a match. Failure. */
-   ret = ENOENT;
-
-exit:
-   if (dir) {
-      closedir(dir);
+   if (dir->dev != dirStat->st_dev || dir->ino != dirStat->st_ino ||
+       dir->mtime != dirStat->st_mtime) {
+      LOG(4, ("%s: dropping stale listing of \"%s\"\n", __FUNCTION__, dirPath));
+      HgfsCaseCacheRemoveDir(dir);
+      goto exit;
    }
-   if (ret) {
-      *convertedComponent = NULL;
-      *convertedComponentSize = 0;
+
+   DblLnkLst_Unlink1(&dir->links);
+   DblLnkLst_LinkFirst(&gCaseCache.lru, &dir->links);
+
+   if (HashTable_Lookup(dir->names, foldedName, (void **)&name)) {
+      *convertedComponent = Util_SafeStrdup(name);
    }
-   return ret;
+   cached = TRUE;
+
+exit:
+   MXUser_ReleaseExclLock(gCaseCache.lock);
+
+   return cached;
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * HgfsConstructConvertedPath --
+ * HgfsCaseCacheInsert --
  *
- *    Expand the passed string and append the converted path.
+ *    Adds a directory listing to the cache, evicting the least recently
+ *    used listings to stay within bounds.
  *
  * Results:
- *    Returns 0 if successful, errno on failure. Note that this
- *    function cannot return ENOENT.
+ *    None.
  *
  * Side effects:
- *    Reallocs the path.
+ *    The cache owns the listing or it is freed.
  *
  *-----------------------------------------------------------------------------
  */
 
-static int
-HgfsConstructConvertedPath(char **path,                 // IN/OUT
-                           size_t *pathSize,            // IN/OUT
-                           char *convertedPath,         // IN
-                           size_t convertedPathSize)    // IN
+static void
+HgfsCaseCacheInsert(HgfsCaseCacheDir *dir)  // IN: listing
 {
-   char *p;
-   size_t convertedPathLen = convertedPathSize - 1;
+   ASSERT(dir->numNames <= HGFS_CASE_CACHE_MAX_DIR_NAMES);
 
-   ASSERT(path);
-   ASSERT(*path);
-   ASSERT(convertedPath);
-   ASSERT(pathSize);
+   MXUser_AcquireExclLock(gCaseCache.lock);
 
-   p = realloc(*path, *pathSize + convertedPathLen + sizeof (DIRSEPC));
-   if (!p) {
-      int error = errno;
-      LOG(4, ("%s: failed to realloc.\n", __FUNCTION__));
-      return error;
+   while (gCaseCache.numNames + dir->numNames > HGFS_CASE_CACHE_MAX_NAMES) {
+      ASSERT(DblLnkLst_IsLinked(&gCaseCache.lru));
+      HgfsCaseCacheRemoveDir(DblLnkLst_Container(gCaseCache.lru.prev,
+                                                 HgfsCaseCacheDir, links));
    }
 
-   *path = p;
-   *pathSize += convertedPathLen + sizeof (DIRSEPC);
+   if (HashTable_Insert(gCaseCache.dirs, dir->dirPath, dir)) {
+      DblLnkLst_LinkFirst(&gCaseCache.lru, &dir->links);
+      gCaseCache.numNames += dir->numNames;
+      dir = NULL;
+   }
 
-   /* Copy out the converted component to curDir, and free it. */
-   Str_Strncat(p, *pathSize, DIRSEPS, sizeof (DIRSEPS));
-   Str_Strncat(p, *pathSize, convertedPath, convertedPathLen);
-   return 0;
+   MXUser_ReleaseExclLock(gCaseCache.lock);
+
+   /* Another thread cached the directory first. */
+   HgfsCaseCacheFreeDir(dir);
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * HgfsCaseInsensitiveLookup --
+ * HgfsCaseCacheReadDir --
  *
- *    Do a case insensitive lookup for fileName. Each component past sharePath is
- *    looked-up case-insensitively. Expensive!
+ *    Reads a directory looking for an entry matching a case folded name
+ *    and, if the listing can be cached, indexes the names of its entries
+ *    by their case folded form. When several entries fold to the same name
+ *    the first one read wins, as it would with a scan of the directory.
  *
- *    NOTE:
- *    shareName is always expected to be a prefix of fileName.
+ *    A directory changed within HGFS_CASE_CACHE_RACY_SECS, or holding more
+ *    than HGFS_CASE_CACHE_MAX_DIR_NAMES names, is not indexed: the read
+ *    stops at the first match as a plain scan would.
  *
  * Results:
- *    Returns 0 if successful and resolved path for fileName is returned in
- *    convertedFileName and its length (without nul) in convertedFileNameLength.
- *    Otherwise returns non-zero errno with convertedFileName and
- *    convertedFileNameLength set to NULL and 0 respectively.
+ *    0 on success, errno otherwise. convertedComponent is the allocated
+ *    matching entry name, or NULL if there is none. listing is the listing
+ *    to cache, or NULL.
  *
  * Side effects:
- *    On success, allocated memory is returned in convertedFileName and needs
- *    to be freed.
+ *    None.
  *
  *-----------------------------------------------------------------------------
  */
 
 static int
-HgfsCaseInsensitiveLookup(const char *sharePath,           // IN
-                          size_t sharePathLength,          // IN
-                          char *fileName,                  // IN
-                          size_t fileNameLength,           // IN
-                          char **convertedFileName,        // OUT
-                          size_t *convertedFileNameLength) // OUT
+HgfsCaseCacheReadDir(const char *dirPath,          // IN: directory
+                     const struct stat *dirStat,   // IN: its stat
+                     const char *foldedName,       // IN: folded component
+                     char **convertedComponent,    // OUT: entry name
+                     HgfsCaseCacheDir **listing)   // OUT: its listing
 {
-   char *currentComponent;
-   char *nextComponent;
-   char *curDir;
-   size_t curDirSize;
-   char *convertedComponent = NULL;
-   size_t convertedComponentSize = 0;
-   int error = 0;
+   struct dirent *dirent;
+   HgfsCaseCacheDir *dir = NULL;
+   DIR *dirStream;
 
-   ASSERT(sharePath);
-   ASSERT(fileName);
+   *convertedComponent = NULL;
+   *listing = NULL;
+
+   dirStream = Posix_OpenDir(dirPath);
+   if (dirStream == NULL) {
+      return errno;
+   }
+
+   if (time(NULL) - dirStat->st_mtime >= HGFS_CASE_CACHE_RACY_SECS) {
+      dir = Util_SafeCalloc(1, sizeof *dir);
+      DblLnkLst_Init(&dir->links);
+      dir->dirPath = Util_SafeStrdup(dirPath);
+      dir->dev = dirStat->st_dev;
+      dir->ino = dirStat->st_ino;
+      dir->mtime = dirStat->st_mtime;
+      dir->names = HashTable_Alloc(HGFS_CASE_CACHE_NUM_BUCKETS,
+                                   HASH_STRING_KEY | HASH_FLAG_COPYKEY, free);
+   }
+
+   while ((dirent = readdir(dirStream))) {
+      const char *dentryName = dirent->d_name;
+      char *dentryNameU;
+      char *foldedDentryName;
+
+      /*
+       * Unicode_FoldCase crashes with invalid unicode strings, validate
+       * and convert it appropriately before passing it to Unicode_*
+       * functions.
+       */
+      if (!Unicode_IsBufferValid(dentryName, strlen(dentryName),
+                                 STRING_ENCODING_DEFAULT)) {
+         /* Invalid unicode string, skip the entry. */
+         continue;
+      }
+
+      dentryNameU = Unicode_Alloc(dentryName, STRING_ENCODING_DEFAULT);
+      foldedDentryName = Unicode_FoldCase(dentryNameU);
+      free(dentryNameU);
+
+      if (*convertedComponent == NULL &&
+          strcmp(foldedDentryName, foldedName) == 0) {
+         *convertedComponent = Util_SafeStrdup(dentryName);
+      }
+
+      if (dir != NULL && dir->numNames == HGFS_CASE_CACHE_MAX_DIR_NAMES) {
+         LOG(4, ("%s: \"%s\" is too large to cache\n", __FUNCTION__, dirPath));
+         HgfsCaseCacheFreeDir(dir);
+         dir = NULL;
+      }
+      if (dir != NULL) {
+         char *name = Util_SafeStrdup(dentryName);
+
+         if (HashTable_Insert(dir->names, foldedDentryName, name)) {
+            dir->numNames++;
+         } else {
+            free(name);
+         }
+      }
+      free(foldedDentryName);
+
+      if (dir == NULL && *convertedComponent != NULL) {
+         break;
+      }
+   }
+
+   closedir(dirStream);
+
+   *listing = dir;
+   return 0;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsConvertComponentCase --
+ *
+ *    Do a case insensitive search of a directory for the specified entry. If
+ *    a matching entry is found, return it in the convertedComponent argument.
+ *
+ *    Directory listings are cached, so that repeated lookups in a
+ *    directory, including those of names that do not exist, cost a hash
+ *    lookup as long as the directory does not change. Directories too
+ *    large or changed too recently to be cached are scanned up to the
+ *    first match.
+ *
+ * Results:
+ *    On Success:
+ *    Returns 0 and the converted component name in the argument convertedComponent.
+ *    The length for the convertedComponent is returned in convertedComponentSize.
+ *
+ *    On Failure:
+ *    Non-zero errno return, with convertedComponent and convertedComponentSize
+ *    set to NULL and 0 respectively.
+ *
+ * Side effects:
+ *    On success, allocated memory is returned in convertedComponent and needs
+ *    to be freed.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+HgfsConvertComponentCase(char *currentComponent,           // IN
+                         const char *dirPath,              // IN
+                         const char **convertedComponent,  // OUT
+                         size_t *convertedComponentSize)   // OUT
+{
+   struct stat dirStat;
+   HgfsCaseCacheDir *dir;
+   char *foldedComponent = NULL;
+   char *myConvertedComponent = NULL;
+   int ret;
+
+   ASSERT(currentComponent);
+   ASSERT(dirPath);
+   ASSERT(convertedComponent);
+   ASSERT(convertedComponentSize);
+
+#if defined(__APPLE__)
+   /*
+    *  Can't use Posix_Stat because of inconsistent definition
+    *  of _DARWIN_USE_64_BIT_INODE in this file and in other libraries.
+    */
+   if (stat(dirPath, &dirStat) < 0) {
+#else
+   if (Posix_Stat(dirPath, &dirStat) < 0) {
+#endif
+      ret = errno;
+      goto exit;
+   }
+   if (!S_ISDIR(dirStat.st_mode)) {
+      ret = ENOTDIR;
+      goto exit;
+   }
+
+   /*
+    * Unicode_FoldCase crashes with invalid unicode strings,
+    * validate it before passing it to Unicode_* functions.
+    */
+   if (!Unicode_IsBufferValid(currentComponent, -1, STRING_ENCODING_UTF8)) {
+      /* Invalid unicode string, return failure. */
+      ret = EINVAL;
+      goto exit;
+   }
+
+   foldedComponent = Unicode_FoldCase(currentComponent);
+
+   if (!HgfsCaseCacheLookup(dirPath, &dirStat, foldedComponent,
+                            &myConvertedComponent)) {
+      ret = HgfsCaseCacheReadDir(dirPath, &dirStat, foldedComponent,
+                                 &myConvertedComponent, &dir);
+      if (ret != 0) {
+         goto exit;
+      }
+      if (dir != NULL) {
+         HgfsCaseCacheInsert(dir);
+      }
+   }
+
+   if (myConvertedComponent == NULL) {
+      /* We didn't find a match. Failure. */
+      ret = ENOENT;
+      goto exit;
+   }
+
+   /* Success. */
+   ret = 0;
+   *convertedComponentSize = strlen(myConvertedComponent) + 1;
+   *convertedComponent = myConvertedComponent;
+
+exit:
+   free(foldedComponent);
+   if (ret) {
+      *convertedComponent = NULL;
+      *convertedComponentSize = 0;
+   }
+   return ret;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsConstructConvertedPath --
+ *
+ *    Expand the passed string and append the converted path.
+ *
+ * Results:
+ *    Returns 0 if successful, errno on failure. Note that this
+ *    function cannot return ENOENT.
+ *
+ * Side effects:
+ *    Reallocs the path.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+HgfsConstructConvertedPath(char **path,                 // IN/OUT
+                           size_t *pathSize,            // IN/OUT
+                           char *convertedPath,         // IN
+                           size_t convertedPathSize)    // IN
+{
+   char *p;
+   size_t convertedPathLen = convertedPathSize - 1;
+
+   ASSERT(path);
+   ASSERT(*path);
+   ASSERT(convertedPath);
+   ASSERT(pathSize);
+
+   p = realloc(*path, *pathSize + convertedPathLen + sizeof (DIRSEPC));
+   if (!p) {
+      int error = errno;
+      LOG(4, ("%s: failed to realloc.\n", __FUNCTION__));
+      return error;
+   }
+
+   *path = p;
+   *pathSize += convertedPathLen + sizeof (DIRSEPC);
+
+   /* Copy out the converted component to curDir, and free it. */
+   Str_Strncat(p, *pathSize, DIRSEPS, sizeof (DIRSEPS));
+   Str_Strncat(p, *pathSize, convertedPath, convertedPathLen);
+   return 0;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsCaseInsensitiveLookup --
+ *
+ *    Do a case insensitive lookup for fileName. Each component past sharePath is
+ *    looked-up case-insensitively. Expensive!
+ *
+ *    NOTE:
+ *    shareName is always expected to be a prefix of fileName.
+ *
+ * Results:
+ *    Returns 0 if successful and resolved path for fileName is returned in
+ *    convertedFileName and its length (without nul) in convertedFileNameLength.
+ *    Otherwise returns non-zero errno with convertedFileName and
+ *    convertedFileNameLength set to NULL and 0 respectively.
+ *
+ * Side effects:
+ *    On success, allocated memory is returned in convertedFileName and needs
+ *    to be freed.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+HgfsCaseInsensitiveLookup(const char *sharePath,           // IN
+                          size_t sharePathLength,          // IN
+                          char *fileName,                  // IN
+                          size_t fileNameLength,           // IN
+                          char **convertedFileName,        // OUT
+                          size_t *convertedFileNameLength) // OUT
+{
+   char *currentComponent;
+   char *nextComponent;
+   char *curDir;
+   size_t curDirSize;
+   char *convertedComponent = NULL;
+   size_t convertedComponentSize = 0;
+   int error = 0;
+
+   ASSERT(sharePath);
+   ASSERT(fileName);
    ASSERT(convertedFileName);
    ASSERT(fileNameLength >= sharePathLength);
 
@@ -1873,6 +2361,49 @@ HgfsEffectivePermissions(char *fileName,          // IN: Input filename
 }
 
 
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsEffectivePermissionsAt --
+ *
+ *    Same as HgfsEffectivePermissions, but checks entryName relative to
+ *    dirFd when it is an open directory.
+ *
+ * Results:
+ *    Zero on success. Non-zero on failure.
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static HgfsInternalStatus
+HgfsEffectivePermissionsAt(int dirFd,                // IN: directory or -1
+                           const char *entryName,    // IN: name in dirFd
+                           char *fileName,           // IN: full file name
+                           Bool readOnlyShare,       // IN: Share name
+                           uint32 *permissions)      // OUT: Effective permissions
+{
+#if defined(__linux__)
+   if (dirFd >= 0) {
+      *permissions = 0;
+      if (faccessat(dirFd, entryName, R_OK, 0) == 0) {
+         *permissions |= HGFS_PERM_READ;
+      }
+      if (faccessat(dirFd, entryName, X_OK, 0) == 0) {
+         *permissions |= HGFS_PERM_EXEC;
+      }
+      if (!readOnlyShare && faccessat(dirFd, entryName, W_OK, 0) == 0) {
+         *permissions |= HGFS_PERM_WRITE;
+      }
+      return 0;
+   }
+#endif
+   return HgfsEffectivePermissions(fileName, readOnlyShare, permissions);
+}
+
+
 /*
  *-----------------------------------------------------------------------------
  *
@@ -2149,39 +2680,123 @@ HgfsGetSequentialOnlyFlagFromFd(int fd,                     // IN
 }
 
 
+#if defined(__linux__)
 /*
- *-----------------------------------------------------------------------------
+ *----------------------------------------------------------------------------
  *
- * HgfsPlatformGetattrFromName --
+ * HgfsGetSequentialOnlyFlagAt --
  *
- *    Performs a stat operation on the given filename, and, if it is a symlink,
- *    allocates the target filename on behalf of the caller and performs a
- *    readlink to get it. If not a symlink, the targetName argument is
- *    untouched. Does necessary translation between Unix file stats and the
- *    HgfsFileAttrInfo formats.
- *    NOTE: The function is different from HgfsGetAttrFromId: this function returns
- *    effectve permissions while HgfsGetAttrFromId does not.
- *    The reason for this asymmetry is that effective permissions are needed
- *    to get a new handle. If the file is already opened then
- *    getting effective permissions does not have any value. However getting
- *    effective permissions would hurt perfomance and should be avoided.
+ *    Same as HgfsGetSequentialOnlyFlagFromName for a file known not to be
+ *    a directory or symlink, opened as entryName relative to dirFd and
+ *    probed with HgfsGetSequentialOnlyFlagFromFd.
  *
  * Results:
- *    Zero on success.
- *    Non-zero on failure.
+ *    None.
  *
  * Side effects:
  *    None
  *
- *-----------------------------------------------------------------------------
+ *----------------------------------------------------------------------------
  */
 
-HgfsInternalStatus
-HgfsPlatformGetattrFromName(char *fileName,                 // IN/OUT:  Input filename
-                            HgfsShareOptions configOptions, // IN: Share config options
-                            char *shareName,                // IN: Share name
-                            HgfsFileAttrInfo *attr,         // OUT: Struct to copy into
-                            char **targetName)              // OUT: Symlink target
+static void
+HgfsGetSequentialOnlyFlagAt(int dirFd,                   // IN: directory
+                            const char *entryName,       // IN: name in dirFd
+                            Bool followSymlinks,         // IN: If true then follow symlink
+                            HgfsFileAttrInfo *attr)      // IN/OUT
+{
+   int fd;
+   int openFlags;
+
+   HgfsServerGetOpenFlags(0, &openFlags);
+   if (followSymlinks) {
+      openFlags &= ~O_NOFOLLOW;
+   }
+
+   /* See HgfsGetSequentialOnlyFlagFromName for FIFOs. */
+   fd = openat(dirFd, entryName, openFlags | O_RDONLY);
+   if (fd < 0) {
+      LOG(4, ("%s: Couldn't open the file \"%s\"\n", __FUNCTION__, entryName));
+      return;
+   }
+
+   HgfsGetSequentialOnlyFlagFromFd(fd, attr);
+   close(fd);
+}
+#endif
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsPlatformGetattrFromName --
+ *
+ *    Performs a stat operation on the given filename, and, if it is a symlink,
+ *    allocates the target filename on behalf of the caller and performs a
+ *    readlink to get it. If not a symlink, the targetName argument is
+ *    untouched. Does necessary translation between Unix file stats and the
+ *    HgfsFileAttrInfo formats.
+ *    NOTE: The function is different from HgfsGetAttrFromId: this function returns
+ *    effectve permissions while HgfsGetAttrFromId does not.
+ *    The reason for this asymmetry is that effective permissions are needed
+ *    to get a new handle. If the file is already opened then
+ *    getting effective permissions does not have any value. However getting
+ *    effective permissions would hurt perfomance and should be avoided.
+ *
+ * Results:
+ *    Zero on success.
+ *    Non-zero on failure.
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+HgfsInternalStatus
+HgfsPlatformGetattrFromName(char *fileName,                 // IN/OUT:  Input filename
+                            HgfsShareOptions configOptions, // IN: Share config options
+                            char *shareName,                // IN: Share name
+                            HgfsFileAttrInfo *attr,         // OUT: Struct to copy into
+                            char **targetName)              // OUT: Symlink target
+{
+   return HgfsGetattrFromNameAt(-1, NULL, fileName, configOptions, shareName,
+                                TRUE, attr, targetName);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsGetattrFromNameAt --
+ *
+ *    Same as HgfsPlatformGetattrFromName, but when dirFd is an open
+ *    directory the file is stat'ed as entryName relative to it, which
+ *    saves a walk of the full path. File name based attributes still use
+ *    fileName, the full path of the same file.
+ *
+ *    The attribute flags and effective permissions cost extra system calls
+ *    and are skipped unless getFlags is set.
+ *
+ * Results:
+ *    Zero on success.
+ *    Non-zero on failure.
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static HgfsInternalStatus
+HgfsGetattrFromNameAt(int dirFd,                      // IN: directory or -1
+                      const char *entryName,          // IN: name in dirFd
+                      char *fileName,                 // IN: full file name
+                      HgfsShareOptions configOptions, // IN: Share config options
+                      char *shareName,                // IN: Share name
+                      Bool getFlags,                  // IN: get flags and perms
+                      HgfsFileAttrInfo *attr,         // OUT: Struct to copy into
+                      char **targetName)              // OUT: Symlink target
 {
    HgfsInternalStatus status = 0;
    struct stat stats;
@@ -2192,15 +2807,25 @@ HgfsPlatformGetattrFromName(char *fileName,                 // IN/OUT:  Input fi
 
    ASSERT(fileName);
    ASSERT(attr);
+   ASSERT(dirFd < 0 || entryName != NULL);
 
    LOG(4, ("%s: getting attrs for \"%s\"\n", __FUNCTION__, fileName));
    followSymlinks = HgfsServerPolicy_IsShareOptionSet(configOptions,
-                                                      HGFS_SHARE_FOLLOW_SYMLINKS),
+                                                      HGFS_SHARE_FOLLOW_SYMLINKS);
 
-   error = HgfsStat(fileName,
-                    followSymlinks,
-                    &stats,
-                    &creationTime);
+#if defined(__linux__)
+   if (dirFd >= 0) {
+      error = fstatat(dirFd, entryName, &stats,
+                      followSymlinks ? 0 : AT_SYMLINK_NOFOLLOW);
+      creationTime = HgfsGetCreationTime(&stats);
+   } else
+#endif
+   {
+      error = HgfsStat(fileName,
+                       followSymlinks,
+                       &stats,
+                       &creationTime);
+   }
    if (error) {
       status = errno;
       LOG(4, ("%s: error stating file: %s\n", __FUNCTION__, strerror(status)));
@@ -2329,13 +2954,27 @@ HgfsPlatformGetattrFromName(char *fileName,                 // IN/OUT:  Input fi
 
    HgfsStatToFileAttr(&stats, &creationTime, attr);
 
+   if (!getFlags) {
+      goto exit;
+   }
+
    /*
     * In the case we have a Windows client, force the hidden flag.
     * This will be ignored by Linux, Solaris clients.
     */
    HgfsGetHiddenAttr(fileName, attr);
 
-   HgfsGetSequentialOnlyFlagFromName(fileName, followSymlinks, attr);
+   /* Directories and symlinks are never sequential only. */
+   if (!S_ISDIR(stats.st_mode) && !S_ISLNK(stats.st_mode)) {
+#if defined(__linux__)
+      if (dirFd >= 0) {
+         HgfsGetSequentialOnlyFlagAt(dirFd, entryName, followSymlinks, attr);
+      } else
+#endif
+      {
+         HgfsGetSequentialOnlyFlagFromName(fileName, followSymlinks, attr);
+      }
+   }
 
    /* Get effective permissions if we can */
    if (!(S_ISLNK(stats.st_mode))) {
@@ -2345,9 +2984,9 @@ HgfsPlatformGetattrFromName(char *fileName,                 // IN/OUT:  Input fi
       nameStatus = HgfsServerPolicy_GetShareMode(shareName, strlen(shareName),
                                                  &shareMode);
       if (nameStatus == HGFS_NAME_STATUS_COMPLETE &&
-          HgfsEffectivePermissions(fileName,
-                                   shareMode == HGFS_OPEN_MODE_READ_ONLY,
-                                   &permissions) == 0) {
+          HgfsEffectivePermissionsAt(dirFd, entryName, fileName,
+                                     shareMode == HGFS_OPEN_MODE_READ_ONLY,
+                                     &permissions) == 0) {
          attr->mask |= HGFS_ATTR_VALID_EFFECTIVE_PERMS;
          attr->effectivePerms = permissions;
       }
@@ -3482,8 +4121,11 @@ HgfsPlatformGetDirEntry(HgfsSearch *search,               // IN: search
       goto out;
    }
 
-   /* If we're not removing the result, we need to make a copy of it. */
-   if (remove) {
+   /*
+    * If we're not removing the result, we need to make a copy of it.
+    * Dents packed in an arena cannot be handed over either.
+    */
+   if (remove && NULL == search->dentsArena) {
       /*
        * We're going to shift the dents array, overwriting the dent pointer at
        * offset, so first we need to save said pointer so that we can return it
@@ -3527,6 +4169,14 @@ HgfsPlatformGetDirEntry(HgfsSearch *search,               // IN: search
       dent->d_reclen = originalDent->d_reclen;
       memcpy(dent->d_name, originalDent->d_name, nameLen);
       dent->d_name[nameLen] = 0;
+
+      if (remove) {
+         if (index < search->numDents - 1) {
+            memmove(&search->dents[index], &search->dents[index + 1],
+                    (search->numDents - (index + 1)) * sizeof search->dents[0]);
+         }
+         search->numDents--;
+      }
    }
 
 out:
@@ -3537,6 +4187,75 @@ out:
 }
 
 
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsPlatformOpenSearchDir --
+ *
+ *    Opens the directory of a search for the duration of a search read, so
+ *    that the attributes of its entries are read relative to it rather than
+ *    by walking the full path of each entry.
+ *
+ * Results:
+ *    None. If the directory cannot be opened the attributes are read by
+ *    path name.
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+HgfsPlatformOpenSearchDir(HgfsSearch *search,              // IN/OUT: search copy
+                          HgfsShareOptions configOptions)  // IN: share config options
+{
+   search->dirFd = -1;
+
+#if defined(__linux__)
+   if (search->type == DIRECTORY_SEARCH_TYPE_DIR) {
+      int openFlags = O_NONBLOCK | O_RDONLY | O_DIRECTORY | O_NOFOLLOW;
+
+      /* Same as HgfsPlatformScandir. */
+      if (HgfsServerPolicy_IsShareOptionSet(configOptions,
+                                            HGFS_SHARE_FOLLOW_SYMLINKS)) {
+         openFlags &= ~O_NOFOLLOW;
+      }
+      search->dirFd = Posix_Open(search->utf8Dir, openFlags);
+      if (search->dirFd < 0) {
+         LOG(4, ("%s: error in open: %s\n", __FUNCTION__, strerror(errno)));
+      }
+   }
+#endif
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsPlatformCloseSearchDir --
+ *
+ *    Closes the directory opened by HgfsPlatformOpenSearchDir.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+HgfsPlatformCloseSearchDir(HgfsSearch *search)  // IN/OUT: search copy
+{
+   if (search->dirFd >= 0) {
+      close(search->dirFd);
+      search->dirFd = -1;
+   }
+}
+
+
 /*
  *-----------------------------------------------------------------------------
  *
@@ -3558,7 +4277,7 @@ HgfsPlatformSetDirEntry(HgfsSearch *search,              // IN: partially valid
                         HgfsShareOptions configOptions,  // IN: share configuration settings
                         HgfsSessionInfo *session,        // IN: session info
                         struct DirectoryEntry *dirEntry, // IN: the indexed dirent
-                        Bool getAttr,                    // IN: get the entry attributes
+                        HgfsSearchReadMask attrMask,     // IN: attributes wanted, if any
                         HgfsFileAttrInfo *entryAttr,     // OUT: entry attributes, optional
                         char **entryName,                // OUT: entry name
                         uint32 *entryNameLength)         // OUT: entry name length
@@ -3572,6 +4291,7 @@ HgfsPlatformSetDirEntry(HgfsSearch *search,              // IN: partially valid
    HgfsLockType serverLock = HGFS_LOCK_NONE;
    fileDesc fileDesc;
    Bool unescapeName = TRUE;
+   Bool getAttr = attrMask != 0;
 
    length = strlen(dirEntry->d_name);
 
@@ -3614,9 +4334,12 @@ HgfsPlatformSetDirEntry(HgfsSearch *search,              // IN: partially valid
                         "to avoid oplock break deadlock\n", __FUNCTION__));
                status = HgfsPlatformGetattrFromFd(fileDesc, session, entryAttr);
             } else {
-               status = HgfsPlatformGetattrFromName(fullName, configOptions,
-                                                    search->utf8ShareName,
-                                                    entryAttr, NULL);
+               status = HgfsGetattrFromNameAt(search->dirFd, dirEntry->d_name,
+                                              fullName, configOptions,
+                                              search->utf8ShareName,
+                                              (attrMask &
+                                               HGFS_SEARCH_READ_FILE_ATTRIBUTES) != 0,
+                                              entryAttr, NULL);
             }
 
             if (HGFS_ERROR_SUCCESS != status) {
@@ -3726,6 +4449,67 @@ HgfsPlatformSetDirEntry(HgfsSearch *search,              // IN: partially valid
 }
 
 
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsScandirArenaAdd --
+ *
+ *    Appends a copy of a dent to the arena of the scan, growing the arena
+ *    and the array of dent offsets geometrically.
+ *
+ *    The dents array holds the offsets of the dents in the arena until the
+ *    scan completes, as the arena may move when it grows.
+ *
+ * Results:
+ *    TRUE on success, FALSE if out of memory.
+ *
+ * Side effects:
+ *    Memory allocation.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+HgfsScandirArenaAdd(HgfsScandirArena *arena,   // IN/OUT: arena of the scan
+                    DirectoryEntry const *dent) // IN: dent to append
+{
+   size_t recordSize = ROUNDUP(dent->d_reclen, HGFS_SCANDIR_ALIGN);
+
+   if (arena->size + recordSize > arena->capacity) {
+      size_t newCapacity = MAX(arena->capacity * 2, arena->size + recordSize);
+      char *newBase = realloc(arena->base, newCapacity);
+
+      if (newBase == NULL) {
+         return FALSE;
+      }
+      arena->base = newBase;
+      arena->capacity = newCapacity;
+   }
+
+   if (arena->numDents == arena->maxDents) {
+      size_t newMaxDents = MAX(arena->maxDents * 2, HGFS_SCANDIR_MIN_DENTS);
+      DirectoryEntry **newDents = realloc(arena->dents,
+                                          newMaxDents * sizeof *newDents);
+
+      if (newDents == NULL) {
+         return FALSE;
+      }
+      arena->dents = newDents;
+      arena->maxDents = newMaxDents;
+   }
+
+   /*
+    * We do a straight memcpy of the entire record to avoid dealing with
+    * platform-specific fields.
+    */
+   memcpy(arena->base + arena->size, dent, dent->d_reclen);
+   arena->dents[arena->numDents++] = (DirectoryEntry *)(uintptr_t)arena->size;
+   arena->size += recordSize;
+
+   return TRUE;
+}
+
+
 /*
  *-----------------------------------------------------------------------------
  *
@@ -3741,6 +4525,11 @@ HgfsPlatformSetDirEntry(HgfsSearch *search,              // IN: partially valid
  *    there is no similar API available. Thus on Mac OS readdir is used that
  *    returns one directory entry at a time.
  *
+ *    The dents are packed in a single arena returned to the caller, which
+ *    frees the arena and the dents array only, not the individual dents.
+ *    The getdents buffer grows while the directory keeps filling it, so
+ *    large directories are read with few system calls.
+ *
  * Results:
  *    Zero on success. numDents contains the number of directory entries found.
  *    Non-zero on error.
@@ -3756,7 +4545,8 @@ HgfsPlatformScandir(char const *baseDir,            // IN: Directory to search i
                     size_t baseDirLen,              // IN: Ignored
                     Bool followSymlinks,            // IN: followSymlinks config option
                     struct DirectoryEntry ***dents, // OUT: Array of DirectoryEntrys
-                    int *numDents)                  // OUT: Number of DirectoryEntrys
+                    int *numDents,                  // OUT: Number of DirectoryEntrys
+                    void **dentsArena)              // OUT: Storage of the dents
 {
 #if defined(__APPLE__)
    DIR *fd = NULL;
@@ -3765,15 +4555,11 @@ HgfsPlatformScandir(char const *baseDir,            // IN: Directory to search i
    int openFlags = O_NONBLOCK | O_RDONLY | O_DIRECTORY | O_NOFOLLOW;
 #endif
    int result;
-   DirectoryEntry **myDents = NULL;
-   int myNumDents = 0;
+   HgfsScandirArena arena = { NULL, 0, 0, NULL, 0, 0 };
    HgfsInternalStatus status = 0;
-
-   /*
-    * XXX: glibc uses 8192 (BUFSIZ) when it can't get st_blksize from a stat.
-    * Should we follow its lead and use stat to get st_blksize?
-    */
-   char buffer[8192];
+   char *buffer = NULL;
+   size_t bufferSize = HGFS_SCANDIR_BUFFER_MIN;
+   size_t i;
 
 #if defined(__APPLE__)
    /*
@@ -3819,58 +4605,55 @@ HgfsPlatformScandir(char const *baseDir,            // IN: Directory to search i
    fd = result;
 #endif
 
+   buffer = malloc(bufferSize);
+   if (buffer == NULL) {
+      status = ENOMEM;
+      goto exit;
+   }
+
    /*
     * Rather than read a single dent at a time, batch up multiple dents
     * in each call by using a buffer substantially larger than one dent.
     */
-   while ((result = getdents(fd, (void *)buffer, sizeof buffer)) > 0) {
+   while ((result = getdents(fd, (void *)buffer, bufferSize)) > 0) {
       size_t offset = 0;
       while (offset < result) {
-         DirectoryEntry *newDent, **newDents;
-
-         newDent = (DirectoryEntry *)(buffer + offset);
+         DirectoryEntry *newDent = (DirectoryEntry *)(buffer + offset);
 
          /* This dent had better fit in the actual space we've got left. */
          ASSERT(newDent->d_reclen <= result - offset);
 
-         /* Add another dent pointer to the dents array. */
-         newDents = realloc(myDents, sizeof *myDents * (myNumDents + 1));
-         if (newDents == NULL) {
-            status = ENOMEM;
-            goto exit;
+         if (HgfsConvertToUtf8FormC(newDent->d_name,
+                                    newDent->d_reclen - offsetof(DirectoryEntry, d_name))) {
+            if (!HgfsScandirArenaAdd(&arena, newDent)) {
+               status = ENOMEM;
+               goto exit;
+            }
          }
-         myDents = newDents;
+         /*
+          * XXX:
+          *    HGFS discards all file names that can't be converted to utf8.
+          *    It is not desirable since it causes many problems like
+          *    failure to delete directories which contain such files.
+          *    Need to change this to a more reasonable behavior, similar
+          *    to name escaping which is used to deal with illegal file names.
+          */
 
          /*
-          * Allocate the new dent and set it up. We do a straight memcpy of
-          * the entire record to avoid dealing with platform-specific fields.
+          * Dent is done. Bump the offset to the batched buffer to process the
+          * next dent within it.
           */
-         myDents[myNumDents] = malloc(newDent->d_reclen);
-         if (myDents[myNumDents] == NULL) {
-            status = ENOMEM;
-            goto exit;
-         }
+         offset += newDent->d_reclen;
+      }
 
-         if (HgfsConvertToUtf8FormC(newDent->d_name,
-                                    newDent->d_reclen - offsetof(DirectoryEntry, d_name))) {
-            memcpy(myDents[myNumDents], newDent, newDent->d_reclen);
-            /*
-             * Dent is done. Bump the offset to the batched buffer to process the
-             * next dent within it.
-             */
-            myNumDents++;
-         } else {
-            /*
-             * XXX:
-             *    HGFS discards all file names that can't be converted to utf8.
-             *    It is not desirable since it causes many problems like
-             *    failure to delete directories which contain such files.
-             *    Need to change this to a more reasonable behavior, similar
-             *    to name escaping which is used to deal with illegal file names.
-             */
-            free(myDents[myNumDents]);
+      /* A large directory is read with fewer calls using a larger buffer. */
+      if (result > bufferSize / 2 && bufferSize < HGFS_SCANDIR_BUFFER_MAX) {
+         char *newBuffer = realloc(buffer, bufferSize * 2);
+
+         if (newBuffer != NULL) {
+            buffer = newBuffer;
+            bufferSize *= 2;
          }
-         offset += newDent->d_reclen;
       }
    }
 
@@ -3891,20 +4674,23 @@ HgfsPlatformScandir(char const *baseDir,            // IN: Directory to search i
       LOG(4, ("%s: error in close: %d (%s)\n", __FUNCTION__, status,
               strerror(status)));
    }
+   free(buffer);
 
    /*
-    * On error, free all allocated dents. On success, set the dents pointer
-    * given to us by the client.
+    * On error, free the arena and the dents array. On success, turn the
+    * dent offsets into pointers and hand both over to the client.
     */
    if (status != 0) {
-      size_t i;
-      for (i = 0; i < myNumDents; i++) {
-         free(myDents[i]);
-      }
-      free(myDents);
+      free(arena.base);
+      free(arena.dents);
    } else {
-      *dents = myDents;
-      *numDents = myNumDents;
+      for (i = 0; i < arena.numDents; i++) {
+         arena.dents[i] = (DirectoryEntry *)(arena.base +
+                                             (uintptr_t)arena.dents[i]);
+      }
+      *dents = arena.dents;
+      *numDents = arena.numDents;
+      *dentsArena = arena.base;
    }
    return status;
 }
@@ -4122,6 +4908,62 @@ exit:
  */
 
 
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsApplyReadAdvice --
+ *
+ *    Passes the hints derived from the read pattern of a file on to the
+ *    host kernel: readahead for the range the client is about to read and
+ *    drop behind for the range of a long stream it is done with. The hints
+ *    are best effort, failures are only logged.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    Starts asynchronous reads into the page cache, may evict clean pages.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsApplyReadAdvice(fileDesc file,                 // IN: file descriptor
+                    const HgfsReadAdvice *advice)  // IN: hints to apply
+{
+#if defined(__linux__)
+   int error = 0;
+
+   if (advice->hint == HGFS_READ_HINT_SEQUENTIAL) {
+      error = posix_fadvise(file, 0, 0, POSIX_FADV_SEQUENTIAL);
+   } else if (advice->hint == HGFS_READ_HINT_NORMAL) {
+      error = posix_fadvise(file, 0, 0, POSIX_FADV_NORMAL);
+   }
+   if (error != 0) {
+      LOG(4, ("%s: access pattern hint failed: %s\n", __FUNCTION__,
+              strerror(error)));
+   }
+
+   if (advice->prefetchLength != 0) {
+      error = posix_fadvise(file, advice->prefetchOffset,
+                            advice->prefetchLength, POSIX_FADV_WILLNEED);
+      if (error != 0) {
+         LOG(4, ("%s: readahead failed: %s\n", __FUNCTION__, strerror(error)));
+      }
+   }
+
+   if (advice->dropLength != 0) {
+      error = posix_fadvise(file, advice->dropOffset, advice->dropLength,
+                            POSIX_FADV_DONTNEED);
+      if (error != 0) {
+         LOG(4, ("%s: drop behind failed: %s\n", __FUNCTION__,
+                 strerror(error)));
+      }
+   }
+#endif
+}
+
+
 /*
  *-----------------------------------------------------------------------------
  *
@@ -4149,8 +4991,8 @@ HgfsPlatformReadFile(fileDesc file,               // IN: file descriptor
 {
    int error;
    HgfsInternalStatus status = 0;
-   HgfsHandle handle;
    Bool sequentialOpen;
+   HgfsReadAdvice advice;
 
    ASSERT(session);
 
@@ -4158,12 +5000,8 @@ HgfsPlatformReadFile(fileDesc file,               // IN: file descriptor
    LOG(4, ("%s: read fh %u, offset %"FMT64"u, count %u\n", __FUNCTION__,
            file, offset, requiredSize));
 
-   if (!HgfsFileDesc2Handle(file, session, &handle)) {
-      LOG(4, ("%s: Could not get file handle\n", __FUNCTION__));
-      return EBADF;
-   }
-
-   if (!HgfsHandleIsSequentialOpen(handle, session, &sequentialOpen)) {
+   if (!HgfsFileDescTrackRead(file, session, offset, requiredSize,
+                              &sequentialOpen, &advice)) {
       LOG(4, ("%s: Could not get sequenial open status\n", __FUNCTION__));
       return EBADF;
    }
@@ -4216,6 +5054,7 @@ HgfsPlatformReadFile(fileDesc file,               // IN: file descriptor
    } else {
       LOG(4, ("%s: read %d bytes\n", __FUNCTION__, error));
       *actualSize = error;
+      HgfsApplyReadAdvice(file, &advice);
    }
 
    return status;
@@ -4251,80 +5090,472 @@ HgfsPlatformWriteFile(fileDesc writeFd,            // IN: file descriptor
                       uint32 *writtenSize)         // OUT: actual length written
 {
    HgfsInternalStatus status = 0;
-   int error = 0;
-
-   LOG(4, ("%s: write fh %u offset %"FMT64"u, count %u\n",
-           __FUNCTION__, writeFd, writeOffset, writeDataSize));
+   int error = 0;
+
+   LOG(4, ("%s: write fh %u offset %"FMT64"u, count %u\n",
+           __FUNCTION__, writeFd, writeOffset, writeDataSize));
+
+#if !defined(sun)
+   if (!writeSequential) {
+      status = HgfsWriteCheckIORange(writeOffset, writeDataSize);
+      if (status != 0) {
+         return status;
+      }
+   }
+#endif
+
+#if defined(__linux__)
+   /* Write to the file. */
+   if (writeSequential) {
+      error = write(writeFd, writeData, writeDataSize);
+   } else {
+      error = pwrite(writeFd, writeData, writeDataSize, writeOffset);
+   }
+#elif defined(__APPLE__)
+   {
+      /* Write to the file. */
+      if (writeSequential || writeAppend) {
+         error = write(writeFd, writeData, writeDataSize);
+      } else {
+         error = pwrite(writeFd, writeData, writeDataSize, writeOffset);
+      }
+   }
+#else
+   /*
+    * Seek to the offset and write from the file. Grab the IO lock to make
+    * this and the subsequent write atomic.
+    */
+
+   MXUser_AcquireExclLock(session->fileIOLock);
+   if (!writeSequential) {
+#   ifdef linux
+      {
+         uint64 res;
+#      if !defined(VM_X86_64)
+         error = _llseek(writeFd, writeOffset >> 32, writeOffset & 0xFFFFFFFF, &res, 0);
+#      else
+         error = llseek(writeFd, writeOffset >> 32, writeOffset & 0xFFFFFFFF, &res, 0);
+#      endif
+      }
+#   else
+      error = lseek(writeFd, writeOffset, 0);
+#   endif
+
+   }
+
+   if (error < 0) {
+      LOG(4, ("%s: could not seek to %"FMT64"u: %s\n", __FUNCTION__,
+              writeOffset, strerror(errno)));
+   } else {
+      error = write(writeFd, writeData, writeDataSize);
+   }
+   {
+      int savedErr = errno;
+      MXUser_ReleaseExclLock(session->fileIOLock);
+      errno = savedErr;
+   }
+#endif
+
+   if (error < 0) {
+      status = errno;
+      LOG(4, ("%s: error writing to file: %s\n", __FUNCTION__,
+         strerror(status)));
+   } else {
+      *writtenSize = error;
+      LOG(4, ("%s: wrote %d bytes\n", __FUNCTION__, *writtenSize));
+   }
+   return status;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsPlatformCopyRange --
+ *
+ *    Copies data between two open files. The kernel copies the data with
+ *    copy_file_range where available, which may avoid the copy altogether
+ *    on file systems that share extents, otherwise the data is copied in
+ *    a loop through a bounce buffer.
+ *
+ *    At most HGFS_COPY_RANGE_MAX bytes are copied by one call. As with
+ *    copy_file_range, a destination opened for appending and overlapping
+ *    ranges of the same file are refused: positional writes would land at
+ *    the end of the file and a forward copy would read back data it wrote.
+ *
+ * Results:
+ *    Zero on success, the number of bytes copied in copiedSize which is
+ *    less than requested at the end of the source file or after an error.
+ *    Non-zero on failure if nothing was copied.
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+HgfsInternalStatus
+HgfsPlatformCopyRange(fileDesc srcFile,            // IN: source file descriptor
+                      uint64 srcOffset,            // IN: source offset
+                      fileDesc dstFile,            // IN: destination file descriptor
+                      uint64 dstOffset,            // IN: destination offset
+                      uint64 length,               // IN: bytes to copy
+                      uint64 *copiedSize)          // OUT: bytes copied
+{
+   HgfsInternalStatus status = 0;
+   uint64 copied = 0;
+   struct stat srcStat;
+   struct stat dstStat;
+   int dstFlags;
+   char *buf;
+
+   length = MIN(length, HGFS_COPY_RANGE_MAX);
+   if (srcOffset > MAX_INT64 - length || dstOffset > MAX_INT64 - length) {
+      status = EINVAL;
+      goto exit;
+   }
+
+   dstFlags = fcntl(dstFile, F_GETFL);
+   if (dstFlags < 0) {
+      status = errno;
+      goto exit;
+   }
+   if (0 != (dstFlags & O_APPEND)) {
+      LOG(4, ("%s: destination opened for appending\n", __FUNCTION__));
+      status = EBADF;
+      goto exit;
+   }
+
+   if (fstat(srcFile, &srcStat) < 0 || fstat(dstFile, &dstStat) < 0) {
+      status = errno;
+      goto exit;
+   }
+   if (srcStat.st_dev == dstStat.st_dev && srcStat.st_ino == dstStat.st_ino &&
+       srcOffset < dstOffset + length && dstOffset < srcOffset + length) {
+      LOG(4, ("%s: overlapping ranges of the same file\n", __FUNCTION__));
+      status = EINVAL;
+      goto exit;
+   }
+
+#if !defined(sun)
+   status = HgfsWriteCheckIORange(dstOffset, (uint32)length);
+   if (status != 0) {
+      goto exit;
+   }
+#endif
+
+#if defined(HGFS_HAVE_COPY_FILE_RANGE)
+   while (copied < length) {
+      loff_t inOffset = srcOffset + copied;
+      loff_t outOffset = dstOffset + copied;
+      ssize_t result;
+
+      result = syscall(SYS_copy_file_range, srcFile, &inOffset, dstFile,
+                       &outOffset, (size_t)(length - copied), 0);
+      if (result > 0) {
+         copied += result;
+      } else if (0 == result) {
+         /* End of the source file. */
+         goto exit;
+      } else if (EINTR != errno) {
+         if (0 == copied &&
+             (ENOSYS == errno || EXDEV == errno ||
+              EOPNOTSUPP == errno || EINVAL == errno)) {
+            LOG(4, ("%s: copy_file_range: %s, copying in the server\n",
+                    __FUNCTION__, strerror(errno)));
+            break;
+         }
+         status = errno;
+         goto exit;
+      }
+   }
+   if (copied == length) {
+      goto exit;
+   }
+#endif
+
+   buf = Util_SafeMalloc(HGFS_COPY_RANGE_BUF_SIZE);
+   while (copied < length && 0 == status) {
+      size_t chunk = MIN(length - copied, HGFS_COPY_RANGE_BUF_SIZE);
+      ssize_t bytesRead;
+      ssize_t bytesWritten = 0;
+
+      bytesRead = pread(srcFile, buf, chunk, srcOffset + copied);
+      if (bytesRead < 0) {
+         if (EINTR != errno) {
+            status = errno;
+         }
+         continue;
+      } else if (0 == bytesRead) {
+         /* End of the source file. */
+         break;
+      }
+
+      while (bytesWritten < bytesRead) {
+         ssize_t result = pwrite(dstFile, buf + bytesWritten,
+                                 bytesRead - bytesWritten,
+                                 dstOffset + copied + bytesWritten);
+         if (result > 0) {
+            bytesWritten += result;
+         } else if (0 == result || EINTR != errno) {
+            status = (0 == result) ? EIO : errno;
+            break;
+         }
+      }
+      copied += bytesWritten;
+   }
+   free(buf);
+
+exit:
+   if (copied > 0) {
+      /* Report what was copied, the next request gets the error if any. */
+      status = 0;
+   }
+   *copiedSize = copied;
+   LOG(4, ("%s: copied %"FMT64"u bytes, status %d\n", __FUNCTION__, copied,
+           status));
+   return status;
+}
+
+
+#if defined(__linux__)
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsFileTransferIov --
+ *
+ *    Reads or writes file data straight from or into a list of mapped
+ *    buffers, with as few vectored system calls as the buffers allow.
+ *
+ * Results:
+ *    Zero on success, the number of bytes transferred in transferred.
+ *    Non-zero on failure if nothing was transferred.
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static HgfsInternalStatus
+HgfsFileTransferIov(fileDesc fd,              // IN: file descriptor
+                    Bool isWrite,             // IN: write, else read
+                    Bool sequential,          // IN: use the file offset
+                    uint64 offset,            // IN: file offset otherwise
+                    uint32 size,              // IN: length of data
+                    HgfsVmxIov *iov,          // IN: buffers of the data
+                    uint32 iovCount,          // IN: number of buffers
+                    uint32 *transferred)      // OUT: length transferred
+{
+   struct iovec vec[HGFS_FILE_IOV_BATCH];
+   uint32 iovIndex = 0;
+   uint32 done = 0;
+
+   while (done < size && iovIndex < iovCount) {
+      uint32 batchSize = 0;
+      int vecCount = 0;
+      ssize_t result;
+
+      while (vecCount < (int)ARRAYSIZE(vec) && iovIndex < iovCount &&
+             done + batchSize < size) {
+         uint32 len = MIN(iov[iovIndex].len, size - done - batchSize);
+
+         ASSERT(iov[iovIndex].va != NULL);
+         vec[vecCount].iov_base = iov[iovIndex].va;
+         vec[vecCount].iov_len = len;
+         batchSize += len;
+         vecCount++;
+         iovIndex++;
+      }
+
+      if (isWrite) {
+         result = sequential ? writev(fd, vec, vecCount) :
+                               pwritev(fd, vec, vecCount, offset + done);
+      } else {
+         result = sequential ? readv(fd, vec, vecCount) :
+                               preadv(fd, vec, vecCount, offset + done);
+      }
+
+      if (result < 0) {
+         if (done == 0) {
+            return errno;
+         }
+         break;
+      }
+      done += result;
+      if (result < batchSize) {
+         /* End of file or short write. */
+         break;
+      }
+   }
+
+   *transferred = done;
+   return 0;
+}
+#endif
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsPlatformReadFileIov --
+ *
+ *    Reads data from a file into the mapped buffers of the transport,
+ *    without gathering them into a contiguous buffer.
+ *
+ * Results:
+ *    Zero on success.
+ *    Non-zero on failure.
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+HgfsInternalStatus
+HgfsPlatformReadFileIov(fileDesc file,               // IN: file descriptor
+                        HgfsSessionInfo *session,    // IN: session info
+                        uint64 offset,               // IN: file offset to read from
+                        uint32 requiredSize,         // IN: length of data to read
+                        HgfsVmxIov *iov,             // IN: mapped buffers for the data
+                        uint32 iovCount,             // IN: number of buffers
+                        uint32 *actualSize)          // OUT: actual length read
+{
+   HgfsInternalStatus status = 0;
+#if defined(__linux__)
+   Bool sequentialOpen;
+   HgfsReadAdvice advice;
+
+   ASSERT(session);
+
+   LOG(4, ("%s: read fh %u, offset %"FMT64"u, count %u, iovs %u\n",
+           __FUNCTION__, file, offset, requiredSize, iovCount));
+
+   if (!HgfsFileDescTrackRead(file, session, offset, requiredSize,
+                              &sequentialOpen, &advice)) {
+      LOG(4, ("%s: Could not get sequenial open status\n", __FUNCTION__));
+      return EBADF;
+   }
+
+   status = HgfsFileTransferIov(file, FALSE, sequentialOpen, offset,
+                                requiredSize, iov, iovCount, actualSize);
+   if (status != 0) {
+      LOG(4, ("%s: error reading from file: %s\n", __FUNCTION__,
+              strerror(status)));
+   } else {
+      LOG(4, ("%s: read %u bytes\n", __FUNCTION__, *actualSize));
+      HgfsApplyReadAdvice(file, &advice);
+   }
+#else
+   uint32 done = 0;
+   uint32 i;
+
+   /* No positioned vectored I/O, read each buffer in turn. */
+   for (i = 0; i < iovCount && done < requiredSize; i++) {
+      uint32 len = MIN(iov[i].len, requiredSize - done);
+      uint32 read = 0;
+
+      status = HgfsPlatformReadFile(file, session, offset + done, len,
+                                    iov[i].va, &read);
+      if (status != 0) {
+         if (done > 0) {
+            status = 0;
+         }
+         break;
+      }
+      done += read;
+      if (read < len) {
+         break;
+      }
+   }
+   if (status == 0) {
+      *actualSize = done;
+   }
+#endif
+
+   return status;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsPlatformWriteFileIov --
+ *
+ *    Writes data to a file from the mapped buffers of the transport,
+ *    without gathering them into a contiguous buffer.
+ *
+ * Results:
+ *    Zero on success.
+ *    Non-zero on failure.
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+HgfsInternalStatus
+HgfsPlatformWriteFileIov(fileDesc writeFd,            // IN: file descriptor
+                         HgfsSessionInfo *session,    // IN: session info
+                         uint64 writeOffset,          // IN: file offset to write to
+                         uint32 writeDataSize,        // IN: length of data to write
+                         HgfsWriteFlags writeFlags,   // IN: write flags
+                         Bool writeSequential,        // IN: write is sequential
+                         Bool writeAppend,            // IN: write is appended
+                         HgfsVmxIov *iov,             // IN: mapped buffers of the data
+                         uint32 iovCount,             // IN: number of buffers
+                         uint32 *writtenSize)         // OUT: actual length written
+{
+   HgfsInternalStatus status = 0;
+#if defined(__linux__)
+   LOG(4, ("%s: write fh %u offset %"FMT64"u, count %u, iovs %u\n",
+           __FUNCTION__, writeFd, writeOffset, writeDataSize, iovCount));
 
-#if !defined(sun)
    if (!writeSequential) {
       status = HgfsWriteCheckIORange(writeOffset, writeDataSize);
       if (status != 0) {
          return status;
       }
    }
-#endif
 
-#if defined(__linux__)
-   /* Write to the file. */
-   if (writeSequential) {
-      error = write(writeFd, writeData, writeDataSize);
+   status = HgfsFileTransferIov(writeFd, TRUE, writeSequential, writeOffset,
+                                writeDataSize, iov, iovCount, writtenSize);
+   if (status != 0) {
+      LOG(4, ("%s: error writing to file: %s\n", __FUNCTION__,
+              strerror(status)));
    } else {
-      error = pwrite(writeFd, writeData, writeDataSize, writeOffset);
-   }
-#elif defined(__APPLE__)
-   {
-      /* Write to the file. */
-      if (writeSequential || writeAppend) {
-         error = write(writeFd, writeData, writeDataSize);
-      } else {
-         error = pwrite(writeFd, writeData, writeDataSize, writeOffset);
-      }
+      LOG(4, ("%s: wrote %u bytes\n", __FUNCTION__, *writtenSize));
    }
 #else
-   /*
-    * Seek to the offset and write from the file. Grab the IO lock to make
-    * this and the subsequent write atomic.
-    */
-
-   MXUser_AcquireExclLock(session->fileIOLock);
-   if (!writeSequential) {
-#   ifdef linux
-      {
-         uint64 res;
-#      if !defined(VM_X86_64)
-         error = _llseek(writeFd, writeOffset >> 32, writeOffset & 0xFFFFFFFF, &res, 0);
-#      else
-         error = llseek(writeFd, writeOffset >> 32, writeOffset & 0xFFFFFFFF, &res, 0);
-#      endif
-      }
-#   else
-      error = lseek(writeFd, writeOffset, 0);
-#   endif
+   uint32 done = 0;
+   uint32 i;
 
-   }
+   /* No positioned vectored I/O, write each buffer in turn. */
+   for (i = 0; i < iovCount && done < writeDataSize; i++) {
+      uint32 len = MIN(iov[i].len, writeDataSize - done);
+      uint32 written = 0;
 
-   if (error < 0) {
-      LOG(4, ("%s: could not seek to %"FMT64"u: %s\n", __FUNCTION__,
-              writeOffset, strerror(errno)));
-   } else {
-      error = write(writeFd, writeData, writeDataSize);
+      status = HgfsPlatformWriteFile(writeFd, session, writeOffset + done, len,
+                                     writeFlags, writeSequential, writeAppend,
+                                     iov[i].va, &written);
+      if (status != 0) {
+         if (done > 0) {
+            status = 0;
+         }
+         break;
+      }
+      done += written;
+      if (written < len) {
+         break;
+      }
    }
-   {
-      int savedErr = errno;
-      MXUser_ReleaseExclLock(session->fileIOLock);
-      errno = savedErr;
+   if (status == 0) {
+      *writtenSize = done;
    }
 #endif
 
-   if (error < 0) {
-      status = errno;
-      LOG(4, ("%s: error writing to file: %s\n", __FUNCTION__,
-         strerror(status)));
-   } else {
-      *writtenSize = error;
-      LOG(4, ("%s: wrote %d bytes\n", __FUNCTION__, *writtenSize));
-   }
    return status;
 }
 
@@ -4853,6 +6084,355 @@ HgfsPlatformSymlinkCreate(char *localSymlinkName,   // IN: symbolic link file na
 }
 
 
+#if defined(HGFS_HAVE_OPENAT2)
+/*
+ * Open share root. Replaced when the share path no longer refers to the
+ * same directory, and freed once no lookup uses it anymore.
+ */
+typedef struct HgfsShareRoot {
+   char *path;          // Share path
+   int fd;              // O_PATH descriptor of the share path
+   dev_t dev;           // Identity of the directory
+   ino_t ino;
+   time_t checked;      // When the share path last named the directory
+   uint32 refCount;     // Lookups using the root
+   Bool cached;         // Still in the table
+} HgfsShareRoot;
+
+static struct {
+   MXUserExclLock *lock;
+   HashTable *roots;    // Share path -> HgfsShareRoot
+   Bool unsupported;    // The kernel does not have openat2
+} gShareRoots;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsShareRootFree --
+ *
+ *      Closes and frees a share root.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsShareRootFree(HgfsShareRoot *root)  // IN: share root
+{
+   close(root->fd);
+   free(root->path);
+   free(root);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsShareRootsInit --
+ *
+ *      Sets up the table of open share roots.
+ *
+ * Results:
+ *      TRUE on success, FALSE otherwise.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Bool
+HgfsShareRootsInit(void)
+{
+   gShareRoots.lock = MXUser_CreateExclLock("HgfsShareRootLock",
+                                            RANK_hgfsShareRootLock);
+   if (gShareRoots.lock == NULL) {
+      LOG(4, ("%s: failed to create the share root lock\n", __FUNCTION__));
+      return FALSE;
+   }
+   gShareRoots.roots = HashTable_Alloc(HGFS_MAX_SHARE_ROOTS, HASH_STRING_KEY,
+                                       NULL);
+   gShareRoots.unsupported = FALSE;
+
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsShareRootsFreeEntry --
+ *
+ *      HashTable_ForEach callback freeing a cached share root.
+ *
+ * Results:
+ *      Zero.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+HgfsShareRootsFreeEntry(const char *key,     // IN: share path
+                        void *value,         // IN: share root
+                        void *clientData)    // IN: unused
+{
+   HgfsShareRoot *root = value;
+
+   ASSERT(root->refCount == 0);
+   HgfsShareRootFree(root);
+
+   return 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsShareRootsDestroy --
+ *
+ *      Closes all the share roots.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsShareRootsDestroy(void)
+{
+   if (gShareRoots.lock == NULL) {
+      return;
+   }
+
+   HashTable_ForEach(gShareRoots.roots, HgfsShareRootsFreeEntry, NULL);
+   HashTable_Free(gShareRoots.roots);
+   gShareRoots.roots = NULL;
+   MXUser_DestroyExclLock(gShareRoots.lock);
+   gShareRoots.lock = NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsShareRootPut --
+ *
+ *      Releases a share root obtained from HgfsShareRootGet.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      A share root no longer in the table is freed with its last user.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsShareRootPut(HgfsShareRoot *root)  // IN: share root
+{
+   Bool freeRoot;
+
+   MXUser_AcquireExclLock(gShareRoots.lock);
+   ASSERT(root->refCount > 0);
+   root->refCount--;
+   freeRoot = root->refCount == 0 && !root->cached;
+   MXUser_ReleaseExclLock(gShareRoots.lock);
+
+   if (freeRoot) {
+      HgfsShareRootFree(root);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsShareRootGet --
+ *
+ *      Gets the open root of a share, opening it if the share path is not
+ *      open yet or now refers to another directory.
+ *
+ *      A removed root is seen with fstat on its descriptor. The share path
+ *      is only walked again every HGFS_SHARE_ROOT_CHECK_SECS to see that
+ *      it still names the root.
+ *
+ * Results:
+ *      The share root, to be released with HgfsShareRootPut, or NULL.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static HgfsShareRoot *
+HgfsShareRootGet(const char *sharePath)  // IN: share path
+{
+   struct stat pathStat;
+   HgfsShareRoot *root = NULL;
+   HgfsShareRoot *newRoot;
+   time_t now = time(NULL);
+   Bool checkPath = FALSE;
+
+   MXUser_AcquireExclLock(gShareRoots.lock);
+   if (HashTable_Lookup(gShareRoots.roots, sharePath, (void **)&root)) {
+      root->refCount++;
+      if (now - root->checked >= HGFS_SHARE_ROOT_CHECK_SECS) {
+         root->checked = now;
+         checkPath = TRUE;
+      }
+   }
+   MXUser_ReleaseExclLock(gShareRoots.lock);
+
+   if (root != NULL) {
+      if (fstat(root->fd, &pathStat) == 0 && pathStat.st_nlink > 0 &&
+          (!checkPath ||
+           (Posix_Stat(sharePath, &pathStat) == 0 &&
+            root->dev == pathStat.st_dev && root->ino == pathStat.st_ino))) {
+         return root;
+      }
+
+      LOG(4, ("%s: share root \"%s\" was replaced\n", __FUNCTION__,
+              sharePath));
+      MXUser_AcquireExclLock(gShareRoots.lock);
+      if (root->cached) {
+         HashTable_Delete(gShareRoots.roots, root->path);
+         root->cached = FALSE;
+      }
+      MXUser_ReleaseExclLock(gShareRoots.lock);
+      HgfsShareRootPut(root);
+   }
+
+   newRoot = Util_SafeCalloc(1, sizeof *newRoot);
+   newRoot->fd = Posix_Open(sharePath, O_PATH | O_DIRECTORY | O_CLOEXEC);
+   if (newRoot->fd < 0 || fstat(newRoot->fd, &pathStat) < 0) {
+      LOG(4, ("%s: cannot open share root \"%s\": %s\n", __FUNCTION__,
+              sharePath, strerror(errno)));
+      if (newRoot->fd >= 0) {
+         close(newRoot->fd);
+      }
+      free(newRoot);
+      return NULL;
+   }
+   newRoot->path = Util_SafeStrdup(sharePath);
+   newRoot->dev = pathStat.st_dev;
+   newRoot->ino = pathStat.st_ino;
+   newRoot->checked = now;
+   newRoot->refCount = 1;
+
+   MXUser_AcquireExclLock(gShareRoots.lock);
+   if (HashTable_GetNumElements(gShareRoots.roots) < HGFS_MAX_SHARE_ROOTS &&
+       HashTable_Insert(gShareRoots.roots, newRoot->path, newRoot)) {
+      newRoot->cached = TRUE;
+   }
+   MXUser_ReleaseExclLock(gShareRoots.lock);
+
+   return newRoot;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsPathIsBeneathShare --
+ *
+ *      Checks that a directory path stays within its share with a single
+ *      kernel walk: openat2 relative to the open share root, refusing to
+ *      leave it through "..", symlinks or magic links.
+ *
+ *      Only clear answers are returned. An escape is not, as openat2 also
+ *      refuses absolute symlinks that point back into the share, nor are
+ *      errors other than a missing component, so that the caller falls
+ *      back to realpath(3) and decides as it did before.
+ *
+ * Results:
+ *      TRUE if the check was done, nameStatus is its result.
+ *      FALSE if the caller has to do the check with realpath(3).
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Bool
+HgfsPathIsBeneathShare(const char *dirPath,         // IN: path to check
+                       const char *sharePath,       // IN: share path
+                       size_t sharePathLength,      // IN: its length
+                       HgfsNameStatus *nameStatus)  // OUT: check result
+{
+   struct open_how how;
+   HgfsShareRoot *root;
+   const char *relativePath;
+   int fd;
+   int error;
+
+   if (gShareRoots.unsupported ||
+       Str_Strncmp(dirPath, sharePath, sharePathLength) != 0) {
+      return FALSE;
+   }
+
+   relativePath = dirPath + sharePathLength;
+   while (*relativePath == DIRSEPC) {
+      relativePath++;
+   }
+   if (*relativePath == '\0') {
+      relativePath = ".";
+   }
+
+   root = HgfsShareRootGet(sharePath);
+   if (root == NULL) {
+      return FALSE;
+   }
+
+   memset(&how, 0, sizeof how);
+   how.flags = O_PATH | O_CLOEXEC;
+   how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+   fd = syscall(SYS_openat2, root->fd, relativePath, &how, sizeof how);
+   error = errno;
+   HgfsShareRootPut(root);
+
+   if (fd >= 0) {
+      close(fd);
+      *nameStatus = HGFS_NAME_STATUS_COMPLETE;
+      return TRUE;
+   }
+
+   switch (error) {
+   case ENOENT:
+      *nameStatus = HGFS_NAME_STATUS_DOES_NOT_EXIST;
+      return TRUE;
+   case ENOTDIR:
+      *nameStatus = HGFS_NAME_STATUS_NOT_A_DIRECTORY;
+      return TRUE;
+   case ENOSYS:
+   case E2BIG:
+      LOG(4, ("%s: openat2 is not supported\n", __FUNCTION__));
+      gShareRoots.unsupported = TRUE;
+      return FALSE;
+   default:
+      LOG(4, ("%s: openat2 failed for \"%s\": %s\n", __FUNCTION__, dirPath,
+              strerror(error)));
+      return FALSE;
+   }
+}
+#endif
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -4949,6 +6529,13 @@ HgfsPlatformPathHasSymlink(const char *fileName,      // IN
       }
    }
 
+#if defined(HGFS_HAVE_OPENAT2)
+   if (HgfsPathIsBeneathShare(fileDirName, sharePath, sharePathLength,
+                              &nameStatus)) {
+      goto exit;
+   }
+#endif
+
    /*
     * Resolve parent directory of fileName.
     * Use realpath(2) to resolve the parent.
@@ -29,6 +29,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "vmware.h"
 #include "str.h"
@@ -37,6 +38,9 @@
 #include "hgfsServerInt.h"
 #include "hgfsServerOplockInt.h"
 
+#define LOGLEVEL_MODULE hgfs
+#include "loglevel_user.h"
+
 
 
 /*
@@ -132,24 +136,16 @@ HgfsHandle2ServerLock(HgfsHandle handle,        // IN: Hgfs file handle
                       HgfsLockType *lock)       // OUT: Server lock
 {
 #ifdef HGFS_OPLOCKS
-   Bool found = FALSE;
-   HgfsFileNode *fileNode = NULL;
+   HgfsFileNode fileNode;
 
    ASSERT(lock);
 
-   MXUser_AcquireExclLock(session->nodeArrayLock);
-   fileNode = HgfsHandle2FileNode(handle, session);
-   if (fileNode == NULL) {
-      goto exit;
+   if (!HgfsGetNodeCopy(handle, session, FALSE, &fileNode)) {
+      return FALSE;
    }
 
-   *lock = fileNode->serverLock;
-   found = TRUE;
-
-exit:
-   MXUser_ReleaseExclLock(session->nodeArrayLock);
-
-   return found;
+   *lock = fileNode.serverLock;
+   return TRUE;
 #else
    *lock = HGFS_LOCK_NONE;
    return TRUE;
@@ -185,26 +181,34 @@ HgfsFileHasServerLock(const char *utf8Name,             // IN: Name in UTF8
                       fileDesc   *fileDesc)             // OUT: Existing fd
 {
 #ifdef HGFS_OPLOCKS
-   unsigned int i;
+   DblLnkLst_Links *lists[2];
    Bool found = FALSE;
+   uint32 i;
    ASSERT(utf8Name);
 
    ASSERT(session);
-   ASSERT(session->nodeArray);
+   ASSERT(session->nodeSlabs);
 
    MXUser_AcquireExclLock(session->nodeArrayLock);
 
-   for (i = 0; i < session->numNodes; i++) {
-      HgfsFileNode *existingFileNode = &session->nodeArray[i];
-
-      if ((existingFileNode->state == FILENODE_STATE_IN_USE_CACHED) &&
-          (existingFileNode->serverLock != HGFS_LOCK_NONE) &&
-          (!stricmp(existingFileNode->utf8Name, utf8Name))) {
-         LOG(4, ("Found file with a lock: %s\n", utf8Name));
-         *serverLock = existingFileNode->serverLock;
-         *fileDesc = existingFileNode->fileDesc;
-         found = TRUE;
-         break;
+   /* Locked nodes are always cached, in either of the cache lists. */
+   lists[0] = &session->nodeCachedList;
+   lists[1] = &session->nodeCachedHotList;
+   for (i = 0; i < ARRAYSIZE(lists) && !found; i++) {
+      DblLnkLst_Links *link;
+
+      DblLnkLst_ForEach(link, lists[i]) {
+         HgfsFileNode *existingFileNode =
+            DblLnkLst_Container(link, HgfsFileNode, links);
+
+         if ((existingFileNode->serverLock != HGFS_LOCK_NONE) &&
+             (!strcmp(existingFileNode->utf8Name, utf8Name))) {
+            LOG(4, ("Found file with a lock: %s\n", utf8Name));
+            *serverLock = existingFileNode->serverLock;
+            *fileDesc = existingFileNode->fileDesc;
+            found = TRUE;
+            break;
+         }
       }
    }
 
@@ -219,159 +223,125 @@ HgfsFileHasServerLock(const char *utf8Name,             // IN: Name in UTF8
 
 
 #ifdef HGFS_OPLOCKS
-/*
- *-----------------------------------------------------------------------------
- *
- * HgfsServerOplockBreakReply --
- *
- *      The client was sent an oplock break request, and responded with this
- *      reply. It contains the oplock status that the client is now in. Since
- *      the break could have actually been a degrade, it is well within the
- *      client's rights to transition to a non-broken state. We need to make
- *      sure that such a transition was legal, acknowledge the brea
- *      appropriately, and update our own state.
- *
- * Results:
- *      None.
- *
- * Side effects:
- *      None.
- *
- *-----------------------------------------------------------------------------
- */
-
-void
-HgfsServerOplockBreakReply(const unsigned char *packetIn, // IN: Reply packet
-                           unsigned int packetSize,       // IN: Size of packet
-                           void *clientData)              // IN: From request
-{
-   HgfsReplyServerLockChange *reply;
-   ServerLockData *lockData = clientData;
-
-   ASSERT(packetIn);
-   ASSERT(clientData);
-
-   if (packetSize < sizeof *reply) {
-      return;
-   }
-   reply = (HgfsReplyServerLockChange *)packetIn;
-
-   /*
-    * XXX: It should be safe to ignore the status and id from the actual
-    * HgfsReply. The only information we need to properly acknowledge the break
-    * is the original fd and the new lease, which, in the case of a degrade,
-    * is double checked in HgfsAckOplockBreak, so we'd be safe from a garbage
-    * value.
-    */
-   HgfsAckOplockBreak(lockData, reply->serverLock);
-}
-
-
 /*
  *-----------------------------------------------------------------------------
  *
  * HgfsServerOplockBreak --
  *
  *      When the host FS needs to break the oplock so that another client
- *      can open the file, it signals the event in the overlapped structure
- *      that we used to request an oplock.
- *      This sets off the following chains of events:
- *      1. Send the oplock break request to the guest.
- *      2. Once the guest acknowledges the oplock break, the completion
- *      routine GuestRpcServerRequestCallback will fire, causing
- *      HgfsServerOplockBreakReply to also fire, which will break the oplock
- *      on the host FS.
+ *      can open the file, the platform code calls us with the lock the
+ *      server may keep on the file. This sets off the following chain
+ *      of events:
+ *      1. Send the oplock break request to the client, telling it the lock
+ *      it holds from now on.
+ *      2. The client flushes what it cached under the old lock and
+ *      acknowledges the break with an HGFS_OP_OPLOCK_BREAK_V4 request (see
+ *      HgfsServerOplockBreakReply).
+ *      3. Acknowledge the break on the host FS, which lets the other opener
+ *      proceed. Should the client not answer in time, the platform code
+ *      breaks the lock altogether.
  *
  * Results:
- *      None.
+ *      TRUE if the break was handled.
+ *      FALSE if the file is not in the cache yet, i.e. the lock was granted
+ *      but the open which asked for it did not complete. The platform code
+ *      retries the break later.
  *
  * Side effects:
- *      If successful, allocates memory for the rpc request.
+ *      None.
  *
  *-----------------------------------------------------------------------------
  */
 
-void
-HgfsServerOplockBreak(ServerLockData *lockData)
+Bool
+HgfsServerOplockBreak(HgfsSessionInfo *session,   // IN: session info
+                      ServerLockData *lockData)   // IN: server lock info
 {
    HgfsHandle hgfsHandle;
-   char *requestBuffer = NULL;
-   HgfsRequestServerLockChange *request;
    HgfsLockType lock;
 
-   LOG(4, ("%s: entered\n", __FUNCTION__));
+   ASSERT(session);
+   ASSERT(lockData);
 
-   /*
-    * XXX: Just because the file in not in the cache on the server,
-    * does not mean it was closed on the client. It is possible that
-    * we closed the file on the server because we ran out of space
-    * in cache. That's why for now as long as a file has a lock,
-    * we don't remove it from the node cache. This should be fixed.
-    *
-    * In any case, none of these cache-related failures should cause us to ack
-    * the oplock break locally. That is because if the file wasn't in the
-    * cache, or it had no lock, chances are someone else (maybe the VCPU
-    * thread) broke the oplock and/or closed the file.
-    */
+   LOG(4, ("%s: entered fd %d\n", __FUNCTION__, lockData->fileDesc));
 
-   if (!HgfsFileDesc2Handle(lockData->fileDesc, &hgfsHandle)) {
+   if (!HgfsFileDesc2Handle(lockData->fileDesc, session, &hgfsHandle)) {
       LOG(4, ("%s: file is not in the cache\n", __FUNCTION__));
-      goto free_and_exit;
+      return FALSE;
    }
 
-   if (!HgfsHandle2ServerLock(hgfsHandle, &lock)) {
+   if (!HgfsHandle2ServerLock(hgfsHandle, session, &lock)) {
       LOG(4, ("%s: could not retrieve node's lock info.\n", __FUNCTION__));
-      goto free_and_exit;
+      return FALSE;
    }
 
+   /*
+    * A node without a lock was opened without one, or lost it already, and
+    * the client has nothing to give up. Only the host FS lease is released.
+    */
    if (lock == HGFS_LOCK_NONE) {
       LOG(4, ("%s: the file does not have a server lock.\n", __FUNCTION__));
-      goto free_and_exit;
+      HgfsAckOplockBreak(session, lockData, HGFS_LOCK_NONE);
+      return TRUE;
    }
 
    /*
-    * We need to setup the entire request here. The command prefix will be
-    * added later, so save some space for it.
+    * The break waits for the client from before the request is sent, as the
+    * acknowledgement may come back before the send returns.
     *
-    * XXX: This should probably go into a common allocation function that
-    * other out-of-band requests can use.
+    * If the request cannot be sent the client keeps believing it holds the
+    * lock, the best we can do is to log it. The break goes ahead regardless
+    * since the host FS would force it after its timeout anyway.
     */
-
-   requestBuffer = malloc(sizeof *request + HGFS_CLIENT_CMD_LEN);
-   if (requestBuffer == NULL) {
-      LOG(4, ("%s: could not allocate memory.\n", __FUNCTION__));
-      goto ack_and_exit;
+   HgfsPendOplockBreak(session, lockData);
+   if (!HgfsServerSendOplockBreak(session, hgfsHandle, lockData->serverLock)) {
+      Log("%s: Could not send oplock break for fd %d\n", __FUNCTION__,
+          lockData->fileDesc);
+      HgfsCompleteOplockBreak(session, lockData->fileDesc,
+                              lockData->serverLock);
    }
 
-   /* Save space for the command prefix. */
-   request = (HgfsRequestServerLockChange *)
-      (requestBuffer + HGFS_CLIENT_CMD_LEN);
-   request->header.op = HGFS_OP_SERVER_LOCK_CHANGE;
-   request->header.id = 0; /* XXX */
-   request->file = hgfsHandle;
-   request->newServerLock = lockData->serverLock;
+   return TRUE;
+}
+#endif
 
-   /*
-    * Just send the request size for our actual request; our callee will
-    * write in the command prefix and modify the request size appropriately.
-    *
-    * If for some reason we fail, we'll acknowledge the oplock break
-    * immediately.
-    */
 
-   if (HgfsServerManager_SendRequest(requestBuffer, sizeof *request,
-                                     HgfsServerOplockBreakReply, lockData)) {
-      return;
-   }
-   free(requestBuffer);
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerOplockBreakReply --
+ *
+ *      Called when the client acknowledges an oplock break request, telling
+ *      the lock it kept on the file. Completes the break on the host FS.
+ *
+ * Results:
+ *      TRUE if a break of the file was waiting for the client.
+ *      FALSE otherwise, e.g. the acknowledgement came too late or the server
+ *      is compiled without oplock support.
+ *
+ * Side effects:
+ *      None.
+ *
+ *-----------------------------------------------------------------------------
+ */
 
-  ack_and_exit:
-   HgfsAckOplockBreak(lockData, HGFS_LOCK_NONE);
+Bool
+HgfsServerOplockBreakReply(HgfsHandle handle,         // IN: Hgfs file handle
+                           HgfsSessionInfo *session,  // IN: session info
+                           HgfsLockType replyLock)    // IN: client has this lock
+{
+#ifdef HGFS_OPLOCKS
+   fileDesc fd;
 
-   return;
+   ASSERT(session);
 
-  free_and_exit:
-   free(lockData);
-}
-#endif
+   if (!HgfsHandle2FileDesc(handle, session, &fd, NULL)) {
+      LOG(4, ("%s: invalid handle %u\n", __FUNCTION__, handle));
+      return FALSE;
+   }
 
+   return HgfsCompleteOplockBreak(session, fd, replyLock);
+#else
+   return FALSE;
+#endif
+}
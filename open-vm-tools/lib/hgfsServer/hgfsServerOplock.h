@@ -55,10 +55,14 @@ Bool HgfsFileHasServerLock(const char *utf8Name,
                            HgfsSessionInfo *session,
                            HgfsLockType *serverLock,
                            fileDesc   *fileDesc);
+Bool HgfsServerOplockBreakReply(HgfsHandle handle,
+                                HgfsSessionInfo *session,
+                                HgfsLockType replyLock);
 
 Bool HgfsAcquireServerLock(fileDesc fileDesc,
                            HgfsSessionInfo *session,
                            HgfsLockType *serverLock);
+void HgfsReleaseServerLock(fileDesc fileDesc);
 
 
 #endif // ifndef _HGFS_SERVER_OPLOCK_H_
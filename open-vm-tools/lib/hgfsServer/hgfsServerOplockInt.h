@@ -31,16 +31,16 @@
 
 /*
  * Does this platform have oplock support? We define it here to avoid long
- * ifdefs all over the code. For now, Linux and Windows hosts only.
- *
- * XXX: Just kidding, no oplock support yet.
+ * ifdefs all over the code. For now, Linux only, where server locks are
+ * file leases.
  */
-#if 0
+#if defined(__linux__)
 #define HGFS_OPLOCKS
 #endif
 
 /*
- * XXX describe the data structure
+ * A server lock break: the file whose lock is broken, the platform event
+ * that signaled the break if any, and the lock the server may keep.
  */
 
 /* Server lock related structure */
@@ -62,13 +62,30 @@ typedef struct {
  */
 
 #ifdef HGFS_OPLOCKS
+Bool
+HgfsPlatformOplockInit(void);
+
 void
-HgfsServerOplockBreak(ServerLockData *data);
+HgfsPlatformOplockDestroy(void);
+
+Bool
+HgfsServerOplockBreak(HgfsSessionInfo *session,
+                      ServerLockData *lockData);
 
 void
-HgfsAckOplockBreak(ServerLockData *lockData,
+HgfsAckOplockBreak(HgfsSessionInfo *session,
+                   ServerLockData *lockData,
                    HgfsLockType replyLock);
 
+void
+HgfsPendOplockBreak(HgfsSessionInfo *session,
+                    ServerLockData *lockData);
+
+Bool
+HgfsCompleteOplockBreak(HgfsSessionInfo *session,
+                        fileDesc fileDesc,
+                        HgfsLockType replyLock);
+
 #endif
 
 #endif // ifndef _HGFS_SERVER_OPLOCKINT_H_
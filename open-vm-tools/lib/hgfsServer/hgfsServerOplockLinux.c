@@ -20,8 +20,19 @@
  * hgfsServerOplockLinux.c --
  *
  *      HGFS server opportunistic lock support for the Linux platform.
+ *
+ *      Server locks are file leases. The lease break signals are directed
+ *      to a thread of their own with F_SETOWN_EX, which blocks the signal
+ *      and reads it from a signalfd. No signal handler is installed, so
+ *      the rest of the process never sees lease break signals.
+ *
+ *      Every granted lease is registered in a table along with the session
+ *      whose client holds it, which tells the thread whom to send the break.
+ *      The lease is only downgraded or released once the client acknowledges
+ *      the break, or after HGFS_OPLOCK_ACK_TIMEOUT_MSEC without an answer.
  */
 
+#define _GNU_SOURCE // for F_SETLEASE, F_SETSIG and F_SETOWN_EX
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -33,33 +44,408 @@
 #include "hgfsServerOplockInt.h"
 
 #ifdef HGFS_OPLOCKS
+#   include <unistd.h>
+#   include <fcntl.h>
 #   include <signal.h>
-#   include "sig.h"
+#   include <pthread.h>
+#   include <sys/poll.h>
+#   include <sys/signalfd.h>
+#   include <sys/syscall.h>
+#   include "hashTable.h"
+#   include "hostinfo.h"
+#   include "userlock.h"
+#   include "mutexRankLib.h"
 #endif
 
+#define LOGLEVEL_MODULE hgfs
+#include "loglevel_user.h"
+
+
+#ifdef HGFS_OPLOCKS
+/*
+ * Signal telling the lease thread that a lease is being broken. A realtime
+ * signal is queued once per break and carries the leased fd. Should the
+ * queue overflow, the kernel sends SIGIO and all the leases are checked.
+ */
+#define HGFS_OPLOCK_SIGNAL (SIGRTMIN + 1)
+
+/* Delay before retrying the breaks of leases whose open did not complete. */
+#define HGFS_OPLOCK_RETRY_MSEC 10
+
+/*
+ * Time the client has to acknowledge a break before the lease is released
+ * without it. Well below the default kernel lease break time of 45 seconds,
+ * after which the kernel would release the lease on its own.
+ */
+#define HGFS_OPLOCK_ACK_TIMEOUT_MSEC 5000
+
+/* Number of signals read at once from the signalfd. */
+#define HGFS_OPLOCK_MAX_SIGNALS 16
+
+/* Number of hash buckets for the leases table. */
+#define HGFS_OPLOCK_NUM_BUCKETS 256
+
+#define HGFS_OPLOCK_LEASE_KEY(_fd) ((const void *)(uintptr_t)(_fd))
+
+/* A lease held on an open file on behalf of a client. */
+typedef struct HgfsOplockLease {
+   fileDesc fileDesc;
+   HgfsSessionInfo *session;   /* Session of the client holding the lock */
+   int leaseType;              /* F_RDLCK or F_WRLCK */
+   Bool breakPending;          /* Break deferred until the node is cached */
+   Bool ackPending;            /* Break sent, waiting for the client's ack */
+   HgfsLockType ackLock;       /* Lock the break left to the client */
+   VmTimeType ackDeadline;     /* Time to release the lease without the ack */
+} HgfsOplockLease;
+
+/* Arguments for collecting the leases to check for a break. */
+typedef struct HgfsOplockCheckData {
+   Bool pendingOnly;
+   fileDesc *fds;
+   uint32 numFds;
+} HgfsOplockCheckData;
+
+/* A break the client did not acknowledge in time. */
+typedef struct HgfsOplockExpiredAck {
+   HgfsSessionInfo *session;
+   ServerLockData lockData;
+} HgfsOplockExpiredAck;
+
+/* Arguments for collecting the breaks whose acknowledgement timed out. */
+typedef struct HgfsOplockExpireData {
+   VmTimeType now;
+   VmTimeType nextDeadline;    /* Earliest deadline yet to come, 0 if none */
+   HgfsOplockExpiredAck *acks;
+   uint32 numAcks;
+} HgfsOplockExpireData;
+
 
 /*
  * Local data
  */
 
 /*
- * Global data
+ * Lock for the leases table, the deferred breaks flag, the count of breaks
+ * waiting for the client and the lease thread id. Taken with the session
+ * node array lock held when a file is closed.
  */
+static MXUserExclLock *gOplockLock;
+static HashTable *gOplockLeases;
+static Bool gOplockBreaksDeferred;
+static uint32 gOplockAcksPending;
+static pid_t gOplockThreadId;
+
+static int gOplockSignalFd = -1;
+static int gOplockExitPipe[2] = { -1, -1 };
+static pthread_t gOplockThread;
+static Bool gOplockThreadStarted;
 
 
 /*
  * Local functions
  */
 
-#ifdef HGFS_OPLOCKS
-static void HgfsServerSigOplockBreak(int sigNum,
-                                     siginfo_t *info,
-                                     ucontext_t *u,
-                                     void *clientData);
+static void HgfsOplockLeaseBreak(fileDesc fileDesc);
 #endif
 
 
 
+#ifdef HGFS_OPLOCKS
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsOplockCollectLease --
+ *
+ *      HashTable_ForEach callback collecting the fds of the leases to check.
+ *
+ * Results:
+ *      Always 0.
+ *
+ * Side effects:
+ *      None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+HgfsOplockCollectLease(const char *key,   // IN: fd
+                       void *value,       // IN: lease
+                       void *clientData)  // IN/OUT: leases to check
+{
+   HgfsOplockLease *lease = value;
+   HgfsOplockCheckData *data = clientData;
+
+   if (!data->pendingOnly || lease->breakPending) {
+      data->fds[data->numFds++] = lease->fileDesc;
+   }
+
+   return 0;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsOplockCheckLeases --
+ *
+ *      Checks the registered leases for breaks, either all of them after the
+ *      signal queue overflowed or only the ones with deferred breaks.
+ *
+ *      Called from the lease thread only.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsOplockCheckLeases(Bool pendingOnly)  // IN: deferred breaks only
+{
+   HgfsOplockCheckData data;
+   uint32 numLeases;
+   uint32 i;
+
+   data.pendingOnly = pendingOnly;
+   data.numFds = 0;
+
+   MXUser_AcquireExclLock(gOplockLock);
+   gOplockBreaksDeferred = FALSE;
+   numLeases = HashTable_GetNumElements(gOplockLeases);
+   if (numLeases == 0) {
+      MXUser_ReleaseExclLock(gOplockLock);
+      return;
+   }
+   data.fds = malloc(numLeases * sizeof *data.fds);
+   if (data.fds == NULL) {
+      /* Try again later. */
+      gOplockBreaksDeferred = TRUE;
+      MXUser_ReleaseExclLock(gOplockLock);
+      return;
+   }
+   HashTable_ForEach(gOplockLeases, HgfsOplockCollectLease, &data);
+   MXUser_ReleaseExclLock(gOplockLock);
+
+   LOG(4, ("%s: checking %u leases\n", __FUNCTION__, data.numFds));
+
+   for (i = 0; i < data.numFds; i++) {
+      HgfsOplockLeaseBreak(data.fds[i]);
+   }
+
+   free(data.fds);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsOplockCollectExpiredAck --
+ *
+ *      HashTable_ForEach callback collecting the breaks whose acknowledgement
+ *      timed out, and the earliest deadline of the others.
+ *
+ * Results:
+ *      Always 0.
+ *
+ * Side effects:
+ *      The collected breaks are no longer pending and hold a reference on
+ *      their session.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+HgfsOplockCollectExpiredAck(const char *key,   // IN: fd
+                            void *value,       // IN: lease
+                            void *clientData)  // IN/OUT: expired breaks
+{
+   HgfsOplockLease *lease = value;
+   HgfsOplockExpireData *data = clientData;
+   HgfsOplockExpiredAck *ack;
+
+   if (!lease->ackPending) {
+      return 0;
+   }
+
+   if (lease->ackDeadline > data->now) {
+      if (data->nextDeadline == 0 || lease->ackDeadline < data->nextDeadline) {
+         data->nextDeadline = lease->ackDeadline;
+      }
+      return 0;
+   }
+
+   lease->ackPending = FALSE;
+   gOplockAcksPending--;
+
+   /* A session being torn down closes the file, which releases the lease. */
+   if (HgfsServerSessionTryGet(lease->session)) {
+      ack = &data->acks[data->numAcks++];
+      ack->session = lease->session;
+      ack->lockData.fileDesc = lease->fileDesc;
+      ack->lockData.event = 0; // not needed
+      ack->lockData.serverLock = lease->ackLock;
+   }
+
+   return 0;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsOplockExpireAcks --
+ *
+ *      Releases the leases whose break the client did not acknowledge in
+ *      time, and shortens the poll timeout of the lease thread to the next
+ *      deadline.
+ *
+ *      Called from the lease thread only.
+ *
+ * Results:
+ *      The poll timeout in milliseconds, -1 for none.
+ *
+ * Side effects:
+ *      None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+HgfsOplockExpireAcks(int timeout)  // IN: poll timeout so far
+{
+   HgfsOplockExpireData data;
+   uint32 i;
+
+   MXUser_AcquireExclLock(gOplockLock);
+   if (gOplockAcksPending == 0) {
+      MXUser_ReleaseExclLock(gOplockLock);
+      return timeout;
+   }
+   data.acks = malloc(gOplockAcksPending * sizeof *data.acks);
+   if (data.acks == NULL) {
+      /* Try again later. */
+      MXUser_ReleaseExclLock(gOplockLock);
+      return HGFS_OPLOCK_RETRY_MSEC;
+   }
+   data.now = Hostinfo_SystemTimerMS();
+   data.nextDeadline = 0;
+   data.numAcks = 0;
+   HashTable_ForEach(gOplockLeases, HgfsOplockCollectExpiredAck, &data);
+   MXUser_ReleaseExclLock(gOplockLock);
+
+   for (i = 0; i < data.numAcks; i++) {
+      Log("%s: No oplock break acknowledgement for fd %d\n", __FUNCTION__,
+          data.acks[i].lockData.fileDesc);
+      HgfsAckOplockBreak(data.acks[i].session, &data.acks[i].lockData,
+                         HGFS_LOCK_NONE);
+      HgfsServerSessionPut(data.acks[i].session);
+   }
+   free(data.acks);
+
+   if (data.nextDeadline != 0) {
+      int ackTimeout = (int)(data.nextDeadline - data.now);
+
+      if (timeout < 0 || ackTimeout < timeout) {
+         timeout = ackTimeout;
+      }
+   }
+
+   return timeout;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsOplockThread --
+ *
+ *      The lease thread: waits for the lease break signals and breaks the
+ *      leases until told to exit through the exit pipe. Also releases the
+ *      leases whose break the client did not acknowledge in time.
+ *
+ * Results:
+ *      Always NULL.
+ *
+ * Side effects:
+ *      None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void *
+HgfsOplockThread(void *data)  // IN: unused
+{
+   MXUser_AcquireExclLock(gOplockLock);
+   gOplockThreadId = syscall(SYS_gettid);
+   MXUser_ReleaseExclLock(gOplockLock);
+
+   for (;;) {
+      struct signalfd_siginfo info[HGFS_OPLOCK_MAX_SIGNALS];
+      struct pollfd fds[2];
+      Bool checkAll = FALSE;
+      ssize_t result;
+      ssize_t i;
+      int timeout;
+
+      MXUser_AcquireExclLock(gOplockLock);
+      timeout = gOplockBreaksDeferred ? HGFS_OPLOCK_RETRY_MSEC : -1;
+      MXUser_ReleaseExclLock(gOplockLock);
+      timeout = HgfsOplockExpireAcks(timeout);
+
+      fds[0].fd = gOplockExitPipe[0];
+      fds[0].events = POLLIN;
+      fds[0].revents = 0;
+      fds[1].fd = gOplockSignalFd;
+      fds[1].events = POLLIN;
+      fds[1].revents = 0;
+
+      result = poll(fds, ARRAYSIZE(fds), timeout);
+      if (result < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+         LOG(4, ("%s: error in poll: %d (%s)\n", __FUNCTION__, errno,
+                 strerror(errno)));
+         break;
+      }
+      if (fds[0].revents != 0) {
+         break;
+      }
+      if (result == 0) {
+         HgfsOplockCheckLeases(TRUE);
+         continue;
+      }
+
+      result = read(gOplockSignalFd, info, sizeof info);
+      if (result < (ssize_t)sizeof info[0]) {
+         continue;
+      }
+
+      for (i = 0; i < result / (ssize_t)sizeof info[0]; i++) {
+         if (info[i].ssi_signo == SIGIO) {
+            checkAll = TRUE;
+         } else {
+            HgfsOplockLeaseBreak(info[i].ssi_fd);
+         }
+      }
+      if (checkAll) {
+         LOG(4, ("%s: lease break signals lost\n", __FUNCTION__));
+         HgfsOplockCheckLeases(FALSE);
+      }
+   }
+
+   MXUser_AcquireExclLock(gOplockLock);
+   gOplockThreadId = 0;
+   MXUser_ReleaseExclLock(gOplockLock);
+
+   return NULL;
+}
+#endif
+
+
 /*
  *-----------------------------------------------------------------------------
  *
@@ -68,10 +454,10 @@ static void HgfsServerSigOplockBreak(int sigNum,
  *      Set up any state needed to start Linux HGFS server oplock support.
  *
  * Results:
- *      TRUE always.
+ *      TRUE if leases can be granted, FALSE otherwise.
  *
  * Side effects:
- *      None.
+ *      Starts the lease thread.
  *
  *-----------------------------------------------------------------------------
  */
@@ -80,10 +466,57 @@ Bool
 HgfsPlatformOplockInit(void)
 {
 #ifdef HGFS_OPLOCKS
-   /* Register a signal handler to catch oplock break signals. */
-   Sig_Callback(SIGIO, SIG_SAFE, HgfsServerSigOplockBreak, NULL);
-#endif
+   sigset_t signals;
+   sigset_t oldSignals;
+   int result;
+
+   gOplockBreaksDeferred = FALSE;
+   gOplockAcksPending = 0;
+   gOplockThreadId = 0;
+
+   /*
+    * Block the signals before starting the thread which inherits the mask,
+    * so that they are only ever read from the signalfd.
+    */
+   sigemptyset(&signals);
+   sigaddset(&signals, HGFS_OPLOCK_SIGNAL);
+   sigaddset(&signals, SIGIO);
+
+   gOplockSignalFd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+   if (gOplockSignalFd < 0) {
+      LOG(4, ("%s: error in signalfd: %d (%s)\n", __FUNCTION__, errno,
+              strerror(errno)));
+      goto error;
+   }
+
+   if (pipe(gOplockExitPipe) < 0) {
+      LOG(4, ("%s: error in pipe: %d (%s)\n", __FUNCTION__, errno,
+              strerror(errno)));
+      gOplockExitPipe[0] = gOplockExitPipe[1] = -1;
+      goto error;
+   }
+
+   gOplockLock = MXUser_CreateExclLock("HgfsOplockLock", RANK_hgfsOplockLock);
+   gOplockLeases = HashTable_Alloc(HGFS_OPLOCK_NUM_BUCKETS, HASH_INT_KEY, free);
+
+   pthread_sigmask(SIG_BLOCK, &signals, &oldSignals);
+   result = pthread_create(&gOplockThread, NULL, HgfsOplockThread, NULL);
+   pthread_sigmask(SIG_SETMASK, &oldSignals, NULL);
+   if (0 != result) {
+      LOG(4, ("%s: error in pthread_create: %d (%s)\n", __FUNCTION__, result,
+              strerror(result)));
+      goto error;
+   }
+   gOplockThreadStarted = TRUE;
+
    return TRUE;
+
+error:
+   HgfsPlatformOplockDestroy();
+   return FALSE;
+#else
+   return TRUE;
+#endif
 }
 
 
@@ -94,11 +527,13 @@ HgfsPlatformOplockInit(void)
  *
  *      Tear down any state used for Linux HGFS server.
  *
+ *      Called once all the sessions are gone, so no leases are left.
+ *
  * Results:
  *      None.
  *
  * Side effects:
- *      None.
+ *      Stops the lease thread.
  *
  *-----------------------------------------------------------------------------
  */
@@ -107,8 +542,33 @@ void
 HgfsPlatformOplockDestroy(void)
 {
 #ifdef HGFS_OPLOCKS
-   /* Tear down oplock state, so we no longer catch signals. */
-   Sig_Callback(SIGIO, SIG_NOHANDLER, NULL, NULL);
+   if (gOplockThreadStarted) {
+      if (write(gOplockExitPipe[1], "", 1) < 0) {
+         LOG(4, ("%s: error in write: %d (%s)\n", __FUNCTION__, errno,
+                 strerror(errno)));
+      }
+      pthread_join(gOplockThread, NULL);
+      gOplockThreadStarted = FALSE;
+   }
+
+   if (NULL != gOplockLeases) {
+      ASSERT(HashTable_GetNumElements(gOplockLeases) == 0);
+      HashTable_Free(gOplockLeases);
+      gOplockLeases = NULL;
+   }
+   if (NULL != gOplockLock) {
+      MXUser_DestroyExclLock(gOplockLock);
+      gOplockLock = NULL;
+   }
+   if (gOplockExitPipe[0] >= 0) {
+      close(gOplockExitPipe[0]);
+      close(gOplockExitPipe[1]);
+      gOplockExitPipe[0] = gOplockExitPipe[1] = -1;
+   }
+   if (gOplockSignalFd >= 0) {
+      close(gOplockSignalFd);
+      gOplockSignalFd = -1;
+   }
 #endif
 }
 
@@ -122,6 +582,9 @@ HgfsPlatformOplockDestroy(void)
  *    lease desired, but if the client asked for HGFS_LOCK_OPPORTUNISTIC, we'll
  *    take the "best" lease we can get.
  *
+ *    The lease is registered for the session so that its break is sent to
+ *    the client, until HgfsReleaseServerLock is called for the file.
+ *
  * Results:
  *    TRUE on success. serverLock contains the type of the lock acquired.
  *    FALSE on failure. serverLock is HGFS_LOCK_NONE.
@@ -142,6 +605,8 @@ HgfsAcquireServerLock(fileDesc fileDesc,            // IN: OS handle
 {
 #ifdef HGFS_OPLOCKS
    HgfsLockType desiredLock;
+   HgfsOplockLease *lease;
+   struct f_owner_ex owner;
    int leaseType, error;
 
    ASSERT(serverLock);
@@ -153,22 +618,7 @@ HgfsAcquireServerLock(fileDesc fileDesc,            // IN: OS handle
       return TRUE;
    }
 
-   if (!HgfsIsServerLockAllowed(session)) {
-      return FALSE;
-   }
-
-   /*
-    * First tell the kernel which signal to send us. SIGIO is already the
-    * default, but if we skip this step, we won't get the siginfo_t when
-    * a lease break occurs.
-    *
-    * XXX: Do I need to do fcntl(fileDesc, F_SETOWN, getpid())?
-    */
-   if (fcntl(fileDesc, F_SETSIG, SIGIO)) {
-      error = errno;
-      Log("%s: Could not set SIGIO as the desired lease break signal for "
-          "fd %d: %s\n", __FUNCTION__, fileDesc, strerror(error));
-
+   if (gOplockLock == NULL || !HgfsIsServerLockAllowed(session)) {
       return FALSE;
    }
 
@@ -186,6 +636,40 @@ HgfsAcquireServerLock(fileDesc fileDesc,            // IN: OS handle
 
       return FALSE;
    }
+
+   lease = malloc(sizeof *lease);
+   if (lease == NULL) {
+      LOG(4, ("%s: Could not allocate memory for lease on fd %d\n",
+              __FUNCTION__, fileDesc));
+
+      return FALSE;
+   }
+
+   /*
+    * The lock is held from setting the lease to registering it, so that a
+    * break signaled in between finds it.
+    */
+   MXUser_AcquireExclLock(gOplockLock);
+
+   if (gOplockThreadId == 0) {
+      LOG(4, ("%s: Lease thread is not running\n", __FUNCTION__));
+      goto error;
+   }
+
+   /*
+    * First tell the kernel which signal to send, and to send it to the lease
+    * thread only. Without F_SETSIG we would not get the fd of the lease.
+    */
+   owner.type = F_OWNER_TID;
+   owner.pid = gOplockThreadId;
+   if (fcntl(fileDesc, F_SETSIG, HGFS_OPLOCK_SIGNAL) ||
+       fcntl(fileDesc, F_SETOWN_EX, &owner)) {
+      error = errno;
+      Log("%s: Could not direct lease break signal for fd %d: %s\n",
+          __FUNCTION__, fileDesc, strerror(error));
+      goto error;
+   }
+
    if (fcntl(fileDesc, F_SETLEASE, leaseType)) {
       /*
        * If our client was opportunistic and we failed to get his lease because
@@ -200,29 +684,187 @@ HgfsAcquireServerLock(fileDesc fileDesc,            // IN: OS handle
             LOG(4, ("%s: Could not get any opportunistic lease for fd %d: %s\n",
                     __FUNCTION__, fileDesc, strerror(error)));
 
-            return FALSE;
+            goto error;
          }
       } else {
          error = errno;
          LOG(4, ("%s: Could not get %s lease for fd %d: %s\n",
                  __FUNCTION__, leaseType == F_WRLCK ? "write" : "read",
-                 fileDesc, strerror(errno)));
+                 fileDesc, strerror(error)));
 
-         return FALSE;
+         goto error;
       }
    }
 
+   lease->fileDesc = fileDesc;
+   lease->session = session;
+   lease->leaseType = leaseType;
+   lease->breakPending = FALSE;
+   lease->ackPending = FALSE;
+   HashTable_ReplaceOrInsert(gOplockLeases, HGFS_OPLOCK_LEASE_KEY(fileDesc),
+                             lease);
+
+   MXUser_ReleaseExclLock(gOplockLock);
+
    /* Got a lease of some kind. */
    LOG(4, ("%s: Got %s lease for fd %d\n", __FUNCTION__,
            leaseType == F_WRLCK ? "write" : "read", fileDesc));
    *serverLock = leaseType == F_WRLCK ? HGFS_LOCK_EXCLUSIVE : HGFS_LOCK_SHARED;
    return TRUE;
+
+error:
+   MXUser_ReleaseExclLock(gOplockLock);
+   free(lease);
+   return FALSE;
 #else
    return FALSE;
 #endif
 }
 
 
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsReleaseServerLock --
+ *
+ *    Forget the lease of a file which is about to be closed. Closing the file
+ *    releases the lease itself.
+ *
+ *    Must be called before the fd is closed, as the fd may be reused by
+ *    the next open.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+HgfsReleaseServerLock(fileDesc fileDesc)   // IN: OS handle
+{
+#ifdef HGFS_OPLOCKS
+   HgfsOplockLease *lease;
+
+   if (gOplockLock == NULL) {
+      return;
+   }
+
+   MXUser_AcquireExclLock(gOplockLock);
+   if (HashTable_Lookup(gOplockLeases, HGFS_OPLOCK_LEASE_KEY(fileDesc),
+                        (void **)&lease)) {
+      if (lease->ackPending) {
+         gOplockAcksPending--;
+      }
+      HashTable_Delete(gOplockLeases, HGFS_OPLOCK_LEASE_KEY(fileDesc));
+      LOG(4, ("%s: Released lease for fd %d\n", __FUNCTION__, fileDesc));
+   }
+   MXUser_ReleaseExclLock(gOplockLock);
+#endif
+}
+
+
+#ifdef HGFS_OPLOCKS
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsPendOplockBreak --
+ *
+ *    Marks the break of a lease as waiting for the client's acknowledgement,
+ *    before the break request is sent. The lease is left as it is until
+ *    HgfsCompleteOplockBreak is called, or the acknowledgement times out.
+ *
+ *    Called from the lease thread, which picks up the new deadline before
+ *    it waits again.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+HgfsPendOplockBreak(HgfsSessionInfo *session,  // IN: session info
+                    ServerLockData *lockData)  // IN: server lock info
+{
+   HgfsOplockLease *lease;
+
+   ASSERT(session);
+   ASSERT(lockData);
+
+   MXUser_AcquireExclLock(gOplockLock);
+   if (HashTable_Lookup(gOplockLeases,
+                        HGFS_OPLOCK_LEASE_KEY(lockData->fileDesc),
+                        (void **)&lease) &&
+       lease->session == session) {
+      if (!lease->ackPending) {
+         lease->ackPending = TRUE;
+         gOplockAcksPending++;
+      }
+      lease->ackLock = lockData->serverLock;
+      lease->ackDeadline = Hostinfo_SystemTimerMS() +
+                           HGFS_OPLOCK_ACK_TIMEOUT_MSEC;
+   }
+   MXUser_ReleaseExclLock(gOplockLock);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsCompleteOplockBreak --
+ *
+ *    Completes a break waiting for the client: downgrades or releases the
+ *    lease according to the lock the client kept.
+ *
+ * Results:
+ *    TRUE if a break of the file was waiting for the client.
+ *    FALSE otherwise, e.g. the acknowledgement came too late.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+Bool
+HgfsCompleteOplockBreak(HgfsSessionInfo *session,  // IN: session info
+                        fileDesc fileDesc,         // IN: leased file
+                        HgfsLockType replyLock)    // IN: client has this lock
+{
+   ServerLockData lockData;
+   HgfsOplockLease *lease;
+
+   ASSERT(session);
+
+   MXUser_AcquireExclLock(gOplockLock);
+   if (!HashTable_Lookup(gOplockLeases, HGFS_OPLOCK_LEASE_KEY(fileDesc),
+                         (void **)&lease)) {
+      lease = NULL;
+   }
+   if (lease == NULL || lease->session != session || !lease->ackPending) {
+      MXUser_ReleaseExclLock(gOplockLock);
+      LOG(4, ("%s: no break pending for fd %d\n", __FUNCTION__, fileDesc));
+      return FALSE;
+   }
+   lease->ackPending = FALSE;
+   gOplockAcksPending--;
+   lockData.fileDesc = fileDesc;
+   lockData.event = 0; // not needed
+   lockData.serverLock = lease->ackLock;
+   MXUser_ReleaseExclLock(gOplockLock);
+
+   HgfsAckOplockBreak(session, &lockData, replyLock);
+   return TRUE;
+}
+#endif
+
+
 #ifdef HGFS_OPLOCKS
 /*
  *-----------------------------------------------------------------------------
@@ -230,11 +872,11 @@ HgfsAcquireServerLock(fileDesc fileDesc,            // IN: OS handle
  * HgfsAckOplockBreak --
  *
  *    Platform-dependent implementation of oplock break acknowledgement.
- *    This function gets called when the oplock break rpc command is completed.
- *    The rpc oplock break command (HgfsServerOplockBreak) is in hgfsServer.c
+ *    This function gets called once the client acknowledged the oplock break
+ *    request, or did not in time (see HgfsServerOplockBreak).
  *
  *    On Linux, we use fcntl() to downgrade the lease. Then we update the node
- *    cache, free the clientData, and call it a day.
+ *    cache and call it a day.
  *
  * Results:
  *    None
@@ -246,12 +888,15 @@ HgfsAcquireServerLock(fileDesc fileDesc,            // IN: OS handle
  */
 
 void
-HgfsAckOplockBreak(ServerLockData *lockData, // IN: server lock info
-                   HgfsLockType replyLock)   // IN: client has this lock
+HgfsAckOplockBreak(HgfsSessionInfo *session,  // IN: session info
+                   ServerLockData *lockData,  // IN: server lock info
+                   HgfsLockType replyLock)    // IN: client has this lock
 {
+   HgfsOplockLease *lease;
    int fileDesc, newLock;
    HgfsLockType actualLock;
 
+   ASSERT(session);
    ASSERT(lockData);
    fileDesc = lockData->fileDesc;
    LOG(4, ("%s: Acknowledging break on fd %d\n", __FUNCTION__, fileDesc));
@@ -270,28 +915,47 @@ HgfsAckOplockBreak(ServerLockData *lockData, // IN: server lock info
       actualLock = HGFS_LOCK_NONE;
    }
 
+   /* The file may have been closed, and its fd reused, in the meantime. */
+   MXUser_AcquireExclLock(gOplockLock);
+   if (!HashTable_Lookup(gOplockLeases, HGFS_OPLOCK_LEASE_KEY(fileDesc),
+                         (void **)&lease)) {
+      lease = NULL;
+   }
+   if (lease == NULL || lease->session != session) {
+      MXUser_ReleaseExclLock(gOplockLock);
+      LOG(4, ("%s: fd %d is no longer leased\n", __FUNCTION__, fileDesc));
+      return;
+   }
+
    /* Downgrade or acknowledge the break altogether. */
    if (fcntl(fileDesc, F_SETLEASE, newLock) == -1) {
       int error = errno;
       Log("%s: Could not break lease on fd %d: %s\n",
           __FUNCTION__, fileDesc, strerror(error));
    }
+   if (newLock == F_UNLCK) {
+      HashTable_Delete(gOplockLeases, HGFS_OPLOCK_LEASE_KEY(fileDesc));
+   } else {
+      lease->leaseType = newLock;
+      lease->breakPending = FALSE;
+   }
+   MXUser_ReleaseExclLock(gOplockLock);
 
-   /* Cleanup. */
-   HgfsUpdateNodeServerLock(fileDesc, actualLock);
-   free(lockData);
+   HgfsUpdateNodeServerLock(fileDesc, session, actualLock);
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * HgfsServerSigOplockBreak --
+ * HgfsOplockLeaseBreak --
  *
- *      Handle a pending oplock break. Called from the VMX poll loop context.
+ *      Handle a pending lease break of a file. Called from the lease thread.
  *      All we really do is set up the state for an oplock break and call
  *      HgfsServerOplockBreak which will do the rest of the work.
  *
+ *      Spurious calls, for leases which are not being broken, are harmless.
+ *
  * Results:
  *      None.
  *
@@ -302,76 +966,88 @@ HgfsAckOplockBreak(ServerLockData *lockData, // IN: server lock info
  */
 
 static void
-HgfsServerSigOplockBreak(int sigNum,       // IN: Signal number
-                         siginfo_t *info,  // IN: Additional info about signal
-                         ucontext_t *u,    // IN: Interrupted context (regs etc)
-                         void *clientData) // IN: Ignored
+HgfsOplockLeaseBreak(fileDesc fileDesc)  // IN: leased file
 {
-   ServerLockData *lockData;
-   int newLease, fd;
-   HgfsLockType newServerLock;
-
-   ASSERT(sigNum == SIGIO);
-   ASSERT(info);
-   ASSERT(clientData == NULL);
+   ServerLockData lockData;
+   HgfsOplockLease *lease;
+   HgfsSessionInfo *session;
+   int newLease;
 
-   fd = info->si_fd;
-   LOG(4, ("%s: Received SIGIO for fd %d\n", __FUNCTION__, fd));
+   LOG(4, ("%s: Lease break for fd %d\n", __FUNCTION__, fileDesc));
 
    /*
-    * We've got all we need from the signal handler, let it continue handling
-    * signals of this type.
+    * The lease stays registered, and thus the fd open and the session alive,
+    * while the lock is held. The session must still be referenced for the
+    * rest of the break, unless it is already being torn down.
     */
-   Sig_Continue(sigNum);
+   MXUser_AcquireExclLock(gOplockLock);
+   if (!HashTable_Lookup(gOplockLeases, HGFS_OPLOCK_LEASE_KEY(fileDesc),
+                         (void **)&lease)) {
+      lease = NULL;
+   }
+   if (lease != NULL && lease->ackPending) {
+      MXUser_ReleaseExclLock(gOplockLock);
+      LOG(4, ("%s: break of fd %d already sent\n", __FUNCTION__, fileDesc));
+      return;
+   }
+   if (lease == NULL || !HgfsServerSessionTryGet(lease->session)) {
+      MXUser_ReleaseExclLock(gOplockLock);
+      LOG(4, ("%s: fd %d is no longer leased\n", __FUNCTION__, fileDesc));
+      return;
+   }
+   session = lease->session;
+   lease->breakPending = FALSE;
 
    /*
     * According to locks.c in kernel source, doing F_GETLEASE when a lease
     * break is pending will return the new lease we should use. It'll be
     * F_RDLCK if we can downgrade, or F_UNLCK if we should break altogether.
+    * Otherwise it is the lease we hold, and there is nothing to break.
     */
-   newLease = fcntl(fd, F_GETLEASE);
+   newLease = fcntl(fileDesc, F_GETLEASE);
+   if (newLease == lease->leaseType) {
+      MXUser_ReleaseExclLock(gOplockLock);
+      HgfsServerSessionPut(session);
+      return;
+   }
+   MXUser_ReleaseExclLock(gOplockLock);
+
+   lockData.fileDesc = fileDesc;
+   lockData.event = 0; // not needed
    if (newLease == F_RDLCK) {
-      newServerLock = HGFS_LOCK_SHARED;
+      lockData.serverLock = HGFS_LOCK_SHARED;
    } else if (newLease == F_UNLCK) {
-      newServerLock = HGFS_LOCK_NONE;
-   } else if (newLease == -1) {
-      int error = errno;
-      Log("%s: Could not get old lease for fd %d: %s\n", __FUNCTION__,
-          fd, strerror(error));
-      goto error;
+      lockData.serverLock = HGFS_LOCK_NONE;
    } else {
-      Log("%s: Unexpected reply to get lease for fd %d: %d\n",
-          __FUNCTION__, fd, newLease);
-      goto error;
+      if (newLease == -1) {
+         int error = errno;
+         Log("%s: Could not get old lease for fd %d: %s\n", __FUNCTION__,
+             fileDesc, strerror(error));
+      } else {
+         Log("%s: Unexpected reply to get lease for fd %d: %d\n",
+             __FUNCTION__, fileDesc, newLease);
+      }
+      /* Clean up as best we can. */
+      lockData.serverLock = HGFS_LOCK_NONE;
+      HgfsAckOplockBreak(session, &lockData, HGFS_LOCK_NONE);
+      HgfsServerSessionPut(session);
+      return;
    }
 
-   /*
-    * Setup a ServerLockData struct so that we can make use of
-    * HgfsServerOplockBreak which does the heavy lifting of discovering which
-    * HGFS handle we're interested in breaking, sending the break, receiving
-    * the acknowledgement, and firing the platform-specific acknowledgement
-    * function (where we'll downgrade the lease).
-    */
-   lockData = malloc(sizeof *lockData);
-   if (lockData) {
-      lockData->fileDesc = fd;
-      lockData->serverLock = newServerLock;
-      lockData->event = 0; // not needed
-
-      /*
-       * Relinquish control of this data. It'll get freed later, when the RPC
-       * command completes.
-       */
-      HgfsServerOplockBreak(lockData);
-      return;
-   } else {
-      Log("%s: Could not allocate memory for lease break on behalf of fd %d\n",
-          __FUNCTION__, fd);
+   if (!HgfsServerOplockBreak(session, &lockData)) {
+      /* The open which got the lease is not done yet, retry shortly. */
+      MXUser_AcquireExclLock(gOplockLock);
+      if (!HashTable_Lookup(gOplockLeases, HGFS_OPLOCK_LEASE_KEY(fileDesc),
+                            (void **)&lease)) {
+         lease = NULL;
+      }
+      if (lease != NULL && lease->session == session) {
+         lease->breakPending = TRUE;
+         gOplockBreaksDeferred = TRUE;
+      }
+      MXUser_ReleaseExclLock(gOplockLock);
    }
 
-  error:
-   /* Clean up as best we can. */
-   fcntl(fd, F_SETLEASE, F_UNLCK);
-   HgfsUpdateNodeServerLock(fd, HGFS_LOCK_NONE);
+   HgfsServerSessionPut(session);
 }
 #endif /* HGFS_OPLOCKS */
@@ -29,10 +29,34 @@
 #include "hgfsServer.h"
 #include "hgfsServerInt.h"
 #include "util.h"
+#include "userlock.h"
+#include "mutexRankLib.h"
 
 #define LOGLEVEL_MODULE hgfs
 #include "loglevel_user.h"
 
+/*
+ * Maximum number of free buffers kept by a reply pool. Beyond that the
+ * buffers are freed as their replies complete.
+ */
+#define HSPU_REPLY_POOL_MAX_FREE 8
+
+/*
+ * The pool of reply buffers of a transport session, for the channels which
+ * do not supply one. All the buffers have the same size, large enough for
+ * any reply of the channel, so that they can be reused for any reply.
+ *
+ * The pool outlives its destruction until the replies it allocated are put.
+ */
+struct HgfsReplyPool {
+   MXUserExclLock *lock;
+   size_t bufSize;                 /* Size of each buffer */
+   uint32 numBusy;                 /* Replies allocated and not put yet */
+   uint32 numFree;                 /* Buffers in freeBufs */
+   Bool destroyed;                 /* Free the pool with the last buffer */
+   void *freeBufs[HSPU_REPLY_POOL_MAX_FREE];
+};
+
 static void *HSPUGetBuf(HgfsServerChannelCallbacks *chanCb,
                         MappingType mappingType,
                         HgfsVmxIov *iov,
@@ -204,6 +228,7 @@ exit:
 void *
 HSPU_GetReplyPacket(HgfsPacket *packet,                  // IN/OUT: Hgfs Packet
                     HgfsServerChannelCallbacks *chanCb,  // IN: Channel callbacks
+                    HgfsReplyPool *replyPool,            // IN: Reply buffers pool
                     size_t replyDataSize,                // IN: Size of reply data
                     size_t *replyPacketSize)             // OUT: Size of reply Packet
 {
@@ -246,6 +271,28 @@ HSPU_GetReplyPacket(HgfsPacket *packet,                  // IN/OUT: Hgfs Packet
       } else {
          NOT_IMPLEMENTED();
       }
+   } else if (replyPool != NULL) {
+      /*
+       * For sockets channel we always need a buffer, reuse a pooled one.
+       * Oversized replies get their own buffer which is still accounted
+       * for by the pool, so that the pool outlives all its replies.
+       */
+      packet->replyPacket = NULL;
+      packet->replyPacketSize = MAX(replyDataSize, replyPool->bufSize);
+
+      MXUser_AcquireExclLock(replyPool->lock);
+      if (replyDataSize <= replyPool->bufSize && replyPool->numFree > 0) {
+         packet->replyPacket = replyPool->freeBufs[--replyPool->numFree];
+      }
+      replyPool->numBusy++;
+      MXUser_ReleaseExclLock(replyPool->lock);
+
+      if (packet->replyPacket == NULL) {
+         LOG(10, ("%s Allocating reply packet\n", __FUNCTION__));
+         packet->replyPacket = Util_SafeMalloc(packet->replyPacketSize);
+      }
+      packet->replyPacketIsAllocated = TRUE;
+      packet->replyPacketDataSize = replyDataSize;
    } else {
       /* For sockets channel we always need to allocate buffer */
       LOG(10, ("%s Allocating reply packet\n", __FUNCTION__));
@@ -265,7 +312,8 @@ HSPU_GetReplyPacket(HgfsPacket *packet,                  // IN/OUT: Hgfs Packet
  *
  * HSPU_PutReplyPacket --
  *
- *    Free buffer if reply packet was allocated.
+ *    Free buffer if reply packet was allocated, or return it to the pool
+ *    it came from.
  *
  * Results:
  *    None.
@@ -277,7 +325,8 @@ HSPU_GetReplyPacket(HgfsPacket *packet,                  // IN/OUT: Hgfs Packet
 
 void
 HSPU_PutReplyPacket(HgfsPacket *packet,                  // IN/OUT: Hgfs Packet
-                    HgfsServerChannelCallbacks *chanCb)  // IN: Channel callbacks
+                    HgfsServerChannelCallbacks *chanCb,  // IN: Channel callbacks
+                    HgfsReplyPool *replyPool)            // IN: Reply buffers pool
 {
    /*
     * If there wasn't an allocated buffer for the reply, there is nothing to
@@ -285,8 +334,31 @@ HSPU_PutReplyPacket(HgfsPacket *packet,                  // IN/OUT: Hgfs Packet
     * put on the metapacket.
     */
    if (packet->replyPacketIsAllocated) {
-      LOG(10, ("%s Freeing reply packet", __FUNCTION__));
-      free(packet->replyPacket);
+      Bool destroyPool = FALSE;
+
+      /* Pooled buffers are told apart by their size, see HSPU_GetReplyPacket. */
+      if (replyPool != NULL) {
+         MXUser_AcquireExclLock(replyPool->lock);
+         ASSERT(replyPool->numBusy > 0);
+         replyPool->numBusy--;
+         if (!replyPool->destroyed &&
+             packet->replyPacketSize == replyPool->bufSize &&
+             replyPool->numFree < ARRAYSIZE(replyPool->freeBufs)) {
+            replyPool->freeBufs[replyPool->numFree++] = packet->replyPacket;
+            packet->replyPacket = NULL;
+         }
+         destroyPool = replyPool->destroyed && replyPool->numBusy == 0;
+         MXUser_ReleaseExclLock(replyPool->lock);
+      }
+
+      if (packet->replyPacket != NULL) {
+         LOG(10, ("%s Freeing reply packet", __FUNCTION__));
+         free(packet->replyPacket);
+      }
+      if (destroyPool) {
+         MXUser_DestroyExclLock(replyPool->lock);
+         free(replyPool);
+      }
       packet->replyPacketIsAllocated = FALSE;
       packet->replyPacket = NULL;
       packet->replyPacketSize = 0;
@@ -294,6 +366,72 @@ HSPU_PutReplyPacket(HgfsPacket *packet,                  // IN/OUT: Hgfs Packet
 }
 
 
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HSPU_CreateReplyPool --
+ *
+ *    Create a pool of reply buffers for a transport session.
+ *
+ * Results:
+ *    The reply buffers pool.
+ *
+ * Side effects:
+ *    None.
+ *-----------------------------------------------------------------------------
+ */
+
+HgfsReplyPool *
+HSPU_CreateReplyPool(size_t bufSize)   // IN: Size of a buffer
+{
+   HgfsReplyPool *replyPool = Util_SafeCalloc(1, sizeof *replyPool);
+
+   ASSERT(bufSize > 0);
+
+   replyPool->lock = MXUser_CreateExclLock("HgfsReplyPoolLock",
+                                           RANK_hgfsReplyPoolLock);
+   replyPool->bufSize = bufSize;
+
+   return replyPool;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HSPU_DestroyReplyPool --
+ *
+ *    Destroy a pool of reply buffers. Buffers still in use are freed when
+ *    their replies complete, the last one frees the pool.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *-----------------------------------------------------------------------------
+ */
+
+void
+HSPU_DestroyReplyPool(HgfsReplyPool *replyPool)   // IN: Reply buffers pool
+{
+   Bool destroyPool;
+
+   MXUser_AcquireExclLock(replyPool->lock);
+   while (replyPool->numFree > 0) {
+      free(replyPool->freeBufs[--replyPool->numFree]);
+   }
+   replyPool->destroyed = TRUE;
+   destroyPool = replyPool->numBusy == 0;
+   MXUser_ReleaseExclLock(replyPool->lock);
+
+   if (destroyPool) {
+      MXUser_DestroyExclLock(replyPool->lock);
+      free(replyPool);
+   }
+}
+
+
 /*
  *-----------------------------------------------------------------------------
  *
@@ -407,6 +545,83 @@ HSPU_GetDataPacketBuf(HgfsPacket *packet,                   // IN/OUT: Hgfs Pack
 }
 
 
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HSPU_GetDataPacketIov --
+ *
+ *    Get the data packet of an hgfs packet as the transport's iovs.
+ *    Guest mappings will be established, the data is neither copied nor
+ *    gathered into a contiguous buffer, so it can be read or written in
+ *    place with vectored I/O.
+ *
+ *    The mappings are released by HSPU_PutDataPacketBuf.
+ *
+ * Results:
+ *    Pointer to the first iov of the data packet, NULL if it could not be
+ *    mapped or was already gathered in a buffer.
+ *
+ * Side effects:
+ *    None.
+ *-----------------------------------------------------------------------------
+ */
+
+HgfsVmxIov *
+HSPU_GetDataPacketIov(HgfsPacket *packet,                   // IN/OUT: Hgfs Packet
+                      MappingType mappingType,              // IN: Writeable/Readable
+                      HgfsServerChannelCallbacks *chanCb,   // IN: Channel callbacks
+                      uint32 *iovCount)                     // OUT: Mapped iov count
+{
+   HgfsChannelMapVirtAddrFunc mapVa;
+
+   *iovCount = 0;
+
+   if (packet->dataPacket != NULL) {
+      if (packet->dataPacketIsAllocated) {
+         return NULL;
+      }
+      *iovCount = packet->dataPacketMappedIov;
+      return &packet->iov[packet->dataPacketIovIndex];
+   }
+
+   if (packet->dataPacketSize == 0 || chanCb == NULL) {
+      return NULL;
+   }
+
+   if (mappingType == BUF_WRITEABLE ||
+       mappingType == BUF_READWRITEABLE) {
+      mapVa = chanCb->getWriteVa;
+   } else {
+      ASSERT(mappingType == BUF_READABLE);
+      mapVa = chanCb->getReadVa;
+   }
+
+   /* Looks like we are in the middle of poweroff. */
+   if (mapVa == NULL) {
+      return NULL;
+   }
+
+   if (!HSPUMapBuf(mapVa,
+                   chanCb->putVa,
+                   packet->dataPacketSize,
+                   packet->dataPacketIovIndex,
+                   packet->iovCount,
+                   packet->iov,
+                   &packet->dataPacketMappedIov)) {
+      /* Guest probably passed us bad physical address */
+      return NULL;
+   }
+
+   /* Hold the mappings as the data packet, HSPU_PutDataPacketBuf drops them. */
+   packet->dataMappingType = mappingType;
+   packet->dataPacket = packet->iov[packet->dataPacketIovIndex].va;
+   packet->dataPacketIsAllocated = FALSE;
+
+   *iovCount = packet->dataPacketMappedIov;
+   return &packet->iov[packet->dataPacketIovIndex];
+}
+
+
 /*
  *-----------------------------------------------------------------------------
  *
@@ -123,6 +123,8 @@ static HgfsCapability hgfsDefaultCapabilityTable[] =
    {HGFS_OP_UNLOCK_BYTE_RANGE_V4,  HGFS_REQUEST_NOT_SUPPORTED},
    {HGFS_OP_QUERY_EAS_V4,          HGFS_REQUEST_NOT_SUPPORTED},
    {HGFS_OP_SET_EAS_V4,            HGFS_REQUEST_NOT_SUPPORTED},
+   {HGFS_OP_COMPOUND_V4,           HGFS_REQUEST_SUPPORTED},
+   {HGFS_OP_COPY_RANGE_V4,         HGFS_REQUEST_SUPPORTED},
 };
 
 
@@ -6213,3 +6215,99 @@ HgfsPackChangeNotificationRequest(void *packet,                    // IN/OUT: Hg
 exit:
    return result;
 }
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsUnpackCopyRangeRequest --
+ *
+ *    Unpack hgfs copy range request V4.
+ *
+ * Results:
+ *    TRUE on success.
+ *    FALSE on failure.
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+Bool
+HgfsUnpackCopyRangeRequest(const void *packet,     // IN: HGFS packet
+                           size_t packetSize,      // IN: request packet size
+                           HgfsOp op,              // IN: requested operation
+                           HgfsHandle *srcFile,    // OUT: source file handle
+                           uint64 *srcOffset,      // OUT: source offset
+                           HgfsHandle *dstFile,    // OUT: destination file handle
+                           uint64 *dstOffset,      // OUT: destination offset
+                           uint64 *length)         // OUT: bytes to copy
+{
+   const HgfsRequestCopyRangeV4 *requestV4 = packet;
+
+   ASSERT(packet);
+   ASSERT(HGFS_OP_COPY_RANGE_V4 == op);
+
+   if (HGFS_OP_COPY_RANGE_V4 != op || packetSize < sizeof *requestV4) {
+      LOG(4, ("%s: Error decoding HGFS packet\n", __FUNCTION__));
+      return FALSE;
+   }
+
+   if (0 != requestV4->flags) {
+      LOG(4, ("%s: Unsupported flags %#x\n", __FUNCTION__, requestV4->flags));
+      return FALSE;
+   }
+
+   *srcFile = requestV4->srcFile;
+   *srcOffset = requestV4->srcOffset;
+   *dstFile = requestV4->dstFile;
+   *dstOffset = requestV4->dstOffset;
+   *length = requestV4->length;
+   return TRUE;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsPackCopyRangeReply --
+ *
+ *    Pack hgfs copy range reply to the HgfsReplyCopyRangeV4 structure.
+ *
+ * Results:
+ *    TRUE if successfully allocated reply request, FALSE otherwise.
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+Bool
+HgfsPackCopyRangeReply(HgfsPacket *packet,           // IN/OUT: Hgfs Packet
+                       const void *packetHeader,     // IN: packet header
+                       HgfsOp op,                    // IN: operation code
+                       uint64 copiedSize,            // IN: bytes copied
+                       size_t *payloadSize,          // OUT: size of packet
+                       HgfsSessionInfo *session)     // IN: Session info
+{
+   Bool result = TRUE;
+   HgfsReplyCopyRangeV4 *reply;
+
+   HGFS_ASSERT_PACK_PARAMS;
+
+   *payloadSize = 0;
+
+   if (HGFS_OP_COPY_RANGE_V4 != op) {
+      NOT_REACHED();
+      result = FALSE;
+   } else {
+      reply = HgfsAllocInitReply(packet, packetHeader, sizeof *reply,
+                                 session);
+      reply->actualSize = copiedSize;
+      reply->reserved = 0;
+      *payloadSize = sizeof *reply;
+   }
+   return result;
+}
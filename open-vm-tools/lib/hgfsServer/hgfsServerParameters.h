@@ -338,6 +338,22 @@ HgfsPackRemoveWatchReply(HgfsPacket *packet,           // IN/OUT: Hgfs Packet
                          HgfsOp     op,                // IN: operation code
                          size_t *payloadSize,          // OUT: size of packet
                          HgfsSessionInfo *session);    // IN: Session info
+Bool
+HgfsUnpackCopyRangeRequest(const void *packet,     // IN: HGFS packet
+                           size_t packetSize,      // IN: request packet size
+                           HgfsOp op,              // IN: requested operation
+                           HgfsHandle *srcFile,    // OUT: source file handle
+                           uint64 *srcOffset,      // OUT: source offset
+                           HgfsHandle *dstFile,    // OUT: destination file handle
+                           uint64 *dstOffset,      // OUT: destination offset
+                           uint64 *length);        // OUT: bytes to copy
+Bool
+HgfsPackCopyRangeReply(HgfsPacket *packet,           // IN/OUT: Hgfs Packet
+                       const void *packetHeader,     // IN: packet header
+                       HgfsOp op,                    // IN: operation code
+                       uint64 copiedSize,            // IN: bytes copied
+                       size_t *payloadSize,          // OUT: size of packet
+                       HgfsSessionInfo *session);    // IN: Session info
 size_t
 HgfsPackCalculateNotificationSize(char const *shareName, // IN: shared folder name
                                   char *fileName);       // IN: file name
@@ -350,6 +366,20 @@ HgfsPackChangeNotificationRequest(void *packet,                    // IN/OUT: Hg
                                   uint32 notifyFlags,              // IN: notify flags
                                   HgfsSessionInfo *session,        // IN: session
                                   size_t *bufferSize);             // IN/OUT: packet size
+size_t
+HgfsPackGetOplockBreakSize(void);
+Bool
+HgfsPackOplockBreakRequest(void *packet,                    // IN/OUT: Hgfs Packet
+                           HgfsHandle fileId,               // IN: file ID
+                           HgfsLockType serverLock,         // IN: lock type
+                           uint64 sessionId,                // IN: session ID
+                           size_t *bufferSize);             // IN/OUT: size of packet
+Bool
+HgfsUnpackOplockBreakAckReply(const void *packet,            // IN: HGFS packet
+                              size_t packetSize,             // IN: reply packet size
+                              HgfsOp op,                     // IN: operation version
+                              HgfsHandle *fileId,            // OUT: file Id to remove
+                              HgfsLockType *serverLock);     // OUT: lock type
 
 
 #endif // ifndef _HGFS_SERVER_PARAMETERS_H_
@@ -0,0 +1,183 @@
+/*********************************************************
+ * Copyright (C) 2016 VMware, Inc. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation version 2.1 and no later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the Lesser GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA.
+ *
+ *********************************************************/
+
+/*
+ * hgfsThreadpool.c --
+ *
+ *	Worker pool used to process HGFS requests asynchronously in the guest.
+ *	This is a thin wrapper around a glib thread pool.
+ */
+
+#include <glib.h>
+
+#include "vmware.h"
+#include "vm_basic_types.h"
+#include "util.h"
+
+#include "hgfsProto.h"
+#include "hgfsServer.h"
+#include "hgfsUtil.h"
+#include "hgfsThreadpool.h"
+
+#define LOGLEVEL_MODULE hgfs
+#include "loglevel_user.h"
+
+/* A queued work item and its argument. */
+typedef struct HgfsThreadpoolItem {
+   HgfsThreadpoolWorkItem *workItem;
+   void *data;
+} HgfsThreadpoolItem;
+
+static GThreadPool *gHgfsThreadpool = NULL;
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsThreadpoolWorker --
+ *
+ *    Runs a queued work item in the context of a pool thread.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Frees the queued item.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsThreadpoolWorker(gpointer data,      // IN: queued item
+                     gpointer userData)  // IN: unused
+{
+   HgfsThreadpoolItem *item = data;
+
+   item->workItem(item->data);
+   free(item);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsThreadpool_Init --
+ *
+ *    Creates the worker pool. Threads are started on demand up to
+ *    HGFS_THREADPOOL_MAX_THREADS.
+ *
+ * Results:
+ *    HGFS_ERROR_SUCCESS if the pool is created, an error otherwise.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+HgfsInternalStatus
+HgfsThreadpool_Init(void)
+{
+   GError *error = NULL;
+
+   ASSERT(NULL == gHgfsThreadpool);
+
+   gHgfsThreadpool = g_thread_pool_new(HgfsThreadpoolWorker,
+                                       NULL,
+                                       HGFS_THREADPOOL_MAX_THREADS,
+                                       FALSE,
+                                       &error);
+   if (NULL == gHgfsThreadpool) {
+      LOG(4, ("%s: failed to create the thread pool: %s\n", __FUNCTION__,
+              (NULL != error) ? error->message : "unknown"));
+      g_clear_error(&error);
+      return HGFS_ERROR_INTERNAL;
+   }
+
+   return HGFS_ERROR_SUCCESS;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsThreadpool_Exit --
+ *
+ *    Destroys the worker pool, waiting for queued work items to complete.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+HgfsThreadpool_Exit(void)
+{
+   if (NULL != gHgfsThreadpool) {
+      g_thread_pool_free(gHgfsThreadpool, FALSE, TRUE);
+      gHgfsThreadpool = NULL;
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsThreadpool_QueueWorkItem --
+ *
+ *    Queues a work item to be run by one of the pool threads.
+ *
+ * Results:
+ *    TRUE if the item is queued, FALSE otherwise in which case the caller
+ *    still owns the data.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+Bool
+HgfsThreadpool_QueueWorkItem(HgfsThreadpoolWorkItem *workItem, // IN: callback
+                             void *data)                       // IN: argument
+{
+   HgfsThreadpoolItem *item;
+   GError *error = NULL;
+
+   if (NULL == gHgfsThreadpool) {
+      return FALSE;
+   }
+
+   item = Util_SafeMalloc(sizeof *item);
+   item->workItem = workItem;
+   item->data = data;
+
+   if (!g_thread_pool_push(gHgfsThreadpool, item, &error)) {
+      LOG(4, ("%s: failed to queue work item: %s\n", __FUNCTION__,
+              (NULL != error) ? error->message : "unknown"));
+      g_clear_error(&error);
+      free(item);
+      return FALSE;
+   }
+
+   return TRUE;
+}
@@ -0,0 +1,43 @@
+/*********************************************************
+ * Copyright (C) 2016 VMware, Inc. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation version 2.1 and no later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the Lesser GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA.
+ *
+ *********************************************************/
+
+#ifndef _HGFS_THREADPOOL_H
+#define _HGFS_THREADPOOL_H
+
+/*
+ * hgfsThreadpool.h --
+ *
+ *	Function definitions for the worker pool used to process HGFS
+ *	requests asynchronously in the guest.
+ */
+
+#include "vm_basic_types.h"
+#include "hgfsUtil.h"   // for HgfsInternalStatus
+
+/* Maximum number of worker threads processing asynchronous requests. */
+#define HGFS_THREADPOOL_MAX_THREADS 4
+
+/* This is a callback that is implemented in hgfsServer.c */
+typedef void HgfsThreadpoolWorkItem(void *data);
+
+HgfsInternalStatus HgfsThreadpool_Init(void);
+void HgfsThreadpool_Exit(void);
+Bool HgfsThreadpool_QueueWorkItem(HgfsThreadpoolWorkItem *workItem,
+                                  void *data);
+
+#endif // _HGFS_THREADPOOL_H
@@ -106,9 +106,14 @@ static HgfsChannelData gHgfsChannels[] = {
    { "guest", &gGuestBackdoorOps, 0, NULL, NULL, {0} },
 };
 
+/*
+ * Server locks stay disabled: the backdoor channel cannot carry the lease
+ * break requests, so no client could ever be granted one.
+ */
 static HgfsServerConfig gHgfsGuestCfgSettings = {
    (HGFS_CONFIG_SHARE_ALL_HOST_DRIVES_ENABLED | HGFS_CONFIG_VOL_INFO_MIN),
-   HGFS_MAX_CACHED_FILENODES
+   HGFS_MAX_CACHED_FILENODES,
+   HGFS_MAX_LOCKED_FILENODES
 };
 
 /* HGFS server info state. Referenced by each separate channel that uses it. */
@@ -766,3 +771,39 @@ HgfsChannelGuest_InvalidateInactiveSessions(HgfsServerMgrData *mgrData) // IN: c
 
    return result;
 }
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * HgfsChannelGuest_GetStats -
+ *
+ *    Gets the HGFS server request statistics of the channel.
+ *
+ * Results:
+ *    Statistics text allocated with malloc, NULL if there are none.
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------------
+ */
+
+char *
+HgfsChannelGuest_GetStats(HgfsServerMgrData *mgrData) // IN: conn manager
+{
+   HgfsChannelData *channel = NULL;
+   char *result = NULL;
+
+   ASSERT(NULL != mgrData);
+   ASSERT(NULL != mgrData->connection);
+   ASSERT(NULL != mgrData->appName);
+
+   channel = mgrData->connection;
+
+   if (HgfsChannelIsChannelActive(channel)) {
+      result = channel->ops->getStats(channel->connection);
+   }
+
+   return result;
+}
@@ -48,8 +48,7 @@ typedef struct HgfsGuestConn {
    HgfsServerChannelCallbacks channelCbTable;
    void *serverSession;
    size_t packetOutLen;
-   unsigned char *clientPacketOut;                 /* Client supplied buffer. */
-   unsigned char packetOut[HGFS_LARGE_PACKET_MAX]; /* For RPC msg callbacks. */
+   unsigned char *clientPacketOut;            /* Client supplied buffer. */
 } HgfsGuestConn;
 
 
@@ -68,12 +67,14 @@ static Bool HgfsChannelGuestBdReceive(HgfsGuestConn *data,
                                       char *packetOut,
                                       size_t *packetOutSize);
 static uint32 HgfsChannelGuestBdInvalidateInactiveSessions(HgfsGuestConn *data);
+static char *HgfsChannelGuestBdGetStats(HgfsGuestConn *data);
 
 HgfsGuestChannelCBTable gGuestBackdoorOps = {
    HgfsChannelGuestBdInit,
    HgfsChannelGuestBdExit,
    HgfsChannelGuestBdReceive,
    HgfsChannelGuestBdInvalidateInactiveSessions,
+   HgfsChannelGuestBdGetStats,
 };
 
 /* Private functions. */
@@ -343,9 +344,13 @@ static Bool
 HgfsChannelGuestConnConnect(HgfsGuestConn *connData)  // IN: our connection data
 {
    Bool result;
+   /*
+    * Replies go to the client supplied buffer which is sized for the largest
+    * packet a session can negotiate, see HgfsServerRpcDispatch.
+    */
    static HgfsServerChannelData HgfsBdCapData = {
       0,
-      HGFS_LARGE_PACKET_MAX
+      HGFS_HUGE_PACKET_MAX
    };
 
    connData->channelCbTable.getWriteVa = NULL;
@@ -567,7 +572,7 @@ HgfsChannelGuestBdReceive(HgfsGuestConn *connData,    // IN: connection
                                             packetOutSize);
 
    connData->clientPacketOut = NULL;
-   connData->packetOutLen = sizeof connData->packetOut;
+   connData->packetOutLen = 0;
 
 exit:
    return result;
@@ -613,6 +618,41 @@ HgfsChannelGuestBdInvalidateInactiveSessions(HgfsGuestConn *connData)  // IN: co
 }
 
 
+/*
+ *----------------------------------------------------------------------------
+ *
+ * HgfsChannelGuestBdGetStats --
+ *
+ *    Gets the HGFS server request statistics of the connection.
+ *
+ * Results:
+ *    Statistics text allocated with malloc, NULL if no session was
+ *    created yet.
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static char *
+HgfsChannelGuestBdGetStats(HgfsGuestConn *connData)  // IN: connection
+{
+   ASSERT(NULL != connData);
+
+   if (connData->state == HGFS_GST_CONN_UNINITIALIZED) {
+      /* The connection was closed as we are exiting, so bail. */
+      return NULL;
+   }
+
+   if (connData->serverSession) {
+      return connData->serverCbTable->getStats(connData->serverSession);
+   }
+
+   return NULL;
+}
+
+
 /*
  *-----------------------------------------------------------------------------
  *
@@ -45,6 +45,7 @@ typedef struct HgfsGuestChannelCBTable {
    void (*exit)(struct HgfsGuestConn *);
    Bool (*receive)(struct HgfsGuestConn *, char const *, size_t, char *, size_t *);
    uint32 (*invalidateInactiveSessions)(struct HgfsGuestConn *);
+   char *(*getStats)(struct HgfsGuestConn *);
 } HgfsGuestChannelCBTable;
 
 /* The guest channels callback tables. */
@@ -59,6 +60,7 @@ Bool HgfsChannelGuest_Receive(HgfsServerMgrData *data,
                               char *packetOut,
                               size_t *packetOutSize);
 uint32 HgfsChannelGuest_InvalidateInactiveSessions(HgfsServerMgrData *data);
+char *HgfsChannelGuest_GetStats(HgfsServerMgrData *data);
 
 #endif /* _HGFSCHANNELGUESTINT_H_ */
 
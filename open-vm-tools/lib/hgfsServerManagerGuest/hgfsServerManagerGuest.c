@@ -145,6 +145,31 @@ HgfsServerManager_InvalidateInactiveSessions(HgfsServerMgrData *mgrData)  // IN:
 }
 
 
+/*
+ *----------------------------------------------------------------------------
+ *
+ * HgfsServerManager_GetStats --
+ *
+ *    Gets the HGFS server request statistics as text.
+ *
+ * Results:
+ *    Statistics text allocated with malloc, NULL if there are none.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+char *
+HgfsServerManager_GetStats(HgfsServerMgrData *mgrData)  // IN: RpcIn channel
+{
+   ASSERT(mgrData);
+
+   return HgfsChannelGuest_GetStats(mgrData);
+}
+
+
 /*
  *----------------------------------------------------------------------------
  *
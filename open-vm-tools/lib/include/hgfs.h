@@ -79,6 +79,15 @@
 /* Maximum number of bytes to read or write to a V3 server in a single hgfs packet. */
 #define HGFS_LARGE_IO_MAX (HGFS_LARGE_IO_MAX_PAGES * 4096)
 
+/*
+ * The HGFS_HUGE_PACKET_MAX size is the largest packet size a client can
+ * negotiate with the create session request, for reads and writes of up to
+ * HGFS_HUGE_IO_MAX bytes. Sessions that do not negotiate the packet size
+ * remain limited to HGFS_LARGE_PACKET_MAX.
+ */
+#define HGFS_HUGE_IO_MAX (4 * 1024 * 1024)
+#define HGFS_HUGE_PACKET_MAX (HGFS_HUGE_IO_MAX + 2048)
+
 /*
  * File type
  *
@@ -239,6 +248,15 @@ typedef enum {
 #define HGFS_SYNC_REQREP_CLIENT_CMD HGFS_SYNC_REQREP_CMD " "
 #define HGFS_SYNC_REQREP_CLIENT_CMD_LEN (sizeof HGFS_SYNC_REQREP_CLIENT_CMD - 1)
 
+/*
+ * Command returning the HGFS server request statistics as text: per opcode
+ * counts, errors and latency histograms, data moved and node cache hits.
+ * It is a TCLO command, only the host can send it. In the guest the same
+ * text is written to the vmtoolsd log with the rest of its state when the
+ * service gets SIGUSR1.
+ */
+#define HGFS_STATS_CMD "hgfs.stats"
+
 /*
  * This is just for the sake of macro naming. Since we are guaranteed
  * equal command lengths, defining command length via a generalized macro name
@@ -146,6 +146,8 @@ typedef enum {
    HGFS_OP_UNLOCK_BYTE_RANGE_V4,  /* Release byte range lock. */
    HGFS_OP_QUERY_EAS_V4,          /* Query extended attributes. */
    HGFS_OP_SET_EAS_V4,            /* Add or modify extended attributes. */
+   HGFS_OP_COMPOUND_V4,           /* Process a batch of requests in one packet. */
+   HGFS_OP_COPY_RANGE_V4,         /* Copy data between two open files. */
 
    HGFS_OP_MAX,                   /* Dummy op, must be last in enum */
    HGFS_OP_NEW_HEADER = 0xff,     /* Header op, must be unique, distinguishes packet headers. */
@@ -2684,4 +2686,96 @@ struct HgfsReplyDeleteFileV4 {
 #include "vmware_pack_end.h"
 HgfsReplyDeleteFileV4;
 
+/*
+ * Compound request allows a client to send several requests in one packet and
+ * get all the replies back in one packet. It is only valid with the new
+ * header and the embedded requests have no header of their own, each one is
+ * described by an HgfsCompoundEntryV4 followed by the operation arguments.
+ * Every entry, the arguments included, is padded to an 8 byte boundary.
+ *
+ * Requests are processed in order. When an entry has the
+ * HGFS_COMPOUND_ENTRY_FLAG_LAST_HANDLE flag set, the file or search handle
+ * field of its request is replaced by the handle returned by the last open or
+ * search open request of the same compound request, so that e.g. open, read
+ * and close of a file can be done in one round trip.
+ * Only V3 requests that carry their data inline in the packet are allowed.
+ *
+ * The reply contains an entry for each processed request in the same format
+ * with the status field set to the result of the request. When the
+ * HGFS_COMPOUND_FLAG_STOP_ON_ERROR flag is set the processing stops after
+ * the first request that failed and numReplies tells how many requests were
+ * processed.
+ */
+
+#define HGFS_COMPOUND_MAX_REQUESTS        16
+#define HGFS_COMPOUND_ENTRY_ALIGN         8
+
+#define HGFS_COMPOUND_FLAG_STOP_ON_ERROR  (1 << 0)
+
+#define HGFS_COMPOUND_ENTRY_FLAG_LAST_HANDLE  (1 << 0)
+
+typedef
+#include "vmware_pack_begin.h"
+struct HgfsCompoundEntryV4 {
+   uint32 op;            /* Operation, HgfsOp V3 request. */
+   uint32 size;          /* Size of the arguments following this entry. */
+   uint32 status;        /* Reply only: HgfsStatus of the request. */
+   uint32 flags;         /* Request only: HGFS_COMPOUND_ENTRY_FLAG_* */
+}
+#include "vmware_pack_end.h"
+HgfsCompoundEntryV4;
+
+typedef
+#include "vmware_pack_begin.h"
+struct HgfsRequestCompoundV4 {
+   uint32 numRequests;   /* Number of entries following the request. */
+   uint32 flags;         /* HGFS_COMPOUND_FLAG_* */
+   uint64 reserved;      /* Reserved for future use. */
+}
+#include "vmware_pack_end.h"
+HgfsRequestCompoundV4;
+
+typedef
+#include "vmware_pack_begin.h"
+struct HgfsReplyCompoundV4 {
+   uint32 numReplies;    /* Number of entries following the reply. */
+   uint32 reserved1;     /* Reserved for future use. */
+   uint64 reserved;      /* Reserved for future use. */
+}
+#include "vmware_pack_end.h"
+HgfsReplyCompoundV4;
+
+/*
+ * Copy range request copies data between two files opened for the session
+ * without the data crossing the transport. The server may copy less than
+ * requested, e.g. when the source end of file is reached or to bound the
+ * time spent in one request, so the client must loop on the copied size.
+ * Handles of files opened for sequential access only are not supported, nor
+ * are a destination opened for appending or overlapping ranges of one file.
+ */
+
+typedef
+#include "vmware_pack_begin.h"
+struct HgfsRequestCopyRangeV4 {
+   HgfsHandle srcFile;   /* Opaque source file ID used by the server */
+   HgfsHandle dstFile;   /* Opaque destination file ID used by the server */
+   uint64 srcOffset;     /* Offset in the source file to copy from */
+   uint64 dstOffset;     /* Offset in the destination file to copy to */
+   uint64 length;        /* Number of bytes to copy */
+   uint32 flags;         /* Reserved for future use, must be 0 */
+   uint32 reserved1;     /* Reserved for future use */
+   uint64 reserved;      /* Reserved for future use */
+}
+#include "vmware_pack_end.h"
+HgfsRequestCopyRangeV4;
+
+typedef
+#include "vmware_pack_begin.h"
+struct HgfsReplyCopyRangeV4 {
+   uint64 actualSize;    /* Number of bytes copied */
+   uint64 reserved;      /* Reserved for future use */
+}
+#include "vmware_pack_end.h"
+HgfsReplyCopyRangeV4;
+
 #endif /* _HGFS_PROTO_H_ */
@@ -110,6 +110,9 @@ typedef struct HgfsServerChannelData {
 /* Default maximum number of open nodes. */
 #define HGFS_MAX_CACHED_FILENODES   30
 
+/* Default maximum number of open nodes that have server locks. */
+#define HGFS_MAX_LOCKED_FILENODES   10
+
 typedef uint32 HgfsConfigFlags;
 #define HGFS_CONFIG_USE_HOST_TIME                    (1 << 0)
 #define HGFS_CONFIG_NOTIFY_ENABLED                   (1 << 1)
@@ -120,6 +123,7 @@ typedef uint32 HgfsConfigFlags;
 typedef struct HgfsServerConfig {
    HgfsConfigFlags flags;
    uint32 maxCachedOpenNodes;
+   uint32 maxCachedLockedNodes;
 }HgfsServerConfig;
 
 /*
@@ -187,6 +191,7 @@ typedef struct HgfsServerSessionCallbacks {
    void (*invalidateObjects)(void *, DblLnkLst_Links *);
    uint32 (*invalidateInactiveSessions)(void *);
    void (*sendComplete)(HgfsPacket *, void *);
+   char *(*getStats)(void *);
 } HgfsServerSessionCallbacks;
 
 typedef struct HgfsServerCallbacks {
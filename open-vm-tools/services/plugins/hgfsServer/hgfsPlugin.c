@@ -25,6 +25,7 @@
 #if defined(_WIN32)
 #include <windows.h>
 #endif // defined(_WIN32)
+#include <stdlib.h>
 #include <string.h>
 
 #define G_LOG_DOMAIN "hgfsd"
@@ -38,6 +39,13 @@
 #include "vmware/tools/plugin.h"
 #include "vmware/tools/utils.h"
 
+/*
+ * Reply buffer for the RPC dispatch, sized for the largest packet a session
+ * can negotiate. Allocated on first use, pages are only touched by replies
+ * that need them.
+ */
+static char *gHgfsReply = NULL;
+
 
 #if !defined(__APPLE__)
 #include "vm_version.h"
@@ -63,6 +71,8 @@ HgfsServerShutdown(gpointer src,
    HgfsServerMgrData *mgrData = plugin->_private;
    HgfsServerManager_Unregister(mgrData);
    g_free(mgrData);
+   g_free(gHgfsReply);
+   gHgfsReply = NULL;
 }
 
 
@@ -79,8 +89,6 @@ HgfsServerRpcDispatch(RpcInData *data)
 {
    HgfsServerMgrData *mgrData;
    size_t replySize;
-   static char reply[HGFS_LARGE_PACKET_MAX];
-
 
    ASSERT(data->clientData != NULL);
    mgrData = data->clientData;
@@ -89,15 +97,90 @@ HgfsServerRpcDispatch(RpcInData *data)
       return RPCIN_SETRETVALS(data, "1 argument required", FALSE);
    }
 
-   replySize = sizeof reply;
-   HgfsServerManager_ProcessPacket(mgrData, data->args + 1, data->argsSize - 1, reply, &replySize);
+   if (gHgfsReply == NULL) {
+      gHgfsReply = g_malloc(HGFS_HUGE_PACKET_MAX);
+   }
+
+   replySize = HGFS_HUGE_PACKET_MAX;
+   HgfsServerManager_ProcessPacket(mgrData, data->args + 1, data->argsSize - 1,
+                                   gHgfsReply, &replySize);
 
-   data->result = reply;
+   data->result = gHgfsReply;
    data->resultLen = replySize;
    return TRUE;
 }
 
 
+/**
+ * Returns the HGFS server request statistics. This is a TCLO command so only
+ * the host can send it, see HgfsServerDumpState for the guest.
+ *
+ * @param[in]  data  RPC request data.
+ *
+ * @return TRUE on success, FALSE if the server has no statistics yet.
+ */
+
+static gboolean
+HgfsServerStatsRpc(RpcInData *data)
+{
+   HgfsServerMgrData *mgrData;
+   char *stats;
+   gchar *result;
+
+   ASSERT(data->clientData != NULL);
+   mgrData = data->clientData;
+
+   stats = HgfsServerManager_GetStats(mgrData);
+   if (stats == NULL) {
+      return RPCIN_SETRETVALS(data, "No HGFS session", FALSE);
+   }
+
+   /* The RPC channel frees the result with g_free. */
+   result = g_strdup(stats);
+   free(stats);
+   return RPCIN_SETRETVALSF(data, result, TRUE);
+}
+
+
+/**
+ * Writes the HGFS server request statistics to the log along with the rest
+ * of the service state, which is requested in the guest by sending SIGUSR1
+ * to the service on POSIX systems.
+ *
+ * @param[in]  src      The source object.
+ * @param[in]  ctx      Unused.
+ * @param[in]  plugin   Plugin registration data.
+ */
+
+static void
+HgfsServerDumpState(gpointer src,
+                    ToolsAppCtx *ctx,
+                    ToolsPluginData *plugin)
+{
+   HgfsServerMgrData *mgrData = plugin->_private;
+   char *stats;
+   char *line;
+   char *next;
+
+   stats = HgfsServerManager_GetStats(mgrData);
+   if (stats == NULL) {
+      ToolsCore_LogState(TOOLS_STATE_LOG_PLUGIN, "No HGFS session.\n");
+      return;
+   }
+
+   for (line = stats; *line != '\0'; line = next) {
+      next = strchr(line, '\n');
+      if (next == NULL) {
+         next = line + strlen(line);
+      } else {
+         *next++ = '\0';
+      }
+      ToolsCore_LogState(TOOLS_STATE_LOG_PLUGIN, "%s\n", line);
+   }
+   free(stats);
+}
+
+
 /**
  * Sends the HGFS capability to the VMX.
  *
@@ -272,11 +355,13 @@ ToolsOnLoad(ToolsAppCtx *ctx)
 
    {
       RpcChannelCallback rpcs[] = {
-         { HGFS_SYNC_REQREP_CMD, HgfsServerRpcDispatch, mgrData, NULL, NULL, 0 }
+         { HGFS_SYNC_REQREP_CMD, HgfsServerRpcDispatch, mgrData, NULL, NULL, 0 },
+         { HGFS_STATS_CMD, HgfsServerStatsRpc, mgrData, NULL, NULL, 0 }
       };
       ToolsPluginSignalCb sigs[] = {
          { TOOLS_CORE_SIG_CAPABILITIES, HgfsServerCapReg, &regData },
-         { TOOLS_CORE_SIG_SHUTDOWN, HgfsServerShutdown, &regData }
+         { TOOLS_CORE_SIG_SHUTDOWN, HgfsServerShutdown, &regData },
+         { TOOLS_CORE_SIG_DUMP_STATE, HgfsServerDumpState, &regData }
       };
       ToolsAppReg regs[] = {
          { TOOLS_APP_GUESTRPC, VMTools_WrapArray(rpcs, sizeof *rpcs, ARRAYSIZE(rpcs)) },
@@ -0,0 +1,2619 @@
+/*********************************************************
+ * Copyright (C) 2016 VMware, Inc. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation version 2.1 and no later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the Lesser GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA.
+ *
+ *********************************************************/
+
+/*
+ * hgfsServerBench.c --
+ *
+ *   In-process load generator for the HGFS server.
+ *
+ *   The HGFS server library is driven through a loopback channel: each
+ *   worker thread connects its own transport session, creates an HGFS V4
+ *   session and sends real V3/V4 request packets against a file set created
+ *   in a local directory. Throughput and latency percentiles are reported
+ *   per operation, so server changes can be measured without a VM.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "vmware.h"
+#include "hgfs.h"
+#include "hgfsProto.h"
+#include "hgfsServer.h"
+#include "hgfsServerPolicy.h"
+
+
+typedef enum {
+   BENCH_OP_OPEN,
+   BENCH_OP_READ,
+   BENCH_OP_WRITE,
+   BENCH_OP_GETATTR,
+   BENCH_OP_SEARCH,
+   BENCH_OP_MAX
+} BenchOp;
+
+static const char *benchOpNames[BENCH_OP_MAX] = {
+   "open",
+   "read",
+   "write",
+   "getattr",
+   "search",
+};
+
+/* Latency samples of one operation, in nanoseconds. */
+typedef struct BenchLatency {
+   uint64 *samples;
+   size_t numSamples;
+   size_t maxSamples;
+   uint64 errors;
+} BenchLatency;
+
+typedef enum {
+   BENCH_CHANNEL_BACKDOOR,
+   BENCH_CHANNEL_VMCI,
+   BENCH_CHANNEL_SOCKET,
+   BENCH_CHANNEL_MAX
+} BenchChannel;
+
+static const char *benchChannelNames[BENCH_CHANNEL_MAX] = {
+   "backdoor",
+   "vmci",
+   "socket",
+};
+
+#define BENCH_MAX_DEPTH             32
+#define BENCH_VMCI_PACKET_SIZE      ROUNDUP(HGFS_LARGE_PACKET_MAX, PAGE_SIZE)
+#define BENCH_MAX_SERVER_REQUESTS   16
+#define BENCH_SERVER_ARGS_SIZE      512
+#define BENCH_CHECK_TIMEOUT_SEC     5
+#define BENCH_CHECK_IO_SIZE         4096
+#define BENCH_CHECK_IO_ROUNDS       64
+
+/* One request of a connection and its buffers. */
+typedef struct BenchSlot {
+   HgfsPacket *packet;
+   char *request;
+   char *reply;                 // Same as request for the VMCI channel
+   char *data;                  // VMCI channel fast read/write data
+   uint32 requestId;
+   size_t replyDataSize;
+   Bool done;
+} BenchSlot;
+
+/* A request the server sent on its own, its arguments truncated. */
+typedef struct BenchServerRequest {
+   HgfsOp op;
+   char args[BENCH_SERVER_ARGS_SIZE];
+} BenchServerRequest;
+
+/*
+ * Loopback channel connection, one transport session per worker.
+ *
+ * The backdoor channel is synchronous: the reply is written to a buffer
+ * passed along with the request before receive returns. The VMCI channel
+ * is asynchronous with shared memory: requests are lists of pages the
+ * server maps and replies into, read and write data travel in separate
+ * pages and requests may complete on server worker threads, in any order.
+ * Only the VMCI channel can carry requests from the server, such as
+ * change notifications; they are queued for BenchNextServerRequest.
+ * The socket channel is synchronous and passes no reply buffer, so the
+ * server replies in buffers of its own, copied out when sent.
+ */
+typedef struct BenchConn {
+   BenchChannel channel;
+   HgfsServerChannelCallbacks channelCbTable;
+   void *transportSession;
+   uint64 sessionId;
+   uint32 requestId;
+   uint32 maxPacketSize;
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   uint32 numSlots;
+   BenchSlot slots[BENCH_MAX_DEPTH];
+   BenchServerRequest serverRequests[BENCH_MAX_SERVER_REQUESTS];
+   uint32 serverRequestsHead;
+   uint32 serverRequestsTail;
+} BenchConn;
+
+/* Local opener of a file leased by the server, for the oplock check. */
+typedef struct BenchOplockOpener {
+   char path[PATH_MAX];
+   pthread_mutex_t lock;
+   Bool done;
+   Bool opened;
+} BenchOplockOpener;
+
+typedef struct BenchWorker {
+   pthread_t thread;
+   unsigned int seed;
+   BenchConn conn;
+   HgfsHandle *files;
+   char *ioBuf;
+   BenchLatency latency[BENCH_OP_MAX];
+} BenchWorker;
+
+typedef struct BenchConfig {
+   const char *dir;
+   uint32 numFiles;
+   uint64 fileSize;
+   uint32 ioSize;
+   uint32 numWorkers;
+   uint32 seconds;
+   uint32 cachedNodes;
+   BenchChannel channel;
+   uint32 depth;
+   Bool check;
+   uint32 weights[BENCH_OP_MAX];
+   uint32 totalWeight;
+   Bool keepFiles;
+} BenchConfig;
+
+static BenchConfig gConfig = {
+   NULL,                          // dir
+   64,                            // numFiles
+   1024 * 1024,                   // fileSize
+   64 * 1024,                     // ioSize
+   4,                             // numWorkers
+   10,                            // seconds
+   HGFS_MAX_CACHED_FILENODES,     // cachedNodes
+   BENCH_CHANNEL_BACKDOOR,        // channel
+   1,                             // depth
+   FALSE,                         // check
+   { 10, 40, 20, 20, 10 },        // weights
+   100,                           // totalWeight
+   FALSE,                         // keepFiles
+};
+
+static HgfsServerCallbacks *gServerCbTable;
+static HgfsServerMgrCallbacks gServerMgrData;
+static char gBenchDir[PATH_MAX];
+static char **gFileCpNames;
+static uint32 *gFileCpNameLens;
+static char *gDirCpName;
+static uint32 gDirCpNameLen;
+static volatile Bool gStop;
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchNow --
+ *
+ *    Monotonic time stamp.
+ *
+ * Results:
+ *    Current time in nanoseconds.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static uint64
+BenchNow(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchLatencyAdd --
+ *
+ *    Records the latency of one completed operation.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    The sample array may be grown.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+BenchLatencyAdd(BenchLatency *latency,   // IN/OUT: operation samples
+                uint64 ns)               // IN: latency in nanoseconds
+{
+   if (latency->numSamples == latency->maxSamples) {
+      latency->maxSamples = MAX(latency->maxSamples * 2, 4096);
+      latency->samples = realloc(latency->samples,
+                                 latency->maxSamples * sizeof *latency->samples);
+      if (NULL == latency->samples) {
+         fprintf(stderr, "Out of memory.\n");
+         exit(EXIT_FAILURE);
+      }
+   }
+   latency->samples[latency->numSamples++] = ns;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchMakeCpName --
+ *
+ *    Converts an absolute local path into the cross-platform name of the
+ *    guest policy root share: "root" followed by the NUL separated path
+ *    components.
+ *
+ * Results:
+ *    Allocated CP name, its length (without terminating NUL) in cpNameLen.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static char *
+BenchMakeCpName(const char *path,    // IN: absolute local path
+                uint32 *cpNameLen)   // OUT: CP name length
+{
+   size_t shareLen = strlen(HGFS_SERVER_POLICY_ROOT_SHARE_NAME);
+   char *cpName = malloc(shareLen + strlen(path) + 2);
+   char *out;
+
+   if (NULL == cpName) {
+      fprintf(stderr, "Out of memory.\n");
+      exit(EXIT_FAILURE);
+   }
+   memcpy(cpName, HGFS_SERVER_POLICY_ROOT_SHARE_NAME, shareLen);
+   out = cpName + shareLen;
+   for (; *path != '\0'; path++) {
+      if (*path == '/') {
+         if (out[-1] != '\0') {
+            *out++ = '\0';
+         }
+      } else {
+         *out++ = *path;
+      }
+   }
+   if (out[-1] == '\0') {
+      out--;
+   }
+   *out = '\0';
+   *cpNameLen = (uint32)(out - cpName);
+   return cpName;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchPackFileName --
+ *
+ *    Packs a CP name into a V3 file name.
+ *
+ * Results:
+ *    Size of the packed file name, including the name.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static size_t
+BenchPackFileName(HgfsFileNameV3 *fileName,   // OUT: packed name
+                  const char *cpName,         // IN: CP name
+                  uint32 cpNameLen)           // IN: CP name length
+{
+   fileName->length = cpNameLen;
+   fileName->flags = 0;
+   fileName->caseType = HGFS_FILE_NAME_DEFAULT_CASE;
+   fileName->fid = HGFS_INVALID_HANDLE;
+   memcpy(fileName->name, cpName, cpNameLen);
+   fileName->name[cpNameLen] = '\0';
+   return sizeof *fileName + cpNameLen;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchMapVa --
+ *
+ *    VMCI channel mapping callback: the "physical" addresses of the
+ *    loopback channel are our own virtual addresses.
+ *
+ * Results:
+ *    The mapped address, the mapping context in context.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void *
+BenchMapVa(uint64 pa,        // IN: address
+           uint32 size,      // IN: size to map
+           void **context)   // OUT: mapping context
+{
+   *context = (void *)(uintptr_t)pa;
+   return (void *)(uintptr_t)pa;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchUnmapVa --
+ *
+ *    VMCI channel unmapping callback.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+BenchUnmapVa(void **context)   // IN/OUT: mapping context
+{
+   *context = NULL;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchPageIovs --
+ *
+ *    Describes a page aligned buffer as a list of one iov per page, as the
+ *    VMCI transport passes buffers to the server.
+ *
+ * Results:
+ *    Number of iovs.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static uint32
+BenchPageIovs(HgfsVmxIov *iov,   // OUT: iovs
+              char *buf,         // IN: page aligned buffer
+              size_t size)       // IN: buffer size
+{
+   uint32 count;
+
+   for (count = 0; size > 0; count++) {
+      iov[count].va = NULL;
+      iov[count].pa = (uint64)(uintptr_t)buf;
+      iov[count].len = (uint32)MIN(size, PAGE_SIZE);
+      iov[count].context = NULL;
+      buf += iov[count].len;
+      size -= iov[count].len;
+   }
+   return count;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchAllocPages --
+ *
+ *    Allocates a page aligned buffer.
+ *
+ * Results:
+ *    The buffer or NULL.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static char *
+BenchAllocPages(size_t size)   // IN: buffer size
+{
+   void *buf;
+
+   if (0 != posix_memalign(&buf, PAGE_SIZE, ROUNDUP(size, PAGE_SIZE))) {
+      return NULL;
+   }
+   return buf;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchSlotInit --
+ *
+ *    Allocates the buffers of a request slot for the connection channel.
+ *
+ * Results:
+ *    TRUE on success, FALSE otherwise.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+BenchSlotInit(BenchConn *conn,   // IN: connection
+              BenchSlot *slot)   // OUT: request slot
+{
+   uint32 numIovs = 1;
+
+   if (BENCH_CHANNEL_VMCI == conn->channel) {
+      numIovs = BENCH_VMCI_PACKET_SIZE / PAGE_SIZE +
+                CEILING(gConfig.ioSize, PAGE_SIZE);
+      slot->request = BenchAllocPages(BENCH_VMCI_PACKET_SIZE);
+      slot->reply = slot->request;
+      slot->data = BenchAllocPages(gConfig.ioSize);
+      if (NULL == slot->data) {
+         return FALSE;
+      }
+   } else {
+      slot->request = malloc(HGFS_HUGE_PACKET_MAX);
+      slot->reply = malloc(HGFS_HUGE_PACKET_MAX);
+   }
+   slot->packet = calloc(1, offsetof(HgfsPacket, iov) +
+                            numIovs * sizeof slot->packet->iov[0]);
+   return NULL != slot->request && NULL != slot->reply &&
+          NULL != slot->packet;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchSlotExit --
+ *
+ *    Frees the buffers of a request slot.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+BenchSlotExit(BenchSlot *slot)   // IN: request slot
+{
+   if (slot->reply != slot->request) {
+      free(slot->reply);
+   }
+   free(slot->request);
+   free(slot->data);
+   free(slot->packet);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchChannelSend --
+ *
+ *    Loopback channel send callback. Completing the packet releases the
+ *    server buffers, which for the VMCI channel copies the reply into the
+ *    request pages; then the waiter of the request is woken up. The socket
+ *    channel copies the reply out of the server buffer first.
+ *
+ *    Requests the server initiates itself are queued for
+ *    BenchNextServerRequest, dropping them if the queue is full.
+ *
+ * Results:
+ *    TRUE always.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+BenchChannelSend(void *data,              // IN: our connection
+                 HgfsPacket *packet,      // IN/OUT: Hgfs packet
+                 HgfsSendFlags flags)     // IN: send flags
+{
+   BenchConn *conn = data;
+   BenchSlot *slot = NULL;
+   size_t replyDataSize = packet->replyPacketDataSize;
+   uint32 i;
+
+   if (0 == (packet->state & HGFS_STATE_CLIENT_REQUEST)) {
+      const HgfsHeader *header = packet->metaPacket;
+
+      pthread_mutex_lock(&conn->lock);
+      if (conn->serverRequestsTail - conn->serverRequestsHead <
+          BENCH_MAX_SERVER_REQUESTS &&
+          packet->metaPacketDataSize >= sizeof *header) {
+         BenchServerRequest *request =
+            &conn->serverRequests[conn->serverRequestsTail++ %
+                                  BENCH_MAX_SERVER_REQUESTS];
+
+         request->op = header->op;
+         memset(request->args, 0, sizeof request->args);
+         memcpy(request->args, (const char *)header + header->headerSize,
+                MIN(sizeof request->args,
+                    packet->metaPacketDataSize - header->headerSize));
+         pthread_cond_broadcast(&conn->cond);
+      }
+      pthread_mutex_unlock(&conn->lock);
+      gServerCbTable->session.sendComplete(packet, conn->transportSession);
+      return TRUE;
+   }
+
+   for (i = 0; i < conn->numSlots; i++) {
+      if (conn->slots[i].packet == packet) {
+         slot = &conn->slots[i];
+         break;
+      }
+   }
+   ASSERT(NULL != slot);
+
+   if (BENCH_CHANNEL_SOCKET == conn->channel) {
+      memcpy(slot->reply, packet->replyPacket,
+             MIN(replyDataSize, HGFS_HUGE_PACKET_MAX));
+   }
+
+   if (0 == (flags & HGFS_SEND_NO_COMPLETE)) {
+      gServerCbTable->session.sendComplete(packet, conn->transportSession);
+   }
+
+   pthread_mutex_lock(&conn->lock);
+   slot->replyDataSize = replyDataSize;
+   slot->done = TRUE;
+   pthread_cond_broadcast(&conn->cond);
+   pthread_mutex_unlock(&conn->lock);
+   return TRUE;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchSlotArgs --
+ *
+ *    Location of the operation arguments in a request slot.
+ *
+ * Results:
+ *    Pointer to the arguments following the V4 header.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void *
+BenchSlotArgs(BenchConn *conn,   // IN: connection
+              uint32 index)      // IN: request slot
+{
+   return conn->slots[index].request + sizeof(HgfsHeader);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchRequestArgs --
+ *
+ *    Location of the operation arguments of the request sent by
+ *    BenchTransact.
+ *
+ * Results:
+ *    Pointer to the arguments following the V4 header.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void *
+BenchRequestArgs(BenchConn *conn)   // IN: connection
+{
+   return BenchSlotArgs(conn, 0);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchSubmit --
+ *
+ *    Sends the request prepared in a request slot to the server. With the
+ *    VMCI channel dataSize bytes of the slot data pages are passed along
+ *    for a fast read or write.
+ *
+ *    The server processes requests of a channel without HGFS_CHANNEL_ASYNC
+ *    synchronously, otherwise read, write and search requests are queued
+ *    to its worker threads and BenchWait has to be used for the reply.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+BenchSubmit(BenchConn *conn,     // IN: connection
+            uint32 index,        // IN: request slot
+            HgfsOp op,           // IN: operation
+            size_t argsSize,     // IN: size of the arguments
+            size_t dataSize)     // IN: size of the data pages
+{
+   BenchSlot *slot = &conn->slots[index];
+   HgfsPacket *packet = slot->packet;
+   HgfsHeader *header = (HgfsHeader *)slot->request;
+   size_t packetSize = sizeof *header + argsSize;
+
+   memset(header, 0, sizeof *header);
+   header->version = HGFS_HEADER_VERSION;
+   header->dummy = HGFS_OP_NEW_HEADER;
+   header->packetSize = (uint32)packetSize;
+   header->headerSize = sizeof *header;
+   header->requestId = conn->requestId++;
+   header->op = op;
+   header->flags = HGFS_PACKET_FLAG_REQUEST;
+   header->sessionId = conn->sessionId;
+
+   memset(packet, 0, offsetof(HgfsPacket, iov));
+   if (BENCH_CHANNEL_VMCI == conn->channel) {
+      packet->iovCount = BenchPageIovs(packet->iov, slot->request,
+                                       BENCH_VMCI_PACKET_SIZE);
+      packet->metaPacketDataSize = packetSize;
+      packet->metaPacketSize = HGFS_LARGE_PACKET_MAX;
+      if (0 != dataSize) {
+         packet->dataPacketIovIndex = packet->iovCount;
+         packet->dataPacketSize = dataSize;
+         packet->iovCount += BenchPageIovs(&packet->iov[packet->iovCount],
+                                           slot->data, dataSize);
+      }
+   } else {
+      packet->iov[0].va = slot->request;
+      packet->iov[0].len = packetSize;
+      packet->iovCount = 1;
+      packet->metaPacket = slot->request;
+      packet->metaPacketDataSize = packetSize;
+      packet->metaPacketSize = packetSize;
+      if (BENCH_CHANNEL_BACKDOOR == conn->channel) {
+         packet->replyPacket = slot->reply;
+         packet->replyPacketSize = HGFS_HUGE_PACKET_MAX;
+      }
+   }
+   packet->state |= HGFS_STATE_CLIENT_REQUEST;
+
+   slot->requestId = header->requestId;
+   slot->replyDataSize = 0;
+   slot->done = FALSE;
+   gServerCbTable->session.receive(packet, conn->transportSession);
+
+   if (BENCH_CHANNEL_VMCI != conn->channel) {
+      /* A request the server dropped will not be answered later either. */
+      slot->done = TRUE;
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchWait --
+ *
+ *    Waits for the reply to the request of a request slot.
+ *
+ * Results:
+ *    HGFS status of the reply and its arguments in replyArgs.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static HgfsStatus
+BenchWait(BenchConn *conn,            // IN: connection
+          uint32 index,               // IN: request slot
+          const void **replyArgs)     // OUT: reply arguments
+{
+   BenchSlot *slot = &conn->slots[index];
+   const HgfsHeader *replyHeader = (const HgfsHeader *)slot->reply;
+
+   pthread_mutex_lock(&conn->lock);
+   while (!slot->done) {
+      pthread_cond_wait(&conn->cond, &conn->lock);
+   }
+   pthread_mutex_unlock(&conn->lock);
+
+   if (slot->replyDataSize < sizeof *replyHeader ||
+       replyHeader->requestId != slot->requestId) {
+      return HGFS_STATUS_PROTOCOL_ERROR;
+   }
+   *replyArgs = slot->reply + replyHeader->headerSize;
+   return replyHeader->status;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchTransact --
+ *
+ *    Sends the request prepared by the caller at BenchRequestArgs to the
+ *    server and waits for the reply.
+ *
+ * Results:
+ *    HGFS status of the reply and its arguments in replyArgs.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static HgfsStatus
+BenchTransact(BenchConn *conn,            // IN: connection
+              HgfsOp op,                  // IN: operation
+              size_t argsSize,            // IN: size of the arguments
+              const void **replyArgs)     // OUT: reply arguments
+{
+   BenchSubmit(conn, 0, op, argsSize, 0);
+   return BenchWait(conn, 0, replyArgs);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchNextServerRequest --
+ *
+ *    Takes the oldest request the server sent on its own, waiting for one
+ *    for a few seconds.
+ *
+ * Results:
+ *    TRUE and the request in request, FALSE on timeout.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+BenchNextServerRequest(BenchConn *conn,                // IN: connection
+                       BenchServerRequest *request)    // OUT: request
+{
+   struct timespec deadline;
+   Bool result = FALSE;
+
+   clock_gettime(CLOCK_REALTIME, &deadline);
+   deadline.tv_sec += BENCH_CHECK_TIMEOUT_SEC;
+
+   pthread_mutex_lock(&conn->lock);
+   while (conn->serverRequestsHead == conn->serverRequestsTail) {
+      if (ETIMEDOUT == pthread_cond_timedwait(&conn->cond, &conn->lock,
+                                              &deadline)) {
+         break;
+      }
+   }
+   if (conn->serverRequestsHead != conn->serverRequestsTail) {
+      *request = conn->serverRequests[conn->serverRequestsHead++ %
+                                      BENCH_MAX_SERVER_REQUESTS];
+      result = TRUE;
+   }
+   pthread_mutex_unlock(&conn->lock);
+   return result;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchConnect --
+ *
+ *    Connects a loopback transport session over a channel and creates an
+ *    HGFS session negotiating the largest packet size.
+ *
+ * Results:
+ *    TRUE on success, FALSE otherwise.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+BenchConnect(BenchConn *conn,        // OUT: connection
+             BenchChannel channel)   // IN: channel
+{
+   static HgfsServerChannelData channelData[BENCH_CHANNEL_MAX] = {
+      { 0, HGFS_HUGE_PACKET_MAX },
+      { HGFS_CHANNEL_SHARED_MEM | HGFS_CHANNEL_ASYNC, HGFS_LARGE_PACKET_MAX },
+      { 0, HGFS_HUGE_PACKET_MAX },
+   };
+   HgfsRequestCreateSessionV4 *request;
+   const HgfsReplyCreateSessionV4 *reply;
+   HgfsStatus status;
+
+   memset(conn, 0, sizeof *conn);
+   pthread_mutex_init(&conn->lock, NULL);
+   pthread_cond_init(&conn->cond, NULL);
+   conn->channel = channel;
+   conn->maxPacketSize = channelData[channel].maxPacketSize;
+   for (conn->numSlots = 0; conn->numSlots < gConfig.depth; conn->numSlots++) {
+      if (!BenchSlotInit(conn, &conn->slots[conn->numSlots])) {
+         fprintf(stderr, "Out of memory.\n");
+         conn->numSlots++;
+         return FALSE;
+      }
+   }
+
+   conn->channelCbTable.send = BenchChannelSend;
+   if (BENCH_CHANNEL_VMCI == channel) {
+      conn->channelCbTable.getReadVa = BenchMapVa;
+      conn->channelCbTable.getWriteVa = BenchMapVa;
+      conn->channelCbTable.putVa = BenchUnmapVa;
+   }
+   if (!gServerCbTable->session.connect(conn, &conn->channelCbTable,
+                                        &channelData[channel],
+                                        &conn->transportSession)) {
+      fprintf(stderr, "Failed to connect a transport session.\n");
+      return FALSE;
+   }
+
+   conn->sessionId = HGFS_INVALID_SESSION_ID;
+   request = BenchRequestArgs(conn);
+   memset(request, 0, sizeof *request);
+   request->numCapabilities = 0;
+   request->maxPacketSize = conn->maxPacketSize;
+   request->flags = HGFS_SESSION_OPLOCK_ENABLED;
+   status = BenchTransact(conn, HGFS_OP_CREATE_SESSION_V4, sizeof *request,
+                          (const void **)&reply);
+   if (HGFS_STATUS_SUCCESS != status) {
+      fprintf(stderr, "Failed to create a session: %u.\n", status);
+      return FALSE;
+   }
+   conn->sessionId = reply->sessionId;
+   conn->maxPacketSize = MIN(conn->maxPacketSize, reply->maxPacketSize);
+   return TRUE;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchDisconnect --
+ *
+ *    Destroys the HGFS session and closes the transport session.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+BenchDisconnect(BenchConn *conn)   // IN: connection
+{
+   HgfsRequestDestroySessionV4 *request;
+   const void *reply;
+   uint32 i;
+
+   if (NULL != conn->transportSession) {
+      request = BenchRequestArgs(conn);
+      memset(request, 0, sizeof *request);
+      BenchTransact(conn, HGFS_OP_DESTROY_SESSION_V4, sizeof *request, &reply);
+      gServerCbTable->session.disconnect(conn->transportSession);
+      gServerCbTable->session.close(conn->transportSession);
+   }
+   for (i = 0; i < conn->numSlots; i++) {
+      BenchSlotExit(&conn->slots[i]);
+   }
+   pthread_cond_destroy(&conn->cond);
+   pthread_mutex_destroy(&conn->lock);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchOpen --
+ *
+ *    Opens a file of the file set.
+ *
+ * Results:
+ *    HGFS status, the handle in file.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static HgfsStatus
+BenchOpen(BenchConn *conn,         // IN: connection
+          uint32 index,            // IN: file index
+          HgfsOpenMode mode,       // IN: access mode
+          HgfsHandle *file)        // OUT: handle
+{
+   HgfsRequestOpenV3 *request = BenchRequestArgs(conn);
+   const HgfsReplyOpenV3 *reply;
+   HgfsStatus status;
+   size_t size;
+
+   memset(request, 0, sizeof *request);
+   request->mask = HGFS_OPEN_VALID_MODE | HGFS_OPEN_VALID_FLAGS |
+                   HGFS_OPEN_VALID_FILE_NAME;
+   request->mode = mode;
+   request->flags = HGFS_OPEN;
+   size = offsetof(HgfsRequestOpenV3, fileName) +
+          BenchPackFileName(&request->fileName, gFileCpNames[index],
+                            gFileCpNameLens[index]);
+   status = BenchTransact(conn, HGFS_OP_OPEN_V3, size, (const void **)&reply);
+   if (HGFS_STATUS_SUCCESS == status) {
+      *file = reply->file;
+   }
+   return status;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchClose --
+ *
+ *    Closes a file handle.
+ *
+ * Results:
+ *    HGFS status.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static HgfsStatus
+BenchClose(BenchConn *conn,    // IN: connection
+           HgfsHandle file)    // IN: handle
+{
+   HgfsRequestCloseV3 *request = BenchRequestArgs(conn);
+   const void *reply;
+
+   memset(request, 0, sizeof *request);
+   request->file = file;
+   return BenchTransact(conn, HGFS_OP_CLOSE_V3, sizeof *request, &reply);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchIo --
+ *
+ *    Reads or writes the configured number of consecutive blocks of a file,
+ *    all requests in flight at once. The VMCI channel moves the data with
+ *    the fast V4 operations in the slot data pages.
+ *
+ * Results:
+ *    HGFS status, the first error if any request failed.
+ *
+ * Side effects:
+ *    The file is read or written.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static HgfsStatus
+BenchIo(BenchWorker *worker,   // IN: worker
+        BenchOp op,            // IN: BENCH_OP_READ or BENCH_OP_WRITE
+        uint32 index,          // IN: file index
+        uint64 block)          // IN: first block
+{
+   BenchConn *conn = &worker->conn;
+   Bool vmci = BENCH_CHANNEL_VMCI == conn->channel;
+   size_t dataSize = vmci ? gConfig.ioSize : 0;
+   uint64 numBlocks = MAX(gConfig.fileSize / gConfig.ioSize, 1);
+   HgfsStatus status = HGFS_STATUS_SUCCESS;
+   uint32 i;
+
+   for (i = 0; i < conn->numSlots; i++) {
+      uint64 offset = ((block + i) % numBlocks) * gConfig.ioSize;
+
+      if (BENCH_OP_READ == op) {
+         HgfsRequestReadV3 *request = BenchSlotArgs(conn, i);
+
+         memset(request, 0, sizeof *request);
+         request->file = worker->files[index];
+         request->offset = offset;
+         request->requiredSize = gConfig.ioSize;
+         BenchSubmit(conn, i, vmci ? HGFS_OP_READ_FAST_V4 : HGFS_OP_READ_V3,
+                     sizeof *request, dataSize);
+      } else {
+         HgfsRequestWriteV3 *request = BenchSlotArgs(conn, i);
+         size_t size = offsetof(HgfsRequestWriteV3, payload);
+
+         memset(request, 0, sizeof *request);
+         request->file = worker->files[index];
+         request->offset = offset;
+         request->requiredSize = gConfig.ioSize;
+         if (vmci) {
+            memcpy(conn->slots[i].data, worker->ioBuf, gConfig.ioSize);
+         } else {
+            memcpy(request->payload, worker->ioBuf, gConfig.ioSize);
+            size += gConfig.ioSize;
+         }
+         BenchSubmit(conn, i, vmci ? HGFS_OP_WRITE_FAST_V4 : HGFS_OP_WRITE_V3,
+                     size, dataSize);
+      }
+   }
+
+   for (i = 0; i < conn->numSlots; i++) {
+      const void *reply;
+      HgfsStatus slotStatus = BenchWait(conn, i, &reply);
+
+      if (HGFS_STATUS_SUCCESS == status) {
+         status = slotStatus;
+      }
+   }
+   return status;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchOneOp --
+ *
+ *    Performs one operation of the given type on a random file.
+ *
+ *    BENCH_OP_OPEN opens and closes a file, BENCH_OP_SEARCH lists the
+ *    whole file set directory, BENCH_OP_READ and BENCH_OP_WRITE transfer
+ *    as many blocks as requests may be in flight; each counts as one
+ *    operation.
+ *
+ * Results:
+ *    HGFS status.
+ *
+ * Side effects:
+ *    Files of the file set are read or written.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static HgfsStatus
+BenchOneOp(BenchWorker *worker,   // IN: worker
+           BenchOp op)            // IN: operation
+{
+   BenchConn *conn = &worker->conn;
+   uint32 index = rand_r(&worker->seed) % gConfig.numFiles;
+   uint64 numBlocks = MAX(gConfig.fileSize / gConfig.ioSize, 1);
+   uint64 offset = (rand_r(&worker->seed) % numBlocks) * gConfig.ioSize;
+   HgfsStatus status;
+
+   switch (op) {
+   case BENCH_OP_OPEN: {
+      HgfsHandle file;
+
+      status = BenchOpen(conn, index, HGFS_OPEN_MODE_READ_ONLY, &file);
+      if (HGFS_STATUS_SUCCESS == status) {
+         status = BenchClose(conn, file);
+      }
+      break;
+   }
+
+   case BENCH_OP_READ:
+   case BENCH_OP_WRITE:
+      status = BenchIo(worker, op, index, offset / gConfig.ioSize);
+      break;
+
+   case BENCH_OP_GETATTR: {
+      HgfsRequestGetattrV3 *request = BenchRequestArgs(conn);
+      const HgfsReplyGetattrV3 *reply;
+      size_t size;
+
+      memset(request, 0, sizeof *request);
+      size = offsetof(HgfsRequestGetattrV3, fileName) +
+             BenchPackFileName(&request->fileName, gFileCpNames[index],
+                               gFileCpNameLens[index]);
+      status = BenchTransact(conn, HGFS_OP_GETATTR_V3, size,
+                             (const void **)&reply);
+      break;
+   }
+
+   case BENCH_OP_SEARCH: {
+      HgfsRequestSearchOpenV3 *openRequest = BenchRequestArgs(conn);
+      const HgfsReplySearchOpenV3 *openReply;
+      HgfsHandle search;
+      uint32 restartIndex = 0;
+      size_t size;
+
+      memset(openRequest, 0, sizeof *openRequest);
+      size = offsetof(HgfsRequestSearchOpenV3, dirName) +
+             BenchPackFileName(&openRequest->dirName, gDirCpName, gDirCpNameLen);
+      status = BenchTransact(conn, HGFS_OP_SEARCH_OPEN_V3, size,
+                             (const void **)&openReply);
+      if (HGFS_STATUS_SUCCESS != status) {
+         break;
+      }
+      search = openReply->search;
+
+      for (;;) {
+         HgfsRequestSearchReadV4 *request = BenchRequestArgs(conn);
+         const HgfsReplySearchReadV4 *reply;
+
+         memset(request, 0, sizeof *request);
+         request->mask = HGFS_SEARCH_READ_NAME | HGFS_SEARCH_READ_FILE_SIZE |
+                         HGFS_SEARCH_READ_TIME_STAMP |
+                         HGFS_SEARCH_READ_FILE_ATTRIBUTES |
+                         HGFS_SEARCH_READ_FILE_NODE_TYPE |
+                         HGFS_SEARCH_READ_FILE_ID;
+         request->fid = search;
+         request->restartIndex = restartIndex;
+         request->replyDirEntryMaxSize = conn->maxPacketSize -
+                                         sizeof(HgfsHeader) -
+                                         offsetof(HgfsReplySearchReadV4, entries);
+         status = BenchTransact(conn, HGFS_OP_SEARCH_READ_V4, sizeof *request,
+                                (const void **)&reply);
+         if (HGFS_STATUS_SUCCESS != status ||
+             0 == reply->numberEntriesReturned ||
+             0 != (reply->flags & HGFS_SEARCH_READ_REPLY_FINAL_ENTRY)) {
+            break;
+         }
+         restartIndex += reply->numberEntriesReturned;
+      }
+
+      {
+         HgfsRequestSearchCloseV3 *closeRequest = BenchRequestArgs(conn);
+         const void *closeReply;
+         HgfsStatus closeStatus;
+
+         memset(closeRequest, 0, sizeof *closeRequest);
+         closeRequest->search = search;
+         closeStatus = BenchTransact(conn, HGFS_OP_SEARCH_CLOSE_V3,
+                                     sizeof *closeRequest, &closeReply);
+         if (HGFS_STATUS_SUCCESS == status) {
+            status = closeStatus;
+         }
+      }
+      break;
+   }
+
+   default:
+      NOT_REACHED();
+   }
+
+   return status;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchPickOp --
+ *
+ *    Picks a random operation according to the configured mix.
+ *
+ * Results:
+ *    The operation.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static BenchOp
+BenchPickOp(BenchWorker *worker)   // IN: worker
+{
+   uint32 pick = rand_r(&worker->seed) % gConfig.totalWeight;
+   BenchOp op;
+
+   for (op = 0; op < BENCH_OP_MAX - 1; op++) {
+      if (pick < gConfig.weights[op]) {
+         break;
+      }
+      pick -= gConfig.weights[op];
+   }
+   return op;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchWorkerRun --
+ *
+ *    Worker thread: issues operations on its own session until stopped.
+ *
+ * Results:
+ *    NULL.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void *
+BenchWorkerRun(void *data)   // IN: worker
+{
+   BenchWorker *worker = data;
+
+   while (!gStop) {
+      BenchOp op = BenchPickOp(worker);
+      uint64 start = BenchNow();
+      HgfsStatus status = BenchOneOp(worker, op);
+
+      if (HGFS_STATUS_SUCCESS == status) {
+         BenchLatencyAdd(&worker->latency[op], BenchNow() - start);
+      } else {
+         worker->latency[op].errors++;
+      }
+   }
+   return NULL;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchWorkerInit --
+ *
+ *    Connects the worker session and opens its handles to the file set.
+ *
+ * Results:
+ *    TRUE on success, FALSE otherwise.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+BenchWorkerInit(BenchWorker *worker,   // OUT: worker
+                uint32 index)          // IN: worker index
+{
+   uint32 i;
+
+   memset(worker, 0, sizeof *worker);
+   worker->seed = (unsigned int)(BenchNow() ^ (index * 2654435761U));
+   worker->files = calloc(gConfig.numFiles, sizeof *worker->files);
+   worker->ioBuf = malloc(gConfig.ioSize);
+   if (NULL == worker->files || NULL == worker->ioBuf) {
+      fprintf(stderr, "Out of memory.\n");
+      return FALSE;
+   }
+   memset(worker->ioBuf, 'a' + index % 26, gConfig.ioSize);
+
+   if (!BenchConnect(&worker->conn, gConfig.channel)) {
+      return FALSE;
+   }
+   for (i = 0; i < gConfig.numFiles; i++) {
+      HgfsStatus status = BenchOpen(&worker->conn, i, HGFS_OPEN_MODE_READ_WRITE,
+                                    &worker->files[i]);
+
+      if (HGFS_STATUS_SUCCESS != status) {
+         fprintf(stderr, "Failed to open file %u: %u.\n", i, status);
+         return FALSE;
+      }
+   }
+   return TRUE;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchWorkerExit --
+ *
+ *    Closes the worker handles and session.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+BenchWorkerExit(BenchWorker *worker)   // IN: worker
+{
+   uint32 i;
+   BenchOp op;
+
+   if (NULL != worker->conn.transportSession) {
+      for (i = 0; i < gConfig.numFiles; i++) {
+         if (0 != worker->files[i]) {
+            BenchClose(&worker->conn, worker->files[i]);
+         }
+      }
+   }
+   BenchDisconnect(&worker->conn);
+   for (op = 0; op < BENCH_OP_MAX; op++) {
+      free(worker->latency[op].samples);
+   }
+   free(worker->files);
+   free(worker->ioBuf);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchCompareU64 --
+ *
+ *    qsort comparison of latency samples.
+ *
+ * Results:
+ *    <0, 0 or >0.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+BenchCompareU64(const void *a,   // IN
+                const void *b)   // IN
+{
+   uint64 x = *(const uint64 *)a;
+   uint64 y = *(const uint64 *)b;
+
+   return x < y ? -1 : x > y;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchReport --
+ *
+ *    Merges the worker samples and prints throughput and latency
+ *    percentiles per operation.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+BenchReport(BenchWorker *workers,   // IN: workers
+            uint64 elapsedNs)       // IN: run time
+{
+   double seconds = elapsedNs / 1e9;
+   uint64 totalOps = 0;
+   BenchOp op;
+
+   printf("%-8s %10s %10s %8s %10s %10s %10s %10s %10s\n",
+          "op", "count", "ops/s", "errors",
+          "avg(us)", "p50(us)", "p90(us)", "p99(us)", "max(us)");
+
+   for (op = 0; op < BENCH_OP_MAX; op++) {
+      BenchLatency all = { NULL, 0, 0, 0 };
+      uint64 sum = 0;
+      size_t n;
+      uint32 i;
+
+      for (i = 0; i < gConfig.numWorkers; i++) {
+         BenchLatency *latency = &workers[i].latency[op];
+
+         for (n = 0; n < latency->numSamples; n++) {
+            BenchLatencyAdd(&all, latency->samples[n]);
+            sum += latency->samples[n];
+         }
+         all.errors += latency->errors;
+      }
+      if (0 == all.numSamples && 0 == all.errors) {
+         continue;
+      }
+
+      totalOps += all.numSamples;
+      qsort(all.samples, all.numSamples, sizeof *all.samples, BenchCompareU64);
+#define BENCH_PCT_US(p) \
+   (all.numSamples == 0 ? 0.0 : \
+    all.samples[MIN((size_t)(all.numSamples * (p) / 100), all.numSamples - 1)] / 1e3)
+      printf("%-8s %10"FMTSZ"u %10.0f %8"FMT64"u %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+             benchOpNames[op], all.numSamples, all.numSamples / seconds,
+             all.errors,
+             all.numSamples == 0 ? 0.0 : sum / 1e3 / all.numSamples,
+             BENCH_PCT_US(50), BENCH_PCT_US(90), BENCH_PCT_US(99),
+             BENCH_PCT_US(100));
+#undef BENCH_PCT_US
+      free(all.samples);
+   }
+   printf("%-8s %10"FMT64"u %10.0f\n", "total", totalOps, totalOps / seconds);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchCreateFileSet --
+ *
+ *    Creates the benchmark directory and its files under the configured
+ *    directory, and computes their CP names.
+ *
+ * Results:
+ *    TRUE on success, FALSE otherwise.
+ *
+ * Side effects:
+ *    Files are created.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+BenchCreateFileSet(void)
+{
+   char resolved[PATH_MAX];
+   char path[PATH_MAX];
+   char *buf;
+   uint32 i;
+
+   if (NULL == realpath(gConfig.dir, resolved)) {
+      fprintf(stderr, "%s: %s\n", gConfig.dir, strerror(errno));
+      return FALSE;
+   }
+   snprintf(gBenchDir, sizeof gBenchDir, "%s/hgfsServerBench.%d",
+            resolved, (int)getpid());
+   if (mkdir(gBenchDir, 0755) < 0) {
+      fprintf(stderr, "%s: %s\n", gBenchDir, strerror(errno));
+      return FALSE;
+   }
+   gDirCpName = BenchMakeCpName(gBenchDir, &gDirCpNameLen);
+
+   gFileCpNames = calloc(gConfig.numFiles, sizeof *gFileCpNames);
+   gFileCpNameLens = calloc(gConfig.numFiles, sizeof *gFileCpNameLens);
+   buf = malloc(gConfig.ioSize);
+   if (NULL == gFileCpNames || NULL == gFileCpNameLens || NULL == buf) {
+      fprintf(stderr, "Out of memory.\n");
+      free(buf);
+      return FALSE;
+   }
+   memset(buf, 'x', gConfig.ioSize);
+
+   for (i = 0; i < gConfig.numFiles; i++) {
+      uint64 written;
+      int fd;
+
+      snprintf(path, sizeof path, "%s/file%u", gBenchDir, i);
+      fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+      if (fd < 0) {
+         fprintf(stderr, "%s: %s\n", path, strerror(errno));
+         free(buf);
+         return FALSE;
+      }
+      for (written = 0; written < gConfig.fileSize; ) {
+         size_t chunk = (size_t)MIN(gConfig.ioSize, gConfig.fileSize - written);
+         ssize_t ret = write(fd, buf, chunk);
+
+         if (ret <= 0) {
+            fprintf(stderr, "%s: %s\n", path, strerror(errno));
+            close(fd);
+            free(buf);
+            return FALSE;
+         }
+         written += ret;
+      }
+      close(fd);
+      gFileCpNames[i] = BenchMakeCpName(path, &gFileCpNameLens[i]);
+   }
+
+   free(buf);
+   return TRUE;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchDestroyFileSet --
+ *
+ *    Removes the files created by BenchCreateFileSet unless asked to keep
+ *    them.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Files are deleted.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+BenchDestroyFileSet(void)
+{
+   char path[PATH_MAX];
+   uint32 i;
+
+   for (i = 0; i < gConfig.numFiles && NULL != gFileCpNames; i++) {
+      if (!gConfig.keepFiles && NULL != gFileCpNames[i]) {
+         snprintf(path, sizeof path, "%s/file%u", gBenchDir, i);
+         unlink(path);
+      }
+      free(gFileCpNames[i]);
+   }
+   if (!gConfig.keepFiles && '\0' != gBenchDir[0]) {
+      rmdir(gBenchDir);
+   }
+   free(gFileCpNames);
+   free(gFileCpNameLens);
+   free(gDirCpName);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchCheckPath --
+ *
+ *    Builds the local path of a name in the benchmark directory.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+BenchCheckPath(char *path,          // OUT: local path
+               const char *name)    // IN: name in the benchmark directory
+{
+   snprintf(path, PATH_MAX, "%s/%s", gBenchDir, name);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchSetWatch --
+ *
+ *    Sets a change notification watch on a local directory.
+ *
+ * Results:
+ *    HGFS status, the watch in watchId.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static HgfsStatus
+BenchSetWatch(BenchConn *conn,                  // IN: connection
+              const char *path,                 // IN: local directory
+              uint32 events,                    // IN: HGFS_NOTIFY_ events
+              uint32 flags,                     // IN: HGFS_NOTIFY_FLAG_ flags
+              HgfsSubscriberHandle *watchId)    // OUT: watch
+{
+   HgfsRequestSetWatchV4 *request = BenchRequestArgs(conn);
+   const HgfsReplySetWatchV4 *reply;
+   HgfsStatus status;
+   uint32 cpNameLen;
+   char *cpName = BenchMakeCpName(path, &cpNameLen);
+   size_t size;
+
+   memset(request, 0, sizeof *request);
+   request->events = events;
+   request->flags = flags;
+   size = offsetof(HgfsRequestSetWatchV4, fileName) +
+          BenchPackFileName(&request->fileName, cpName, cpNameLen);
+   free(cpName);
+   status = BenchTransact(conn, HGFS_OP_SET_WATCH_V4, size,
+                          (const void **)&reply);
+   if (HGFS_STATUS_SUCCESS == status) {
+      *watchId = reply->watchId;
+   }
+   return status;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchWaitNotify --
+ *
+ *    Waits for a change notification of a watch reporting some events.
+ *    Other notifications are skipped.
+ *
+ * Results:
+ *    TRUE if the notification came, FALSE on timeout.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+BenchWaitNotify(BenchConn *conn,                 // IN: connection
+                HgfsSubscriberHandle watchId,    // IN: watch
+                uint64 mask)                     // IN: HGFS_NOTIFY_ events
+{
+   BenchServerRequest request;
+
+   while (BenchNextServerRequest(conn, &request)) {
+      const HgfsRequestNotifyV4 *notify = (const void *)request.args;
+
+      if (HGFS_OP_NOTIFY_V4 == request.op && notify->watchId == watchId &&
+          notify->count > 0 && 0 != (notify->events[0].mask & mask)) {
+         return TRUE;
+      }
+   }
+   return FALSE;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchCheckNotify --
+ *
+ *    Checks change notifications of a recursive watch, including events in
+ *    a directory created after the watch was set.
+ *
+ * Results:
+ *    TRUE if the check passed, FALSE otherwise.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+BenchCheckNotify(BenchConn *conn)   // IN: connection
+{
+   char dir[PATH_MAX];
+   char subDir[PATH_MAX];
+   char file[PATH_MAX];
+   HgfsSubscriberHandle watchId;
+   Bool result = FALSE;
+   int fd;
+
+   BenchCheckPath(dir, "notify");
+   BenchCheckPath(subDir, "notify/dir");
+   BenchCheckPath(file, "notify/dir/file");
+   if (mkdir(dir, 0755) < 0) {
+      return FALSE;
+   }
+   if (HGFS_STATUS_SUCCESS !=
+       BenchSetWatch(conn, dir, HGFS_NOTIFY_CREATE_FILE | HGFS_NOTIFY_CREATE_DIR,
+                     HGFS_NOTIFY_FLAG_WATCH_TREE, &watchId)) {
+      goto exit;
+   }
+
+   if (mkdir(subDir, 0755) < 0 ||
+       !BenchWaitNotify(conn, watchId, HGFS_NOTIFY_CREATE_DIR)) {
+      goto removeWatch;
+   }
+   /* The new directory is watched by the time its creation is reported. */
+   fd = open(file, O_CREAT | O_WRONLY, 0644);
+   if (fd < 0) {
+      goto removeWatch;
+   }
+   close(fd);
+   result = BenchWaitNotify(conn, watchId, HGFS_NOTIFY_CREATE_FILE);
+
+removeWatch:
+   {
+      HgfsRequestRemoveWatchV4 *request = BenchRequestArgs(conn);
+      const void *reply;
+
+      memset(request, 0, sizeof *request);
+      request->watchId = watchId;
+      if (HGFS_STATUS_SUCCESS !=
+          BenchTransact(conn, HGFS_OP_REMOVE_WATCH_V4, sizeof *request, &reply)) {
+         result = FALSE;
+      }
+   }
+
+exit:
+   unlink(file);
+   rmdir(subDir);
+   rmdir(dir);
+   return result;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchCheckIo --
+ *
+ *    Checks that data written to a file reads back, many times over so
+ *    that reply buffers get reused. The VMCI channel moves the data in
+ *    place with the fast V4 operations, the socket channel replies in
+ *    pooled server buffers.
+ *
+ * Results:
+ *    TRUE if the check passed, FALSE otherwise.
+ *
+ * Side effects:
+ *    The first file of the file set is overwritten.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+BenchCheckIo(BenchConn *conn)   // IN: connection
+{
+   Bool vmci = BENCH_CHANNEL_VMCI == conn->channel;
+   size_t ioSize = MIN(gConfig.ioSize, BENCH_CHECK_IO_SIZE);
+   size_t dataSize = vmci ? ioSize : 0;
+   char expected[BENCH_CHECK_IO_SIZE];
+   HgfsHandle file;
+   Bool result = TRUE;
+   uint32 round;
+
+   if (HGFS_STATUS_SUCCESS !=
+       BenchOpen(conn, 0, HGFS_OPEN_MODE_READ_WRITE, &file)) {
+      return FALSE;
+   }
+
+   for (round = 0; round < BENCH_CHECK_IO_ROUNDS && result; round++) {
+      HgfsRequestWriteV3 *writeRequest = BenchRequestArgs(conn);
+      HgfsRequestReadV3 *readRequest;
+      const HgfsReplyReadV3 *reply;
+      size_t size = offsetof(HgfsRequestWriteV3, payload);
+
+      memset(expected, 'a' + round % 26, ioSize);
+      memset(writeRequest, 0, sizeof *writeRequest);
+      writeRequest->file = file;
+      writeRequest->requiredSize = ioSize;
+      if (vmci) {
+         memcpy(conn->slots[0].data, expected, ioSize);
+      } else {
+         memcpy(writeRequest->payload, expected, ioSize);
+         size += ioSize;
+      }
+      BenchSubmit(conn, 0, vmci ? HGFS_OP_WRITE_FAST_V4 : HGFS_OP_WRITE_V3,
+                  size, dataSize);
+      if (HGFS_STATUS_SUCCESS != BenchWait(conn, 0, (const void **)&reply)) {
+         result = FALSE;
+         break;
+      }
+
+      readRequest = BenchRequestArgs(conn);
+      memset(readRequest, 0, sizeof *readRequest);
+      readRequest->file = file;
+      readRequest->requiredSize = ioSize;
+      if (vmci) {
+         memset(conn->slots[0].data, 0, ioSize);
+      }
+      BenchSubmit(conn, 0, vmci ? HGFS_OP_READ_FAST_V4 : HGFS_OP_READ_V3,
+                  sizeof *readRequest, dataSize);
+      result = HGFS_STATUS_SUCCESS ==
+                  BenchWait(conn, 0, (const void **)&reply) &&
+               reply->actualSize == ioSize &&
+               0 == memcmp(vmci ? conn->slots[0].data : reply->payload,
+                           expected, ioSize);
+   }
+
+   if (HGFS_STATUS_SUCCESS != BenchClose(conn, file)) {
+      result = FALSE;
+   }
+   return result;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchCompoundAdd --
+ *
+ *    Appends an entry to a compound request, the caller has packed its
+ *    arguments after the entry already.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+BenchCompoundAdd(HgfsRequestCompoundV4 *request,   // IN/OUT: compound request
+                 size_t *size,                     // IN/OUT: request size
+                 HgfsOp op,                        // IN: operation
+                 size_t argsSize,                  // IN: size of the arguments
+                 uint32 flags)                     // IN: HGFS_COMPOUND_ENTRY_FLAG_
+{
+   HgfsCompoundEntryV4 *entry =
+      (HgfsCompoundEntryV4 *)((char *)request + *size);
+
+   memset(entry, 0, sizeof *entry);
+   entry->op = op;
+   entry->size = (uint32)argsSize;
+   entry->flags = flags;
+   *size = ROUNDUP(*size + sizeof *entry + argsSize, HGFS_COMPOUND_ENTRY_ALIGN);
+   request->numRequests++;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchCheckCompound --
+ *
+ *    Checks that a compound request opens, writes, reads back and closes a
+ *    file in one round trip with the open handle passed along, and that a
+ *    request using the last handle before any open fails. The replies are
+ *    built in place in the reply buffer of the channel, which is the
+ *    request buffer with VMCI.
+ *
+ * Results:
+ *    TRUE if the check passed, FALSE otherwise.
+ *
+ * Side effects:
+ *    The first file of the file set is overwritten.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+BenchCheckCompound(BenchConn *conn)   // IN: connection
+{
+   static const HgfsOp ops[] = {
+      HGFS_OP_OPEN_V3, HGFS_OP_WRITE_V3, HGFS_OP_READ_V3, HGFS_OP_CLOSE_V3,
+   };
+   size_t ioSize = MIN(gConfig.ioSize, BENCH_CHECK_IO_SIZE);
+   char expected[BENCH_CHECK_IO_SIZE];
+   HgfsRequestCompoundV4 *request = BenchRequestArgs(conn);
+   const HgfsReplyCompoundV4 *reply;
+   const HgfsCompoundEntryV4 *entry;
+   size_t size = sizeof *request;
+   Bool result = TRUE;
+   uint32 i;
+
+   memset(expected, 'c', ioSize);
+   memset(request, 0, sizeof *request);
+   request->flags = HGFS_COMPOUND_FLAG_STOP_ON_ERROR;
+
+   {
+      HgfsRequestOpenV3 *open = (void *)((char *)request + size + sizeof *entry);
+
+      memset(open, 0, sizeof *open);
+      open->mask = HGFS_OPEN_VALID_MODE | HGFS_OPEN_VALID_FLAGS |
+                   HGFS_OPEN_VALID_FILE_NAME;
+      open->mode = HGFS_OPEN_MODE_READ_WRITE;
+      open->flags = HGFS_OPEN;
+      BenchCompoundAdd(request, &size, HGFS_OP_OPEN_V3,
+                       offsetof(HgfsRequestOpenV3, fileName) +
+                       BenchPackFileName(&open->fileName, gFileCpNames[0],
+                                         gFileCpNameLens[0]), 0);
+   }
+   {
+      HgfsRequestWriteV3 *write = (void *)((char *)request + size + sizeof *entry);
+
+      memset(write, 0, sizeof *write);
+      write->requiredSize = ioSize;
+      memcpy(write->payload, expected, ioSize);
+      BenchCompoundAdd(request, &size, HGFS_OP_WRITE_V3,
+                       offsetof(HgfsRequestWriteV3, payload) + ioSize,
+                       HGFS_COMPOUND_ENTRY_FLAG_LAST_HANDLE);
+   }
+   {
+      HgfsRequestReadV3 *read = (void *)((char *)request + size + sizeof *entry);
+
+      memset(read, 0, sizeof *read);
+      read->requiredSize = ioSize;
+      BenchCompoundAdd(request, &size, HGFS_OP_READ_V3, sizeof *read,
+                       HGFS_COMPOUND_ENTRY_FLAG_LAST_HANDLE);
+   }
+   {
+      HgfsRequestCloseV3 *close = (void *)((char *)request + size + sizeof *entry);
+
+      memset(close, 0, sizeof *close);
+      BenchCompoundAdd(request, &size, HGFS_OP_CLOSE_V3, sizeof *close,
+                       HGFS_COMPOUND_ENTRY_FLAG_LAST_HANDLE);
+   }
+
+   if (HGFS_STATUS_SUCCESS != BenchTransact(conn, HGFS_OP_COMPOUND_V4, size,
+                                            (const void **)&reply) ||
+       reply->numReplies != ARRAYSIZE(ops)) {
+      return FALSE;
+   }
+
+   size = sizeof *reply;
+   for (i = 0; i < ARRAYSIZE(ops) && result; i++) {
+      const void *args;
+
+      entry = (const HgfsCompoundEntryV4 *)((const char *)reply + size);
+      args = entry + 1;
+      result = entry->op == ops[i] && HGFS_STATUS_SUCCESS == entry->status;
+      if (result && HGFS_OP_WRITE_V3 == entry->op) {
+         result = ((const HgfsReplyWriteV3 *)args)->actualSize == ioSize;
+      } else if (result && HGFS_OP_READ_V3 == entry->op) {
+         const HgfsReplyReadV3 *read = args;
+
+         result = read->actualSize == ioSize &&
+                  0 == memcmp(read->payload, expected, ioSize);
+      }
+      size = ROUNDUP(size + sizeof *entry + entry->size,
+                     HGFS_COMPOUND_ENTRY_ALIGN);
+   }
+   if (!result) {
+      return FALSE;
+   }
+
+   /* Without an open there is no last handle to use. */
+   request = BenchRequestArgs(conn);
+   memset(request, 0, sizeof *request);
+   size = sizeof *request;
+   {
+      HgfsRequestCloseV3 *close = (void *)((char *)request + size + sizeof *entry);
+
+      memset(close, 0, sizeof *close);
+      BenchCompoundAdd(request, &size, HGFS_OP_CLOSE_V3, sizeof *close,
+                       HGFS_COMPOUND_ENTRY_FLAG_LAST_HANDLE);
+   }
+   if (HGFS_STATUS_SUCCESS != BenchTransact(conn, HGFS_OP_COMPOUND_V4, size,
+                                            (const void **)&reply) ||
+       reply->numReplies != 1) {
+      return FALSE;
+   }
+   entry = (const HgfsCompoundEntryV4 *)(reply + 1);
+   return HGFS_OP_CLOSE_V3 == entry->op &&
+          HGFS_STATUS_INVALID_HANDLE == entry->status;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchCopyRange --
+ *
+ *    Copies data between two open files within the server.
+ *
+ * Results:
+ *    HGFS status, the number of bytes copied in copied.
+ *
+ * Side effects:
+ *    The destination file is written.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static HgfsStatus
+BenchCopyRange(BenchConn *conn,    // IN: connection
+               HgfsHandle src,     // IN: source handle
+               uint64 srcOffset,   // IN: source offset
+               HgfsHandle dst,     // IN: destination handle
+               uint64 dstOffset,   // IN: destination offset
+               uint64 length,      // IN: bytes to copy
+               uint64 *copied)     // OUT: bytes copied
+{
+   HgfsRequestCopyRangeV4 *request = BenchRequestArgs(conn);
+   const HgfsReplyCopyRangeV4 *reply;
+   HgfsStatus status;
+
+   memset(request, 0, sizeof *request);
+   request->srcFile = src;
+   request->srcOffset = srcOffset;
+   request->dstFile = dst;
+   request->dstOffset = dstOffset;
+   request->length = length;
+   status = BenchTransact(conn, HGFS_OP_COPY_RANGE_V4, sizeof *request,
+                          (const void **)&reply);
+   *copied = HGFS_STATUS_SUCCESS == status ? reply->actualSize : 0;
+   return status;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchCheckCopyRange --
+ *
+ *    Checks copy range: a plain copy between two files reads back, a copy
+ *    past the end of the source is short, and overlapping ranges of one
+ *    file or a destination opened for appending are refused.
+ *
+ * Results:
+ *    TRUE if the check passed, FALSE otherwise.
+ *
+ * Side effects:
+ *    The first two files of the file set are overwritten.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+BenchCheckCopyRange(BenchConn *conn)   // IN: connection
+{
+   size_t ioSize = MIN(gConfig.ioSize, BENCH_CHECK_IO_SIZE);
+   uint64 srcSize = MAX(gConfig.fileSize, ioSize);
+   char expected[BENCH_CHECK_IO_SIZE];
+   HgfsHandle src = HGFS_INVALID_HANDLE;
+   HgfsHandle dst = HGFS_INVALID_HANDLE;
+   HgfsRequestWriteV3 *writeRequest;
+   HgfsRequestReadV3 *readRequest;
+   const HgfsReplyReadV3 *readReply;
+   const void *reply;
+   uint64 copied;
+   Bool result = FALSE;
+
+   if (gConfig.numFiles < 2 ||
+       HGFS_STATUS_SUCCESS !=
+          BenchOpen(conn, 0, HGFS_OPEN_MODE_READ_WRITE, &src) ||
+       HGFS_STATUS_SUCCESS !=
+          BenchOpen(conn, 1, HGFS_OPEN_MODE_READ_WRITE, &dst)) {
+      goto exit;
+   }
+
+   memset(expected, 'r', ioSize);
+   writeRequest = BenchRequestArgs(conn);
+   memset(writeRequest, 0, sizeof *writeRequest);
+   writeRequest->file = src;
+   writeRequest->requiredSize = ioSize;
+   memcpy(writeRequest->payload, expected, ioSize);
+   if (HGFS_STATUS_SUCCESS !=
+       BenchTransact(conn, HGFS_OP_WRITE_V3,
+                     offsetof(HgfsRequestWriteV3, payload) + ioSize, &reply)) {
+      goto exit;
+   }
+
+   /* Plain copy. */
+   if (HGFS_STATUS_SUCCESS !=
+          BenchCopyRange(conn, src, 0, dst, 0, ioSize, &copied) ||
+       copied != ioSize) {
+      goto exit;
+   }
+   readRequest = BenchRequestArgs(conn);
+   memset(readRequest, 0, sizeof *readRequest);
+   readRequest->file = dst;
+   readRequest->requiredSize = ioSize;
+   if (HGFS_STATUS_SUCCESS !=
+          BenchTransact(conn, HGFS_OP_READ_V3, sizeof *readRequest,
+                        (const void **)&readReply) ||
+       readReply->actualSize != ioSize ||
+       0 != memcmp(readReply->payload, expected, ioSize)) {
+      goto exit;
+   }
+
+   /* The source ends one byte into the range. */
+   if (HGFS_STATUS_SUCCESS !=
+          BenchCopyRange(conn, src, srcSize - 1, dst, 0, ioSize, &copied) ||
+       copied != 1) {
+      goto exit;
+   }
+
+   /* Overlapping ranges of the same file. */
+   if (HGFS_STATUS_SUCCESS ==
+       BenchCopyRange(conn, src, 0, src, 1, ioSize, &copied)) {
+      goto exit;
+   }
+
+   /* An appending write reopens the destination for appending. */
+   writeRequest = BenchRequestArgs(conn);
+   memset(writeRequest, 0, sizeof *writeRequest);
+   writeRequest->file = dst;
+   writeRequest->flags = HGFS_WRITE_APPEND;
+   writeRequest->requiredSize = 1;
+   writeRequest->payload[0] = 'a';
+   if (HGFS_STATUS_SUCCESS !=
+          BenchTransact(conn, HGFS_OP_WRITE_V3,
+                        offsetof(HgfsRequestWriteV3, payload) + 1, &reply) ||
+       HGFS_STATUS_SUCCESS ==
+          BenchCopyRange(conn, src, 0, dst, 0, ioSize, &copied)) {
+      goto exit;
+   }
+   result = TRUE;
+
+exit:
+   if (HGFS_INVALID_HANDLE != dst && HGFS_STATUS_SUCCESS != BenchClose(conn, dst)) {
+      result = FALSE;
+   }
+   if (HGFS_INVALID_HANDLE != src && HGFS_STATUS_SUCCESS != BenchClose(conn, src)) {
+      result = FALSE;
+   }
+   return result;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchCheckOplockOpen --
+ *
+ *    Thread opening a file locally for writing, which breaks the lease the
+ *    server holds on it.
+ *
+ * Results:
+ *    Always NULL.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void *
+BenchCheckOplockOpen(void *data)   // IN/OUT: BenchOplockOpener
+{
+   BenchOplockOpener *opener = data;
+   int fd = open(opener->path, O_WRONLY);
+
+   if (fd >= 0) {
+      close(fd);
+   }
+   pthread_mutex_lock(&opener->lock);
+   opener->opened = fd >= 0;
+   opener->done = TRUE;
+   pthread_mutex_unlock(&opener->lock);
+   return NULL;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchCheckOplock --
+ *
+ *    Checks that a local open conflicting with a server lock waits until
+ *    the client acknowledges the oplock break request.
+ *
+ * Results:
+ *    TRUE if the check passed, FALSE otherwise.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+BenchCheckOplock(BenchConn *conn)   // IN: connection
+{
+   BenchOplockOpener opener;
+   BenchServerRequest breakRequest;
+   HgfsRequestOpenV3 *request;
+   const HgfsReplyOpenV3 *reply;
+   HgfsHandle file = HGFS_INVALID_HANDLE;
+   pthread_t thread;
+   Bool threadStarted = FALSE;
+   Bool result = FALSE;
+   uint32 cpNameLen;
+   char *cpName;
+   size_t size;
+   int fd;
+
+   memset(&opener, 0, sizeof opener);
+   pthread_mutex_init(&opener.lock, NULL);
+   BenchCheckPath(opener.path, "oplock");
+   fd = open(opener.path, O_CREAT | O_WRONLY, 0644);
+   if (fd < 0) {
+      goto exit;
+   }
+   close(fd);
+
+   request = BenchRequestArgs(conn);
+   memset(request, 0, sizeof *request);
+   request->mask = HGFS_OPEN_VALID_MODE | HGFS_OPEN_VALID_FLAGS |
+                   HGFS_OPEN_VALID_FILE_NAME | HGFS_OPEN_VALID_SERVER_LOCK;
+   request->mode = HGFS_OPEN_MODE_READ_WRITE;
+   request->flags = HGFS_OPEN;
+   request->desiredLock = HGFS_LOCK_EXCLUSIVE;
+   cpName = BenchMakeCpName(opener.path, &cpNameLen);
+   size = offsetof(HgfsRequestOpenV3, fileName) +
+          BenchPackFileName(&request->fileName, cpName, cpNameLen);
+   free(cpName);
+   if (HGFS_STATUS_SUCCESS !=
+       BenchTransact(conn, HGFS_OP_OPEN_V3, size, (const void **)&reply)) {
+      goto exit;
+   }
+   file = reply->file;
+   if (HGFS_LOCK_EXCLUSIVE != reply->acquiredLock) {
+      fprintf(stderr, "No server lock granted, are leases supported?\n");
+      goto exit;
+   }
+
+   if (0 != pthread_create(&thread, NULL, BenchCheckOplockOpen, &opener)) {
+      goto exit;
+   }
+   threadStarted = TRUE;
+
+   if (!BenchNextServerRequest(conn, &breakRequest) ||
+       HGFS_OP_OPLOCK_BREAK_V4 != breakRequest.op) {
+      goto exit;
+   }
+
+   /* Give an early break acknowledgement the time to let the open through. */
+   usleep(100000);
+   pthread_mutex_lock(&opener.lock);
+   result = !opener.done;
+   pthread_mutex_unlock(&opener.lock);
+
+   {
+      const HgfsRequestOplockBreakV4 *breakArgs =
+         (const void *)breakRequest.args;
+      HgfsReplyOplockBreakV4 *ack = BenchRequestArgs(conn);
+      const void *ackReply;
+
+      memset(ack, 0, sizeof *ack);
+      ack->fid = breakArgs->fid;
+      ack->serverLock = HGFS_LOCK_NONE;
+      if (breakArgs->fid != file ||
+          HGFS_STATUS_SUCCESS != BenchTransact(conn, HGFS_OP_OPLOCK_BREAK_V4,
+                                               sizeof *ack, &ackReply)) {
+         result = FALSE;
+      }
+   }
+
+exit:
+   if (threadStarted) {
+      pthread_join(thread, NULL);
+      result = result && opener.opened;
+   }
+   if (HGFS_INVALID_HANDLE != file) {
+      BenchClose(conn, file);
+   }
+   unlink(opener.path);
+   pthread_mutex_destroy(&opener.lock);
+   return result;
+}
+
+
+/* Functional checks of server features the load does not cover. */
+static const struct {
+   const char *name;
+   Bool (*run)(BenchConn *conn);
+   BenchChannel channel;
+} benchChecks[] = {
+   { "fastio",     BenchCheckIo,         BENCH_CHANNEL_VMCI },
+   { "replypool",  BenchCheckIo,         BENCH_CHANNEL_SOCKET },
+   { "notify",     BenchCheckNotify,     BENCH_CHANNEL_VMCI },
+   { "oplock",     BenchCheckOplock,     BENCH_CHANNEL_VMCI },
+   { "compound",   BenchCheckCompound,   BENCH_CHANNEL_BACKDOOR },
+   { "copyrange",  BenchCheckCopyRange,  BENCH_CHANNEL_BACKDOOR },
+   { "compoundvmci", BenchCheckCompound, BENCH_CHANNEL_VMCI },
+};
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchRunChecks --
+ *
+ *    Runs the functional checks, each on a session of its own over the
+ *    channel it needs.
+ *
+ * Results:
+ *    TRUE if all the checks passed, FALSE otherwise.
+ *
+ * Side effects:
+ *    Files are created and deleted in the benchmark directory.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+BenchRunChecks(void)
+{
+   Bool result = TRUE;
+   uint32 i;
+
+   for (i = 0; i < ARRAYSIZE(benchChecks); i++) {
+      BenchConn conn;
+      Bool passed = BenchConnect(&conn, benchChecks[i].channel) &&
+                    benchChecks[i].run(&conn);
+
+      BenchDisconnect(&conn);
+      printf("%-12s %s\n", benchChecks[i].name, passed ? "ok" : "FAILED");
+      result = result && passed;
+   }
+   return result;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchParseMix --
+ *
+ *    Parses an operation mix of the form "read=40,write=20,...". Operations
+ *    not listed get no weight.
+ *
+ * Results:
+ *    TRUE on success, FALSE if the mix is malformed.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+BenchParseMix(const char *mix)   // IN: operation mix
+{
+   char *copy = strdup(mix);
+   char *saveptr = NULL;
+   char *item;
+   BenchOp op;
+   Bool result = TRUE;
+
+   if (NULL == copy) {
+      return FALSE;
+   }
+   memset(gConfig.weights, 0, sizeof gConfig.weights);
+   gConfig.totalWeight = 0;
+
+   for (item = strtok_r(copy, ",", &saveptr);
+        NULL != item && result;
+        item = strtok_r(NULL, ",", &saveptr)) {
+      char *value = strchr(item, '=');
+
+      result = FALSE;
+      if (NULL == value) {
+         break;
+      }
+      *value++ = '\0';
+      for (op = 0; op < BENCH_OP_MAX; op++) {
+         if (0 == strcmp(item, benchOpNames[op])) {
+            gConfig.weights[op] = (uint32)strtoul(value, NULL, 0);
+            gConfig.totalWeight += gConfig.weights[op];
+            result = TRUE;
+            break;
+         }
+      }
+   }
+
+   free(copy);
+   return result && gConfig.totalWeight > 0;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * BenchUsage --
+ *
+ *    Prints the usage.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+BenchUsage(const char *prog)   // IN: program name
+{
+   fprintf(stderr,
+           "Usage: %s -d <dir> [options]\n"
+           "  -d <dir>     directory to create the file set in\n"
+           "  -f <count>   number of files (default %u)\n"
+           "  -s <bytes>   file size (default %"FMT64"u)\n"
+           "  -i <bytes>   read/write size, up to %u (default %u)\n"
+           "  -t <count>   concurrent sessions, one thread each (default %u)\n"
+           "  -T <secs>    run time (default %u)\n"
+           "  -c <count>   server open node cache size (default %u)\n"
+           "  -C <channel> loopback channel, backdoor (synchronous), vmci\n"
+           "               (asynchronous, shared memory) or socket (synchronous,\n"
+           "               server reply buffers) (default %s)\n"
+           "  -q <depth>   read/write requests in flight per session, up to %u\n"
+           "               (default %u)\n"
+           "  -m <mix>     operation weights (default "
+           "open=10,read=40,write=20,getattr=20,search=10)\n"
+           "  -k           keep the file set\n"
+           "  -x           run the functional checks instead of the load\n",
+           prog, gConfig.numFiles, gConfig.fileSize, HGFS_HUGE_IO_MAX,
+           gConfig.ioSize, gConfig.numWorkers, gConfig.seconds,
+           gConfig.cachedNodes, benchChannelNames[gConfig.channel],
+           BENCH_MAX_DEPTH, gConfig.depth);
+}
+
+
+int
+main(int argc,      // IN
+     char **argv)   // IN
+{
+   HgfsServerConfig serverConfig;
+   BenchWorker *workers = NULL;
+   uint64 start;
+   uint32 numStarted = 0;
+   uint32 i;
+   int ret = EXIT_FAILURE;
+   int opt;
+
+   while ((opt = getopt(argc, argv, "d:f:s:i:t:T:c:C:q:m:kx")) != -1) {
+      switch (opt) {
+      case 'd':
+         gConfig.dir = optarg;
+         break;
+      case 'f':
+         gConfig.numFiles = (uint32)strtoul(optarg, NULL, 0);
+         break;
+      case 's':
+         gConfig.fileSize = strtoull(optarg, NULL, 0);
+         break;
+      case 'i':
+         gConfig.ioSize = (uint32)strtoul(optarg, NULL, 0);
+         break;
+      case 't':
+         gConfig.numWorkers = (uint32)strtoul(optarg, NULL, 0);
+         break;
+      case 'T':
+         gConfig.seconds = (uint32)strtoul(optarg, NULL, 0);
+         break;
+      case 'c':
+         gConfig.cachedNodes = (uint32)strtoul(optarg, NULL, 0);
+         break;
+      case 'C':
+         for (gConfig.channel = 0; gConfig.channel < BENCH_CHANNEL_MAX;
+              gConfig.channel++) {
+            if (0 == strcmp(optarg, benchChannelNames[gConfig.channel])) {
+               break;
+            }
+         }
+         if (BENCH_CHANNEL_MAX == gConfig.channel) {
+            fprintf(stderr, "Invalid channel: %s\n", optarg);
+            return EXIT_FAILURE;
+         }
+         break;
+      case 'q':
+         gConfig.depth = (uint32)strtoul(optarg, NULL, 0);
+         break;
+      case 'm':
+         if (!BenchParseMix(optarg)) {
+            fprintf(stderr, "Invalid operation mix: %s\n", optarg);
+            return EXIT_FAILURE;
+         }
+         break;
+      case 'k':
+         gConfig.keepFiles = TRUE;
+         break;
+      case 'x':
+         gConfig.check = TRUE;
+         break;
+      default:
+         BenchUsage(argv[0]);
+         return EXIT_FAILURE;
+      }
+   }
+
+   if (NULL == gConfig.dir || 0 == gConfig.numFiles || 0 == gConfig.numWorkers ||
+       0 == gConfig.ioSize || gConfig.ioSize > HGFS_HUGE_IO_MAX ||
+       gConfig.ioSize > gConfig.fileSize ||
+       0 == gConfig.depth || gConfig.depth > BENCH_MAX_DEPTH) {
+      BenchUsage(argv[0]);
+      return EXIT_FAILURE;
+   }
+
+   if (!HgfsServerPolicy_Init(NULL, NULL, &gServerMgrData.enumResources)) {
+      fprintf(stderr, "Failed to initialize the server policy.\n");
+      return EXIT_FAILURE;
+   }
+   memset(&serverConfig, 0, sizeof serverConfig);
+   if (gConfig.check) {
+      serverConfig.flags |= HGFS_CONFIG_NOTIFY_ENABLED |
+                            HGFS_CONFIG_OPLOCK_ENABLED;
+   }
+   serverConfig.maxCachedOpenNodes = gConfig.cachedNodes;
+   serverConfig.maxCachedLockedNodes = MIN(HGFS_MAX_LOCKED_FILENODES,
+                                           gConfig.cachedNodes / 2);
+   if (!HgfsServer_InitState(&gServerCbTable, &serverConfig, &gServerMgrData)) {
+      fprintf(stderr, "Failed to initialize the HGFS server.\n");
+      HgfsServerPolicy_Cleanup();
+      return EXIT_FAILURE;
+   }
+
+   if (!BenchCreateFileSet()) {
+      goto exit;
+   }
+
+   if (gConfig.check) {
+      ret = BenchRunChecks() ? EXIT_SUCCESS : EXIT_FAILURE;
+      goto exit;
+   }
+
+   workers = calloc(gConfig.numWorkers, sizeof *workers);
+   if (NULL == workers) {
+      fprintf(stderr, "Out of memory.\n");
+      goto exit;
+   }
+   for (i = 0; i < gConfig.numWorkers; i++) {
+      if (!BenchWorkerInit(&workers[i], i)) {
+         BenchWorkerExit(&workers[i]);
+         goto exit;
+      }
+      numStarted++;
+   }
+
+   printf("%u %s sessions, %u files of %"FMT64"u bytes, %u byte I/O, "
+          "%u in flight, %u seconds\n",
+          gConfig.numWorkers, benchChannelNames[gConfig.channel],
+          gConfig.numFiles, gConfig.fileSize, gConfig.ioSize, gConfig.depth,
+          gConfig.seconds);
+
+   start = BenchNow();
+   for (i = 0; i < gConfig.numWorkers; i++) {
+      if (0 != pthread_create(&workers[i].thread, NULL, BenchWorkerRun,
+                              &workers[i])) {
+         fprintf(stderr, "Failed to start worker %u.\n", i);
+         gStop = TRUE;
+         break;
+      }
+   }
+   if (!gStop) {
+      sleep(gConfig.seconds);
+      gStop = TRUE;
+   }
+   while (i-- > 0) {
+      pthread_join(workers[i].thread, NULL);
+   }
+
+   BenchReport(workers, BenchNow() - start);
+   ret = EXIT_SUCCESS;
+
+exit:
+   for (i = 0; i < numStarted; i++) {
+      BenchWorkerExit(&workers[i]);
+   }
+   free(workers);
+   BenchDestroyFileSet();
+   HgfsServer_ExitState();
+   HgfsServerPolicy_Cleanup();
+   return ret;
+}
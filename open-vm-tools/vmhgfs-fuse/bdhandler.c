@@ -34,7 +34,106 @@
 #include "transport.h"
 #include "vm_assert.h"
 
+/*
+ * Each RPC channel carries one request at a time, so the backdoor
+ * channel keeps several and gives each sender its own. They are opened
+ * on demand, up to HGFS_BD_MAX_CONNECTIONS, and all but one are closed
+ * again once they have sat idle for HGFS_BD_IDLE_CLOSE_MSEC.
+ */
+#define HGFS_BD_MAX_CONNECTIONS 4
+#define HGFS_BD_IDLE_CLOSE_MSEC 5000
+
+typedef struct HgfsBdConnPool {
+   RpcOut *idle[HGFS_BD_MAX_CONNECTIONS];  /* Connections not in use */
+   uint64 idleSince[HGFS_BD_MAX_CONNECTIONS]; /* When each was put back */
+   uint32 idleCount;
+   uint32 openCount;                      /* Idle, busy or being opened */
+   uint32 maxCount;                       /* Lowered when an open fails */
+   pthread_cond_t idleCond;               /* Signaled on a put back */
+} HgfsBdConnPool;
+
 static HgfsTransportChannel bdChannel;
+static HgfsBdConnPool bdConnPool;
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsBdConnNow --
+ *
+ *      Current monotonic time.
+ *
+ * Results:
+ *      The time in milliseconds.
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static uint64
+HgfsBdConnNow(void)
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (uint64)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsBdConnPutIdle --
+ *
+ *      Put a connection back in the idle list, and take out the connections
+ *      that have been idle too long, keeping at least one open. The idle
+ *      list is used as a stack, so the oldest connections are at the
+ *      bottom. The channel lock must be held.
+ *
+ * Results:
+ *      The number of connections stored in stale, which the caller closes
+ *      after dropping the lock.
+ *
+ * Side effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static uint32
+HgfsBdConnPutIdle(HgfsBdConnPool *pool,                     // IN: Pool
+                  RpcOut *out,                              // IN: Connection
+                  RpcOut *stale[HGFS_BD_MAX_CONNECTIONS])   // OUT: To close
+{
+   uint64 now = HgfsBdConnNow();
+   uint32 staleCount = 0;
+   uint32 i;
+
+   ASSERT(pool->idleCount < HGFS_BD_MAX_CONNECTIONS);
+   pool->idle[pool->idleCount] = out;
+   pool->idleSince[pool->idleCount] = now;
+   pool->idleCount++;
+
+   while (staleCount < pool->idleCount &&
+          pool->openCount - staleCount > 1 &&
+          now - pool->idleSince[staleCount] >= HGFS_BD_IDLE_CLOSE_MSEC) {
+      stale[staleCount] = pool->idle[staleCount];
+      staleCount++;
+   }
+
+   if (staleCount > 0) {
+      for (i = staleCount; i < pool->idleCount; i++) {
+         pool->idle[i - staleCount] = pool->idle[i];
+         pool->idleSince[i - staleCount] = pool->idleSince[i];
+      }
+      pool->idleCount -= staleCount;
+      pool->openCount -= staleCount;
+      LOG(8, ("Closing %u idle backdoor connections.\n", staleCount));
+   }
+   return staleCount;
+}
 
 
 /*
@@ -64,15 +163,24 @@ HgfsBdChannelOpen(HgfsTransportChannel *channel) // IN: Channel
    case HGFS_CHANNEL_CONNECTED:
       LOG(8, ("Backdoor already connected.\n"));
       break;
-   case HGFS_CHANNEL_NOTCONNECTED:
-      if (HgfsBd_OpenBackdoor((RpcOut **)&channel->priv)) {
+   case HGFS_CHANNEL_NOTCONNECTED: {
+      HgfsBdConnPool *pool = channel->priv;
+      RpcOut *out = NULL;
+
+      /* The first connection also checks that HGFS is enabled. */
+      ASSERT(pool->openCount == 0);
+      if (HgfsBd_OpenBackdoor(&out)) {
          LOG(8, ("Backdoor opened and connected.\n"));
+         pool->idleSince[pool->idleCount] = HgfsBdConnNow();
+         pool->idle[pool->idleCount++] = out;
+         pool->openCount++;
+         pool->maxCount = HGFS_BD_MAX_CONNECTIONS;
          channel->status = HGFS_CHANNEL_CONNECTED;
-         ASSERT(channel->priv != NULL);
       } else {
          LOG(8, ("ERROR: Backdoor cannot connect.\n"));
       }
       break;
+   }
    default:
       ASSERT(0); /* Not reached. */
       LOG(2, ("ERROR: Backdoor status %d is unknown resetting.\n",
@@ -105,9 +213,17 @@ static void
 HgfsBdChannelCloseInt(HgfsTransportChannel *channel) // IN: Channel
 {
    if (channel->status == HGFS_CHANNEL_CONNECTED) {
-      ASSERT(channel->priv != NULL);
-      HgfsBd_CloseBackdoor((RpcOut **)&channel->priv);
-      ASSERT(channel->priv == NULL);
+      HgfsBdConnPool *pool = channel->priv;
+
+      /* The transport closes the channel with no send in progress. */
+      ASSERT(pool->idleCount == pool->openCount);
+      while (pool->idleCount > 0) {
+         RpcOut *out = pool->idle[--pool->idleCount];
+
+         HgfsBd_CloseBackdoor(&out);
+         ASSERT(out == NULL);
+         pool->openCount--;
+      }
       channel->status = HGFS_CHANNEL_NOTCONNECTED;
    }
    LOG(8, ("Backdoor closed.\n"));
@@ -160,38 +276,86 @@ static int
 HgfsBdChannelSend(HgfsTransportChannel *channel, // IN: Channel
                   HgfsReq *req)                  // IN: request to send
 {
+   HgfsBdConnPool *pool = channel->priv;
    char const *replyPacket = NULL;
+   RpcOut *stale[HGFS_BD_MAX_CONNECTIONS];
+   uint32 staleCount = 0;
+   RpcOut *out = NULL;
    size_t payloadSize;
    int ret;
 
    ASSERT(req);
    ASSERT(req->state == HGFS_REQ_STATE_UNSENT);
-   ASSERT(req->payloadSize <= HGFS_LARGE_PACKET_MAX);
+   ASSERT(req->payloadSize <= req->bufferSize);
 
+   /* Take an idle connection, open a new one or wait for one. */
    pthread_mutex_lock(&channel->connLock);
+   while (out == NULL) {
+      if (channel->status != HGFS_CHANNEL_CONNECTED) {
+         LOG(6, ("Backdoor not opened.\n"));
+         pthread_mutex_unlock(&channel->connLock);
+         return -ENOTCONN;
+      }
 
-   if (channel->status != HGFS_CHANNEL_CONNECTED) {
-      LOG(6, ("Backdoor not opened.\n"));
-      pthread_mutex_unlock(&channel->connLock);
-      return -ENOTCONN;
+      if (pool->idleCount > 0) {
+         out = pool->idle[--pool->idleCount];
+      } else if (pool->openCount < pool->maxCount) {
+         pool->openCount++;
+         pthread_mutex_unlock(&channel->connLock);
+         if (!HgfsBd_OpenBackdoor(&out)) {
+            LOG(4, ("Additional backdoor connection cannot connect.\n"));
+         }
+         pthread_mutex_lock(&channel->connLock);
+         if (out == NULL) {
+            /* Make do with the connections there are. */
+            pool->openCount--;
+            pool->maxCount = MAX(pool->openCount, 1);
+            if (pool->openCount == 0) {
+               pthread_mutex_unlock(&channel->connLock);
+               return -EIO;
+            }
+         }
+      } else {
+         pthread_cond_wait(&pool->idleCond, &channel->connLock);
+      }
    }
+   pthread_mutex_unlock(&channel->connLock);
 
    payloadSize = req->payloadSize;
    LOG(8, ("Backdoor sending.\n"));
-   ret = HgfsBd_Dispatch(channel->priv, HGFS_REQ_PAYLOAD(req), &payloadSize,
+   ret = HgfsBd_Dispatch(out, HGFS_REQ_PAYLOAD(req), &payloadSize,
                          &replyPacket);
    if (ret == 0) {
       LOG(8, ("Backdoor reply received.\n"));
-      /* Request sent successfully. Copy the reply and wake the client. */
+      /*
+       * Request sent successfully. Copy the reply, which lives in the
+       * connection's buffer, before anyone else can use it.
+       */
       ASSERT(replyPacket);
       HgfsCompleteReq(req, replyPacket, payloadSize);
    } else {
-      /* Map rpc failure to EIO. */
+      /* Map rpc failure to EIO, and drop the connection. */
+      HgfsBd_CloseBackdoor(&out);
       ret = -EIO;
    }
 
+   pthread_mutex_lock(&channel->connLock);
+   if (out != NULL) {
+      staleCount = HgfsBdConnPutIdle(pool, out, stale);
+   } else {
+      pool->openCount--;
+   }
+   pthread_cond_signal(&pool->idleCond);
    pthread_mutex_unlock(&channel->connLock);
 
+   /*
+    * Idle connections are only aged out here, so after a burst the extra
+    * ones close on the next request that finishes past the idle period.
+    */
+   while (staleCount > 0) {
+      HgfsBd_CloseBackdoor(&stale[--staleCount]);
+   }
+
    return ret;
 }
 
@@ -247,8 +411,11 @@ HgfsBdChannelInit(void)
    bdChannel.ops.send = HgfsBdChannelSend;
    bdChannel.ops.recv = NULL;
    bdChannel.ops.exit = HgfsBdChannelExit;
-   bdChannel.priv = NULL;
+   bdChannel.priv = &bdConnPool;
    pthread_mutex_init(&bdChannel.connLock, NULL);
+   memset(&bdConnPool, 0, sizeof bdConnPool);
+   bdConnPool.maxCount = HGFS_BD_MAX_CONNECTIONS;
+   pthread_cond_init(&bdConnPool.idleCond, NULL);
    bdChannel.status = HGFS_CHANNEL_NOTCONNECTED;
    return &bdChannel;
 }
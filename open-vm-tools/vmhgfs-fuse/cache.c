@@ -20,11 +20,15 @@
  * cache.c --
  *
  * Module-specific components of the vmhgfs driver.
+ *
+ * The attribute cache is split into shards, each with its own lock, hash
+ * buckets and LRU list, so that lookups of different paths rarely contend.
+ * Every entry carries its own deadline, checked when it is looked up, and
+ * each shard holds a bounded number of entries, evicting the least
+ * recently used one to make room.
  */
 #include "module.h"
-#if !defined(__FreeBSD__) && !defined(__SOLARIS__)
-#include <glib.h>
-#endif
+#include <time.h>
 
 /*
  * We make the default attribute cache timeout 1 second which is the same
@@ -32,10 +36,11 @@
  * This can be overridden with the mount option attr_timeout=T
  */
 #define CACHE_TIMEOUT HGFS_DEFAULT_TTL
-#define CACHE_PURGE_TIME 10
-#define CACHE_PURGE_SLEEP_TIME 30
-#define HASH_THRESHOLD_SIZE (2046 * 4)
-#define HASH_PURGE_SIZE (HASH_THRESHOLD_SIZE / 2)
+
+#define CACHE_SHARDS            32                    /* Power of 2 */
+#define CACHE_SHARD_BUCKETS     64                    /* Power of 2 */
+#define CACHE_MAX_ENTRIES       (2046 * 4)
+#define CACHE_SHARD_MAX_ENTRIES (CACHE_MAX_ENTRIES / CACHE_SHARDS)
 #include "cache.h"
 
 /*
@@ -43,61 +48,59 @@
  */
 
 typedef struct HgfsAttrCache {
-   HgfsAttrInfo attr; /* Attribute of a file or directory */
-   uint64 changeTime; /* time the attribute was last updated */
-   struct list_head list; /* used in linked list implementation */
-   char path[0];      /* path of the file corresponding the the attr */
+   HgfsAttrInfo attr;     /* Attribute of a file or directory */
+   uint64 expires;        /* Monotonic time in ms the entry is valid until */
+   uint32 hash;           /* Hash of the path */
+   struct list_head hashLink; /* Link in the shard bucket */
+   struct list_head lruLink;  /* Link in the shard LRU, most recent first */
+   char path[0];          /* path of the file corresponding the the attr */
 } HgfsAttrCache;
 
+typedef struct HgfsAttrCacheShard {
+   pthread_mutex_t lock;
+   struct list_head buckets[CACHE_SHARD_BUCKETS];
+   struct list_head lru;
+   uint32 count;
+} HgfsAttrCacheShard;
 
-/* Head of the list */
-struct HgfsAttrCache attrList;
-
-/*Lock for accessing the attribute cache*/
-static pthread_mutex_t HgfsAttrCacheLock = PTHREAD_MUTEX_INITIALIZER;
-
-/*
- * Lists are used to manage attribute cache in Solaris and FreeBSD,
- * HashTables are used in Linux. HashTables perform better and hence
- * once newer version of glib with hash tables are packaged for Solaris
- * and FreeBSD, this section will go away.
- */
+static HgfsAttrCacheShard HgfsAttrCacheShards[CACHE_SHARDS];
 
-#if defined(__FreeBSD__) || defined(__SOLARIS__)
 
 /*
  *----------------------------------------------------------------------
  *
- * HgfsInitCache
+ * HgfsCacheNow
  *
- *    Initializes the list attrList to cache attributes.
+ *    Current monotonic time.
  *
  * Results:
- *    None
+ *    The time in milliseconds.
  *
  * Side effects:
  *    None
  *
  *----------------------------------------------------------------------
- *
  */
 
-void
-HgfsInitCache()
+static uint64
+HgfsCacheNow(void)
 {
-   INIT_LIST_HEAD(&attrList.list);
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (uint64)now.tv_sec * 1000 + now.tv_nsec / 1000000;
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * HgfsGetAttrCache
+ * HgfsCacheHash
  *
- *    Retrieves the attr from the list for a given path.
+ *    FNV-1a hash of a path.
  *
  * Results:
- *    0 on success else -1 on error
+ *    The hash.
  *
  * Side effects:
  *    None
@@ -105,47 +108,28 @@ HgfsInitCache()
  *----------------------------------------------------------------------
  */
 
-int
-HgfsGetAttrCache(const char* path,   //IN: Path of file or directory
-                 HgfsAttrInfo *attr) //IN: Attribute for a given path
+static uint32
+HgfsCacheHash(const char *path)  //IN: Path of file or directory
 {
-   HgfsAttrCache *tmp;
-   int res = -1;
-   int diff;
-
-   pthread_mutex_lock(&HgfsAttrCacheLock);
-
-   attrList.changeTime = HGFS_GET_TIME(time(NULL));
-   list_for_each_entry(tmp, &attrList.list, list) {
-      LOG(4, ("tmp->path = %d\n", tmp->path));
-      if (strcmp(path, tmp->path) == 0) {
-         LOG(4, ("cache hit. path = %s\n", tmp->path));
-
-         diff = (HGFS_GET_TIME(time(NULL)) - tmp->changeTime) / 10000000;
+   uint32 hash = 2166136261U;
 
-         LOG(4, ("time since last updated is %d seconds\n", diff));
-         if (diff <= CACHE_TIMEOUT) {
-            *attr = tmp->attr;
-            res = 0;
-         }
-         break;
-      }
+   while (*path != '\0') {
+      hash ^= (unsigned char)*path++;
+      hash *= 16777619U;
    }
-
-   pthread_mutex_unlock(&HgfsAttrCacheLock);
-   return res;
+   return hash;
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * HgfsSetAttrCache
+ * HgfsCacheShard
  *
- *    Updates the list with the given (key, attr)pair.
+ *    Shard holding the entry of a path hash.
  *
  * Results:
- *    0 on success else negative value on error
+ *    The shard.
  *
  * Side effects:
  *    None
@@ -153,52 +137,23 @@ HgfsGetAttrCache(const char* path,   //IN: Path of file or directory
  *----------------------------------------------------------------------
  */
 
-int
-HgfsSetAttrCache(const char* path,   //IN: Path of file or directory
-                 HgfsAttrInfo *attr) //IN: Attribute for a given path
+static INLINE HgfsAttrCacheShard *
+HgfsCacheShard(uint32 hash)  //IN: Hash of the path
 {
-   HgfsAttrCache *tmp;
-   int res = 0;
-
-   pthread_mutex_lock(&HgfsAttrCacheLock);
-
-   attrList.changeTime = HGFS_GET_TIME(time(NULL));
-   list_for_each_entry (tmp, &attrList.list, list) {
-      if (strcmp(path, tmp->path) == 0) {
-         tmp->attr = *attr;
-         tmp->changeTime = HGFS_GET_TIME(time(NULL));
-         LOG(4, ("cache entry updated. path = %s\n", tmp->path));
-         goto out;
-      }
-   }
-
-   tmp = malloc(sizeof(HgfsAttrCache) + strlen(path) + 1);
-   if (tmp == NULL) {
-      res = -ENOMEM;
-      goto out;
-   }
-   INIT_LIST_HEAD(&tmp->list);
-   Str_Strcpy(tmp->path, path, strlen(path) + 1);
-   tmp->attr = *attr;
-   tmp->changeTime = HGFS_GET_TIME(time(NULL));
-   list_add(&tmp->list, &attrList.list);
-   LOG(4, ("cache entry added. path = %s\n", tmp->path));
-
-out:
-   pthread_mutex_unlock(&HgfsAttrCacheLock);
-   return res;
+   return &HgfsAttrCacheShards[hash & (CACHE_SHARDS - 1)];
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * HgfsInvalidateAttrCache
+ * HgfsCacheLookup
  *
- *    Invalidate the attribute list entry for a given path.
+ *    Find the entry of a path in its shard. Called with the shard lock
+ *    held.
  *
  * Results:
- *    None
+ *    The entry, or NULL if there is none.
  *
  * Side effects:
  *    None
@@ -206,32 +161,32 @@ out:
  *----------------------------------------------------------------------
  */
 
-void
-HgfsInvalidateAttrCache(const char* path)      //IN: Path to file
+static HgfsAttrCache *
+HgfsCacheLookup(HgfsAttrCacheShard *shard,  //IN: Shard of the path
+                const char *path,           //IN: Path of file or directory
+                uint32 hash)                //IN: Hash of the path
 {
+   struct list_head *bucket;
    HgfsAttrCache *tmp;
 
-   pthread_mutex_lock(&HgfsAttrCacheLock);
-
-   list_for_each_entry (tmp, &attrList.list, list) {
-      if (strcmp(path, tmp->path) == 0) {
-         list_del(&tmp->list);
-         free(tmp);
-         break;
+   /* The low bits pick the shard, so use the next ones for the bucket. */
+   bucket = &shard->buckets[(hash / CACHE_SHARDS) & (CACHE_SHARD_BUCKETS - 1)];
+   list_for_each_entry(tmp, bucket, hashLink) {
+      if (tmp->hash == hash && strcmp(path, tmp->path) == 0) {
+         return tmp;
       }
    }
-
-   pthread_mutex_unlock(&HgfsAttrCacheLock);
+   return NULL;
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * HgfsPurgeCache:
+ * HgfsCacheRemove
  *
- *    This routine is called by an independent thread to purge the cache,
- *    deletion is based on time of last update.
+ *    Remove an entry from its shard and free it. Called with the shard
+ *    lock held.
  *
  * Results:
  *    None
@@ -242,49 +197,30 @@ HgfsInvalidateAttrCache(const char* path)      //IN: Path to file
  *----------------------------------------------------------------------
  */
 
-void*
-HgfsPurgeCache(void* unused) //IN: Thread argument
+static void
+HgfsCacheRemove(HgfsAttrCacheShard *shard,  //IN: Shard of the entry
+                HgfsAttrCache *tmp)         //IN: Entry to free
 {
-   HgfsAttrCache *tmp;
-   HgfsAttrCache *prev;
-   int diff;
-
-   while (1)
-   {
-      sleep(CACHE_PURGE_SLEEP_TIME);
-
-      pthread_mutex_lock(&HgfsAttrCacheLock);
-
-      list_for_each_entry_safe (tmp, prev, &attrList.list, list) {
-         diff = (HGFS_GET_TIME(time(NULL)) - tmp->changeTime) / 10000000;
-         if (diff > CACHE_PURGE_TIME) {
-            list_del (&tmp->list);
-            free (tmp);
-         }
-      }
-
-      pthread_mutex_unlock(&HgfsAttrCacheLock);
-   }
-   return 0;
+   list_del(&tmp->hashLink);
+   list_del(&tmp->lruLink);
+   shard->count--;
+   free(tmp);
 }
 
-#else
-
-
-GHashTable *g_hash_table;
 
 /*
  *----------------------------------------------------------------------
  *
  * HgfsInitCache
  *
- *    Creates a hash table with string as a key.
+ *    Initializes the shards of the attribute cache.
  *
  * Results:
  *    None
  *
  * Side effects:
  *    None
+ *
  *----------------------------------------------------------------------
  *
  */
@@ -292,7 +228,19 @@ GHashTable *g_hash_table;
 void
 HgfsInitCache()
 {
-   g_hash_table = g_hash_table_new(g_str_hash, g_str_equal);
+   int i;
+   int j;
+
+   for (i = 0; i < CACHE_SHARDS; i++) {
+      HgfsAttrCacheShard *shard = &HgfsAttrCacheShards[i];
+
+      pthread_mutex_init(&shard->lock, NULL);
+      for (j = 0; j < CACHE_SHARD_BUCKETS; j++) {
+         INIT_LIST_HEAD(&shard->buckets[j]);
+      }
+      INIT_LIST_HEAD(&shard->lru);
+      shard->count = 0;
+   }
 }
 
 
@@ -301,7 +249,8 @@ HgfsInitCache()
  *
  * HgfsGetAttrCache
  *
- *    Retrieves the attr from the HashTable for a given path.
+ *    Retrieves the attr from the cache for a given path. An expired
+ *    entry is freed on the way.
  *
  * Results:
  *    0 on success else -1 on error
@@ -316,25 +265,27 @@ int
 HgfsGetAttrCache(const char* path,   //IN: Path of file or directory
                  HgfsAttrInfo *attr) //IN: Attribute for a given path
 {
+   uint32 hash = HgfsCacheHash(path);
+   HgfsAttrCacheShard *shard = HgfsCacheShard(hash);
    HgfsAttrCache *tmp;
    int res = -1;
-   int diff;
 
-   pthread_mutex_lock(&HgfsAttrCacheLock);
+   pthread_mutex_lock(&shard->lock);
 
-   tmp = (HgfsAttrCache *)g_hash_table_lookup(g_hash_table, path);
+   tmp = HgfsCacheLookup(shard, path, hash);
    if (tmp != NULL) {
-      LOG(4, ("cache hit. path = %s\n", tmp->path));
-
-      diff = (HGFS_GET_TIME(time(NULL)) - tmp->changeTime) / 10000000;
-      LOG(4, ("time since last updated is %d seconds\n", diff));
-      if ( diff <= CACHE_TIMEOUT ) {
+      if (HgfsCacheNow() <= tmp->expires) {
+         LOG(4, ("cache hit. path = %s\n", tmp->path));
          *attr = tmp->attr;
+         list_move(&tmp->lruLink, &shard->lru);
          res = 0;
+      } else {
+         LOG(4, ("cache entry expired. path = %s\n", tmp->path));
+         HgfsCacheRemove(shard, tmp);
       }
    }
 
-   pthread_mutex_unlock(&HgfsAttrCacheLock);
+   pthread_mutex_unlock(&shard->lock);
    return res;
 }
 
@@ -344,7 +295,8 @@ HgfsGetAttrCache(const char* path,   //IN: Path of file or directory
  *
  * HgfsSetAttrCache
  *
- *    Updates the HashTable with the given (key, attr) pair.
+ *    Updates the cache with the given (key, attr) pair, evicting the
+ *    least recently used entry of the shard if it is full.
  *
  * Results:
  *    0 on success else negative value on error
@@ -359,33 +311,51 @@ int
 HgfsSetAttrCache(const char* path,         //IN: Path of file or directory
                  HgfsAttrInfo *attr)       //IN: Attribute for a given path
 {
+   uint32 hash = HgfsCacheHash(path);
+   HgfsAttrCacheShard *shard = HgfsCacheShard(hash);
+   uint64 expires = HgfsCacheNow() + CACHE_TIMEOUT * 1000;
+   size_t pathLen = strlen(path);
+   HgfsAttrCache *newEntry;
    HgfsAttrCache *tmp;
-   int res = 0;
 
-   pthread_mutex_lock(&HgfsAttrCacheLock);
+   /* Allocate up front to keep the shard locked for less time. */
+   newEntry = malloc(sizeof *newEntry + pathLen + 1);
+
+   pthread_mutex_lock(&shard->lock);
 
-   tmp = (HgfsAttrCache *)g_hash_table_lookup(g_hash_table, path);
+   tmp = HgfsCacheLookup(shard, path, hash);
    if (tmp != NULL) {
       tmp->attr = *attr;
-      tmp->changeTime = HGFS_GET_TIME(time(NULL));
-      goto out;
+      tmp->expires = expires;
+      list_move(&tmp->lruLink, &shard->lru);
+      LOG(4, ("cache entry updated. path = %s\n", tmp->path));
+      pthread_mutex_unlock(&shard->lock);
+      free(newEntry);
+      return 0;
    }
 
-   tmp = malloc(sizeof(HgfsAttrCache) + strlen(path) + 1);
-   if (tmp == NULL) {
+   if (newEntry == NULL) {
+      pthread_mutex_unlock(&shard->lock);
       return -ENOMEM;
-      goto out;
    }
 
-   Str_Strcpy(tmp->path, path, strlen(path) + 1);
-   tmp->attr = *attr;
-   tmp->changeTime = HGFS_GET_TIME(time(NULL));
-
-   g_hash_table_insert(g_hash_table, (gpointer)tmp->path, (gpointer)tmp);
+   if (shard->count >= CACHE_SHARD_MAX_ENTRIES) {
+      HgfsCacheRemove(shard, list_entry(shard->lru.prev, HgfsAttrCache,
+                                        lruLink));
+   }
 
-out:
-   pthread_mutex_unlock(&HgfsAttrCacheLock);
-   return res;
+   memcpy(newEntry->path, path, pathLen + 1);
+   newEntry->attr = *attr;
+   newEntry->expires = expires;
+   newEntry->hash = hash;
+   list_add(&newEntry->hashLink,
+            &shard->buckets[(hash / CACHE_SHARDS) & (CACHE_SHARD_BUCKETS - 1)]);
+   list_add(&newEntry->lruLink, &shard->lru);
+   shard->count++;
+   LOG(4, ("cache entry added. path = %s\n", newEntry->path));
+
+   pthread_mutex_unlock(&shard->lock);
+   return 0;
 }
 
 
@@ -394,7 +364,7 @@ out:
  *
  * HgfsInvalidateAttrCache
  *
- *    Invalidate the HashTable entry for a path.
+ *    Drop the cache entry for a path.
  *
  * Results:
  *    None
@@ -408,56 +378,14 @@ out:
 void
 HgfsInvalidateAttrCache(const char* path)      //IN: Path to file
 {
+   uint32 hash = HgfsCacheHash(path);
+   HgfsAttrCacheShard *shard = HgfsCacheShard(hash);
    HgfsAttrCache *tmp;
 
-   pthread_mutex_lock(&HgfsAttrCacheLock);
-   tmp = (HgfsAttrCache *)g_hash_table_lookup(g_hash_table, path);
+   pthread_mutex_lock(&shard->lock);
+   tmp = HgfsCacheLookup(shard, path, hash);
    if (tmp != NULL) {
-      tmp->changeTime = 0;
+      HgfsCacheRemove(shard, tmp);
    }
-   pthread_mutex_unlock(&HgfsAttrCacheLock);
-}
-
-/*
- *----------------------------------------------------------------------
- *
- * HgfsPurgeCache
- *
- *    This routine is called by an independent thread to purge the cache,
- *    for performance reasons, the deletion is done in random based
- *    on the order of iteration.
- *
- * Results:
- *    None
- *
- * Side effects:
- *    None
- *
- *----------------------------------------------------------------------
- */
-
-void*
-HgfsPurgeCache(void* unused)      //IN: Thread argument
-{
-   gpointer key, value;
-   GHashTableIter iter;
-
-   while (1) {
-      sleep(CACHE_PURGE_SLEEP_TIME);
-
-      pthread_mutex_lock(&HgfsAttrCacheLock);
-
-      if (g_hash_table_size(g_hash_table) >= HASH_THRESHOLD_SIZE) {
-         g_hash_table_iter_init(&iter, g_hash_table);
-         while (g_hash_table_iter_next(&iter, &key, &value) &&
-               (g_hash_table_size(g_hash_table) >= HASH_PURGE_SIZE)) {
-            g_hash_table_iter_remove(&iter);
-            free(value);
-         }
-      }
-
-      pthread_mutex_unlock(&HgfsAttrCacheLock);
-   }
-   return 0;
+   pthread_mutex_unlock(&shard->lock);
 }
-#endif
@@ -28,7 +28,6 @@
 int HgfsGetAttrCache(const char* path, HgfsAttrInfo *attr);
 int HgfsSetAttrCache(const char* path, HgfsAttrInfo *attr);
 void HgfsInitCache();
-void* HgfsPurgeCache(void*);
 void HgfsInvalidateAttrCache(const char* path);
 
 #endif
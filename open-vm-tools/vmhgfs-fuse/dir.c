@@ -22,6 +22,7 @@
  * File operations for the hgfs driver.
  */
 #include "module.h"
+#include "cache.h"
 
 
 #define HGFS_CREATE_DIR_MASK (HGFS_CREATE_DIR_VALID_FILE_NAME | \
@@ -98,7 +99,7 @@ HgfsPackDirOpenRequest(const char *path,    // IN: Path of the dir to open
 
    LOG(4, ("After buildPath = %s\n", path));
    result = CPName_ConvertTo(path,
-                             HGFS_LARGE_PACKET_MAX - (reqSize - 1),
+                             req->bufferSize - (reqSize - 1),
                              name);
    if (result < 0) {
       LOG(4, ("CP conversion failed\n"));
@@ -152,7 +153,7 @@ HgfsDirOpen(const char* path,       // IN: Path of dir to open
    HgfsHandle *replySearch;
 
    ASSERT(path);
-   req = HgfsGetNewRequest();
+   req = HgfsGetNewNameRequest(strlen(path));
    if (!req) {
       LOG(4, ("Out of memory while getting new request.\n"));
       result = -ENOMEM;
@@ -161,16 +162,6 @@ HgfsDirOpen(const char* path,       // IN: Path of dir to open
 
 retry:
    opUsed = hgfsVersionSearchOpen;
-   if (opUsed == HGFS_OP_SEARCH_OPEN_V3) {
-      HgfsReplySearchOpenV3 *requestV3 = HgfsGetReplyPayload(req);
-
-     replySearch = &requestV3->search;
-
-   } else {
-      HgfsReplySearchOpen *request = (HgfsReplySearchOpen *)HGFS_REQ_PAYLOAD(req);
-
-      replySearch = &request->search;
-   }
 
    result = HgfsPackDirOpenRequest(path, opUsed, req);
    if (result != 0) {
@@ -187,6 +178,17 @@ retry:
 
       switch (result) {
       case 0:
+         /* The reply may have moved the packet, so look at it only now. */
+         if (opUsed == HGFS_OP_SEARCH_OPEN_V3) {
+            HgfsReplySearchOpenV3 *requestV3 = HgfsGetReplyPayload(req);
+
+            replySearch = &requestV3->search;
+         } else {
+            HgfsReplySearchOpen *request =
+               (HgfsReplySearchOpen *)HGFS_REQ_PAYLOAD(req);
+
+            replySearch = &request->search;
+         }
          *handle = *replySearch;
          LOG(6, ("Set handle to %u\n", *replySearch));
          break;
@@ -217,6 +219,61 @@ out:
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsReadDirCacheAttr --
+ *
+ *    Put the attributes of a directory entry from a search read reply
+ *    into the attribute cache, so that the lookup the kernel does next
+ *    for the entry needs no getattr round trip.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsReadDirCacheAttr(const char *dirPath,  // IN: HGFS name of the directory
+                     const char *name,     // IN: Escaped entry name
+                     HgfsAttrInfo *attr)   // IN: Entry attributes
+{
+   size_t dirLen = strlen(dirPath);
+   size_t nameLen = strlen(name);
+   Bool addSlash = dirLen == 0 || dirPath[dirLen - 1] != '/';
+   char *path;
+   char *p;
+
+   if ((attr->mask & (HGFS_ATTR_VALID_TYPE | HGFS_ATTR_VALID_SIZE)) !=
+       (HGFS_ATTR_VALID_TYPE | HGFS_ATTR_VALID_SIZE) ||
+       strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+      return;
+   }
+
+   path = malloc(dirLen + 1 + nameLen + 1);
+   if (path == NULL) {
+      return;
+   }
+
+   /* Build the name the same way as the inode table does. */
+   p = path;
+   memcpy(p, dirPath, dirLen);
+   p += dirLen;
+   if (addSlash) {
+      *p++ = '/';
+   }
+   memcpy(p, name, nameLen + 1);
+
+   attr->fileName = NULL;
+   HgfsSetAttrCache(path, attr);
+   free(path);
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -243,6 +300,7 @@ static int
 HgfsReadDirFromReply(uint32 *f_pos,     // IN/OUT: Offset
                      void *vfsDirent,   // OUT: Buffer to copy dentries into
                      fuse_fill_dir_t filldir, // IN:  Filler function
+                     const char *dirPath, // IN: Directory name or NULL
                      HgfsReq *req,      // IN:  The request containing reply
                      HgfsOp opUsed,     // IN:  request type
                      Bool *done)        // OUT: Set true when there are no
@@ -371,6 +429,10 @@ HgfsReadDirFromReply(uint32 *f_pos,     // IN/OUT: Offset
       /* Reuse fileNameLength to store the filename length after escape. */
       fileNameLength = result;
 
+      if (dirPath != NULL) {
+         HgfsReadDirCacheAttr(dirPath, escName, &attr);
+      }
+
       /* Assign the correct dentry type. */
       switch (attr.type) {
       case HGFS_FILE_TYPE_SYMLINK:
@@ -400,7 +462,7 @@ HgfsReadDirFromReply(uint32 *f_pos,     // IN/OUT: Offset
       st.st_size = attr.size;
       st.st_ino = ino;
       st.st_mode = d_type << 12;
-      result = filldir(vfsDirent, escName, &st, 0);
+      result = filldir(vfsDirent, escName, &st, *f_pos + 1);
 
       if (result) {
          /*
@@ -542,6 +604,9 @@ HgfsRequestDirEntries(HgfsHandle searchHandle, // IN: Handle to dir
  *       return from readdir with a non-error.
  *
  * Results:
+ *    Entries are read starting at offset, and each entry is handed to
+ *    filldir with the offset of the entry that follows it, so a reader
+ *    whose buffer fills up can resume from where it stopped.
  *    Returns zero if on success, negative error on failure.
  *    (According to /fs/readdir.c, any non-negative return value
  *    means it succeeded).
@@ -554,13 +619,15 @@ HgfsRequestDirEntries(HgfsHandle searchHandle, // IN: Handle to dir
 
 int
 HgfsReaddir(HgfsHandle handle,        // IN:  Directory handle to read from
+            const char *dirPath,      // IN:  Directory name or NULL
+            uint32 offset,            // IN:  Offset of the first dentry
             void *dirent,             // OUT: Buffer to copy dentries into
             fuse_fill_dir_t filldir)  // IN:  Filler function
 {
    Bool done = FALSE;
    HgfsReq *request;
    int result = 0;
-   uint32 f_pos = 0;
+   uint32 f_pos = offset;
 
    ASSERT(dirent);
 
@@ -581,8 +648,8 @@ HgfsReaddir(HgfsHandle handle,        // IN:  Directory handle to read from
          break;
       }
 
-      result = HgfsReadDirFromReply(&f_pos, dirent, filldir, request, opUsed,
-                                    &done);
+      result = HgfsReadDirFromReply(&f_pos, dirent, filldir, dirPath,
+                                    request, opUsed, &done);
 
       LOG(4, ("f_pos = %d\n", f_pos));
       if (result == -ENAMETOOLONG) {
@@ -604,6 +671,83 @@ HgfsReaddir(HgfsHandle handle,        // IN:  Directory handle to read from
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsDirClose --
+ *
+ *    Close a search handle returned by HgfsDirOpen.
+ *
+ * Results:
+ *    Returns zero on success, negative error on failure.
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+HgfsDirClose(HgfsHandle handle)  // IN: Search handle to close
+{
+   HgfsReq *req;
+   HgfsOp opUsed;
+   HgfsStatus replyStatus;
+   int result = 0;
+
+   LOG(6, ("Entry(handle = %u)\n", handle));
+
+   req = HgfsGetNewNameRequest(0);
+   if (!req) {
+      LOG(4, ("Out of memory while getting new request\n"));
+      result = -ENOMEM;
+      goto out;
+   }
+
+retry:
+   opUsed = hgfsVersionSearchClose;
+   if (opUsed == HGFS_OP_SEARCH_CLOSE_V3) {
+      HgfsRequestSearchCloseV3 *requestV3 = HgfsGetRequestPayload(req);
+
+      requestV3->search = handle;
+      requestV3->reserved = 0;
+      req->payloadSize = sizeof(*requestV3) + HgfsGetRequestHeaderSize();
+
+   } else {
+      HgfsRequestSearchClose *request;
+
+      request = (HgfsRequestSearchClose *)(HGFS_REQ_PAYLOAD(req));
+      request->search = handle;
+      req->payloadSize = sizeof *request;
+   }
+
+   /* Fill in header here as payloadSize needs to be there. */
+   HgfsPackHeader(req, opUsed);
+
+   /* Send the request and process the reply. */
+   result = HgfsSendRequest(req);
+   if (result == 0) {
+      replyStatus = HgfsGetReplyStatus(req);
+      result = HgfsStatusConvertToLinux(replyStatus);
+
+      if (result == -EPROTO && opUsed == HGFS_OP_SEARCH_CLOSE_V3) {
+         LOG(4, ("Version 3 not supported. Falling back to version 1.\n"));
+         hgfsVersionSearchClose = HGFS_OP_SEARCH_CLOSE;
+         goto retry;
+      }
+   } else if (result == -EIO) {
+      LOG(4, ("Timed out. error: %d\n", result));
+   } else {
+      LOG(4, ("Unknown error: %d\n", result));
+   }
+
+out:
+   HgfsFreeRequest(req);
+   LOG(6, ("Exit(%d)\n", result));
+   return result;
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -696,7 +840,7 @@ HgfsPackCreateDirRequest(const char *path,
 
    /* Convert to CP name. */
    result = CPName_ConvertTo(path,
-                             HGFS_LARGE_PACKET_MAX - (reqSize - 1),
+                             req->bufferSize - (reqSize - 1),
                              fileName);
    if (result < 0) {
       LOG(4, ("CP conversion failed.\n"));
@@ -740,7 +884,7 @@ HgfsMkdir(const char *path,     // IN: Path to directory
 
    ASSERT(path);
 
-   req = HgfsGetNewRequest();
+   req = HgfsGetNewNameRequest(strlen(path));
    if (!req) {
       LOG(4, ("Out of memory while getting new request.\n"));
       result = -ENOMEM;
@@ -842,7 +986,7 @@ HgfsDelete(const char* path,       // IN: Path to file
       goto out;
    }
 
-   req = HgfsGetNewRequest();
+   req = HgfsGetNewNameRequest(strlen(path));
    if (!req) {
       LOG(4, ("Out of memory while getting new request.\n"));
       result = -ENOMEM;
@@ -882,7 +1026,7 @@ HgfsDelete(const char* path,       // IN: Path to file
 
    /* Convert to CP name. */
    result = CPName_ConvertTo(path,
-                             HGFS_NAME_BUFFER_SIZET(HGFS_LARGE_PACKET_MAX, reqSize),
+                             HGFS_NAME_BUFFER_SIZET(req->bufferSize, reqSize),
                              fileName);
    if (result < 0) {
       LOG(4, ("CP conversion failed.\n"));
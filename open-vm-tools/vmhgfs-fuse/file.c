@@ -29,9 +29,101 @@
 #include "hgfsUtil.h"
 #include "fsutil.h"
 #include "file.h"
+#include "cache.h"
+#include "node.h"
 #include "vm_assert.h"
 #include "vm_basic_types.h"
+#include "iopool.h"
 
+/* Chunk reads one HgfsRead call keeps in flight. */
+#define HGFS_READ_MAX_INFLIGHT      4
+
+/* Bounds of the readahead window, in chunks of HGFS_LARGE_IO_MAX bytes. */
+#define HGFS_READAHEAD_MIN_CHUNKS   1
+#define HGFS_READAHEAD_MAX_CHUNKS   4
+
+/* Chunk writes a handle may have in flight. */
+#define HGFS_WRITE_MAX_INFLIGHT     8
+
+/* Data read ahead is served no longer than cached attributes, in ms. */
+#define HGFS_READAHEAD_TTL_MSEC     (HGFS_DEFAULT_TTL * 1000)
+
+#define HGFS_FILE_STREAM_BUCKETS    64
+
+/* Streams HgfsWaitForWrites references at once. */
+#define HGFS_FILE_STREAM_WAIT_BATCH 16
+
+/*
+ * One HGFS_LARGE_IO_MAX sized read, possibly run by an I/O thread.
+ */
+typedef struct HgfsReadChunk {
+   HgfsIoJob job;                  /* Must be first */
+   HgfsHandle handle;
+   char *buf;
+   size_t count;
+   loff_t offset;
+   int result;                     /* Bytes read or negative error */
+} HgfsReadChunk;
+
+struct HgfsFileStream;
+
+/*
+ * One write whose data was copied from the caller, sent by an I/O thread.
+ */
+typedef struct HgfsWriteChunk {
+   HgfsIoJob job;                  /* Must be first */
+   struct list_head link;          /* Link in the stream's writes */
+   struct HgfsFileStream *stream;
+   size_t count;
+   loff_t offset;
+   char data[0];
+} HgfsWriteChunk;
+
+/*
+ * I/O state of an open handle.
+ *
+ * For reads: where a sequential reader would go next, how far ahead to
+ * read, and the data read ahead so far. The data is dropped when a write
+ * through any handle of the inode reaches the server, when the server
+ * reports a change or once it is older than the attribute cache timeout.
+ *
+ * For writes: the writes still in flight and the first error one of
+ * them ran into, which is reported by the next write, flush or release.
+ *
+ * The tables hold a reference on a stream until the handle is released,
+ * and every user takes one with HgfsFileStreamGet under the table lock,
+ * so a stream found through another handle of the inode stays valid
+ * until its HgfsFileStreamPut.
+ */
+typedef struct HgfsFileStream {
+   struct list_head hashLink;      /* Link in gHgfsFileStreams */
+   struct list_head inoLink;       /* Link in gHgfsFileStreamsByIno */
+   uint32 refCount;                /* Protected by gHgfsFileStreamsLock */
+   HgfsHandle handle;
+   fuse_ino_t ino;                 /* Inode the handle is open on */
+   Bool readStale;                 /* Read ahead data must be dropped */
+   pthread_mutex_t readLock;       /* Serializes readers of the handle */
+   loff_t nextOffset;              /* End of the last read */
+   uint32 window;                  /* Readahead chunks, 0 if random */
+   char *buf;                      /* Prefetch buffer, allocated on demand */
+   loff_t bufOffset;               /* File offset of buf[0] */
+   size_t bufLen;                  /* Valid bytes at buf */
+   uint64 bufTime;                 /* When the data at buf was first read */
+   loff_t prefetchEnd;             /* End of the data being prefetched */
+   uint32 prefetchCount;           /* Chunks being prefetched */
+   HgfsIoBatch prefetch;
+   HgfsReadChunk chunks[HGFS_READAHEAD_MAX_CHUNKS];
+   pthread_mutex_t writeLock;      /* Serializes writers of the handle */
+   pthread_mutex_t writesLock;     /* Protects writes and writeError */
+   struct list_head writes;        /* HgfsWriteChunks in flight */
+   int writeError;                 /* First error not reported yet */
+   HgfsIoBatch writeBatch;
+} HgfsFileStream;
+
+static struct list_head gHgfsFileStreams[HGFS_FILE_STREAM_BUCKETS];
+static struct list_head gHgfsFileStreamsByIno[HGFS_FILE_STREAM_BUCKETS];
+static Bool gHgfsFileStreamsInited;
+static pthread_mutex_t gHgfsFileStreamsLock = PTHREAD_MUTEX_INITIALIZER;
 
 
 static int
@@ -171,7 +263,7 @@ HgfsPackOpenRequest(const char *path,          // IN: Path to file
 
    /* Convert to CP name. */
    result = CPName_ConvertTo(path,
-                             HGFS_LARGE_PACKET_MAX - (reqSize - 1),
+                             req->bufferSize - (reqSize - 1),
                              name);
    if (result < 0) {
       LOG(4, ("CP conversion failed.\n"));
@@ -388,7 +480,7 @@ HgfsOpenInt(const char *path,           //IN: Path to a file
 
    LOG(4, ("Entry(%s)\n", path));
 
-   req = HgfsGetNewRequest();
+   req = HgfsGetNewNameRequest(strlen(path));
    if (!req) {
       LOG(4, ("Out of memory while getting new request.\n"));
       result = -ENOMEM;
@@ -607,42 +699,566 @@ HgfsDoRead(HgfsHandle handle,  // IN:  Handle for this file
             goto out;
          }
 
-         if (0 == actualSize) {
-            /* We got no bytes, so don't need to copy to user. */
-            LOG(8, ("Server reply returned zero\n"));
-            result = actualSize;
-            goto out;
-         }
+         if (0 == actualSize) {
+            /* We got no bytes, so don't need to copy to user. */
+            LOG(8, ("Server reply returned zero\n"));
+            result = actualSize;
+            goto out;
+         }
+
+         /* Return result. */
+         memcpy(buf, payload, actualSize);
+         LOG(8, ("Copied %u\n", actualSize));
+         result = actualSize;
+         break;
+
+      case -EPROTO:
+         /* Retry with older version(s). Set globally. */
+         if (opUsed == HGFS_OP_READ_V3) {
+            LOG(4, ("Version 3 not supported. Falling back to version 1.\n"));
+            hgfsVersionRead = HGFS_OP_READ;
+            goto retry;
+         }
+         break;
+
+      default:
+         break;
+      }
+   } else if (result == -EIO) {
+      LOG(8, ("Error: send request timed out\n"));
+   } else if (result == -EPROTO) {
+      LOG(4, ("Error: send request server returned error: %d\n", result));
+   } else {
+      LOG(4, ("Error: send request unknown : %d\n", result));
+   }
+
+out:
+   HgfsFreeRequest(req);
+   LOG(4, ("Exit(%d)\n", result));
+   return result;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsReadChunkRun --
+ *
+ *    I/O job reading one chunk.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsReadChunkRun(HgfsIoJob *job)  // IN: HgfsReadChunk to read
+{
+   HgfsReadChunk *chunk = (HgfsReadChunk *)job;
+
+   chunk->result = HgfsDoRead(chunk->handle, chunk->buf, chunk->count,
+                              chunk->offset);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsReadDirect --
+ *
+ *    Read from the server with up to HGFS_READ_MAX_INFLIGHT chunk
+ *    requests in flight. The calling thread reads the first chunk of
+ *    each round itself.
+ *
+ * Results:
+ *    Returns the number of bytes read, which is short only at the end of
+ *    the file or after an error, or a negative error if nothing could be
+ *    read.
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static ssize_t
+HgfsReadDirect(HgfsHandle handle,  // IN:  Handle for this file
+               char *buf,          // OUT: Buffer to copy data into
+               size_t count,       // IN:  Number of bytes to read
+               loff_t offset)      // IN:  Offset at which to read
+{
+   HgfsReadChunk chunks[HGFS_READ_MAX_INFLIGHT];
+   HgfsIoBatch batch;
+   size_t done = 0;
+   ssize_t result = 0;
+
+   HgfsIoBatchInit(&batch);
+
+   while (done < count) {
+      size_t next = done;
+      uint32 n = 0;
+      uint32 i;
+
+      while (n < HGFS_READ_MAX_INFLIGHT && next < count) {
+         chunks[n].handle = handle;
+         chunks[n].buf = buf + next;
+         chunks[n].count = MIN(count - next, HGFS_LARGE_IO_MAX);
+         chunks[n].offset = offset + next;
+         next += chunks[n].count;
+         n++;
+      }
+
+      LOG(4, ("Issue %u reads(0x%"FMTSZ"x bytes @ 0x%"FMT64"x)\n",
+              n, next - done, offset + done));
+      for (i = 1; i < n; i++) {
+         HgfsIoBatchSubmit(&batch, &chunks[i].job, HgfsReadChunkRun);
+      }
+      HgfsReadChunkRun(&chunks[0].job);
+      HgfsIoBatchWait(&batch);
+
+      /* Only the data up to the first short or failed chunk counts. */
+      for (i = 0; i < n; i++) {
+         if (chunks[i].result < 0) {
+            LOG(8, ("Error: DoRead: -> %d\n", chunks[i].result));
+            result = done > 0 ? done : chunks[i].result;
+            goto out;
+         }
+         done += chunks[i].result;
+         if (chunks[i].result < chunks[i].count) {
+            result = done;
+            goto out;
+         }
+      }
+   }
+   result = done;
+
+out:
+   HgfsIoBatchDestroy(&batch);
+   return result;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsFileStreamNow --
+ *
+ *    Current monotonic time.
+ *
+ * Results:
+ *    The time in milliseconds.
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static uint64
+HgfsFileStreamNow(void)
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (uint64)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsFileStreamInoBucket --
+ *
+ *    Find the bucket of the streams of an inode. Inode numbers are node
+ *    addresses, so the low bits carry no information. The streams lock
+ *    must be held.
+ *
+ * Results:
+ *    The bucket.
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static struct list_head *
+HgfsFileStreamInoBucket(fuse_ino_t ino)  // IN: Inode
+{
+   return &gHgfsFileStreamsByIno[((ino >> 4) ^ (ino >> 12)) %
+                                 HGFS_FILE_STREAM_BUCKETS];
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsFileStreamGet --
+ *
+ *    Look up the I/O state of a handle, optionally creating it for the
+ *    inode the handle is open on. Release it with HgfsFileStreamPut.
+ *
+ * Results:
+ *    The referenced stream, or NULL if there is none and it was not
+ *    created.
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static HgfsFileStream *
+HgfsFileStreamGet(HgfsHandle handle,  // IN: Open file handle
+                  fuse_ino_t ino,     // IN: Inode, if create is set
+                  Bool create)        // IN: Create it if not found
+{
+   struct list_head *bucket;
+   HgfsFileStream *stream;
+   int i;
+
+   pthread_mutex_lock(&gHgfsFileStreamsLock);
+   if (!gHgfsFileStreamsInited) {
+      for (i = 0; i < HGFS_FILE_STREAM_BUCKETS; i++) {
+         INIT_LIST_HEAD(&gHgfsFileStreams[i]);
+         INIT_LIST_HEAD(&gHgfsFileStreamsByIno[i]);
+      }
+      gHgfsFileStreamsInited = TRUE;
+   }
+
+   bucket = &gHgfsFileStreams[handle % HGFS_FILE_STREAM_BUCKETS];
+   list_for_each_entry(stream, bucket, hashLink) {
+      if (stream->handle == handle) {
+         stream->refCount++;
+         goto out;
+      }
+   }
+
+   stream = NULL;
+   if (create) {
+      stream = calloc(1, sizeof *stream);
+      if (stream == NULL) {
+         goto out;
+      }
+      stream->refCount = 2;   /* The tables and the caller */
+      stream->handle = handle;
+      stream->ino = ino;
+      pthread_mutex_init(&stream->readLock, NULL);
+      HgfsIoBatchInit(&stream->prefetch);
+      pthread_mutex_init(&stream->writeLock, NULL);
+      pthread_mutex_init(&stream->writesLock, NULL);
+      INIT_LIST_HEAD(&stream->writes);
+      HgfsIoBatchInit(&stream->writeBatch);
+      list_add(&stream->hashLink, bucket);
+      list_add(&stream->inoLink, HgfsFileStreamInoBucket(ino));
+   }
+
+out:
+   pthread_mutex_unlock(&gHgfsFileStreamsLock);
+   return stream;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsFileStreamPut --
+ *
+ *    Drop a reference on a stream, freeing it with the last one.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsFileStreamPut(HgfsFileStream *stream)  // IN: Stream
+{
+   Bool last;
+
+   pthread_mutex_lock(&gHgfsFileStreamsLock);
+   ASSERT(stream->refCount > 0);
+   last = --stream->refCount == 0;
+   pthread_mutex_unlock(&gHgfsFileStreamsLock);
+
+   if (!last) {
+      return;
+   }
+
+   /* The handle was released, which waited for all the I/O. */
+   HgfsIoBatchDestroy(&stream->prefetch);
+   HgfsIoBatchDestroy(&stream->writeBatch);
+   pthread_mutex_destroy(&stream->readLock);
+   pthread_mutex_destroy(&stream->writeLock);
+   pthread_mutex_destroy(&stream->writesLock);
+   free(stream->buf);
+   free(stream);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsReadStreamFinishPrefetch --
+ *
+ *    Wait for the prefetch in flight and add what it read to the
+ *    buffer. Called with the read lock held.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsReadStreamFinishPrefetch(HgfsFileStream *stream)  // IN: Read stream
+{
+   uint32 i;
+
+   if (stream->prefetchCount == 0) {
+      return;
+   }
+
+   HgfsIoBatchWait(&stream->prefetch);
+
+   /* Errors are dropped here; a real read of the range reports them. */
+   for (i = 0; i < stream->prefetchCount; i++) {
+      HgfsReadChunk *chunk = &stream->chunks[i];
+
+      if (chunk->result < 0) {
+         break;
+      }
+      stream->bufLen += chunk->result;
+      if (chunk->result < chunk->count) {
+         break;
+      }
+   }
+   stream->prefetchCount = 0;
+   stream->prefetchEnd = stream->bufOffset + stream->bufLen;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsReadStreamStartPrefetch --
+ *
+ *    Start reading the window past nextOffset into the prefetch buffer,
+ *    keeping the part of the buffer that was not consumed yet. Called
+ *    with the read lock held and no prefetch in flight.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsReadStreamStartPrefetch(HgfsFileStream *stream)  // IN: Read stream
+{
+   size_t target = stream->window * HGFS_LARGE_IO_MAX;
+   size_t keep = 0;
+   size_t next;
+
+   ASSERT(stream->prefetchCount == 0);
+   ASSERT(target <= HGFS_READAHEAD_MAX_CHUNKS * HGFS_LARGE_IO_MAX);
+
+   if (stream->buf == NULL) {
+      stream->buf = malloc(HGFS_READAHEAD_MAX_CHUNKS * HGFS_LARGE_IO_MAX);
+      if (stream->buf == NULL) {
+         return;
+      }
+   }
+
+   if (stream->nextOffset >= stream->bufOffset &&
+       stream->nextOffset < stream->bufOffset + stream->bufLen) {
+      keep = stream->bufOffset + stream->bufLen - stream->nextOffset;
+      if (keep >= target / 2) {
+         /* Still far enough ahead of the reader. */
+         return;
+      }
+      memmove(stream->buf, stream->buf + (stream->nextOffset - stream->bufOffset),
+              keep);
+   }
+   if (keep == 0) {
+      stream->bufTime = HgfsFileStreamNow();
+   }
+   stream->bufOffset = stream->nextOffset;
+   stream->bufLen = keep;
+
+   for (next = keep; next < target; next += HGFS_LARGE_IO_MAX) {
+      HgfsReadChunk *chunk = &stream->chunks[stream->prefetchCount++];
+
+      chunk->handle = stream->handle;
+      chunk->buf = stream->buf + next;
+      chunk->count = MIN(target - next, HGFS_LARGE_IO_MAX);
+      chunk->offset = stream->bufOffset + next;
+      HgfsIoBatchSubmit(&stream->prefetch, &chunk->job, HgfsReadChunkRun);
+   }
+   stream->prefetchEnd = stream->bufOffset + target;
+
+   LOG(8, ("Prefetching %u chunks @ 0x%"FMT64"x\n", stream->prefetchCount,
+           stream->bufOffset + keep));
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsReadStreamDrop --
+ *
+ *    Drop the data read ahead on a handle. Called with the read lock
+ *    held.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsReadStreamDrop(HgfsFileStream *stream)  // IN: Read stream
+{
+   HgfsReadStreamFinishPrefetch(stream);
+   stream->bufLen = 0;
+   stream->prefetchEnd = stream->bufOffset;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsReadStreamCheckStale --
+ *
+ *    Drop the data read ahead on a handle if the file changed since or
+ *    the data is older than HGFS_READAHEAD_TTL_MSEC. Called with the
+ *    read lock held.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsReadStreamCheckStale(HgfsFileStream *stream)  // IN: Read stream
+{
+   Bool stale;
+
+   pthread_mutex_lock(&gHgfsFileStreamsLock);
+   stale = stream->readStale;
+   stream->readStale = FALSE;
+   pthread_mutex_unlock(&gHgfsFileStreamsLock);
+
+   if (!stale && (stream->bufLen > 0 || stream->prefetchCount > 0) &&
+       HgfsFileStreamNow() - stream->bufTime >= HGFS_READAHEAD_TTL_MSEC) {
+      LOG(8, ("Read ahead data of handle %u expired\n", stream->handle));
+      stale = TRUE;
+   }
+   if (stale) {
+      HgfsReadStreamDrop(stream);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsInvalidateReadAhead --
+ *
+ *    Mark the data read ahead on all the handles of an inode as stale,
+ *    after a write through any of them reached the server or the file
+ *    changed there. Each reader drops it before its next read; a reader
+ *    that read from the server before the write landed finds the mark
+ *    set again.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+HgfsInvalidateReadAhead(fuse_ino_t ino)  // IN: Inode
+{
+   HgfsFileStream *stream;
+
+   pthread_mutex_lock(&gHgfsFileStreamsLock);
+   if (gHgfsFileStreamsInited) {
+      list_for_each_entry(stream, HgfsFileStreamInoBucket(ino), inoLink) {
+         if (stream->ino == ino) {
+            stream->readStale = TRUE;
+         }
+      }
+   }
+   pthread_mutex_unlock(&gHgfsFileStreamsLock);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsFileStreamRelease --
+ *
+ *    Remove the I/O state of a handle that is being closed from the
+ *    tables and wait for its I/O. It is freed once no other thread
+ *    uses it.
+ *
+ * Results:
+ *    The error of a write that failed after it was accepted, 0 if none.
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+HgfsFileStreamRelease(HgfsHandle handle)  // IN: Open file handle
+{
+   HgfsFileStream *stream = HgfsFileStreamGet(handle, 0, FALSE);
+   int result;
 
-         /* Return result. */
-         memcpy(buf, payload, actualSize);
-         LOG(8, ("Copied %u\n", actualSize));
-         result = actualSize;
-         break;
+   if (stream == NULL) {
+      return 0;
+   }
 
-      case -EPROTO:
-         /* Retry with older version(s). Set globally. */
-         if (opUsed == HGFS_OP_READ_V3) {
-            LOG(4, ("Version 3 not supported. Falling back to version 1.\n"));
-            hgfsVersionRead = HGFS_OP_READ;
-            goto retry;
-         }
-         break;
+   pthread_mutex_lock(&gHgfsFileStreamsLock);
+   list_del(&stream->hashLink);
+   list_del(&stream->inoLink);
+   ASSERT(stream->refCount > 1);
+   stream->refCount--;     /* The tables' reference */
+   pthread_mutex_unlock(&gHgfsFileStreamsLock);
 
-      default:
-         break;
-      }
-   } else if (result == -EIO) {
-      LOG(8, ("Error: send request timed out\n"));
-   } else if (result == -EPROTO) {
-      LOG(4, ("Error: send request server returned error: %d\n", result));
-   } else {
-      LOG(4, ("Error: send request unknown : %d\n", result));
-   }
+   /* Both use the handle, so they must end before the close. */
+   HgfsIoBatchWait(&stream->prefetch);
+   HgfsIoBatchWait(&stream->writeBatch);
+   result = stream->writeError;
 
-out:
-   HgfsFreeRequest(req);
-   LOG(4, ("Exit(%d)\n", result));
+   HgfsFileStreamPut(stream);
    return result;
 }
 
@@ -654,6 +1270,13 @@ out:
  *
  *    Called whenever a process reads from a file in our filesystem.
  *
+ *    Reads continuing where the previous one on the handle ended, or
+ *    falling into the data read ahead, count as sequential. Each one
+ *    doubles the readahead window up to HGFS_READAHEAD_MAX_CHUNKS and
+ *    starts reading it in the background; any other read closes the
+ *    window. Data read ahead is not used once it is stale, see
+ *    HgfsReadStreamCheckStale.
+ *
  * Results:
  *    Returns the number of bytes read on success, or an error on
  *    failure.
@@ -666,14 +1289,15 @@ out:
 
 ssize_t
 HgfsRead(struct fuse_file_info *fi,  // IN:  File info struct
+         fuse_ino_t ino,             // IN:  Inode of the file
          char  *buf,                 // OUT: User buffer to copy data into
          size_t count,               // IN:  Number of bytes to read
          loff_t offset)              // IN:  Offset at which to read
 {
-   int result = 0;
-   char *buffer = buf;
-   loff_t curOffset = offset;
-   size_t nextCount, remainingCount = count;
+   HgfsFileStream *stream;
+   Bool sequential;
+   size_t copied = 0;
+   ssize_t result;
 
    ASSERT(NULL != fi);
    ASSERT(NULL != buf);
@@ -681,27 +1305,66 @@ HgfsRead(struct fuse_file_info *fi,  // IN:  File info struct
    LOG(4, ("Entry(0x%"FMT64"x 0x%"FMTSZ"x bytes @ 0x%"FMT64"x)\n",
            fi->fh, count, offset));
 
-    do {
-      nextCount = (remainingCount > HGFS_LARGE_IO_MAX) ?
-                                     HGFS_LARGE_IO_MAX : remainingCount;
-      LOG(4, ("Issue DoRead(0x%"FMT64"x 0x%"FMTSZ"x bytes @ 0x%"FMT64"x)\n",
-              fi->fh, nextCount, curOffset));
-      result = HgfsDoRead(fi->fh, buffer, nextCount, curOffset);
-      if (result < 0) {
-         LOG(8, ("Error: DoRead: -> %d\n", result));
-         goto out;
+   stream = HgfsFileStreamGet(fi->fh, ino, TRUE);
+   if (stream == NULL) {
+      result = HgfsReadDirect(fi->fh, buf, count, offset);
+      goto out;
+   }
+
+   /* Reads see the data of the writes before them, on any handle. */
+   HgfsWaitForWrites(ino);
+
+   pthread_mutex_lock(&stream->readLock);
+   HgfsReadStreamCheckStale(stream);
+
+   sequential = offset == stream->nextOffset ||
+                (offset >= stream->bufOffset && offset < stream->prefetchEnd);
+
+   if (stream->prefetchCount > 0 &&
+       offset >= stream->bufOffset && offset < stream->prefetchEnd) {
+      HgfsReadStreamFinishPrefetch(stream);
+   }
+
+   /* A prefetch in flight only writes past bufLen. */
+   if (offset >= stream->bufOffset &&
+       offset < stream->bufOffset + stream->bufLen) {
+      copied = MIN(count, stream->bufOffset + stream->bufLen - offset);
+      memcpy(buf, stream->buf + (offset - stream->bufOffset), copied);
+      LOG(8, ("Copied 0x%"FMTSZ"x prefetched bytes\n", copied));
+   }
+
+   result = 0;
+   if (copied < count) {
+      result = HgfsReadDirect(fi->fh, buf + copied, count - copied,
+                              offset + copied);
+      if (result < 0 && copied == 0) {
+         stream->window = 0;
+         goto unlock;
       }
-      remainingCount -= result;
-      curOffset += result;
-      buffer += result;
+   }
+   result = copied + MAX(result, 0);
 
-   } while ((result > 0) && (remainingCount > 0));
+   if (sequential) {
+      stream->window = stream->window == 0 ? HGFS_READAHEAD_MIN_CHUNKS :
+                       MIN(stream->window * 2, HGFS_READAHEAD_MAX_CHUNKS);
+   } else {
+      stream->window = 0;
+   }
+   stream->nextOffset = offset + result;
+
+   if (stream->window > 0 && result == count && stream->prefetchCount == 0) {
+      HgfsReadStreamStartPrefetch(stream);
+   }
 
-  memset(buffer, 0, remainingCount);
+   memset(buf + result, 0, count - result);
 
-  out:
-   LOG(4, ("Exit(%"FMTSZ"d)\n", count - remainingCount));
-   return (count - remainingCount);
+unlock:
+   pthread_mutex_unlock(&stream->readLock);
+   HgfsFileStreamPut(stream);
+
+out:
+   LOG(4, ("Exit(%"FMTSZ"d)\n", result));
+   return result;
 }
 
 
@@ -835,9 +1498,9 @@ out:
 /*
  *----------------------------------------------------------------------
  *
- * HgfsWrite --
+ * HgfsWriteDirect --
  *
- *    Called whenever a process writes to a file in our filesystem.
+ *    Write to the server one chunk at a time, waiting for each reply.
  *
  * Results:
  *    Returns the number of bytes written on success, or an error on
@@ -849,36 +1512,28 @@ out:
  *----------------------------------------------------------------------
  */
 
-ssize_t
-HgfsWrite(struct fuse_file_info *fi,  // IN: File info structure
-         const char  *buf,            // OUT: User buffer to copy data into
-         size_t count,                // IN:  Number of bytes to read
-         loff_t offset)               // IN:  Offset at which to read
+static ssize_t
+HgfsWriteDirect(HgfsHandle handle,  // IN: Handle for this file
+                const char *buf,    // IN: Data to write
+                size_t count,       // IN: Number of bytes to write
+                loff_t offset)      // IN: Offset at which to write
 {
    int result;
    const char *buffer = buf;
    loff_t curOffset = offset;
    size_t nextCount, remainingCount = count;
-   ssize_t bytesWritten = 0;
-
-   ASSERT(NULL != buf);
-   ASSERT(NULL != fi);
-
-   LOG(6, ("Entry(0x%"FMT64"x off bytes 0x%"FMTSZ"x @ 0x%"FMT64"x)\n",
-           fi->fh, count, offset));
 
    do {
       nextCount = (remainingCount > HGFS_LARGE_IO_MAX) ?
                                      HGFS_LARGE_IO_MAX : remainingCount;
 
-      LOG(4, ("Issue DoWrite(0x%"FMT64"x 0x%"FMTSZ"x bytes @ 0x%"FMT64"x)\n",
-              fi->fh, nextCount, curOffset));
+      LOG(4, ("Issue DoWrite(0x%x 0x%"FMTSZ"x bytes @ 0x%"FMT64"x)\n",
+              handle, nextCount, curOffset));
 
-      result = HgfsDoWrite(fi->fh, buffer, nextCount, curOffset);
+      result = HgfsDoWrite(handle, buffer, nextCount, curOffset);
       if (result < 0) {
-         bytesWritten = result;
          LOG(4, ("Error: DoWrite -> %d\n", result));
-         goto out;
+         return result;
       }
       remainingCount -= result;
       curOffset += result;
@@ -886,7 +1541,234 @@ HgfsWrite(struct fuse_file_info *fi,  // IN: File info structure
 
    } while ((result > 0) && (remainingCount > 0));
 
-   bytesWritten = count - remainingCount;
+   return count - remainingCount;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsWriteChunkRun --
+ *
+ *    I/O job writing one chunk. Records a failure in the stream and
+ *    frees the chunk.
+ *
+ *    The attributes cached for the file and the data read ahead on its
+ *    handles are dropped once the server has the data, so that a lookup,
+ *    readdir or read which ran while the chunk was in flight does not
+ *    leave the old contents behind. The handle is open, so its node is
+ *    too.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsWriteChunkRun(HgfsIoJob *job)  // IN: HgfsWriteChunk to write
+{
+   HgfsWriteChunk *chunk = (HgfsWriteChunk *)job;
+   HgfsFileStream *stream = chunk->stream;
+   HgfsFuseNodePath path;
+   ssize_t result;
+
+   result = HgfsWriteDirect(stream->handle, chunk->data, chunk->count,
+                            chunk->offset);
+   if (result >= 0 && result < chunk->count) {
+      /* The caller was told everything was written. */
+      LOG(4, ("Short write 0x%"FMTSZ"x of 0x%"FMTSZ"x bytes\n",
+              result, chunk->count));
+      result = -EIO;
+   }
+
+   if (HgfsNodeGetPath(HgfsNodeGet(stream->ino), &path) == 0) {
+      HgfsInvalidateAttrCache(path.path);
+      HgfsNodePutPath(&path);
+   }
+   HgfsInvalidateReadAhead(stream->ino);
+
+   pthread_mutex_lock(&stream->writesLock);
+   list_del(&chunk->link);
+   if (result < 0 && stream->writeError == 0) {
+      stream->writeError = result;
+   }
+   pthread_mutex_unlock(&stream->writesLock);
+
+   free(chunk);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsWriteStreamOverlaps --
+ *
+ *    Check whether a range overlaps a write in flight.
+ *
+ * Results:
+ *    TRUE if it does.
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Bool
+HgfsWriteStreamOverlaps(HgfsFileStream *stream,  // IN: Stream
+                        loff_t offset,           // IN: Start of the range
+                        size_t count)            // IN: Length of the range
+{
+   HgfsWriteChunk *chunk;
+   Bool overlaps = FALSE;
+
+   pthread_mutex_lock(&stream->writesLock);
+   list_for_each_entry(chunk, &stream->writes, link) {
+      if (offset < chunk->offset + chunk->count &&
+          chunk->offset < offset + count) {
+         overlaps = TRUE;
+         break;
+      }
+   }
+   pthread_mutex_unlock(&stream->writesLock);
+
+   return overlaps;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsWriteStreamTakeError --
+ *
+ *    Get and clear the error of a write that failed after it was
+ *    accepted.
+ *
+ * Results:
+ *    The error, or 0 if there was none.
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+HgfsWriteStreamTakeError(HgfsFileStream *stream)  // IN: Stream
+{
+   int result;
+
+   pthread_mutex_lock(&stream->writesLock);
+   result = stream->writeError;
+   stream->writeError = 0;
+   pthread_mutex_unlock(&stream->writesLock);
+
+   return result;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsWrite --
+ *
+ *    Called whenever a process writes to a file in our filesystem.
+ *
+ *    The data is copied and sent by the I/O threads, with up to
+ *    HGFS_WRITE_MAX_INFLIGHT chunks in flight per handle; a write
+ *    overlapping one in flight waits for all of them first so that
+ *    the server sees overlapping data in order. A failure is returned
+ *    by the next write, HgfsFlush or HgfsRelease on the handle.
+ *
+ * Results:
+ *    Returns the number of bytes accepted on success, or an error on
+ *    failure.
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+ssize_t
+HgfsWrite(struct fuse_file_info *fi,  // IN: File info structure
+         fuse_ino_t ino,              // IN: Inode of the file
+         const char  *buf,            // IN: Data to write
+         size_t count,                // IN: Number of bytes to write
+         loff_t offset)               // IN: Offset at which to write
+{
+   HgfsFileStream *stream;
+   size_t done = 0;
+   ssize_t bytesWritten;
+
+   ASSERT(NULL != buf);
+   ASSERT(NULL != fi);
+
+   LOG(6, ("Entry(0x%"FMT64"x off bytes 0x%"FMTSZ"x @ 0x%"FMT64"x)\n",
+           fi->fh, count, offset));
+
+   stream = HgfsFileStreamGet(fi->fh, ino, TRUE);
+   if (stream == NULL) {
+      bytesWritten = HgfsWriteDirect(fi->fh, buf, count, offset);
+      HgfsInvalidateReadAhead(ino);
+      goto out;
+   }
+
+   pthread_mutex_lock(&stream->writeLock);
+
+   bytesWritten = HgfsWriteStreamTakeError(stream);
+   if (bytesWritten < 0) {
+      goto unlock;
+   }
+
+   while (done < count) {
+      size_t nextCount = MIN(count - done, HGFS_LARGE_IO_MAX);
+      HgfsWriteChunk *chunk;
+
+      if (HgfsWriteStreamOverlaps(stream, offset + done, nextCount)) {
+         HgfsIoBatchWait(&stream->writeBatch);
+      } else {
+         HgfsIoBatchWaitPending(&stream->writeBatch,
+                                HGFS_WRITE_MAX_INFLIGHT - 1);
+      }
+
+      chunk = malloc(sizeof *chunk + nextCount);
+      if (chunk == NULL) {
+         /* Write the rest in place, after everything before it. */
+         HgfsIoBatchWait(&stream->writeBatch);
+         bytesWritten = HgfsWriteDirect(fi->fh, buf + done, count - done,
+                                        offset + done);
+         HgfsInvalidateReadAhead(ino);
+         if (bytesWritten < 0 && done == 0) {
+            goto unlock;
+         }
+         done += MAX(bytesWritten, 0);
+         break;
+      }
+
+      chunk->stream = stream;
+      chunk->count = nextCount;
+      chunk->offset = offset + done;
+      memcpy(chunk->data, buf + done, nextCount);
+
+      pthread_mutex_lock(&stream->writesLock);
+      list_add_tail(&chunk->link, &stream->writes);
+      pthread_mutex_unlock(&stream->writesLock);
+
+      LOG(4, ("Queue write(0x%"FMT64"x 0x%"FMTSZ"x bytes @ 0x%"FMT64"x)\n",
+              fi->fh, nextCount, chunk->offset));
+      HgfsIoBatchSubmit(&stream->writeBatch, &chunk->job, HgfsWriteChunkRun);
+      done += nextCount;
+   }
+   bytesWritten = done;
+
+unlock:
+   pthread_mutex_unlock(&stream->writeLock);
+   HgfsFileStreamPut(stream);
 
 out:
    LOG(6, ("Exit(0x%"FMTSZ"x)\n", bytesWritten));
@@ -894,6 +1776,102 @@ out:
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsWaitForWrites --
+ *
+ *    Wait for the writes in flight on all the handles of an inode,
+ *    leaving any error to be reported to the writers. Used before
+ *    reading or asking the server about data that the writes may
+ *    change.
+ *
+ *    Busy streams are referenced HGFS_FILE_STREAM_WAIT_BATCH at a time
+ *    and waited for outside the table lock. Streams that start writing
+ *    after a pass that found fewer are not waited for.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+HgfsWaitForWrites(fuse_ino_t ino)  // IN: Inode
+{
+   HgfsFileStream *streams[HGFS_FILE_STREAM_WAIT_BATCH];
+   uint32 numStreams;
+
+   do {
+      HgfsFileStream *stream;
+      uint32 i;
+
+      numStreams = 0;
+      pthread_mutex_lock(&gHgfsFileStreamsLock);
+      if (gHgfsFileStreamsInited) {
+         list_for_each_entry(stream, HgfsFileStreamInoBucket(ino), inoLink) {
+            if (stream->ino == ino && HgfsIoBatchBusy(&stream->writeBatch)) {
+               stream->refCount++;
+               streams[numStreams++] = stream;
+               if (numStreams == ARRAYSIZE(streams)) {
+                  break;
+               }
+            }
+         }
+      }
+      pthread_mutex_unlock(&gHgfsFileStreamsLock);
+
+      for (i = 0; i < numStreams; i++) {
+         HgfsIoBatchWait(&streams[i]->writeBatch);
+         HgfsFileStreamPut(streams[i]);
+      }
+   } while (numStreams == ARRAYSIZE(streams));
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsFlush --
+ *
+ *    Wait for the writes in flight on a handle, for flush and fsync.
+ *
+ * Results:
+ *    Returns the error of a write that failed after it was accepted and
+ *    was not reported yet, or zero.
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+HgfsFlush(HgfsHandle handle)  // IN: Open file handle
+{
+   HgfsFileStream *stream = HgfsFileStreamGet(handle, 0, FALSE);
+   int result;
+
+   if (stream == NULL) {
+      return 0;
+   }
+
+   LOG(6, ("Entry(handle = %u)\n", handle));
+
+   pthread_mutex_lock(&stream->writeLock);
+   HgfsIoBatchWait(&stream->writeBatch);
+   result = HgfsWriteStreamTakeError(stream);
+   pthread_mutex_unlock(&stream->writeLock);
+   HgfsFileStreamPut(stream);
+
+   LOG(6, ("Exit(%d)\n", result));
+   return result;
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -929,7 +1907,7 @@ HgfsRename(const char* from, const char* to)
    ASSERT(from);
    ASSERT(to);
 
-   req = HgfsGetNewRequest();
+   req = HgfsGetNewNameRequest(strlen(from) + strlen(to));
    if (!req) {
       LOG(4, ("Out of memory while getting new request\n"));
       result = -ENOMEM;
@@ -958,7 +1936,7 @@ retry:
    }
    /* Convert old name to CP format. */
    result = CPName_ConvertTo(from,
-                             HGFS_NAME_BUFFER_SIZET(HGFS_LARGE_PACKET_MAX, reqSize),
+                             HGFS_NAME_BUFFER_SIZET(req->bufferSize, reqSize),
                              oldName);
    if (result < 0) {
       LOG(4, ("oldName CP conversion failed\n"));
@@ -1000,7 +1978,7 @@ retry:
 
    /* Convert new name to CP format. */
    result = CPName_ConvertTo(to,
-                             HGFS_NAME_BUFFER_SIZET(HGFS_LARGE_PACKET_MAX, reqSize) - result,
+                             HGFS_NAME_BUFFER_SIZET(req->bufferSize, reqSize) - result,
                              newName);
    if (result < 0) {
       LOG(4, ("newName CP conversion failed\n"));
@@ -1149,7 +2127,7 @@ HgfsPackSetattrRequest(const char *path,   // IN:  path to file
       requestV3->fileName.flags = 0;
       requestV3->reserved = 0;
       reqSize = sizeof(*requestV3) + HgfsGetRequestHeaderSize();
-      reqBufferSize = HGFS_NAME_BUFFER_SIZET(HGFS_LARGE_PACKET_MAX, reqSize);
+      reqBufferSize = HGFS_NAME_BUFFER_SIZET(req->bufferSize, reqSize);
 
       attrV2->mask = attr->mask;
       if (attr->mask & (HGFS_ATTR_VALID_SPECIAL_PERMS |
@@ -1201,7 +2179,7 @@ HgfsPackSetattrRequest(const char *path,   // IN:  path to file
       fileNameLength = &requestV2->fileName.length;
 
       reqSize = sizeof *requestV2;
-      reqBufferSize = HGFS_NAME_BUFFER_SIZE(HGFS_LARGE_PACKET_MAX, requestV2);
+      reqBufferSize = HGFS_NAME_BUFFER_SIZE(req->bufferSize, requestV2);
 
       if (attr->mask & (HGFS_ATTR_VALID_SPECIAL_PERMS |
                           HGFS_ATTR_VALID_OWNER_PERMS |
@@ -1244,7 +2222,7 @@ HgfsPackSetattrRequest(const char *path,   // IN:  path to file
       fileName = request->fileName.name;
       fileNameLength = &request->fileName.length;
       reqSize = sizeof *request;
-      reqBufferSize = HGFS_NAME_BUFFER_SIZE(HGFS_LARGE_PACKET_MAX, request);
+      reqBufferSize = HGFS_NAME_BUFFER_SIZE(req->bufferSize, request);
 
       /*
        * Clear attributes before touching them.
@@ -1333,7 +2311,7 @@ HgfsSetattr(const char* path,       //IN: Path to file
 
    LOG(4, ("Entry(%s)\n", path));
 
-   req = HgfsGetNewRequest();
+   req = HgfsGetNewNameRequest(strlen(path));
    if (!req) {
       result = -ENOMEM;
       LOG(4, ("Error: out of memory -> %d\n", result));
@@ -1392,7 +2370,8 @@ out:
  *    Called when the last user of a file closes it.
  *
  * Results:
- *    Returns zero on success, or an error on failure.
+ *    Returns zero on success, or an error on failure, including one
+ *    of a write that failed after it was accepted.
  *
  * Side effects:
  *    None
@@ -1406,11 +2385,14 @@ HgfsRelease(HgfsHandle handle)  //IN:File handle to close
    HgfsReq *req;
    HgfsOp opUsed;
    HgfsStatus replyStatus;
+   int writeError;
    int result = 0;
 
    LOG(6, ("Entry(handle = %u)\n", handle));
 
-   req = HgfsGetNewRequest();
+   writeError = HgfsFileStreamRelease(handle);
+
+   req = HgfsGetNewNameRequest(0);
    if (!req) {
       LOG(4, ("Out of memory while getting new request\n"));
       result = -ENOMEM;
@@ -1470,6 +2452,9 @@ retry:
 
 out:
    HgfsFreeRequest(req);
+   if (result == 0) {
+      result = writeError;
+   }
    LOG(6, ("Exit(%d)\n", result));
    return result;
 }
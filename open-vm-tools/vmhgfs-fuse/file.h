@@ -41,5 +41,8 @@
 
 /* Public functions (with respect to the entire module). */
 int HgfsRelease(HgfsHandle handle);
+int HgfsFlush(HgfsHandle handle);
+void HgfsWaitForWrites(fuse_ino_t ino);
+void HgfsInvalidateReadAhead(fuse_ino_t ino);
 
 #endif // _HGFS_DRIVER_FILE_H_
@@ -162,7 +162,7 @@ HgfsPackQueryVolumeRequest(const char *path,        // IN: File pointer for this
 
    /* Convert to CP name. */
    result = CPName_ConvertTo(path,
-                             HGFS_LARGE_PACKET_MAX - (requestSize - 1),
+                             req->bufferSize - (requestSize - 1),
                              name);
    if (result < 0) {
       LOG(4, ("CP conversion failed.\n"));
@@ -211,7 +211,7 @@ HgfsStatfs(const char* path,            // IN : Path to the file
    LOG(6, ("Entered.\n"));
    memset(stat, 0, sizeof *stat);
 
-   req = HgfsGetNewRequest();
+   req = HgfsGetNewNameRequest(strlen(path));
    if (!req) {
       LOG(4, ("Out of memory while getting new request.\n"));
       result = -ENOMEM;
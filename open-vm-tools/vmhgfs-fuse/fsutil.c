@@ -195,8 +195,6 @@ HgfsPackGetattrRequest(HgfsReq *req,            // IN/OUT: Request buffer
    ASSERT(req);
    ASSERT(path);
    attr->requestType = opUsed;
-   (void) handle;
-   (void) handleReuse;
 
    switch (opUsed) {
    case HGFS_OP_GETATTR_V3: {
@@ -204,15 +202,27 @@ HgfsPackGetattrRequest(HgfsReq *req,            // IN/OUT: Request buffer
 
       /* Fill out the request packet. */
       requestV3->hints = 0;
+      requestV3->reserved = 0;
+      reqSize = sizeof(*requestV3) + HgfsGetRequestHeaderSize();
+
+      if (handleReuse && handle != HGFS_INVALID_HANDLE) {
+         /* Name the file by its open handle; the server skips the name. */
+         requestV3->fileName.flags = HGFS_FILE_NAME_USE_FILE_DESC;
+         requestV3->fileName.fid = handle;
+         requestV3->fileName.caseType = HGFS_FILE_NAME_CASE_SENSITIVE;
+         requestV3->fileName.length = 0;
+         requestV3->fileName.name[0] = '\0';
+         result = 0;
+         break;
+      }
+
       fileName = requestV3->fileName.name;
       fileNameLength = &requestV3->fileName.length;
       requestV3->fileName.flags = 0;
       requestV3->fileName.fid = HGFS_INVALID_HANDLE;
       requestV3->fileName.caseType = HGFS_FILE_NAME_CASE_SENSITIVE;
 
-      requestV3->reserved = 0;
-      reqSize = sizeof(*requestV3) + HgfsGetRequestHeaderSize();
-      reqBufferSize = HGFS_NAME_BUFFER_SIZET(HGFS_LARGE_PACKET_MAX, reqSize);
+      reqBufferSize = HGFS_NAME_BUFFER_SIZET(req->bufferSize, reqSize);
       break;
    }
 
@@ -226,7 +236,7 @@ HgfsPackGetattrRequest(HgfsReq *req,            // IN/OUT: Request buffer
       fileName = requestV2->fileName.name;
       fileNameLength = &requestV2->fileName.length;
       reqSize = sizeof *requestV2;
-      reqBufferSize = HGFS_NAME_BUFFER_SIZE(HGFS_LARGE_PACKET_MAX, requestV2);
+      reqBufferSize = HGFS_NAME_BUFFER_SIZE(req->bufferSize, requestV2);
       break;
    }
 
@@ -236,7 +246,7 @@ HgfsPackGetattrRequest(HgfsReq *req,            // IN/OUT: Request buffer
       fileName = requestV1->fileName.name;
       fileNameLength = &requestV1->fileName.length;
       reqSize = sizeof *requestV1;
-      reqBufferSize = HGFS_NAME_BUFFER_SIZE(HGFS_LARGE_PACKET_MAX, requestV1);
+      reqBufferSize = HGFS_NAME_BUFFER_SIZE(req->bufferSize, requestV1);
       break;
    }
 
@@ -443,7 +453,7 @@ HgfsPrivateGetattr(HgfsHandle handle,      // IN: file handle
    ASSERT(attr);
    LOG( 4,("path = %s, handle = %u\n", path, handle));
 
-   req = HgfsGetNewRequest();
+   req = HgfsGetNewNameRequest(path != NULL ? strlen(path) : 0);
    if (!req) {
       LOG(8, ("Out of memory while getting new request\n"));
       result = -ENOMEM;
@@ -483,10 +493,15 @@ retry:
 
       case -EBADF:
          /*
-          * There's no reason why the server should have sent us this error
-          * when we haven't used a handle. But to prevent an infinite loop in
-          * the driver, let's make sure that we don't retry again.
+          * The handle may have been closed under us; fall back to the name
+          * once. Without a handle there's no reason why the server should
+          * have sent us this error, so don't retry again.
           */
+         if (allowHandleReuse && handle != HGFS_INVALID_HANDLE) {
+            LOG(4, ("Handle %u is stale, retrying by name\n", handle));
+            allowHandleReuse = FALSE;
+            goto retry;
+         }
          break;
 
       case -EPROTO:
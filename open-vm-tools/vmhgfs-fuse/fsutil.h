@@ -31,6 +31,7 @@
 #include "vm_basic_types.h"
 #include "hgfsProto.h"
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 
 #if defined(__FreeBSD__) || defined(__SOLARIS__) || defined(__APPLE__)
 typedef long long loff_t;
@@ -71,6 +72,7 @@ HgfsRestoreReadOnly(const char* path,
 
 ssize_t
 HgfsWrite(struct fuse_file_info *fi,
+          fuse_ino_t ino,
           const char  *buf,
           size_t count,
           loff_t offset);
@@ -91,6 +93,7 @@ HgfsCreate(const char *path,
 
 ssize_t
 HgfsRead(struct fuse_file_info *fi,
+         fuse_ino_t ino,
          char  *buf,
          size_t count,
          loff_t offset);
@@ -121,9 +124,14 @@ HgfsDirOpen(const char* path, HgfsHandle* handle);
 
 int
 HgfsReaddir(HgfsHandle handle,
+            const char *dirPath,
+            uint32 offset,
             void *dirent,
             fuse_fill_dir_t filldir);
 
+int
+HgfsDirClose(HgfsHandle handle);
+
 int
 HgfsMkdir(const char *path,
           int mode);
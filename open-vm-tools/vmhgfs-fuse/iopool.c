@@ -0,0 +1,361 @@
+/*********************************************************
+ * Copyright (C) 2013 VMware, Inc. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation version 2.1 and no later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the Lesser GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ *********************************************************/
+
+/*
+ * iopool.c --
+ *
+ * Worker threads for HGFS requests issued in parallel. Each request is
+ * still synchronous for the thread sending it; the pool only provides
+ * more threads to send them.
+ */
+
+#include "module.h"
+#include "iopool.h"
+
+static pthread_t gHgfsIoThreads[HGFS_IO_POOL_THREADS];
+static uint32 gHgfsIoThreadCount;
+
+static struct list_head gHgfsIoQueue;         /* Jobs not yet picked up */
+static pthread_mutex_t gHgfsIoQueueLock;
+static pthread_cond_t gHgfsIoQueueCond;
+static Bool gHgfsIoStop;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsIoJobDone --
+ *
+ *    Account for a finished job and wake up the batch waiters.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsIoJobDone(HgfsIoBatch *batch)  // IN: Batch of the finished job
+{
+   pthread_mutex_lock(&batch->lock);
+   ASSERT(batch->pending > 0);
+   batch->pending--;
+   pthread_cond_broadcast(&batch->done);
+   pthread_mutex_unlock(&batch->lock);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsIoWorker --
+ *
+ *    Body of the worker threads: run queued jobs until the pool is
+ *    stopped.
+ *
+ * Results:
+ *    NULL
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void *
+HgfsIoWorker(void *data)  // IN: unused
+{
+   pthread_mutex_lock(&gHgfsIoQueueLock);
+   for (;;) {
+      HgfsIoBatch *batch;
+      HgfsIoJob *job;
+
+      while (list_empty(&gHgfsIoQueue) && !gHgfsIoStop) {
+         pthread_cond_wait(&gHgfsIoQueueCond, &gHgfsIoQueueLock);
+      }
+      if (list_empty(&gHgfsIoQueue)) {
+         break;
+      }
+
+      job = list_entry(gHgfsIoQueue.next, HgfsIoJob, list);
+      list_del_init(&job->list);
+      pthread_mutex_unlock(&gHgfsIoQueueLock);
+
+      /* The job may free itself. */
+      batch = job->batch;
+      job->func(job);
+      HgfsIoJobDone(batch);
+
+      pthread_mutex_lock(&gHgfsIoQueueLock);
+   }
+   pthread_mutex_unlock(&gHgfsIoQueueLock);
+
+   return NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsIoPoolInit --
+ *
+ *    Start the worker threads. Must be called after the process has
+ *    daemonized, since threads do not survive the fork.
+ *
+ * Results:
+ *    0 on success, negative error if no thread could be started. Jobs
+ *    are then run by the submitting thread.
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+HgfsIoPoolInit(void)
+{
+   uint32 i;
+   int res;
+
+   INIT_LIST_HEAD(&gHgfsIoQueue);
+   pthread_mutex_init(&gHgfsIoQueueLock, NULL);
+   pthread_cond_init(&gHgfsIoQueueCond, NULL);
+   gHgfsIoStop = FALSE;
+
+   for (i = 0; i < HGFS_IO_POOL_THREADS; i++) {
+      res = pthread_create(&gHgfsIoThreads[i], NULL, HgfsIoWorker, NULL);
+      if (res != 0) {
+         LOG(4, ("Pthread create fail. error = %d\n", res));
+         break;
+      }
+   }
+   gHgfsIoThreadCount = i;
+
+   LOG(4, ("Started %u I/O threads\n", gHgfsIoThreadCount));
+   return gHgfsIoThreadCount > 0 ? 0 : -EAGAIN;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsIoPoolExit --
+ *
+ *    Stop the worker threads once the queued jobs are done.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+HgfsIoPoolExit(void)
+{
+   uint32 i;
+
+   pthread_mutex_lock(&gHgfsIoQueueLock);
+   gHgfsIoStop = TRUE;
+   pthread_cond_broadcast(&gHgfsIoQueueCond);
+   pthread_mutex_unlock(&gHgfsIoQueueLock);
+
+   for (i = 0; i < gHgfsIoThreadCount; i++) {
+      pthread_join(gHgfsIoThreads[i], NULL);
+   }
+   gHgfsIoThreadCount = 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsIoBatchInit --
+ *
+ *    Initialize an empty batch.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+HgfsIoBatchInit(HgfsIoBatch *batch)  // OUT: Batch
+{
+   pthread_mutex_init(&batch->lock, NULL);
+   pthread_cond_init(&batch->done, NULL);
+   batch->pending = 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsIoBatchDestroy --
+ *
+ *    Destroy a batch that has no pending jobs.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+HgfsIoBatchDestroy(HgfsIoBatch *batch)  // IN: Batch
+{
+   ASSERT(batch->pending == 0);
+   pthread_cond_destroy(&batch->done);
+   pthread_mutex_destroy(&batch->lock);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsIoBatchSubmit --
+ *
+ *    Queue a job as part of a batch. The batch must stay valid until
+ *    HgfsIoBatchWait returns, the job until it has run; the job function
+ *    may free it.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    Runs the job right away if there are no worker threads.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+HgfsIoBatchSubmit(HgfsIoBatch *batch,  // IN: Batch of the job
+                  HgfsIoJob *job,      // IN: Job to run
+                  HgfsIoJobFunc func)  // IN: Work to do
+{
+   job->func = func;
+   job->batch = batch;
+
+   pthread_mutex_lock(&batch->lock);
+   batch->pending++;
+   pthread_mutex_unlock(&batch->lock);
+
+   if (gHgfsIoThreadCount == 0) {
+      job->func(job);
+      HgfsIoJobDone(batch);
+      return;
+   }
+
+   pthread_mutex_lock(&gHgfsIoQueueLock);
+   list_add_tail(&job->list, &gHgfsIoQueue);
+   pthread_cond_signal(&gHgfsIoQueueCond);
+   pthread_mutex_unlock(&gHgfsIoQueueLock);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsIoBatchWait --
+ *
+ *    Wait for all jobs submitted to the batch to finish.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+HgfsIoBatchWait(HgfsIoBatch *batch)  // IN: Batch
+{
+   HgfsIoBatchWaitPending(batch, 0);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsIoBatchWaitPending --
+ *
+ *    Wait until at most maxPending jobs of the batch are left.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+HgfsIoBatchWaitPending(HgfsIoBatch *batch,  // IN: Batch
+                       uint32 maxPending)   // IN: Jobs that may be left
+{
+   pthread_mutex_lock(&batch->lock);
+   while (batch->pending > maxPending) {
+      pthread_cond_wait(&batch->done, &batch->lock);
+   }
+   pthread_mutex_unlock(&batch->lock);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsIoBatchBusy --
+ *
+ *    Check whether the batch still has jobs pending.
+ *
+ * Results:
+ *    TRUE if some job has not finished yet.
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+Bool
+HgfsIoBatchBusy(HgfsIoBatch *batch)  // IN: Batch
+{
+   Bool busy;
+
+   pthread_mutex_lock(&batch->lock);
+   busy = batch->pending > 0;
+   pthread_mutex_unlock(&batch->lock);
+
+   return busy;
+}
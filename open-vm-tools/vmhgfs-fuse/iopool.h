@@ -0,0 +1,68 @@
+/*********************************************************
+ * Copyright (C) 2013 VMware, Inc. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation version 2.1 and no later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the Lesser GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ *********************************************************/
+
+/*
+ * iopool.h --
+ *
+ * Worker threads that send HGFS requests on behalf of a caller, so that
+ * one large operation can keep several requests in flight.
+ */
+
+#ifndef _VMHGFS_FUSE_IOPOOL_H_
+#define _VMHGFS_FUSE_IOPOOL_H_
+
+#include "vm_basic_types.h"
+#include <linux/list.h>
+#include <pthread.h>
+
+/* Number of worker threads. */
+#define HGFS_IO_POOL_THREADS 8
+
+/*
+ * A group of jobs a caller waits on as a whole.
+ */
+typedef struct HgfsIoBatch {
+   pthread_mutex_t lock;
+   pthread_cond_t done;
+   uint32 pending;                  /* Submitted jobs not yet run */
+} HgfsIoBatch;
+
+struct HgfsIoJob;
+typedef void (*HgfsIoJobFunc)(struct HgfsIoJob *job);
+
+/*
+ * Embedded in the caller's own job structure.
+ */
+typedef struct HgfsIoJob {
+   struct list_head list;           /* Link in the pool queue */
+   HgfsIoJobFunc func;              /* Work to do */
+   HgfsIoBatch *batch;              /* Batch to signal when done */
+} HgfsIoJob;
+
+int HgfsIoPoolInit(void);
+void HgfsIoPoolExit(void);
+
+void HgfsIoBatchInit(HgfsIoBatch *batch);
+void HgfsIoBatchDestroy(HgfsIoBatch *batch);
+void HgfsIoBatchSubmit(HgfsIoBatch *batch, HgfsIoJob *job,
+                       HgfsIoJobFunc func);
+void HgfsIoBatchWait(HgfsIoBatch *batch);
+void HgfsIoBatchWaitPending(HgfsIoBatch *batch, uint32 maxPending);
+Bool HgfsIoBatchBusy(HgfsIoBatch *batch);
+
+#endif // _VMHGFS_FUSE_IOPOOL_H_
@@ -91,7 +91,7 @@ HgfsPackSymlinkCreateRequest(const char* symlink,     // IN: path of the link
 
    /* Convert symlink name to CP format. */
    result = CPName_ConvertTo(symlink,
-                             HGFS_LARGE_PACKET_MAX - (requestSize - 1),
+                             req->bufferSize - (requestSize - 1),
                              symlinkName);
    if (result < 0) {
       LOG(4, ("SymlinkName CP conversion failed.\n"));
@@ -130,7 +130,7 @@ HgfsPackSymlinkCreateRequest(const char* symlink,     // IN: path of the link
    targetNameBytes = strlen(symname) + 1;
 
    /* Copy target name into request packet. */
-   if (targetNameBytes > HGFS_LARGE_PACKET_MAX - (requestSize - 1)) {
+   if (targetNameBytes > req->bufferSize - (requestSize - 1)) {
       LOG(4, ("Target name is too long.\n"));
       return -EINVAL;
    }
@@ -175,7 +175,7 @@ HgfsSymlink(const char* source,    // IN: Source name
    HgfsOp opUsed;
    HgfsStatus replyStatus;
 
-   req = HgfsGetNewRequest();
+   req = HgfsGetNewNameRequest(strlen(source) + strlen(symname));
    if (!req) {
       LOG(4, ("Out of memory while getting new request.\n"));
       result = -ENOMEM;
@@ -20,70 +20,46 @@
  * main.c --
  *
  * Main entry points for fuse file operations for HGFS
+ *
+ * The client uses the low-level FUSE interface: the kernel names files
+ * by inode number, which node.c maps straight to the node holding the
+ * HGFS name, and open files by the server handle kept in the file info.
  */
 
-#if FUSE_USE_VERSION >= 26
-#define HAVE_UTIMENSAT 1
-#endif
-
 #include "module.h"
 #include "cache.h"
 #include "filesystem.h"
 #include "file.h"
+#include "node.h"
+#include "iopool.h"
+
+#include <fuse_lowlevel.h>
+
+/* Timeouts for the kernel dentry and attribute caches, in seconds. */
+#define HGFS_ENTRY_TIMEOUT ((double)HGFS_DEFAULT_TTL)
+#define HGFS_ATTR_TIMEOUT  ((double)HGFS_DEFAULT_TTL)
 
 /*
- *----------------------------------------------------------------------
- *
- * getAbsPath
- *
- *    This function takes the file path used by the local file system
- *    (which is relative to the HGFS mount) and generates the HGFS absolute
- *    path to send to the HGFS server.
- *    the absolute path will be allocated, which is the HGFS share and
- *    all other intermediate subdirectories that contain the file or folder.
- *
- * Results:
- *    zero on success, negative number for error.
- *
- * Side effects:
- *    Caller is responsible to free the absolute path if it's different
- *    from the path.
- *
- *----------------------------------------------------------------------
+ * State of a readdir request: fuse_add_direntry packs entries into buf
+ * until it is full.
  */
-
-static int
-getAbsPath(const char *path, // IN
-           char **abspath)   // OUT
-{
+typedef struct HgfsDirBuf {
+   fuse_req_t req;
+   char *buf;
    size_t size;
-   int res = 0;
-
-   if (gState->basePathLen > 0) {
-      size = gState->basePathLen + strlen(path) + 1;
-      *abspath = (char *)malloc(size);
-      if (*abspath == NULL) {
-         LOG(4, ("Can't allocate memory!\n"));
-         res = -ENOMEM;
-         goto exit;
-      }
-      snprintf(*abspath, size, "%s%s", gState->basePath, path);
+   size_t used;
+} HgfsDirBuf;
 
-   } else {
-      *abspath = (char *)path;
-   }
-
-exit:
-   return res;
-}
+/* Channel of the mount, for invalidations the client sends unasked. */
+static struct fuse_chan *gHgfsChan;
 
 
 /*
  *----------------------------------------------------------------------
  *
- * freeAbsPath
+ * HgfsAttrToStat
  *
- *    This function free's the absolute path allocated from getAbsPath
+ *    Convert HGFS attributes to struct stat.
  *
  * Results:
  *    None
@@ -95,63 +71,10 @@ exit:
  */
 
 static void
-freeAbsPath(char *abspath)  // IN
+HgfsAttrToStat(const HgfsAttrInfo *attr,  //IN: HGFS attributes
+               struct stat *stbuf)        //OUT: file/directoy attribute
 {
-   if (gState->basePathLen > 0) {
-      free(abspath);
-   }
-}
-
-
-/*
- *----------------------------------------------------------------------
- *
- * hgfs_getattr
- *
- *    Get the attributes from the HGFS server and populate struct stat.
- *
- * Results:
- *    Returns zero on success, or a negative error on failure.
- *
- * Side effects:
- *    None
- *
- *----------------------------------------------------------------------
- */
-
-static int
-hgfs_getattr(const char *path,    //IN: path of a file/directory
-             struct stat *stbuf)  //IN/OUT: file/directoy attribute
-{
-   HgfsHandle fileHandle = HGFS_INVALID_HANDLE;
-   HgfsAttrInfo newAttr = {0};
-   HgfsAttrInfo *attr = &newAttr;
    uint32 d_type;
-   char *abspath = NULL;
-   int res;
-
-   LOG(4, ("Entry(path = %s)\n", path));
-   res = getAbsPath(path, &abspath);
-   if (res < 0) {
-      goto exit;
-   }
-
-   res = HgfsGetAttrCache(abspath, attr);
-   LOG(4, ("Retrieve attr from cache. result = %d \n", res));
-   if (res != 0) {
-      /* Retrieve new complete attribute settings and update the cache. */
-      res = HgfsPrivateGetattr(fileHandle, abspath, attr);
-      LOG(4, ("Retrieve attr from server. result = %d \n", res));
-      if (res == 0 ) {
-         HgfsSetAttrCache(abspath, attr);
-      }
-   }
-
-   if (res < 0) {
-      goto exit;
-   }
-
-   LOG(4, ("fill stat for %s\n", abspath));
 
    memset(stbuf, 0, sizeof *stbuf);
 
@@ -206,11 +129,374 @@ hgfs_getattr(const char *path,    //IN: path of a file/directory
    if (attr->mask & HGFS_ATTR_VALID_CHANGE_TIME) {
       HGFS_SET_TIME(stbuf->st_ctime, attr->attrChangeTime);
    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsGetattrCached
+ *
+ *    Get the attributes of a file from the attribute cache, or from the
+ *    server if they are not cached. An open handle, if given, names the
+ *    file to the server instead of its path.
+ *
+ * Results:
+ *    Returns zero on success, or a negative error on failure.
+ *
+ * Side effects:
+ *    The cache is updated with the attributes from the server.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+HgfsGetattrCached(const char *path,     //IN: HGFS name of the file
+                  HgfsHandle handle,    //IN: Open handle or invalid
+                  HgfsAttrInfo *attr)   //OUT: Attributes
+{
+   int res;
+
+   res = HgfsGetAttrCache(path, attr);
+   LOG(4, ("Retrieve attr from cache. result = %d \n", res));
+   if (res != 0) {
+      /* Retrieve new complete attribute settings and update the cache. */
+      res = HgfsPrivateGetattr(handle, path, attr);
+      LOG(4, ("Retrieve attr from server. result = %d \n", res));
+      if (res == 0) {
+         /* Only readlink wants the symlink target, which is not cached. */
+         free(attr->fileName);
+         attr->fileName = NULL;
+         HgfsSetAttrCache(path, attr);
+      }
+   }
+   return res;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsRefreshAttr
+ *
+ *    Fetch the attributes of a file from the server after changing it
+ *    and update the cache.
+ *
+ * Results:
+ *    Returns zero on success, or a negative error on failure.
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+HgfsRefreshAttr(const char *path,     //IN: HGFS name of the file
+                HgfsHandle handle,    //IN: Open handle or invalid
+                HgfsAttrInfo *attr)   //OUT: Attributes
+{
+   int res;
+
+   memset(attr, 0, sizeof *attr);
+   res = HgfsPrivateGetattr(handle, path, attr);
+   if (res < 0) {
+      LOG(4, ("path = %s , res = %d\n", path, res));
+      return res;
+   }
+   free(attr->fileName);
+   attr->fileName = NULL;
+   HgfsSetAttrCache(path, attr);
+   return 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsAttrToVersion
+ *
+ *    Take the attributes that tell whether a file changed on the server.
+ *
+ * Results:
+ *    TRUE if the server returned enough of them to tell.
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Bool
+HgfsAttrToVersion(const HgfsAttrInfo *attr,       //IN: Attributes
+                  HgfsFuseNodeVersion *version)   //OUT: Version
+{
+   if (attr->type != HGFS_FILE_TYPE_REGULAR ||
+       (attr->mask & (HGFS_ATTR_VALID_WRITE_TIME | HGFS_ATTR_VALID_SIZE)) !=
+       (HGFS_ATTR_VALID_WRITE_TIME | HGFS_ATTR_VALID_SIZE)) {
+      return FALSE;
+   }
+
+   version->writeTime = attr->writeTime;
+   version->size = attr->size;
+   version->changeTime = (attr->mask & HGFS_ATTR_VALID_CHANGE_TIME) ?
+                         attr->attrChangeTime : 0;
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsMakeEntry
+ *
+ *    Fetch the attributes of a child of parent that the server now
+ *    knows about and take a lookup reference on its node for the kernel.
+ *
+ * Results:
+ *    Returns zero on success, or a negative error on failure.
+ *
+ * Side effects:
+ *    On success the kernel must be given the entry, or the lookup
+ *    forgotten.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+HgfsMakeEntry(HgfsFuseNode *parent,          //IN: Parent node
+              const char *name,              //IN: Child name
+              const char *path,              //IN: Child HGFS name
+              HgfsHandle handle,             //IN: Open handle or invalid
+              struct fuse_entry_param *e)    //OUT: Entry for the kernel
+{
+   HgfsAttrInfo attr = {0};
+   HgfsFuseNode *node;
+   int res;
+
+   res = HgfsGetattrCached(path, handle, &attr);
+   if (res < 0) {
+      return res;
+   }
+
+   node = HgfsNodeLookup(parent, name);
+   if (node == NULL) {
+      return -ENOMEM;
+   }
+
+   memset(e, 0, sizeof *e);
+   e->ino = HgfsNodeIno(node);
+   e->generation = node->generation;
+   e->attr_timeout = HGFS_ATTR_TIMEOUT;
+   e->entry_timeout = HGFS_ENTRY_TIMEOUT;
+   HgfsAttrToStat(&attr, &e->attr);
+   return 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsReplyEntry
+ *
+ *    Answer a request that creates or looks up a child of parent.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsReplyEntry(fuse_req_t req,          //IN: Request
+               HgfsFuseNode *parent,    //IN: Parent node
+               const char *name,        //IN: Child name
+               const char *path)        //IN: Child HGFS name
+{
+   struct fuse_entry_param e;
+   int res;
+
+   res = HgfsMakeEntry(parent, name, path, HGFS_INVALID_HANDLE, &e);
+   if (res < 0) {
+      fuse_reply_err(req, -res);
+      return;
+   }
+   if (fuse_reply_entry(req, &e) != 0) {
+      HgfsNodeForget(HgfsNodeGet(e.ino), 1);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * hgfs_lookup
+ *
+ *    Look up a directory entry by name and get its attributes.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+hgfs_lookup(fuse_req_t req,        //IN: Request
+            fuse_ino_t parentIno,  //IN: Parent directory
+            const char *name)      //IN: Name to look up
+{
+   HgfsFuseNode *parent = HgfsNodeGet(parentIno);
+   HgfsFuseNodePath path;
+   int res;
+
+   res = HgfsNodeGetChildPath(parent, name, &path);
+   if (res < 0) {
+      fuse_reply_err(req, -res);
+      return;
+   }
+
+   LOG(4, ("Entry(path = %s)\n", path.path));
+   HgfsReplyEntry(req, parent, name, path.path);
+   HgfsNodePutPath(&path);
+   LOG(4, ("Exit()\n"));
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * hgfs_forget
+ *
+ *    Drop kernel lookup references on an inode.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    The node may be freed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+hgfs_forget(fuse_req_t req,           //IN: Request
+            fuse_ino_t ino,           //IN: Inode
+            unsigned long nlookup)    //IN: Lookups to drop
+{
+   HgfsNodeForget(HgfsNodeGet(ino), nlookup);
+   fuse_reply_none(req);
+}
+
+
+#if FUSE_VERSION >= 29
+/*
+ *----------------------------------------------------------------------
+ *
+ * hgfs_forget_multi
+ *
+ *    Drop kernel lookup references on a batch of inodes.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    Nodes may be freed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+hgfs_forget_multi(fuse_req_t req,                   //IN: Request
+                  size_t count,                     //IN: Number of inodes
+                  struct fuse_forget_data *forgets) //IN: Inodes and lookups
+{
+   size_t i;
+
+   for (i = 0; i < count; i++) {
+      HgfsNodeForget(HgfsNodeGet(forgets[i].ino), forgets[i].nlookup);
+   }
+   fuse_reply_none(req);
+}
+#endif
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * hgfs_getattr
+ *
+ *    Get the attributes from the HGFS server and populate struct stat.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+hgfs_getattr(fuse_req_t req,              //IN: Request
+             fuse_ino_t ino,              //IN: Inode
+             struct fuse_file_info *fi)   //IN: Open file or NULL
+{
+   HgfsFuseNode *node = HgfsNodeGet(ino);
+   HgfsAttrInfo attr = {0};
+   HgfsFuseNodeVersion version;
+   HgfsFuseNodePath path;
+   HgfsHandle handle;
+   struct stat stbuf;
+   Bool stale = FALSE;
+   int res;
+
+   res = HgfsNodeGetPath(node, &path);
+   if (res < 0) {
+      goto exit;
+   }
+   handle = fi != NULL ? (HgfsHandle)fi->fh : HgfsNodeGetHandle(node);
+
+   LOG(4, ("Entry(path = %s, handle = %u)\n", path.path, handle));
+   /* The size must include the writes still in flight on any handle. */
+   HgfsWaitForWrites(ino);
+   res = HgfsGetattrCached(path.path, handle, &attr);
+   HgfsNodePutPath(&path);
+   if (res < 0) {
+      goto exit;
+   }
+
+   HgfsAttrToStat(&attr, &stbuf);
+   if (HgfsAttrToVersion(&attr, &version)) {
+      stale = HgfsNodeCheckCache(node, &version);
+   }
+   if (stale) {
+      /* The data read ahead on any handle of the file is stale too. */
+      HgfsInvalidateReadAhead(ino);
+   }
 
 exit:
    LOG(4, ("Exit(%d)\n", res));
-   freeAbsPath(abspath);
-   return res;
+   if (res < 0) {
+      fuse_reply_err(req, -res);
+   } else {
+      fuse_reply_attr(req, &stbuf, HGFS_ATTR_TIMEOUT);
+   }
+
+   /*
+    * The file changed on the server: drop the pages the kernel kept.
+    * Only after the reply, as the kernel may be waiting on it with
+    * pages locked.
+    */
+   if (stale && gHgfsChan != NULL) {
+      LOG(4, ("Invalidate pages of inode %lu\n", (unsigned long)ino));
+      fuse_lowlevel_notify_inval_inode(gHgfsChan, ino, 0, 0);
+   }
 }
 
 
@@ -219,10 +505,10 @@ exit:
  *
  * hgfs_access
  *
- *    Dummy routine, not fully implemented.
+ *    Check access permissions against the attributes from the host.
  *
  * Results:
- *    Returns zero.
+ *    None
  *
  * Side effects:
  *    None
@@ -230,34 +516,26 @@ exit:
  *----------------------------------------------------------------------
  */
 
-static int
-hgfs_access(const char *path,  //IN: Path to a file.
+static void
+hgfs_access(fuse_req_t req,    //IN: Request
+            fuse_ino_t ino,    //IN: Inode
             int mask)          //IN: Mask
 {
-   HgfsHandle fileHandle = HGFS_INVALID_HANDLE;
+   HgfsFuseNode *node = HgfsNodeGet(ino);
    HgfsAttrInfo newAttr = {0};
    HgfsAttrInfo *attr = &newAttr;
+   HgfsFuseNodePath path;
    uint32 effectivePermissions;
-   char *abspath = NULL;
    int res;
 
-   LOG(4, ("Entry(path = %s, mask = %#o)\n", path, mask));
-   res = getAbsPath(path, &abspath);
+   res = HgfsNodeGetPath(node, &path);
    if (res < 0) {
       goto exit;
    }
 
-   res = HgfsGetAttrCache(path, attr);
-   LOG(4, ("Retrieve attr from cache. result = %d \n", res));
-   if (res != 0) {
-      /* Retrieve new complete attribute settings and update the cache. */
-      res = HgfsPrivateGetattr(fileHandle, abspath, attr);
-      LOG(4, ("Retrieve attr from server. result = %d \n", res));
-      if (res == 0 ) {
-         HgfsSetAttrCache(abspath, attr);
-      }
-   }
-
+   LOG(4, ("Entry(path = %s, mask = %#o)\n", path.path, mask));
+   res = HgfsGetattrCached(path.path, HgfsNodeGetHandle(node), attr);
+   HgfsNodePutPath(&path);
    if (res < 0) {
       goto exit;
    }
@@ -288,8 +566,7 @@ hgfs_access(const char *path,  //IN: Path to a file.
 
 exit:
    LOG(4, ("Exit(%d)\n", res));
-   freeAbsPath(abspath);
-   return res;
+   fuse_reply_err(req, -res);
 }
 
 
@@ -301,7 +578,7 @@ exit:
  *    Read the file pointed by the symbolic link.
  *
  * Results:
- *    Returns zero on success, or a negative error on failure.
+ *    None
  *
  * Side effects:
  *    None
@@ -309,55 +586,53 @@ exit:
  *----------------------------------------------------------------------
  */
 
-static int
-hgfs_readlink(const char *path, //IN: path to a file
-              char *buf,        //OUT: buffer to store the filename
-              size_t size)      //IN: size of buf
+static void
+hgfs_readlink(fuse_req_t req,    //IN: Request
+              fuse_ino_t ino)    //IN: Inode of the link
 {
-   char *abspath = NULL;
-   int res = 0;
-   HgfsHandle fileHandle = 0;
    HgfsAttrInfo newAttr = {0};
    HgfsAttrInfo *attr = &newAttr;
+   HgfsFuseNodePath path;
+   int res;
 
-   LOG(4, ("Entry(path = %s, %#"FMTSZ"x)\n", path, size));
-   res = getAbsPath(path, &abspath);
+   res = HgfsNodeGetPath(HgfsNodeGet(ino), &path);
    if (res < 0) {
       goto exit;
    }
 
    /* The attributes fileName field will hold the symlink target name. */
-   res = HgfsPrivateGetattr(fileHandle, abspath, attr);
-   LOG(4, ("ReadLink: Path = %s, attr->fileName = %s \n", abspath, attr->fileName));
+   res = HgfsPrivateGetattr(HGFS_INVALID_HANDLE, path.path, attr);
+   LOG(4, ("ReadLink: Path = %s, attr->fileName = %s \n", path.path,
+           attr->fileName));
+   HgfsNodePutPath(&path);
    if (res < 0) {
       goto exit;
    }
 
-   if (size > strlen(attr->fileName)) {
-      Str_Strcpy(buf, attr->fileName,
-                 strlen(attr->fileName) + 1);
-      LOG(4, ("ReadLink: link target name = %s\n", buf));
-   } else {
-      res = -ENOBUFS;
+   if (attr->fileName == NULL) {
+      res = -EINVAL;
    }
 
 exit:
-   free(attr->fileName);
-   freeAbsPath(abspath);
    LOG(4, ("Exit(%d)\n", res));
-   return res;
+   if (res < 0) {
+      fuse_reply_err(req, -res);
+   } else {
+      fuse_reply_readlink(req, attr->fileName);
+   }
+   free(attr->fileName);
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * hgfs_readdir
+ * hgfs_opendir
  *
- *    Read the directoy file.
+ *    Open a directory search on the server.
  *
  * Results:
- *    Returns zero on success, or a negative error on failure.
+ *    None
  *
  * Side effects:
  *    None
@@ -365,47 +640,46 @@ exit:
  *----------------------------------------------------------------------
  */
 
-static int
-hgfs_readdir(const char *path,          //IN: path to a directory
-             void *buf,                 //OUT: buffer to fill the dir entry
-             fuse_fill_dir_t filler,    //IN: function pointer to fill buf
-             off_t offset,              //IN: offset to read the dir
-             struct fuse_file_info *fi) //IN: file info set by open call
+static void
+hgfs_opendir(fuse_req_t req,              //IN: Request
+             fuse_ino_t ino,              //IN: Directory inode
+             struct fuse_file_info *fi)   //OUT: Search handle
 {
-   char *abspath = NULL;
-   int res = 0;
-   HgfsHandle fileHandle = HGFS_INVALID_HANDLE;
-
-   LOG(4, ("Entry(path = %s, @ %#"FMT64"x)\n", path, offset));
-   res = getAbsPath(path, &abspath);
-   if (res < 0) {
-      goto exit;
-   }
+   HgfsHandle searchHandle = HGFS_INVALID_HANDLE;
+   HgfsFuseNodePath path;
+   int res;
 
-   res = HgfsDirOpen(abspath, &fileHandle);
+   res = HgfsNodeGetPath(HgfsNodeGet(ino), &path);
    if (res < 0) {
       goto exit;
    }
 
-   fi->fh = fileHandle;
-   res = HgfsReaddir(fileHandle, buf, filler);
+   LOG(4, ("Entry(path = %s)\n", path.path));
+   res = HgfsDirOpen(path.path, &searchHandle);
+   HgfsNodePutPath(&path);
 
 exit:
    LOG(4, ("Exit(%d)\n", res));
-   freeAbsPath(abspath);
-   return res;
+   if (res < 0) {
+      fuse_reply_err(req, -res);
+      return;
+   }
+   fi->fh = searchHandle;
+   if (fuse_reply_open(req, fi) != 0) {
+      HgfsDirClose(searchHandle);
+   }
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * hgfs_mknod
+ * HgfsDirBufAdd
  *
- *    Dummy routine.
+ *    Filler passed to HgfsReaddir: pack one entry into the reply.
  *
  * Results:
- *    Returns -1.
+ *    Zero if the entry was added, 1 if the reply is full.
  *
  * Side effects:
  *    None
@@ -414,17 +688,21 @@ exit:
  */
 
 static int
-hgfs_mknod(const char *path,   //IN: Path to a file
-           mode_t mode,        //IN: Mode to set
-           dev_t rdev)         //IN: Device type
+HgfsDirBufAdd(void *dirent,              //IN/OUT: HgfsDirBuf
+              const char *name,          //IN: Entry name
+              const struct stat *stbuf,  //IN: Entry type and inode
+              off_t nextOffset)          //IN: Offset of the next entry
 {
-#if defined(__APPLE__)
-   LOG(4, ("Entry(path = %s, mode = %#o, %u)\n", path, mode, rdev));
-#else
-   LOG(4, ("Entry(path = %s, mode = %#o, %"FMT64"u)\n", path, mode, rdev));
-#endif
-   LOG(4, ("Dummy routine. Not implemented!"));
-   LOG(4, ("Exit(0)\n"));
+   HgfsDirBuf *dirBuf = dirent;
+   size_t room = dirBuf->size - dirBuf->used;
+   size_t len;
+
+   len = fuse_add_direntry(dirBuf->req, dirBuf->buf + dirBuf->used, room,
+                           name, stbuf, nextOffset);
+   if (len > room) {
+      return 1;
+   }
+   dirBuf->used += len;
    return 0;
 }
 
@@ -432,12 +710,15 @@ hgfs_mknod(const char *path,   //IN: Path to a file
 /*
  *----------------------------------------------------------------------
  *
- * hgfs_mkdir
+ * hgfs_readdir
  *
- *    Create directory.
+ *    Read the directoy file. The attributes the server returns with
+ *    the entries go into the attribute cache, so the lookups and getattrs
+ *    the kernel sends next for the same entries (ls -l) are answered
+ *    without a round trip.
  *
  * Results:
- *    Returns zero on success, or a negative error on failure.
+ *    None
  *
  * Side effects:
  *    None
@@ -445,37 +726,58 @@ hgfs_mknod(const char *path,   //IN: Path to a file
  *----------------------------------------------------------------------
  */
 
-static int
-hgfs_mkdir(const char *path,  //IN: path to a new dir
-           mode_t mode)       //IN: Mode of dir to be created
+static void
+hgfs_readdir(fuse_req_t req,             //IN: Request
+             fuse_ino_t ino,             //IN: Directory inode
+             size_t size,                //IN: Size of the reply
+             off_t offset,               //IN: offset to read the dir
+             struct fuse_file_info *fi)  //IN: Search handle
 {
-   char *abspath = NULL;
+   HgfsDirBuf dirBuf;
+   HgfsFuseNodePath path;
+   Bool havePath;
    int res;
 
-   LOG(4, ("Entry(path = %s, mode = %#o)\n", path, mode));
-   res = getAbsPath(path, &abspath);
-   if (res < 0) {
+   LOG(4, ("Entry(handle = %#"FMT64"x, @ %#"FMT64"x)\n", fi->fh, offset));
+
+   /* Without a name the entries are still listed, just not cached. */
+   havePath = HgfsNodeGetPath(HgfsNodeGet(ino), &path) == 0;
+
+   dirBuf.req = req;
+   dirBuf.size = size;
+   dirBuf.used = 0;
+   dirBuf.buf = malloc(size);
+   if (dirBuf.buf == NULL) {
+      res = -ENOMEM;
       goto exit;
    }
 
-   res = HgfsMkdir(abspath, mode);
+   res = HgfsReaddir((HgfsHandle)fi->fh, havePath ? path.path : NULL,
+                     (uint32)offset, &dirBuf, HgfsDirBufAdd);
 
 exit:
+   if (havePath) {
+      HgfsNodePutPath(&path);
+   }
    LOG(4, ("Exit(%d)\n", res));
-   freeAbsPath(abspath);
-   return res;
+   if (res < 0 && dirBuf.used == 0) {
+      fuse_reply_err(req, -res);
+   } else {
+      fuse_reply_buf(req, dirBuf.buf, dirBuf.used);
+   }
+   free(dirBuf.buf);
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * hgfs_unlink
+ * hgfs_releasedir
  *
- *    Delete file.
+ *    Close a directory search.
  *
  * Results:
- *    Returns zero on success, or a negative error on failure.
+ *    None
  *
  * Side effects:
  *    None
@@ -483,39 +785,82 @@ exit:
  *----------------------------------------------------------------------
  */
 
-static int
-hgfs_unlink(const char *path) //IN: path to a file
+static void
+hgfs_releasedir(fuse_req_t req,             //IN: Request
+                fuse_ino_t ino,             //IN: Directory inode
+                struct fuse_file_info *fi)  //IN: Search handle
 {
-   char *abspath = NULL;
+   LOG(4, ("Entry(handle = %#"FMT64"x)\n", fi->fh));
+   HgfsDirClose((HgfsHandle)fi->fh);
+   fuse_reply_err(req, 0);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * hgfs_mknod
+ *
+ *    Create a regular file. Other file types can't be created on a
+ *    shared folder.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+hgfs_mknod(fuse_req_t req,         //IN: Request
+           fuse_ino_t parentIno,   //IN: Parent directory
+           const char *name,       //IN: Name of the new file
+           mode_t mode,            //IN: Mode to set
+           dev_t rdev)             //IN: Device type
+{
+   HgfsFuseNode *parent = HgfsNodeGet(parentIno);
+   struct fuse_file_info fi;
+   HgfsFuseNodePath path;
    int res;
 
-   LOG(4, ("Entry(path = %s)\n", path));
-   res = getAbsPath(path, &abspath);
+   if (!S_ISREG(mode)) {
+      LOG(4, ("Can't create file of mode %#o\n", mode));
+      fuse_reply_err(req, EPERM);
+      return;
+   }
+
+   res = HgfsNodeGetChildPath(parent, name, &path);
    if (res < 0) {
-      goto exit;
+      fuse_reply_err(req, -res);
+      return;
    }
 
-   res = HgfsDelete(abspath, HGFS_OP_DELETE_FILE);
+   LOG(4, ("Entry(path = %s, mode = %#o)\n", path.path, mode));
+   memset(&fi, 0, sizeof fi);
+   fi.flags = O_CREAT | O_EXCL | O_WRONLY;
+   res = HgfsCreate(path.path, mode, &fi);
    if (res == 0) {
-      HgfsInvalidateAttrCache(abspath);
+      HgfsRelease((HgfsHandle)fi.fh);
+      HgfsReplyEntry(req, parent, name, path.path);
+   } else {
+      fuse_reply_err(req, -res);
    }
-
-exit:
+   HgfsNodePutPath(&path);
    LOG(4, ("Exit(%d)\n", res));
-   freeAbsPath(abspath);
-   return res;
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * hgfs_rmdir
+ * hgfs_mkdir
  *
- *    Delete directory.
+ *    Create directory.
  *
  * Results:
- *    Returns zero on success, or a negative error on failure.
+ *    None
  *
  * Side effects:
  *    None
@@ -523,39 +868,43 @@ exit:
  *----------------------------------------------------------------------
  */
 
-static int
-hgfs_rmdir(const char *path) //IN: path to a dir
+static void
+hgfs_mkdir(fuse_req_t req,         //IN: Request
+           fuse_ino_t parentIno,   //IN: Parent directory
+           const char *name,       //IN: Name of the new dir
+           mode_t mode)            //IN: Mode of dir to be created
 {
-   char *abspath = NULL;
+   HgfsFuseNode *parent = HgfsNodeGet(parentIno);
+   HgfsFuseNodePath path;
    int res;
 
-   LOG(4, ("Entry(path = %s)\n", path));
-   res = getAbsPath(path, &abspath);
+   res = HgfsNodeGetChildPath(parent, name, &path);
    if (res < 0) {
-      goto exit;
+      fuse_reply_err(req, -res);
+      return;
    }
 
-   res = HgfsDelete(abspath, HGFS_OP_DELETE_DIR);
+   LOG(4, ("Entry(path = %s, mode = %#o)\n", path.path, mode));
+   res = HgfsMkdir(path.path, mode);
    if (res == 0) {
-      HgfsInvalidateAttrCache(abspath);
+      HgfsReplyEntry(req, parent, name, path.path);
+   } else {
+      fuse_reply_err(req, -res);
    }
-
-exit:
+   HgfsNodePutPath(&path);
    LOG(4, ("Exit(%d)\n", res));
-   freeAbsPath(abspath);
-   return res;
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * hgfs_symlink
+ * HgfsRemove
  *
- *    Create symbolic link.
+ *    Delete a file or a directory.
  *
  * Results:
- *    Returns zero on success, or a negative error on failure.
+ *    None
  *
  * Side effects:
  *    None
@@ -563,38 +912,94 @@ exit:
  *----------------------------------------------------------------------
  */
 
-static int
-hgfs_symlink(const char *symname,   //IN: symname target
-             const char *source)    //IN: source name
+static void
+HgfsRemove(fuse_req_t req,         //IN: Request
+           fuse_ino_t parentIno,   //IN: Parent directory
+           const char *name,       //IN: Name to delete
+           HgfsOp op)              //IN: File or directory delete
 {
-   char *absSource = NULL;
+   HgfsFuseNode *parent = HgfsNodeGet(parentIno);
+   HgfsFuseNodePath path;
    int res;
 
-   LOG(4, ("Entry(from = %s, to = %s)\n", symname, source));
-   res = getAbsPath(source, &absSource);
+   res = HgfsNodeGetChildPath(parent, name, &path);
    if (res < 0) {
       goto exit;
    }
 
-   LOG(4, ("symname = %s, abs source = %s)\n", symname, absSource));
-   res = HgfsSymlink(absSource, symname);
+   LOG(4, ("Entry(path = %s)\n", path.path));
+   res = HgfsDelete(path.path, op);
+   if (res == 0) {
+      HgfsInvalidateAttrCache(path.path);
+      HgfsNodeUnhash(parent, name);
+   }
+   HgfsNodePutPath(&path);
 
 exit:
    LOG(4, ("Exit(%d)\n", res));
-   freeAbsPath(absSource);
-   return res;
+   fuse_reply_err(req, -res);
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * hgfs_rename
+ * hgfs_unlink
  *
- *    Rename file or directory.
+ *    Delete file.
  *
  * Results:
- *    Returns zero on success, or a negative error on failure.
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+hgfs_unlink(fuse_req_t req,         //IN: Request
+            fuse_ino_t parentIno,   //IN: Parent directory
+            const char *name)       //IN: File name
+{
+   HgfsRemove(req, parentIno, name, HGFS_OP_DELETE_FILE);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * hgfs_rmdir
+ *
+ *    Delete directory.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+hgfs_rmdir(fuse_req_t req,         //IN: Request
+           fuse_ino_t parentIno,   //IN: Parent directory
+           const char *name)       //IN: Directory name
+{
+   HgfsRemove(req, parentIno, name, HGFS_OP_DELETE_DIR);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * hgfs_symlink
+ *
+ *    Create symbolic link.
+ *
+ * Results:
+ *    None
  *
  * Side effects:
  *    None
@@ -602,47 +1007,43 @@ exit:
  *----------------------------------------------------------------------
  */
 
-static int
-hgfs_rename(const char *from,  //IN: from path name
-            const char *to)    //IN: to path name
+static void
+hgfs_symlink(fuse_req_t req,         //IN: Request
+             const char *symname,    //IN: symname target
+             fuse_ino_t parentIno,   //IN: Parent directory
+             const char *name)       //IN: Name of the link
 {
-   char *absfrom = NULL;
-   char *absto = NULL;
+   HgfsFuseNode *parent = HgfsNodeGet(parentIno);
+   HgfsFuseNodePath path;
    int res;
 
-   LOG(4, ("Entry(from = %s, to = %s)\n", from, to));
-   res = getAbsPath(from, &absfrom);
-   if (res < 0) {
-      goto exit;
-   }
-   res = getAbsPath(to, &absto);
+   res = HgfsNodeGetChildPath(parent, name, &path);
    if (res < 0) {
-      goto exit;
+      fuse_reply_err(req, -res);
+      return;
    }
 
-   res = HgfsRename(absfrom, absto);
+   LOG(4, ("symname = %s, abs source = %s)\n", symname, path.path));
+   res = HgfsSymlink(path.path, symname);
    if (res == 0) {
-      HgfsInvalidateAttrCache(absfrom);
-      HgfsInvalidateAttrCache(absto);
+      HgfsReplyEntry(req, parent, name, path.path);
+   } else {
+      fuse_reply_err(req, -res);
    }
-
-exit:
+   HgfsNodePutPath(&path);
    LOG(4, ("Exit(%d)\n", res));
-   freeAbsPath(absfrom);
-   freeAbsPath(absto);
-   return res;
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * hgfs_link
+ * hgfs_rename
  *
- *    Dummy routine.
+ *    Rename file or directory.
  *
  * Results:
- *    Returns -1.
+ *    None
  *
  * Side effects:
  *    None
@@ -650,44 +1051,54 @@ exit:
  *----------------------------------------------------------------------
  */
 
-static int
-hgfs_link(const char *from,  //IN: From path
-          const char *to)    //IN: To path
+static void
+hgfs_rename(fuse_req_t req,            //IN: Request
+            fuse_ino_t parentIno,      //IN: Source directory
+            const char *name,          //IN: Source name
+            fuse_ino_t newParentIno,   //IN: Target directory
+            const char *newName)       //IN: Target name
 {
-   char *absfrom = NULL;
-   char *absto = NULL;
-   int res = 0;
+   HgfsFuseNode *parent = HgfsNodeGet(parentIno);
+   HgfsFuseNode *newParent = HgfsNodeGet(newParentIno);
+   HgfsFuseNodePath from;
+   HgfsFuseNodePath to;
+   int res;
 
-   LOG(4, ("Entry(from = %s, to = %s)\n", from, to));
-   res = getAbsPath(from, &absfrom);
+   res = HgfsNodeGetChildPath(parent, name, &from);
    if (res < 0) {
       goto exit;
    }
-   res = getAbsPath(to, &absto);
+   res = HgfsNodeGetChildPath(newParent, newName, &to);
    if (res < 0) {
+      HgfsNodePutPath(&from);
       goto exit;
    }
 
-   /*Do nothing.*/
-   res = -1;
+   LOG(4, ("Entry(from = %s, to = %s)\n", from.path, to.path));
+   res = HgfsRename(from.path, to.path);
+   if (res == 0) {
+      HgfsInvalidateAttrCache(from.path);
+      HgfsInvalidateAttrCache(to.path);
+      HgfsNodeRename(parent, name, newParent, newName);
+   }
+   HgfsNodePutPath(&from);
+   HgfsNodePutPath(&to);
 
 exit:
    LOG(4, ("Exit(%d)\n", res));
-   freeAbsPath(absfrom);
-   freeAbsPath(absto);
-   return res;
+   fuse_reply_err(req, -res);
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * hgfs_chmod
+ * hgfs_link
  *
- *    Change access mode of a file.
+ *    Hard links are not supported on shared folders.
  *
  * Results:
- *    Returns zero on success, or a negative error on failure.
+ *    None
  *
  * Side effects:
  *    None
@@ -695,64 +1106,26 @@ exit:
  *----------------------------------------------------------------------
  */
 
-static int
-hgfs_chmod(const char *path,   //IN: path to a file
-           mode_t mode)        //IN: mode to set
+static void
+hgfs_link(fuse_req_t req,            //IN: Request
+          fuse_ino_t ino,            //IN: Existing file
+          fuse_ino_t newParentIno,   //IN: Directory of the link
+          const char *newName)       //IN: Name of the link
 {
-   char *abspath = NULL;
-   int res;
-   HgfsHandle fileHandle = HGFS_INVALID_HANDLE;
-   HgfsAttrInfo newAttr = {0};
-   HgfsAttrInfo *attr = &newAttr;
-
-   LOG(4, ("Entry(path = %s, mode = %#o)\n", path, mode));
-   res = getAbsPath(path, &abspath);
-   if (res < 0) {
-      goto exit;
-   }
-
-   attr->mask = (HGFS_ATTR_VALID_SPECIAL_PERMS |
-                 HGFS_ATTR_VALID_OWNER_PERMS |
-                 HGFS_ATTR_VALID_GROUP_PERMS |
-                 HGFS_ATTR_VALID_OTHER_PERMS);
-   attr->specialPerms = (mode & (S_ISUID | S_ISGID | S_ISVTX)) >> 9;
-   attr->ownerPerms = (mode & S_IRWXU) >> 6;
-   attr->groupPerms = (mode & S_IRWXG) >> 3;
-   attr->otherPerms = mode & S_IRWXO;
-
-   attr->mask |= HGFS_ATTR_VALID_ACCESS_TIME;
-   attr->accessTime = attr->attrChangeTime = HGFS_GET_TIME(time(NULL));
-
-   res = HgfsSetattr(abspath, attr);
-   if (res < 0) {
-      LOG(4, ("path = %s , HgfsSetattr failed. res = %d\n", abspath, res));
-      goto exit;
-   }
-
-   /* Retrieve new complete attribute settings and update the cache. */
-   res = HgfsPrivateGetattr(fileHandle, abspath, attr);
-   if (res < 0) {
-      LOG(4, ("path = %s , res = %d\n", abspath, res));
-      goto exit;
-   }
-   HgfsSetAttrCache(abspath, attr);
-
-exit:
-   LOG(4, ("Exit(%d)\n", res));
-   freeAbsPath(abspath);
-   return res;
+   LOG(4, ("Entry(to = %s)\n", newName));
+   fuse_reply_err(req, EPERM);
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * hgfs_chown
+ * hgfs_setattr
  *
- *    Change uid or gid of a file.
+ *    Change the mode, owner, size or times of a file.
  *
  * Results:
- *    Returns zero on success, or a negative error on failure.
+ *    None
  *
  * Side effects:
  *    None
@@ -760,62 +1133,152 @@ exit:
  *----------------------------------------------------------------------
  */
 
-static int
-hgfs_chown(const char *path,  //IN: Path to a file
-           uid_t uid,         //IN: User id
-           gid_t gid)         //IN: Group id
+static void
+hgfs_setattr(fuse_req_t req,              //IN: Request
+             fuse_ino_t ino,              //IN: Inode
+             struct stat *stbuf,          //IN: New attributes
+             int toSet,                   //IN: FUSE_SET_ATTR_* to change
+             struct fuse_file_info *fi)   //IN: Open file or NULL
 {
-   HgfsHandle fileHandle = HGFS_INVALID_HANDLE;
+   HgfsFuseNode *node = HgfsNodeGet(ino);
+   HgfsHandle handle = fi != NULL ? (HgfsHandle)fi->fh : HGFS_INVALID_HANDLE;
    HgfsAttrInfo newAttr = {0};
    HgfsAttrInfo *attr = &newAttr;
-   char *abspath = NULL;
+   int timesToSet = toSet & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME);
+   uint64 now = HGFS_GET_TIME(time(NULL));
+   HgfsFuseNodePath path;
+   struct stat newStat;
    int res;
 
-   LOG(4, ("Entry(path = %s, uid = %u, gid = %u)\n", abspath, uid, gid));
-   res = getAbsPath(path, &abspath);
+#ifdef FUSE_SET_ATTR_ATIME_NOW
+   timesToSet |= toSet & (FUSE_SET_ATTR_ATIME_NOW | FUSE_SET_ATTR_MTIME_NOW);
+#endif
+
+   res = HgfsNodeGetPath(node, &path);
    if (res < 0) {
       goto exit;
    }
 
-   attr->mask = HGFS_ATTR_VALID_USERID;
-   attr->userId = uid;
+   LOG(4, ("Entry(path = %s, toSet = %#x)\n", path.path, toSet));
 
-   attr->mask |= HGFS_ATTR_VALID_GROUPID;
-   attr->groupId = gid;
+   /* Writes still in flight must not land after a new size or time. */
+   HgfsWaitForWrites(ino);
 
-   attr->mask |= HGFS_ATTR_VALID_ACCESS_TIME;
-   attr->accessTime = attr->attrChangeTime = HGFS_GET_TIME(time(NULL));
+   if (timesToSet == toSet) {
+      /*
+       * utimensat() has a 'flag' parameter which is not available in fuse.
+       * by default, let's assume AT_SYMLINK_NOFOLLOW. but since there is
+       * neither a way to pass not 'followSymlinks' to setattr, let's simply
+       * do nothing for symlink.
+       */
+      res = HgfsGetattrCached(path.path, handle, attr);
+      if (res < 0 || attr->type == HGFS_FILE_TYPE_SYMLINK) {
+         goto reply;
+      }
+      memset(attr, 0, sizeof *attr);
+   }
+
+   if (toSet & FUSE_SET_ATTR_MODE) {
+      attr->mask |= (HGFS_ATTR_VALID_SPECIAL_PERMS |
+                     HGFS_ATTR_VALID_OWNER_PERMS |
+                     HGFS_ATTR_VALID_GROUP_PERMS |
+                     HGFS_ATTR_VALID_OTHER_PERMS);
+      attr->specialPerms = (stbuf->st_mode & (S_ISUID | S_ISGID | S_ISVTX)) >> 9;
+      attr->ownerPerms = (stbuf->st_mode & S_IRWXU) >> 6;
+      attr->groupPerms = (stbuf->st_mode & S_IRWXG) >> 3;
+      attr->otherPerms = stbuf->st_mode & S_IRWXO;
+   }
+   if (toSet & FUSE_SET_ATTR_UID) {
+      attr->mask |= HGFS_ATTR_VALID_USERID;
+      attr->userId = stbuf->st_uid;
+   }
+   if (toSet & FUSE_SET_ATTR_GID) {
+      attr->mask |= HGFS_ATTR_VALID_GROUPID;
+      attr->groupId = stbuf->st_gid;
+   }
+   if (toSet & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+      attr->mask |= HGFS_ATTR_VALID_ACCESS_TIME;
+      attr->accessTime = attr->attrChangeTime = now;
+   }
+   if (toSet & FUSE_SET_ATTR_SIZE) {
+      attr->mask |= (HGFS_ATTR_VALID_SIZE |
+                     HGFS_ATTR_VALID_WRITE_TIME |
+                     HGFS_ATTR_VALID_ACCESS_TIME |
+                     HGFS_ATTR_VALID_CHANGE_TIME);
+      attr->size = stbuf->st_size;
+      attr->writeTime = attr->accessTime = attr->attrChangeTime = now;
+   }
+   if (toSet & FUSE_SET_ATTR_ATIME) {
+      attr->mask |= HGFS_ATTR_VALID_ACCESS_TIME;
+#ifdef __APPLE__
+      attr->accessTime = HgfsConvertToNtTime(stbuf->st_atimespec.tv_sec,
+                                             stbuf->st_atimespec.tv_nsec);
+#else
+      attr->accessTime = HgfsConvertToNtTime(stbuf->st_atim.tv_sec,
+                                             stbuf->st_atim.tv_nsec);
+#endif
+   }
+   if (toSet & FUSE_SET_ATTR_MTIME) {
+      attr->mask |= HGFS_ATTR_VALID_WRITE_TIME;
+#ifdef __APPLE__
+      attr->writeTime = HgfsConvertToNtTime(stbuf->st_mtimespec.tv_sec,
+                                            stbuf->st_mtimespec.tv_nsec);
+#else
+      attr->writeTime = HgfsConvertToNtTime(stbuf->st_mtim.tv_sec,
+                                            stbuf->st_mtim.tv_nsec);
+#endif
+   }
+#ifdef FUSE_SET_ATTR_ATIME_NOW
+   if (toSet & FUSE_SET_ATTR_ATIME_NOW) {
+      attr->mask |= HGFS_ATTR_VALID_ACCESS_TIME;
+      attr->accessTime = now;
+   }
+   if (toSet & FUSE_SET_ATTR_MTIME_NOW) {
+      attr->mask |= HGFS_ATTR_VALID_WRITE_TIME;
+      attr->writeTime = now;
+   }
+#endif
 
-   res = HgfsSetattr(abspath, attr);
+   HgfsNodeDropCache(node);
+   HgfsInvalidateReadAhead(ino);
+   res = HgfsSetattr(path.path, attr);
    if (res < 0) {
-      LOG(4, ("path = %s , HgfsSetattr failed. res = %d\n", abspath, res));
-      goto exit;
+      LOG(4, ("path = %s , HgfsSetattr failed. res = %d\n", path.path, res));
+      HgfsInvalidateAttrCache(path.path);
+      goto reply;
    }
 
    /* Retrieve new complete attribute settings and update the cache. */
-   res = HgfsPrivateGetattr(fileHandle, abspath, attr);
-   if (res < 0) {
-      LOG(4, ("path = %s , res = %d\n", abspath, res));
-      goto exit;
+   if (handle == HGFS_INVALID_HANDLE) {
+      handle = HgfsNodeGetHandle(node);
    }
-   HgfsSetAttrCache(abspath, attr);
+   res = HgfsRefreshAttr(path.path, handle, attr);
+
+reply:
+   HgfsNodePutPath(&path);
 
 exit:
    LOG(4, ("Exit(%d)\n", res));
-   freeAbsPath(abspath);
-   return res;
+   if (res < 0) {
+      fuse_reply_err(req, -res);
+   } else {
+      HgfsAttrToStat(attr, &newStat);
+      fuse_reply_attr(req, &newStat, HGFS_ATTR_TIMEOUT);
+   }
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * hgfs_truncate
+ * hgfs_open
  *
- *    Truncate a file to the given size.
+ *    Open file at a given inode. The kernel keeps the pages it has of
+ *    the file if the server attributes are the same as at the last
+ *    open; otherwise it drops them.
  *
  * Results:
- *    Returns zero on success, or a negative error on failure.
+ *    None
  *
  * Side effects:
  *    None
@@ -823,60 +1286,56 @@ exit:
  *----------------------------------------------------------------------
  */
 
-static int
-hgfs_truncate(const char *path,  //IN: path to a file
-              off_t size)        //IN: new size
+static void
+hgfs_open(fuse_req_t req,             //IN: Request
+          fuse_ino_t ino,             //IN: Inode
+          struct fuse_file_info *fi)  //IN/OUT: file info structure
 {
-   HgfsHandle fileHandle = HGFS_INVALID_HANDLE;
-   HgfsAttrInfo newAttr = {0};
-   HgfsAttrInfo *attr = &newAttr;
-   char *abspath = NULL;
+   HgfsFuseNode *node = HgfsNodeGet(ino);
+   HgfsFuseNodeVersion version;
+   HgfsAttrInfo attr;
+   HgfsFuseNodePath path;
    int res;
 
-   LOG(4, ("Entry(path = %s, size %"FMT64"x)\n", path, size));
-   res = getAbsPath(path, &abspath);
-   if (res < 0) {
-      goto exit;
-   }
-
-   attr->mask = HGFS_ATTR_VALID_SIZE;
-   attr->size = size;
-
-   attr->mask |= (HGFS_ATTR_VALID_WRITE_TIME |
-                  HGFS_ATTR_VALID_ACCESS_TIME |
-                  HGFS_ATTR_VALID_CHANGE_TIME);
-   attr->writeTime = attr->accessTime = attr->attrChangeTime = HGFS_GET_TIME(time(NULL));
-
-   res = HgfsSetattr(abspath, attr);
+   res = HgfsNodeGetPath(node, &path);
    if (res < 0) {
-      LOG(4, ("path = %s , HgfsSetattr failed. res = %d\n", abspath, res));
       goto exit;
    }
 
-   /* Retrieve new complete attribute settings and update the cache. */
-   res = HgfsPrivateGetattr(fileHandle, abspath, attr);
-   if (res < 0) {
-      LOG(4, ("path = %s , res = %d\n", abspath, res));
-      goto exit;
+   LOG(4, ("Entry(path = %s)\n", path.path));
+   res = HgfsOpen(path.path, fi);
+   if (res == 0) {
+      /* The cached attributes may predate a change on the server. */
+      fi->keep_cache =
+         HgfsRefreshAttr(path.path, (HgfsHandle)fi->fh, &attr) == 0 &&
+         HgfsAttrToVersion(&attr, &version) &&
+         HgfsNodeKeepCache(node, &version);
    }
-   HgfsSetAttrCache(abspath, attr);
+   HgfsNodePutPath(&path);
 
 exit:
    LOG(4, ("Exit(%d)\n", res));
-   freeAbsPath(abspath);
-   return res;
+   if (res < 0) {
+      fuse_reply_err(req, -res);
+      return;
+   }
+   HgfsNodeAddHandle(node, (HgfsHandle)fi->fh);
+   if (fuse_reply_open(req, fi) != 0) {
+      HgfsNodeRemoveHandle(node, (HgfsHandle)fi->fh);
+      HgfsRelease((HgfsHandle)fi->fh);
+   }
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * hgfs_utimens/hgfs_utime
+ * hgfs_create
  *
- *    Update access and write time of a file.
+ *    Create and open a new file, we do it by calling HgfsCreate.
  *
  * Results:
- *    Returns zero on success, or a negative error on failure.
+ *    None
  *
  * Side effects:
  *    None
@@ -884,102 +1343,66 @@ exit:
  *----------------------------------------------------------------------
  */
 
-#ifdef HAVE_UTIMENSAT
-static int
-hgfs_utimens(const char *path,              //IN: path to a file
-             const struct timespec ts[2])   //IN: new time
-#else
-static int
-hgfs_utime(const char *path,        //IN: path to a file
-           struct utimbuf *times)   //IN: new time
-#endif
+static void
+hgfs_create(fuse_req_t req,             //IN: Request
+            fuse_ino_t parentIno,       //IN: Parent directory
+            const char *name,           //IN: Name of the new file
+            mode_t mode,                //IN: file mode
+            struct fuse_file_info *fi)  //IN/OUT: file info structure
 {
-   HgfsHandle fileHandle = HGFS_INVALID_HANDLE;
-   HgfsAttrInfo newAttr = {0};
-   HgfsAttrInfo *attr = &newAttr;
-   time_t accessTimeSec, accessTimeNsec, writeTimeSec, writeTimeNsec;
-   char *abspath = NULL;
+   HgfsFuseNode *parent = HgfsNodeGet(parentIno);
+   struct fuse_entry_param e;
+   HgfsFuseNodePath path;
+   HgfsFuseNode *node;
    int res;
 
-   LOG(4, ("Entry(path = %s)\n", path));
-   res = getAbsPath(path, &abspath);
+   res = HgfsNodeGetChildPath(parent, name, &path);
    if (res < 0) {
-      goto exit;
-   }
-
-   res = HgfsGetAttrCache(abspath, attr);
-   LOG(4, ("Retrieve attr from cache. result = %d \n", res));
-   if (res != 0) {
-      /* Retrieve new complete attribute settings and update the cache. */
-      res = HgfsPrivateGetattr(fileHandle, abspath, attr);
-      LOG(4, ("Retrieve attr from server. result = %d \n", res));
-      if (res == 0 ) {
-         HgfsSetAttrCache(abspath, attr);
-      }
-   }
-
-   if (res != 0) {
-      /* Failed to retrieve file attributes. */
-      goto exit;
+      fuse_reply_err(req, -res);
+      return;
    }
 
-   if (attr->type == HGFS_FILE_TYPE_SYMLINK) {
-      /*
-       * utimensat() has a 'flag' parameter which is not available in fuse.
-       * by default, let's assume AT_SYMLINK_NOFOLLOW. but since there is
-       * neither a way to pass not 'followSymlinks' to setattr, let's simply
-       * do nothing for symlink.
-       */
+   LOG(4, ("Entry(path = %s, mode = %#o)\n", path.path, mode));
+   res = HgfsCreate(path.path, mode, fi);
+   if (res < 0) {
       goto exit;
    }
 
-   attr->mask = (HGFS_ATTR_VALID_WRITE_TIME |
-                 HGFS_ATTR_VALID_ACCESS_TIME);
-
-#ifdef HAVE_UTIMENSAT
-   accessTimeSec = ts[0].tv_sec;
-   accessTimeNsec = ts[0].tv_nsec;
-   writeTimeSec = ts[1].tv_sec;
-   writeTimeNsec = ts[1].tv_nsec;
-#else
-   accessTimeSec = times->actime;
-   accessTimeNsec = 0;
-   writeTimeSec = times->modtime;
-   writeTimeNsec = 0;
-#endif
-   attr->accessTime = HgfsConvertToNtTime(accessTimeSec, accessTimeNsec);
-   attr->writeTime = HgfsConvertToNtTime(writeTimeSec, writeTimeNsec);
-
-   res = HgfsSetattr(abspath, attr);
+   /* The file may have existed; its cached attributes are stale. */
+   HgfsInvalidateAttrCache(path.path);
+   res = HgfsMakeEntry(parent, name, path.path, (HgfsHandle)fi->fh, &e);
    if (res < 0) {
-      LOG(4, ("abspath = %s , HgfsSetattr failed. res = %d\n", abspath, res));
+      HgfsRelease((HgfsHandle)fi->fh);
       goto exit;
    }
 
-   /* Retrieve new complete attribute settings and update the cache. */
-   res = HgfsPrivateGetattr(fileHandle, abspath, attr);
-   if (res < 0) {
-      LOG(4, ("abspath = %s , res = %d\n", abspath, res));
-      goto exit;
+   node = HgfsNodeGet(e.ino);
+   HgfsNodeDropCache(node);
+   HgfsNodeAddHandle(node, (HgfsHandle)fi->fh);
+   if (fuse_reply_create(req, &e, fi) != 0) {
+      HgfsNodeRemoveHandle(node, (HgfsHandle)fi->fh);
+      HgfsRelease((HgfsHandle)fi->fh);
+      HgfsNodeForget(node, 1);
    }
-   HgfsSetAttrCache(abspath, attr);
 
 exit:
+   HgfsNodePutPath(&path);
    LOG(4, ("Exit(%d)\n", res));
-   freeAbsPath(abspath);
-   return res;
+   if (res < 0) {
+      fuse_reply_err(req, -res);
+   }
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * hgfs_open
+ * hgfs_read
  *
- *    Open file at a given path.
+ *    Read the file using the handle from open.
  *
  * Results:
- *    Returns zero on success, or a negative error on failure.
+ *    None
  *
  * Side effects:
  *    None
@@ -987,37 +1410,47 @@ exit:
  *----------------------------------------------------------------------
  */
 
-static int
-hgfs_open(const char *path,          //IN: path to a file
-          struct fuse_file_info *fi) //IN: file info structure
+static void
+hgfs_read(fuse_req_t req,             //IN: Request
+          fuse_ino_t ino,             //IN: Inode
+          size_t size,                //IN: size to read
+          off_t offset,               //IN: starting point to read
+          struct fuse_file_info *fi)  //IN: file info structure
 {
-   char *abspath = NULL;
-   int res;
+   char *buf;
+   ssize_t res;
 
-   LOG(4, ("Entry(path = %s)\n", path));
-   res = getAbsPath(path, &abspath);
-   if (res < 0) {
+   LOG(4, ("Entry(fi->fh = %#"FMT64"x, %#"FMTSZ"x bytes @ %#"FMT64"x)\n",
+           fi->fh, size, offset));
+
+   buf = malloc(size);
+   if (buf == NULL) {
+      res = -ENOMEM;
       goto exit;
    }
 
-   res = HgfsOpen(abspath, fi);
+   res = HgfsRead(fi, ino, buf, size, offset);
 
 exit:
-   LOG(4, ("Exit(%d)\n", res));
-   freeAbsPath(abspath);
-   return res;
+   LOG(4, ("Exit(%"FMTSZ"d)\n", res));
+   if (res < 0) {
+      fuse_reply_err(req, -res);
+   } else {
+      fuse_reply_buf(req, buf, res);
+   }
+   free(buf);
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * hgfs_create
+ * hgfs_write
  *
- *    Create a new file, we do it by calling HgfsOpen.
+ *    Write to the file using the handle from open.
  *
  * Results:
- *    Returns zero on success, or a negative error on failure.
+ *    None
  *
  * Side effects:
  *    None
@@ -1025,39 +1458,52 @@ exit:
  *----------------------------------------------------------------------
  */
 
-static int
-hgfs_create(const char *path,          //IN: path to a file
-            mode_t mode,               //IN: file mode
-            struct fuse_file_info *fi) //IN: file info structure
+static void
+hgfs_write(fuse_req_t req,             //IN: Request
+           fuse_ino_t ino,             //IN: Inode
+           const char *buf,            //IN: data to write
+           size_t size,                //IN: size to write
+           off_t offset,               //IN: starting point to write
+           struct fuse_file_info *fi)  //IN: file info structure
 {
-   char *abspath = NULL;
-   int res;
+   HgfsFuseNode *node = HgfsNodeGet(ino);
+   HgfsFuseNodePath path;
+   ssize_t res;
 
-   LOG(4, ("Entry(path = %s, mode = %#o)\n", path, mode));
-   res = getAbsPath(path, &abspath);
-   if (res < 0) {
-      goto exit;
-   }
+   LOG(4, ("Entry(fi->fh = %#"FMT64"x, write %#"FMTSZ"x bytes @ %#"FMT64"x)\n",
+           fi->fh, size, offset));
 
-   res = HgfsCreate(abspath, mode, fi);
+   /* Our own write must not look like a change on the server. */
+   HgfsNodeDropCache(node);
+   res = HgfsWrite(fi, ino, buf, size, offset);
+   if (res >= 0 && HgfsNodeGetPath(node, &path) == 0) {
+      /*
+       * Positive result indicates the number of bytes written.
+       * For zero bytes and no error, we still purge the cache
+       * this could effect the attributes.
+       */
+      HgfsInvalidateAttrCache(path.path);
+      HgfsNodePutPath(&path);
+   }
 
-exit:
-   LOG(4, ("Exit(%d)\n", res));
-   freeAbsPath(abspath);
-   return res;
+   LOG(4, ("Exit(%"FMTSZ"d)\n", res));
+   if (res < 0) {
+      fuse_reply_err(req, -res);
+   } else {
+      fuse_reply_write(req, res);
+   }
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * hgfs_read
+ * hgfs_statfs
  *
- *    Read the file using the handle, if the handle is zero
- *    then open the file first and then read.
+ *    Stat the host for total and free bytes on disk.
  *
  * Results:
- *    Returns the number of bytes read from the file.
+ *    None
  *
  * Side effects:
  *    None
@@ -1065,48 +1511,43 @@ exit:
  *----------------------------------------------------------------------
  */
 
-static int
-hgfs_read(const char *path,          //IN: path to a file
-          char *buf,                 //OUT: to store the data
-          size_t size,               //IN: size to read
-          off_t offset,              //IN: starting point to read
-          struct fuse_file_info *fi) //IN: file info structure
+static void
+hgfs_statfs(fuse_req_t req,   //IN: Request
+            fuse_ino_t ino)   //IN: Inode in the filesystem
 {
-   char *abspath = NULL;
+   HgfsFuseNodePath path;
+   struct statvfs stbuf;
    int res;
 
-   LOG(4, ("Entry(path = %s, fi->fh = %#"FMT64"x, %#"FMTSZ"x bytes @ %#"FMT64"x)\n",
-           path, fi->fh, size, offset));
-   res = getAbsPath(path, &abspath);
+   res = HgfsNodeGetPath(HgfsNodeGet(ino), &path);
    if (res < 0) {
       goto exit;
    }
 
-   if (fi->fh == HGFS_INVALID_HANDLE) {
-      res = HgfsOpen(abspath, fi);
-      if (res) {
-         goto exit;
-      }
-   }
-   res = HgfsRead(fi, buf, size, offset);
+   LOG(4, ("Entry(path = %s)\n", path.path));
+   res = HgfsStatfs(path.path, &stbuf);
+   HgfsNodePutPath(&path);
 
 exit:
    LOG(4, ("Exit(%d)\n", res));
-   freeAbsPath(abspath);
-   return res;
+   if (res < 0) {
+      fuse_reply_err(req, -res);
+   } else {
+      fuse_reply_statfs(req, &stbuf);
+   }
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * hgfs_write
+ * hgfs_flush
  *
- *    Write to the file using the handle, if the handle is zero
- *    then open the file first and then write.
+ *    Called on each close of a file descriptor. Waits for the writes in
+ *    flight so that close reports their errors.
  *
  * Results:
- *    Returns the number of bytes written to the file.
+ *    None
  *
  * Side effects:
  *    None
@@ -1114,55 +1555,32 @@ exit:
  *----------------------------------------------------------------------
  */
 
-static int
-hgfs_write(const char *path,          //IN: path to a file
-           const char *buf,           //IN: data to write
-           size_t size,               //IN: size to write
-           off_t offset,              //IN: starting point to write
-           struct fuse_file_info *fi) //IN: file info structure
+static void
+hgfs_flush(fuse_req_t req,             //IN: Request
+           fuse_ino_t ino,             //IN: Inode
+           struct fuse_file_info *fi)  //IN: file info structure
 {
-   char *abspath = NULL;
    int res;
 
-   LOG(4, ("Entry(path = %s, fi->fh = %#"FMT64"x, write %#"FMTSZ"x bytes @ %#"FMT64"x)\n",
-           path, fi->fh, size, offset));
-   res = getAbsPath(path, &abspath);
-   if (res < 0) {
-      goto exit;
-   }
-
-   if (fi->fh == HGFS_INVALID_HANDLE) {
-      res = HgfsOpen(abspath, fi);
-      if (res) {
-         goto exit;
-      }
-   }
+   LOG(4, ("Entry(fi->fh = %#"FMT64"x)\n", fi->fh));
 
-   res = HgfsWrite(fi, buf, size, offset);
-   if (res >= 0) {
-      /*
-       * Positive result indicates the number of bytes written.
-       * For zero bytes and no error, we still purge the cache
-       * this could effect the attributes.
-       */
-      HgfsInvalidateAttrCache(abspath);
-   }
+   res = HgfsFlush((HgfsHandle)fi->fh);
 
-exit:
    LOG(4, ("Exit(%d)\n", res));
-   freeAbsPath(abspath);
-   return res;
+   fuse_reply_err(req, -res);
 }
 
+
 /*
  *----------------------------------------------------------------------
  *
- * hgfs_statfs
+ * hgfs_fsync
  *
- *    Stat the host for total and free bytes on disk.
+ *    Wait for the writes in flight. HGFS has no request to sync a file
+ *    on the host, so this only orders the writes before the call.
  *
  * Results:
- *    Returns zero on success, or a negative error on failure.
+ *    None
  *
  * Side effects:
  *    None
@@ -1170,25 +1588,20 @@ exit:
  *----------------------------------------------------------------------
  */
 
-static int
-hgfs_statfs(const char *path,      //IN: Path to the filesystem
-            struct statvfs *stbuf) //OUT:Struct to fill data
+static void
+hgfs_fsync(fuse_req_t req,             //IN: Request
+           fuse_ino_t ino,             //IN: Inode
+           int datasync,               //IN: Only sync the data
+           struct fuse_file_info *fi)  //IN: file info structure
 {
-   char *abspath = NULL;
    int res;
 
-   LOG(4, ("Entry(path = %s)\n", path));
-   res = getAbsPath(path, &abspath);
-   if (res < 0) {
-      goto exit;
-   }
+   LOG(4, ("Entry(fi->fh = %#"FMT64"x, datasync = %d)\n", fi->fh, datasync));
 
-   res = HgfsStatfs(abspath, stbuf);
+   res = HgfsFlush((HgfsHandle)fi->fh);
 
-exit:
    LOG(4, ("Exit(%d)\n", res));
-   freeAbsPath(abspath);
-   return res;
+   fuse_reply_err(req, -res);
 }
 
 
@@ -1200,7 +1613,7 @@ exit:
  *    Release a file.
  *
  * Results:
- *    Returns zero.
+ *    None
  *
  * Side effects:
  *    None
@@ -1208,28 +1621,19 @@ exit:
  *----------------------------------------------------------------------
  */
 
-static int
-hgfs_release(const char *path,                //IN: path to a file
-             struct fuse_file_info *fi)       //IN: file info structure
+static void
+hgfs_release(fuse_req_t req,             //IN: Request
+             fuse_ino_t ino,             //IN: Inode
+             struct fuse_file_info *fi)  //IN: file info structure
 {
-   char *abspath = NULL;
-   int res;
-
-   LOG(4, ("Entry(path = %s, fi->fh = %#"FMT64"x)\n", path, fi->fh));
-   res = getAbsPath(path, &abspath);
-   if (res < 0) {
-      goto exit;
-   }
+   LOG(4, ("Entry(fi->fh = %#"FMT64"x)\n", fi->fh));
 
-   res = HgfsRelease(fi->fh);
-   if (0 == res) {
-      fi->fh = HGFS_INVALID_HANDLE;
-   }
+   HgfsNodeRemoveHandle(HgfsNodeGet(ino), (HgfsHandle)fi->fh);
+   HgfsRelease((HgfsHandle)fi->fh);
+   fi->fh = HGFS_INVALID_HANDLE;
 
-exit:
    LOG(4, ("Exit(0)\n"));
-   freeAbsPath(abspath);
-   return 0;
+   fuse_reply_err(req, 0);
 }
 
 
@@ -1238,10 +1642,10 @@ exit:
  *
  * hgfs_init
  *
- *    Initialization routine. We spawn the cache purge thread here.
+ *    Initialization routine. We spawn the I/O threads here.
  *
  * Results:
- *    Returns NULL.
+ *    None
  *
  * Side effects:
  *    None
@@ -1249,32 +1653,26 @@ exit:
  *----------------------------------------------------------------------
  */
 
-static void*
-hgfs_init(struct fuse_conn_info *conn) // IN: unused
+static void
+hgfs_init(void *userdata,               // IN: unused
+          struct fuse_conn_info *conn)  // IN: unused
 {
-   pthread_t purgeCacheThread;
-   int dummy;
    int res;
 
    LOG(4, ("Entry()\n"));
 
-   /*
-    * dummy argument is required for Solaris and FreeBSD while creating
-    * thread otherwise the program crashes.
-    */
-   res = pthread_create(&purgeCacheThread, NULL,
-                        HgfsPurgeCache, &dummy);
+   res = HgfsCreateSession();
    if (res < 0) {
-      LOG(4, ("Pthread create fail. error = %d\n", res));
+      LOG(4, ("Create session failed. error = %d\n", res));
    }
 
-   res = HgfsCreateSession();
+   res = HgfsIoPoolInit();
    if (res < 0) {
-      LOG(4, ("Create session failed. error = %d\n", res));
+      LOG(4, ("I/O threads not started, requests will not overlap. error = %d\n",
+              res));
    }
 
-   LOG(4, ("Exit(NULL)\n"));
-   return NULL;
+   LOG(4, ("Exit()\n"));
 }
 
 
@@ -1286,7 +1684,7 @@ hgfs_init(struct fuse_conn_info *conn) // IN: unused
  *    Cleanup routine.
  *
  * Results:
- *    Returns NULL.
+ *    None
  *
  * Side effects:
  *    None
@@ -1295,18 +1693,21 @@ hgfs_init(struct fuse_conn_info *conn) // IN: unused
  */
 
 static void
-hgfs_destroy(void *data) // IN: unused
+hgfs_destroy(void *userdata) // IN: unused
 {
    int res;
 
    LOG(4, ("Entry()\n"));
 
+   HgfsIoPoolExit();
+
    res = HgfsDestroySession();
    if (res < 0) {
       LOG(4, ("Destroy session failed. error = %d\n", res));
    }
 
    HgfsTransportExit();
+   HgfsNodeExit();
 
    free(gState->basePath);
 
@@ -1320,34 +1721,36 @@ hgfs_destroy(void *data) // IN: unused
 
 
 /*--------------------------------------------------------------------------- */
-static struct fuse_operations vmhgfs_operations = {
-   .getattr     = hgfs_getattr,
-   .access      = hgfs_access,
-   .readlink    = hgfs_readlink,
-   .readdir     = hgfs_readdir,
-   .mknod       = hgfs_mknod,
-   .mkdir       = hgfs_mkdir,
-   .symlink     = hgfs_symlink,
-   .unlink      = hgfs_unlink,
-   .rmdir       = hgfs_rmdir,
-   .rename      = hgfs_rename,
-   .link        = hgfs_link,
-   .chmod       = hgfs_chmod,
-   .chown       = hgfs_chown,
-   .truncate    = hgfs_truncate,
-#ifdef HAVE_UTIMENSAT
-   .utimens     = hgfs_utimens,
-#else // HAVE_UTIMENSAT
-   .utime       = hgfs_utime,
-#endif // defined HAVE_UTIMENSAT
-   .open        = hgfs_open,
-   .read        = hgfs_read,
-   .write       = hgfs_write,
-   .statfs      = hgfs_statfs,
-   .release     = hgfs_release,
-   .create      = hgfs_create,
-   .init        = hgfs_init,
-   .destroy     = hgfs_destroy,
+static struct fuse_lowlevel_ops vmhgfs_operations = {
+   .init         = hgfs_init,
+   .destroy      = hgfs_destroy,
+   .lookup       = hgfs_lookup,
+   .forget       = hgfs_forget,
+#if FUSE_VERSION >= 29
+   .forget_multi = hgfs_forget_multi,
+#endif
+   .getattr      = hgfs_getattr,
+   .setattr      = hgfs_setattr,
+   .access       = hgfs_access,
+   .readlink     = hgfs_readlink,
+   .opendir      = hgfs_opendir,
+   .readdir      = hgfs_readdir,
+   .releasedir   = hgfs_releasedir,
+   .mknod        = hgfs_mknod,
+   .mkdir        = hgfs_mkdir,
+   .symlink      = hgfs_symlink,
+   .unlink       = hgfs_unlink,
+   .rmdir        = hgfs_rmdir,
+   .rename       = hgfs_rename,
+   .link         = hgfs_link,
+   .open         = hgfs_open,
+   .create       = hgfs_create,
+   .read         = hgfs_read,
+   .write        = hgfs_write,
+   .statfs       = hgfs_statfs,
+   .flush        = hgfs_flush,
+   .release      = hgfs_release,
+   .fsync        = hgfs_fsync,
 };
 
 
@@ -1372,6 +1775,11 @@ main(int argc,       //IN: Argument count
      char *argv[])   //IN: Argument list
 {
    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+   struct fuse_session *se = NULL;
+   struct fuse_chan *ch = NULL;
+   char *mountpoint = NULL;
+   int multithreaded;
+   int foreground;
    int res;
 
    res = vmhgfsPreprocessArgs(&args);
@@ -1380,6 +1788,12 @@ main(int argc,       //IN: Argument count
       exit(1);
    }
 
+   res = fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground);
+   if (res != 0 || mountpoint == NULL) {
+      fprintf(stderr, "Error parsing arguments!\n");
+      exit(1);
+   }
+
    /* Initialization */
    umask(0);
    HgfsResetOps();
@@ -1389,7 +1803,42 @@ main(int argc,       //IN: Argument count
       return res;
    }
    HgfsInitCache();
+   HgfsNodeInit();
 
-   return fuse_main(args.argc, args.argv, &vmhgfs_operations, NULL);
-}
+   res = 1;
+   ch = fuse_mount(mountpoint, &args);
+   if (ch == NULL) {
+      goto exit;
+   }
+
+   se = fuse_lowlevel_new(&args, &vmhgfs_operations,
+                          sizeof vmhgfs_operations, NULL);
+   if (se == NULL) {
+      goto unmount;
+   }
+
+   if (fuse_set_signal_handlers(se) != 0) {
+      goto destroy;
+   }
+   fuse_session_add_chan(se, ch);
+   gHgfsChan = ch;
+
+   if (fuse_daemonize(foreground) == 0) {
+      res = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+   }
+
+   fuse_remove_signal_handlers(se);
+   gHgfsChan = NULL;
+   fuse_session_remove_chan(ch);
 
+destroy:
+   fuse_session_destroy(se);
+
+unmount:
+   fuse_unmount(mountpoint, ch);
+
+exit:
+   free(mountpoint);
+   fuse_opt_free_args(&args);
+   return res == 0 ? 0 : 1;
+}
@@ -0,0 +1,932 @@
+/*********************************************************
+ * Copyright (C) 2013 VMware, Inc. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation version 2.1 and no later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the Lesser GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA.
+ *
+ *********************************************************/
+
+/*
+ * node.c --
+ *
+ * Inode table of the low-level FUSE client.
+ *
+ * The inode number given to the kernel is the address of the node, so
+ * every operation on an existing inode finds its node without any
+ * lookup. The full HGFS name of a node is built once, when the kernel
+ * looks the node up, and only rewritten when the node or one of its
+ * ancestors is renamed. The (parent, name) hash is only consulted by
+ * operations that name a child: lookup, create, unlink and rename.
+ *
+ * A node lives as long as the kernel holds lookups on it or one of its
+ * children is still alive, since children reference their parent. Every
+ * live node but the root is also on a list, hashed or not, so that the
+ * table can be torn down at unmount.
+ */
+
+#include "module.h"
+#include "node.h"
+
+#include <pthread.h>
+
+#define HGFS_NODE_HASH_BITS 12
+#define HGFS_NODE_HASH_SIZE (1 << HGFS_NODE_HASH_BITS)
+
+static struct list_head gNodeHash[HGFS_NODE_HASH_SIZE];
+static struct list_head gNodeList;
+static pthread_rwlock_t gNodeLock = PTHREAD_RWLOCK_INITIALIZER;
+static HgfsFuseNode gRootNode;
+static uint64 gNodeGeneration;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsNodeHash --
+ *
+ *    Hash a (parent, name) pair into a bucket of the node hash.
+ *
+ * Results:
+ *    Bucket index.
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static uint32
+HgfsNodeHash(const HgfsFuseNode *parent,   // IN: Parent node
+             const char *name)             // IN: Child name
+{
+   uint32 hash = 2166136261U;
+   uintptr_t p = (uintptr_t)parent;
+
+   while (*name != '\0') {
+      hash = (hash ^ (uint8)*name++) * 16777619U;
+   }
+   hash ^= (uint32)(p >> 4) ^ (uint32)((uint64)p >> 32);
+
+   return (hash ^ (hash >> HGFS_NODE_HASH_BITS)) & (HGFS_NODE_HASH_SIZE - 1);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsNodeFindLocked --
+ *
+ *    Find the hashed child called name of parent. The node lock must be
+ *    held.
+ *
+ * Results:
+ *    The node, or NULL if the child is not in the table.
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static HgfsFuseNode *
+HgfsNodeFindLocked(const HgfsFuseNode *parent,  // IN: Parent node
+                   const char *name)            // IN: Child name
+{
+   struct list_head *bucket = &gNodeHash[HgfsNodeHash(parent, name)];
+   struct list_head *cur;
+
+   list_for_each(cur, bucket) {
+      HgfsFuseNode *node = list_entry(cur, HgfsFuseNode, hashLink);
+
+      if (node->parent == parent && strcmp(node->name, name) == 0) {
+         return node;
+      }
+   }
+   return NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsNodeBuildPath --
+ *
+ *    Build the HGFS name of a child from the name of its parent.
+ *
+ * Results:
+ *    The allocated name, or NULL if out of memory.
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static char *
+HgfsNodeBuildPath(const HgfsFuseNode *parent,  // IN: Parent node
+                  const char *name,            // IN: Child name
+                  size_t *pathLen)             // OUT: Length of the name
+{
+   size_t nameLen = strlen(name);
+   Bool addSlash = parent->path[parent->pathLen - 1] != '/';
+   size_t len = parent->pathLen + (addSlash ? 1 : 0) + nameLen;
+   char *path = malloc(len + 1);
+   char *p = path;
+
+   if (path == NULL) {
+      return NULL;
+   }
+   memcpy(p, parent->path, parent->pathLen);
+   p += parent->pathLen;
+   if (addSlash) {
+      *p++ = '/';
+   }
+   memcpy(p, name, nameLen + 1);
+   *pathLen = len;
+   return path;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsNodeFreeLocked --
+ *
+ *    Take the node out of the table and free it. The write lock must be
+ *    held.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsNodeFreeLocked(HgfsFuseNode *node)  // IN: Node to free
+{
+   if (node->hashed) {
+      list_del(&node->hashLink);
+   }
+   list_del(&node->nodeLink);
+   free(node->handles);
+   free(node->name);
+   free(node->path);
+   free(node);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsNodeReleaseLocked --
+ *
+ *    Free the node if neither the kernel nor a child still refers to
+ *    it, then do the same for its ancestors. The write lock must be
+ *    held.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    Nodes may be freed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsNodeReleaseLocked(HgfsFuseNode *node)  // IN: Node to release
+{
+   while (node != &gRootNode && node->nlookup == 0 && node->refCount == 0) {
+      HgfsFuseNode *parent = node->parent;
+
+      LOG(4, ("Freeing node %s\n", node->path));
+      HgfsNodeFreeLocked(node);
+
+      ASSERT(parent->refCount > 0);
+      parent->refCount--;
+      node = parent;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsNodeCopyPath --
+ *
+ *    Copy a name into nodePath, using its inline buffer if it fits.
+ *
+ * Results:
+ *    Zero on success, -ENOMEM if out of memory.
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+HgfsNodeCopyPath(const char *path,              // IN: Name to copy
+                 size_t pathLen,                // IN: Its length
+                 HgfsFuseNodePath *nodePath)    // OUT: Copy
+{
+   if (pathLen < sizeof nodePath->buf) {
+      nodePath->path = nodePath->buf;
+   } else {
+      nodePath->path = malloc(pathLen + 1);
+      if (nodePath->path == NULL) {
+         return -ENOMEM;
+      }
+   }
+   memcpy(nodePath->path, path, pathLen + 1);
+   return 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsNodeInit --
+ *
+ *    Set up the node table and its root, which is named after the base
+ *    path of the mount.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+HgfsNodeInit(void)
+{
+   size_t i;
+
+   for (i = 0; i < ARRAYSIZE(gNodeHash); i++) {
+      INIT_LIST_HEAD(&gNodeHash[i]);
+   }
+   INIT_LIST_HEAD(&gNodeList);
+
+   memset(&gRootNode, 0, sizeof gRootNode);
+   gRootNode.parent = &gRootNode;
+   gRootNode.name = "";
+   gRootNode.path = Str_Asprintf(&gRootNode.pathLen, "%s/",
+                                 gState->basePathLen > 0 ?
+                                 gState->basePath : "");
+   VERIFY(gRootNode.path != NULL);
+   gRootNode.nlookup = 1;
+   INIT_LIST_HEAD(&gRootNode.hashLink);
+   INIT_LIST_HEAD(&gRootNode.nodeLink);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsNodeExit --
+ *
+ *    Free every node still in the table, including the unhashed ones of
+ *    deleted or replaced files. The kernel does not forget its inodes
+ *    when the file system is unmounted.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+HgfsNodeExit(void)
+{
+   pthread_rwlock_wrlock(&gNodeLock);
+   while (!list_empty(&gNodeList)) {
+      HgfsFuseNode *node = list_entry(gNodeList.next, HgfsFuseNode, nodeLink);
+
+      HgfsNodeFreeLocked(node);
+   }
+   free(gRootNode.handles);
+   gRootNode.handles = NULL;
+   gRootNode.numHandles = 0;
+   free(gRootNode.path);
+   gRootNode.path = NULL;
+   pthread_rwlock_unlock(&gNodeLock);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsNodeGet --
+ *
+ *    Map an inode number from the kernel to its node.
+ *
+ * Results:
+ *    The node.
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+HgfsFuseNode *
+HgfsNodeGet(fuse_ino_t ino)  // IN: Inode number
+{
+   if (ino == FUSE_ROOT_ID) {
+      return &gRootNode;
+   }
+   return (HgfsFuseNode *)(uintptr_t)ino;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsNodeIno --
+ *
+ *    Map a node to the inode number given to the kernel.
+ *
+ * Results:
+ *    The inode number.
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+fuse_ino_t
+HgfsNodeIno(HgfsFuseNode *node)  // IN: Node
+{
+   if (node == &gRootNode) {
+      return FUSE_ROOT_ID;
+   }
+   return (fuse_ino_t)(uintptr_t)node;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsNodeGetPath --
+ *
+ *    Copy the HGFS name of the node. Release it with HgfsNodePutPath.
+ *
+ * Results:
+ *    Zero on success, -ENOMEM if out of memory.
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+HgfsNodeGetPath(HgfsFuseNode *node,           // IN: Node
+                HgfsFuseNodePath *nodePath)   // OUT: Its HGFS name
+{
+   int res;
+
+   pthread_rwlock_rdlock(&gNodeLock);
+   res = HgfsNodeCopyPath(node->path, node->pathLen, nodePath);
+   pthread_rwlock_unlock(&gNodeLock);
+
+   return res;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsNodeGetChildPath --
+ *
+ *    Build the HGFS name of a child of parent. Release it with
+ *    HgfsNodePutPath.
+ *
+ * Results:
+ *    Zero on success, -ENOMEM if out of memory.
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+HgfsNodeGetChildPath(HgfsFuseNode *parent,         // IN: Parent node
+                     const char *name,             // IN: Child name
+                     HgfsFuseNodePath *nodePath)   // OUT: Child HGFS name
+{
+   size_t nameLen = strlen(name);
+   size_t len;
+   Bool addSlash;
+   char *p;
+
+   pthread_rwlock_rdlock(&gNodeLock);
+   addSlash = parent->path[parent->pathLen - 1] != '/';
+   len = parent->pathLen + (addSlash ? 1 : 0) + nameLen;
+   if (len < sizeof nodePath->buf) {
+      nodePath->path = nodePath->buf;
+   } else {
+      nodePath->path = malloc(len + 1);
+      if (nodePath->path == NULL) {
+         pthread_rwlock_unlock(&gNodeLock);
+         return -ENOMEM;
+      }
+   }
+   p = nodePath->path;
+   memcpy(p, parent->path, parent->pathLen);
+   p += parent->pathLen;
+   pthread_rwlock_unlock(&gNodeLock);
+
+   if (addSlash) {
+      *p++ = '/';
+   }
+   memcpy(p, name, nameLen + 1);
+   return 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsNodePutPath --
+ *
+ *    Release a name returned by HgfsNodeGetPath/HgfsNodeGetChildPath.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+HgfsNodePutPath(HgfsFuseNodePath *nodePath)  // IN: Name to release
+{
+   if (nodePath->path != nodePath->buf) {
+      free(nodePath->path);
+   }
+   nodePath->path = NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsNodeLookup --
+ *
+ *    Take a kernel lookup reference on the child called name of parent,
+ *    adding the child to the table if needed. Called once the server
+ *    has confirmed that the child exists.
+ *
+ * Results:
+ *    The node, or NULL if out of memory.
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+HgfsFuseNode *
+HgfsNodeLookup(HgfsFuseNode *parent,  // IN: Parent node
+               const char *name)      // IN: Child name
+{
+   HgfsFuseNode *node;
+
+   pthread_rwlock_wrlock(&gNodeLock);
+   node = HgfsNodeFindLocked(parent, name);
+   if (node != NULL) {
+      node->nlookup++;
+      goto exit;
+   }
+
+   node = calloc(1, sizeof *node);
+   if (node == NULL) {
+      goto exit;
+   }
+   node->name = strdup(name);
+   node->path = HgfsNodeBuildPath(parent, name, &node->pathLen);
+   if (node->name == NULL || node->path == NULL) {
+      free(node->name);
+      free(node->path);
+      free(node);
+      node = NULL;
+      goto exit;
+   }
+   node->parent = parent;
+   parent->refCount++;
+   node->nlookup = 1;
+   node->generation = ++gNodeGeneration;
+   node->hashed = TRUE;
+   list_add(&node->hashLink, &gNodeHash[HgfsNodeHash(parent, name)]);
+   list_add(&node->nodeLink, &gNodeList);
+   LOG(4, ("New node %s\n", node->path));
+
+exit:
+   pthread_rwlock_unlock(&gNodeLock);
+   return node;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsNodeForget --
+ *
+ *    Drop nlookup kernel lookup references on the node.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    The node and its ancestors may be freed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+HgfsNodeForget(HgfsFuseNode *node,  // IN: Node
+               uint64 nlookup)      // IN: Lookups to drop
+{
+   if (node == &gRootNode) {
+      return;
+   }
+
+   pthread_rwlock_wrlock(&gNodeLock);
+   ASSERT(node->nlookup >= nlookup);
+   node->nlookup -= MIN(node->nlookup, nlookup);
+   HgfsNodeReleaseLocked(node);
+   pthread_rwlock_unlock(&gNodeLock);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsNodeUnhash --
+ *
+ *    Remove the child called name of parent from the hash after it was
+ *    deleted, so that a new file of the same name gets a new node. The
+ *    old node stays valid until the kernel forgets it.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+HgfsNodeUnhash(HgfsFuseNode *parent,  // IN: Parent node
+               const char *name)      // IN: Child name
+{
+   HgfsFuseNode *node;
+
+   pthread_rwlock_wrlock(&gNodeLock);
+   node = HgfsNodeFindLocked(parent, name);
+   if (node != NULL) {
+      list_del_init(&node->hashLink);
+      node->hashed = FALSE;
+   }
+   pthread_rwlock_unlock(&gNodeLock);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsNodeRename --
+ *
+ *    Move a node after the server renamed it, and rewrite the HGFS
+ *    names of all its hashed descendants. A node replaced by the rename
+ *    is unhashed. Renames are rare enough that walking the whole table
+ *    is cheaper than keeping every name up to date on each operation.
+ *
+ * Results:
+ *    Zero on success, -ENOMEM if out of memory. On failure the source is
+ *    unhashed so that it will be looked up again.
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+HgfsNodeRename(HgfsFuseNode *oldParent,  // IN: Source parent
+               const char *oldName,      // IN: Source name
+               HgfsFuseNode *newParent,  // IN: Target parent
+               const char *newName)      // IN: Target name
+{
+   HgfsFuseNode *node;
+   HgfsFuseNode *target;
+   char *name = NULL;
+   char *path = NULL;
+   size_t pathLen;
+   size_t i;
+   int res = 0;
+
+   pthread_rwlock_wrlock(&gNodeLock);
+   node = HgfsNodeFindLocked(oldParent, oldName);
+   target = HgfsNodeFindLocked(newParent, newName);
+   if (target != NULL && target != node) {
+      list_del_init(&target->hashLink);
+      target->hashed = FALSE;
+   }
+   if (node == NULL || node == target) {
+      goto exit;
+   }
+
+   name = strdup(newName);
+   path = HgfsNodeBuildPath(newParent, newName, &pathLen);
+   if (name == NULL || path == NULL) {
+      res = -ENOMEM;
+      goto unhash;
+   }
+
+   /* Rewrite the names below the node while they still match its own. */
+   for (i = 0; i < ARRAYSIZE(gNodeHash); i++) {
+      struct list_head *cur;
+
+      list_for_each(cur, &gNodeHash[i]) {
+         HgfsFuseNode *child = list_entry(cur, HgfsFuseNode, hashLink);
+         char *childPath;
+
+         if (child->pathLen <= node->pathLen ||
+             child->path[node->pathLen] != '/' ||
+             memcmp(child->path, node->path, node->pathLen) != 0) {
+            continue;
+         }
+
+         childPath = malloc(pathLen + child->pathLen - node->pathLen + 1);
+         if (childPath == NULL) {
+            /* Leave it stale; it only serves already open descendants. */
+            LOG(4, ("Out of memory renaming %s\n", child->path));
+            continue;
+         }
+         memcpy(childPath, path, pathLen);
+         memcpy(childPath + pathLen, child->path + node->pathLen,
+                child->pathLen - node->pathLen + 1);
+         free(child->path);
+         child->path = childPath;
+         child->pathLen += pathLen - node->pathLen;
+      }
+   }
+
+   LOG(4, ("Renaming node %s to %s\n", node->path, path));
+   list_del(&node->hashLink);
+   free(node->name);
+   free(node->path);
+   node->name = name;
+   node->path = path;
+   node->pathLen = pathLen;
+   list_add(&node->hashLink, &gNodeHash[HgfsNodeHash(newParent, newName)]);
+
+   if (newParent != oldParent) {
+      newParent->refCount++;
+      node->parent = newParent;
+      oldParent->refCount--;
+      HgfsNodeReleaseLocked(oldParent);
+   }
+   goto exit;
+
+unhash:
+   free(name);
+   free(path);
+   list_del_init(&node->hashLink);
+   node->hashed = FALSE;
+
+exit:
+   pthread_rwlock_unlock(&gNodeLock);
+   return res;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsNodeAddHandle --
+ *
+ *    Remember a server handle opened on the node so that attribute
+ *    requests can name the file by handle rather than by name. A node
+ *    has as many handles as the kernel has opens of the file.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None, if out of memory the handle is just not used for attributes.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+HgfsNodeAddHandle(HgfsFuseNode *node,  // IN: Node
+                  HgfsHandle handle)   // IN: Open server handle
+{
+   pthread_rwlock_wrlock(&gNodeLock);
+   if (node->numHandles == node->maxHandles) {
+      uint32 maxHandles = MAX(node->maxHandles * 2, 2);
+      HgfsHandle *handles = realloc(node->handles,
+                                    maxHandles * sizeof *handles);
+
+      if (handles == NULL) {
+         goto exit;
+      }
+      node->handles = handles;
+      node->maxHandles = maxHandles;
+   }
+   node->handles[node->numHandles++] = handle;
+
+exit:
+   pthread_rwlock_unlock(&gNodeLock);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsNodeRemoveHandle --
+ *
+ *    Forget a server handle that is being closed.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+HgfsNodeRemoveHandle(HgfsFuseNode *node,  // IN: Node
+                     HgfsHandle handle)   // IN: Closed server handle
+{
+   uint32 i;
+
+   pthread_rwlock_wrlock(&gNodeLock);
+   for (i = node->numHandles; i-- > 0;) {
+      if (node->handles[i] == handle) {
+         memmove(&node->handles[i], &node->handles[i + 1],
+                 (node->numHandles - i - 1) * sizeof node->handles[0]);
+         node->numHandles--;
+         break;
+      }
+   }
+   pthread_rwlock_unlock(&gNodeLock);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsNodeGetHandle --
+ *
+ *    Get a server handle open on the node, if any.
+ *
+ * Results:
+ *    The newest handle, or HGFS_INVALID_HANDLE.
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+HgfsHandle
+HgfsNodeGetHandle(HgfsFuseNode *node)  // IN: Node
+{
+   HgfsHandle handle = HGFS_INVALID_HANDLE;
+
+   pthread_rwlock_rdlock(&gNodeLock);
+   if (node->numHandles > 0) {
+      handle = node->handles[node->numHandles - 1];
+   }
+   pthread_rwlock_unlock(&gNodeLock);
+
+   return handle;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsNodeKeepCache --
+ *
+ *    Called on open with the current server attributes of the file.
+ *    Remembers them as the version the kernel pages belong to.
+ *
+ * Results:
+ *    TRUE if the file is unchanged since the last open, so the kernel
+ *    may keep its pages.
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+Bool
+HgfsNodeKeepCache(HgfsFuseNode *node,                   // IN: Node
+                  const HgfsFuseNodeVersion *version)   // IN: Server version
+{
+   Bool keep;
+
+   pthread_rwlock_wrlock(&gNodeLock);
+   keep = node->versionValid &&
+          memcmp(&node->version, version, sizeof *version) == 0;
+   node->version = *version;
+   node->versionValid = TRUE;
+   LOG(4, ("%s cache of %s\n", keep ? "Keep" : "Drop", node->path));
+   pthread_rwlock_unlock(&gNodeLock);
+
+   return keep;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsNodeCheckCache --
+ *
+ *    Compare attributes fetched for the file with the version its kernel
+ *    pages belong to.
+ *
+ * Results:
+ *    TRUE if the file changed on the server and the kernel pages must be
+ *    invalidated.
+ *
+ * Side effects:
+ *    The version is forgotten once it is found stale.
+ *
+ *----------------------------------------------------------------------
+ */
+
+Bool
+HgfsNodeCheckCache(HgfsFuseNode *node,                   // IN: Node
+                   const HgfsFuseNodeVersion *version)   // IN: Server version
+{
+   Bool stale;
+
+   pthread_rwlock_wrlock(&gNodeLock);
+   stale = node->versionValid &&
+           memcmp(&node->version, version, sizeof *version) != 0;
+   if (stale) {
+      node->versionValid = FALSE;
+   }
+   pthread_rwlock_unlock(&gNodeLock);
+
+   return stale;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsNodeDropCache --
+ *
+ *    Forget the version of the kernel pages after the client changed
+ *    the file, so the next open does not keep them.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+HgfsNodeDropCache(HgfsFuseNode *node)  // IN: Node
+{
+   pthread_rwlock_wrlock(&gNodeLock);
+   node->versionValid = FALSE;
+   pthread_rwlock_unlock(&gNodeLock);
+}
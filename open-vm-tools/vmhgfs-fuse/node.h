@@ -0,0 +1,97 @@
+/*********************************************************
+ * Copyright (C) 2013 VMware, Inc. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation version 2.1 and no later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the Lesser GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA.
+ *
+ *********************************************************/
+
+/*
+ * node.h --
+ *
+ * Inode table of the low-level FUSE client. Every inode number handed
+ * to the kernel refers to an HgfsFuseNode that remembers its parent, its
+ * name and the complete HGFS name to send to the server.
+ */
+
+#ifndef _VMHGFS_FUSE_NODE_H_
+#define _VMHGFS_FUSE_NODE_H_
+
+#include "vm_basic_types.h"
+#include "hgfsProto.h"
+#include <linux/list.h>
+#include <fuse_lowlevel.h>
+
+/*
+ * Server attributes the kernel page cache of a file was filled under.
+ */
+typedef struct HgfsFuseNodeVersion {
+   uint64 writeTime;
+   uint64 changeTime;               /* Zero if the server has none */
+   uint64 size;
+} HgfsFuseNodeVersion;
+
+typedef struct HgfsFuseNode {
+   struct list_head hashLink;       /* Link in the (parent, name) hash */
+   struct list_head nodeLink;       /* Link in the list of live nodes */
+   struct HgfsFuseNode *parent;     /* Parent directory, referenced */
+   char *name;                      /* Last component of the name */
+   char *path;                      /* Full HGFS name, built at lookup */
+   size_t pathLen;                  /* strlen(path) */
+   uint64 nlookup;                  /* Lookups not yet forgotten */
+   uint32 refCount;                 /* Children holding the node */
+   Bool hashed;                     /* Reachable by (parent, name) */
+   uint64 generation;               /* Inode generation for the kernel */
+   HgfsHandle *handles;             /* Server handles open on it */
+   uint32 numHandles;               /* Handles in use, last is newest */
+   uint32 maxHandles;               /* Handles allocated */
+   Bool versionValid;               /* Kernel pages match version */
+   HgfsFuseNodeVersion version;     /* Attributes at the last open */
+} HgfsFuseNode;
+
+/*
+ * Name of a node copied out of the table so it can be used while the
+ * table lock is dropped. Short names never touch the heap.
+ */
+typedef struct HgfsFuseNodePath {
+   char *path;
+   char buf[256];
+} HgfsFuseNodePath;
+
+void HgfsNodeInit(void);
+void HgfsNodeExit(void);
+
+HgfsFuseNode *HgfsNodeGet(fuse_ino_t ino);
+fuse_ino_t HgfsNodeIno(HgfsFuseNode *node);
+
+int HgfsNodeGetPath(HgfsFuseNode *node, HgfsFuseNodePath *nodePath);
+int HgfsNodeGetChildPath(HgfsFuseNode *parent, const char *name,
+                         HgfsFuseNodePath *nodePath);
+void HgfsNodePutPath(HgfsFuseNodePath *nodePath);
+
+HgfsFuseNode *HgfsNodeLookup(HgfsFuseNode *parent, const char *name);
+void HgfsNodeForget(HgfsFuseNode *node, uint64 nlookup);
+void HgfsNodeUnhash(HgfsFuseNode *parent, const char *name);
+int HgfsNodeRename(HgfsFuseNode *oldParent, const char *oldName,
+                   HgfsFuseNode *newParent, const char *newName);
+
+void HgfsNodeAddHandle(HgfsFuseNode *node, HgfsHandle handle);
+void HgfsNodeRemoveHandle(HgfsFuseNode *node, HgfsHandle handle);
+HgfsHandle HgfsNodeGetHandle(HgfsFuseNode *node);
+
+Bool HgfsNodeKeepCache(HgfsFuseNode *node, const HgfsFuseNodeVersion *version);
+Bool HgfsNodeCheckCache(HgfsFuseNode *node,
+                        const HgfsFuseNodeVersion *version);
+void HgfsNodeDropCache(HgfsFuseNode *node);
+
+#endif // _VMHGFS_FUSE_NODE_H_
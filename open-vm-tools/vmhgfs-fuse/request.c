@@ -29,17 +29,153 @@
 #include "transport.h"
 #include "fsutil.h"
 #include "vm_assert.h"
+#include "vm_atomic.h"
 
-static HgfsHandle hgfsIdCounter;
-pthread_mutex_t hgfsIdLock = PTHREAD_MUTEX_INITIALIZER;
+#include <pthread.h>
+
+/* Request IDs only need to be unique among requests in flight. */
+static Atomic_uint32 hgfsIdCounter;
+
+/*
+ * Per-thread pools of free requests, one list per size class. Metadata
+ * calls are frequent and small so more of them are kept.
+ */
+typedef struct HgfsReqPool {
+   struct list_head freeList[HGFS_REQ_CLASS_COUNT];
+   uint32 freeCount[HGFS_REQ_CLASS_COUNT];
+} HgfsReqPool;
+
+static const size_t hgfsReqClassSize[HGFS_REQ_CLASS_COUNT] = {
+   HGFS_REQ_SMALL_PACKET_MAX,
+   HGFS_LARGE_PACKET_MAX,
+};
+
+static const uint32 hgfsReqPoolMax[HGFS_REQ_CLASS_COUNT] = {
+   16,
+   4,
+};
+
+static pthread_key_t hgfsReqPoolKey;
+static pthread_once_t hgfsReqPoolOnce = PTHREAD_ONCE_INIT;
+static Bool hgfsReqPoolKeyValid;
 
 
 /*
  *----------------------------------------------------------------------
  *
- * HgfsGetNewRequest --
+ * HgfsReqPoolDestroy --
  *
- *    Get a new request structure off the free list and initialize it.
+ *    Free the requests cached by a thread when it exits.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsReqPoolDestroy(void *data)  // IN: Thread's HgfsReqPool
+{
+   HgfsReqPool *pool = data;
+   int i;
+
+   for (i = 0; i < HGFS_REQ_CLASS_COUNT; i++) {
+      while (!list_empty(&pool->freeList[i])) {
+         HgfsReq *req = list_entry(pool->freeList[i].next, HgfsReq, list);
+
+         list_del(&req->list);
+         free(req);
+      }
+   }
+   free(pool);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsReqPoolKeyInit --
+ *
+ *    Create the thread-specific key of the request pools.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsReqPoolKeyInit(void)
+{
+   hgfsReqPoolKeyValid =
+      pthread_key_create(&hgfsReqPoolKey, HgfsReqPoolDestroy) == 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsReqPoolGet --
+ *
+ *    Get the request pool of the calling thread, creating it on first
+ *    use.
+ *
+ * Results:
+ *    The pool, or NULL if it could not be created. Requests are then
+ *    simply allocated and freed.
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static HgfsReqPool *
+HgfsReqPoolGet(void)
+{
+   HgfsReqPool *pool;
+   int i;
+
+   pthread_once(&hgfsReqPoolOnce, HgfsReqPoolKeyInit);
+   if (!hgfsReqPoolKeyValid) {
+      return NULL;
+   }
+
+   pool = pthread_getspecific(hgfsReqPoolKey);
+   if (pool != NULL) {
+      return pool;
+   }
+
+   pool = malloc(sizeof *pool);
+   if (pool == NULL) {
+      return NULL;
+   }
+   for (i = 0; i < HGFS_REQ_CLASS_COUNT; i++) {
+      INIT_LIST_HEAD(&pool->freeList[i]);
+      pool->freeCount[i] = 0;
+   }
+   if (pthread_setspecific(hgfsReqPoolKey, pool) != 0) {
+      free(pool);
+      return NULL;
+   }
+   return pool;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsGetNewRequestSize --
+ *
+ *    Get a new request structure whose packet can hold packetSize bytes
+ *    of payload, from the calling thread's pool if possible, and
+ *    initialize it.
  *
  * Results:
  *    On success the new struct is returned with all fields
@@ -52,30 +188,68 @@ pthread_mutex_t hgfsIdLock = PTHREAD_MUTEX_INITIALIZER;
  */
 
 HgfsReq *
-HgfsGetNewRequest(void)
+HgfsGetNewRequestSize(size_t packetSize)  // IN: Payload the packet must hold
 {
+   HgfsReqClass reqClass;
+   HgfsReqPool *pool;
    HgfsReq *req = NULL;
 
-   req = (HgfsReq*)malloc(sizeof(HgfsReq));
-   if (req == NULL) {
-      LOG(4, ("Can't allocate memory.\n"));
-      return NULL;
+   reqClass = packetSize <= hgfsReqClassSize[HGFS_REQ_CLASS_SMALL] ?
+              HGFS_REQ_CLASS_SMALL : HGFS_REQ_CLASS_LARGE;
+
+   pool = HgfsReqPoolGet();
+   if (pool != NULL && !list_empty(&pool->freeList[reqClass])) {
+      req = list_entry(pool->freeList[reqClass].next, HgfsReq, list);
+      list_del(&req->list);
+      pool->freeCount[reqClass]--;
+   } else {
+      req = malloc(sizeof *req + HGFS_CLIENT_CMD_LEN +
+                   hgfsReqClassSize[reqClass]);
+      if (req == NULL) {
+         LOG(4, ("Can't allocate memory.\n"));
+         return NULL;
+      }
+      req->reqClass = reqClass;
+      req->bufferSize = hgfsReqClassSize[reqClass];
+      req->packet = req->buffer;
+      /* Setup the packet prefix. */
+      memcpy(req->packet, HGFS_SYNC_REQREP_CLIENT_CMD,
+             HGFS_SYNC_REQREP_CLIENT_CMD_LEN);
    }
+
    INIT_LIST_HEAD(&req->list);
    req->payloadSize = 0;
    req->state = HGFS_REQ_STATE_ALLOCATED;
-   /* Setup the packet prefix. */
-   memcpy(req->packet, HGFS_SYNC_REQREP_CLIENT_CMD,
-          HGFS_SYNC_REQREP_CLIENT_CMD_LEN);
-   pthread_mutex_lock(&hgfsIdLock);
-   req->id = hgfsIdCounter;
-   hgfsIdCounter++;
-   pthread_mutex_unlock(&hgfsIdLock);
+   req->id = Atomic_ReadInc32(&hgfsIdCounter);
 
    return req;
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsGetNewRequest --
+ *
+ *    Get a new request structure large enough for any request or reply.
+ *
+ * Results:
+ *    On success the new struct is returned with all fields
+ *    initialized. Returns NULL on failure.
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+HgfsReq *
+HgfsGetNewRequest(void)
+{
+   return HgfsGetNewRequestSize(HGFS_LARGE_PACKET_MAX);
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -311,15 +485,20 @@ HgfsSendRequest(HgfsReq *req)       // IN/OUT: Outgoing request
    int ret;
 
    ASSERT(req);
-   ASSERT(req->payloadSize <= HGFS_LARGE_PACKET_MAX);
+   ASSERT(req->payloadSize <= req->bufferSize);
 
    req->state = HGFS_REQ_STATE_UNSENT;
+   req->replyError = 0;
 
    LOG(8, ("Sending request id %d\n", req->id));
    LOG(4, ("Before sending \n"));
 
    ret = HgfsTransportSendRequest(req);
    LOG(4, ("After sending \n"));
+   if (ret == 0) {
+      /* The server handled the request, but its reply was lost. */
+      ret = req->replyError;
+   }
 
    LOG(8, ("Request finished, return %d\n", ret));
    return ret;
@@ -331,7 +510,8 @@ HgfsSendRequest(HgfsReq *req)       // IN/OUT: Outgoing request
  *
  * HgfsFreeRequest --
  *
- *    Free an HGFS request.
+ *    Free an HGFS request, keeping it in the calling thread's pool if
+ *    the pool of its size is not full.
  *
  * Results:
  *    None
@@ -345,7 +525,28 @@ HgfsSendRequest(HgfsReq *req)       // IN/OUT: Outgoing request
 void
 HgfsFreeRequest(HgfsReq *req) // IN: Request to free
 {
-   free(req);
+   HgfsReqPool *pool;
+
+   if (req == NULL) {
+      return;
+   }
+
+   if (req->packet != req->buffer) {
+      /* A reply outgrew the packet; go back to the original one. */
+      free(req->packet);
+      req->packet = req->buffer;
+      req->bufferSize = hgfsReqClassSize[req->reqClass];
+   }
+
+   pool = HgfsReqPoolGet();
+   if (pool == NULL ||
+       pool->freeCount[req->reqClass] >= hgfsReqPoolMax[req->reqClass]) {
+      free(req);
+      return;
+   }
+
+   list_add(&req->list, &pool->freeList[req->reqClass]);
+   pool->freeCount[req->reqClass]++;
 }
 
 
@@ -419,7 +620,9 @@ out:
  * HgfsCompleteReq --
  *
  *    Copies the reply packet into the request structure and wakes up
- *    the associated client.
+ *    the associated client. If a reply too large for the request cannot
+ *    be stored, the request fails with -ENOMEM, which HgfsSendRequest
+ *    returns.
  *
  * Results:
  *    None
@@ -439,9 +642,31 @@ HgfsCompleteReq(HgfsReq *req,       // IN: Request
    ASSERT(reply);
    ASSERT(replySize <= HGFS_LARGE_PACKET_MAX);
 
+   if (replySize > req->bufferSize) {
+      /*
+       * A reply to a small request that carries a long name. Callers only
+       * look at the reply after sending, so the packet may move.
+       */
+      char *packet = malloc(HGFS_CLIENT_CMD_LEN + HGFS_LARGE_PACKET_MAX);
+
+      if (packet == NULL) {
+         LOG(4, ("Can't allocate memory for a %"FMTSZ"u byte reply.\n",
+                 replySize));
+         req->replyError = -ENOMEM;
+         req->payloadSize = 0;
+         req->state = HGFS_REQ_STATE_COMPLETED;
+         goto out;
+      }
+      memcpy(packet, req->packet, HGFS_CLIENT_CMD_LEN);
+      req->packet = packet;
+      req->bufferSize = HGFS_LARGE_PACKET_MAX;
+   }
+
    memcpy(HGFS_REQ_PAYLOAD(req), reply, replySize);
    req->payloadSize = replySize;
    req->state = HGFS_REQ_STATE_COMPLETED;
+
+out:
    if (!list_empty(&req->list)) {
       list_del_init(&req->list);
    }
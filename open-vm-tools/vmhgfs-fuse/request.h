@@ -80,6 +80,23 @@ typedef enum {
    HGFS_REQ_STATE_COMPLETED,
 } HgfsState;
 
+/*
+ * Requests come in two sizes. Metadata requests only carry names and get
+ * a packet of the classic HGFS_PACKET_MAX size, reads, writes and
+ * directory reads get a large one. Freed requests are kept in per-thread
+ * pools of each size.
+ */
+typedef enum {
+   HGFS_REQ_CLASS_SMALL,
+   HGFS_REQ_CLASS_LARGE,
+   HGFS_REQ_CLASS_COUNT
+} HgfsReqClass;
+
+#define HGFS_REQ_SMALL_PACKET_MAX HGFS_PACKET_MAX
+
+/* Room for any request header and fixed fields ahead of the names. */
+#define HGFS_REQ_NAME_OVERHEAD 512
+
 /*
  * A request to be sent to the user process.
  */
@@ -103,15 +120,29 @@ typedef struct HgfsReq {
    /* Total size of the payload.*/
    size_t payloadSize;
 
+   /* Negative error if the reply could not be stored, zero otherwise. */
+   int replyError;
+
+   /* Size class the request was allocated from. */
+   HgfsReqClass reqClass;
+
+   /* Largest payload the packet can hold. */
+   size_t bufferSize;
+
    /*
     * Packet of data, for both incoming and outgoing messages.
-    * Include room for the command.
+    * Include room for the command. Points to buffer, or to a large
+    * packet if a reply did not fit a small request.
     */
-   char packet[HGFS_LARGE_PACKET_MAX + HGFS_CLIENT_CMD_LEN];
+   char *packet;
+
+   /* Storage for the packet, sized by the class. */
+   char buffer[0];
 } HgfsReq;
 
 /* Public functions (with respect to the entire module). */
 HgfsReq *HgfsGetNewRequest(void);
+HgfsReq *HgfsGetNewRequestSize(size_t packetSize);
 HgfsStatus HgfsPackHeader(HgfsReq *req, HgfsOp opUsed);
 HgfsStatus HgfsUnpackHeader(void *serverReply,
 			    size_t replySize,
@@ -131,6 +162,11 @@ size_t HgfsGetRequestHeaderSize(void);
 int HgfsSendRequest(HgfsReq *req);
 void HgfsFreeRequest(HgfsReq *req);
 HgfsStatus HgfsGetReplyStatus(HgfsReq *req);
+
+/* Get a request whose packet can hold nameLen bytes of names. */
+#define HgfsGetNewNameRequest(nameLen) \
+   HgfsGetNewRequestSize(HGFS_REQ_NAME_OVERHEAD + (nameLen))
+
 void HgfsCompleteReq(HgfsReq *req,
                      char const *reply,
                      size_t replySize);
@@ -185,7 +185,7 @@ HgfsCreateSession(void)
    gState->sessionEnabled = TRUE;
    gState->headerVersion = HGFS_HEADER_VERSION;
 
-   req = HgfsGetNewRequest();
+   req = HgfsGetNewNameRequest(0);
    if (!req) {
       LOG(4, ("Out of memory while getting new request.\n"));
       result = -ENOMEM;
@@ -371,7 +371,7 @@ HgfsDestroySession(void)
      return 0;
    }
 
-   req = HgfsGetNewRequest();
+   req = HgfsGetNewNameRequest(0);
    if (!req) {
       LOG(4, ("Out of memory while getting new request.\n"));
       result = -ENOMEM;
@@ -24,9 +24,10 @@
  * actual transport channels (backdoor, tcp, vsock, ...).
  *
  * The sends happen in the process context, where as a thread
- * handles the asynchronous replies. A queue of pending replies is
- * maintained and is protected by a lock. The channel opens and close
- * is protected by a mutex.
+ * handles the asynchronous replies. A table of pending requests, hashed
+ * by request ID, is maintained and is protected by a lock. Sends share
+ * a read lock on the active channel, so several can be in flight; the
+ * channel opens and closes take it exclusively.
  */
 
 
@@ -38,11 +39,15 @@
 #include "transport.h"
 #include "vm_assert.h"
 
+#define HGFS_PENDING_BUCKETS 64
+
 static HgfsTransportChannel *gHgfsActiveChannel;     /* Current active channel. */
-static pthread_mutex_t gHgfsActiveChannelLock;       /* Current active channel lock. */
+static pthread_rwlock_t gHgfsActiveChannelLock;      /* Current active channel lock. */
 static Bool gHgfsActiveChannelLockInited;
+static uint32 gHgfsActiveChannelGeneration;          /* Bumped on open/reset. */
 
-static struct list_head gHgfsPendingRequests;        /* Pending requests queue. */
+/* Pending requests, hashed by ID. */
+static struct list_head gHgfsPendingRequests[HGFS_PENDING_BUCKETS];
 static pthread_mutex_t gHgfsPendingRequestsLock;     /* Pending requests queue lock. */
 static Bool gHgfsPendingRequestsLockInited;
 
@@ -158,8 +163,10 @@ HgfsTransportChannelReset(HgfsTransportChannel **channel) // IN: active channel
  *
  * HgfsTransportEnqueueRequest --
  *
- *     Add the request to the gHgfsPendingRequests queue.
+ *     Add the request to the gHgfsPendingRequests table.
  *
+ * Results:
+ *     None
  *
  * Side effects:
  *     None
@@ -173,7 +180,8 @@ HgfsTransportEnqueueRequest(HgfsReq *req)   // IN: Request to add
    ASSERT(req);
 
    pthread_mutex_lock(&gHgfsPendingRequestsLock);
-   list_add_tail(&req->list, &gHgfsPendingRequests);
+   list_add_tail(&req->list,
+                 &gHgfsPendingRequests[req->id % HGFS_PENDING_BUCKETS]);
    pthread_mutex_unlock(&gHgfsPendingRequestsLock);
 }
 
@@ -183,7 +191,7 @@ HgfsTransportEnqueueRequest(HgfsReq *req)   // IN: Request to add
  *
  * HgfsTransportDequeueRequest --
  *
- *     Removes the request from the gHgfsPendingRequests queue.
+ *     Removes the request from the gHgfsPendingRequests table.
  *
  * Results:
  *     None
@@ -233,6 +241,7 @@ HgfsTransportProcessPacket(char *receivedPacket,    //IN: received packet
                            size_t receivedSize)     //IN: packet size
 {
    struct list_head *cur, *next;
+   struct list_head *bucket;
    HgfsHandle id;
    Bool found = FALSE;
 
@@ -243,11 +252,12 @@ HgfsTransportProcessPacket(char *receivedPacket,    //IN: received packet
    LOG(8, ("Entered.\n"));
    LOG(6, ("Req id: %d\n", id));
    /*
-    * Search through gHgfsPendingRequests queue for the matching id and wake up
-    * the associated waiting process. Delete the req from the queue.
+    * Search the gHgfsPendingRequests bucket for the matching id and wake up
+    * the associated waiting process. Delete the req from the table.
     */
    pthread_mutex_lock(&gHgfsPendingRequestsLock);
-   list_for_each_safe(cur, next, &gHgfsPendingRequests) {
+   bucket = &gHgfsPendingRequests[id % HGFS_PENDING_BUCKETS];
+   list_for_each_safe(cur, next, bucket) {
       HgfsReq *req;
       req = list_entry(cur, HgfsReq, list);
       if (req->id == id) {
@@ -287,16 +297,19 @@ void
 HgfsTransportBeforeExitingRecvThread(void)
 {
    struct list_head *cur, *next;
+   int i;
 
-   /* Walk through gHgfsPendingRequests queue and reply them with error. */
+   /* Walk through gHgfsPendingRequests table and reply them with error. */
    pthread_mutex_lock(&gHgfsPendingRequestsLock);
-   list_for_each_safe(cur, next, &gHgfsPendingRequests) {
-      HgfsReq *req;
-      HgfsReply reply;
-
-      req = list_entry(cur, HgfsReq, list);
-      LOG(6, ("Injecting error reply to req id: %d\n", req->id));
-      HgfsCompleteReq(req, (char *)&reply, sizeof reply);
+   for (i = 0; i < HGFS_PENDING_BUCKETS; i++) {
+      list_for_each_safe(cur, next, &gHgfsPendingRequests[i]) {
+         HgfsReq *req;
+         HgfsReply reply;
+
+         req = list_entry(cur, HgfsReq, list);
+         LOG(6, ("Injecting error reply to req id: %d\n", req->id));
+         HgfsCompleteReq(req, (char *)&reply, sizeof reply);
+      }
    }
    pthread_mutex_unlock(&gHgfsPendingRequestsLock);
 }
@@ -321,43 +334,70 @@ HgfsTransportBeforeExitingRecvThread(void)
 int
 HgfsTransportSendRequest(HgfsReq *req)   // IN: Request to send
 {
+   HgfsTransportChannel *channel;
+   uint32 generation;
+   Bool queued;
+   Bool retried = FALSE;
    int ret;
+
    ASSERT(req);
    ASSERT(req->state == HGFS_REQ_STATE_UNSENT);
-   ASSERT(req->payloadSize <= HGFS_LARGE_PACKET_MAX);
+   ASSERT(req->payloadSize <= req->bufferSize);
 
-   pthread_mutex_lock(&gHgfsActiveChannelLock);
+retry:
+   pthread_rwlock_rdlock(&gHgfsActiveChannelLock);
 
    /* Try opening the channel. */
    if (NULL == gHgfsActiveChannel) {
-      ret = HgfsTransportChannelOpen(&gHgfsActiveChannel);
+      pthread_rwlock_unlock(&gHgfsActiveChannelLock);
+      pthread_rwlock_wrlock(&gHgfsActiveChannelLock);
+      ret = 0;
+      if (NULL == gHgfsActiveChannel) {
+         ret = HgfsTransportChannelOpen(&gHgfsActiveChannel);
+         gHgfsActiveChannelGeneration++;
+      }
+      pthread_rwlock_unlock(&gHgfsActiveChannelLock);
       if (ret != 0) {
-         goto exit;
+         return ret;
       }
+      goto retry;
    }
 
-   ASSERT(gHgfsActiveChannel->ops.send);
-
-   HgfsTransportEnqueueRequest(req);
+   channel = gHgfsActiveChannel;
+   generation = gHgfsActiveChannelGeneration;
+   ASSERT(channel->ops.send);
 
-   ret = gHgfsActiveChannel->ops.send(gHgfsActiveChannel, req);
-   if (ret < 0) {
-      LOG(4, ("Send failed, status = %d. Try reopening the channel ...\n",
-              ret));
-      if (HgfsTransportChannelReset(&gHgfsActiveChannel)) {
-         ret = gHgfsActiveChannel->ops.send(gHgfsActiveChannel, req);
-      }
+   /* Only channels with a receive side complete requests later. */
+   queued = channel->ops.recv != NULL;
+   if (queued) {
+      HgfsTransportEnqueueRequest(req);
    }
 
-exit:
+   ret = channel->ops.send(channel, req);
+
    ASSERT(req->state == HGFS_REQ_STATE_COMPLETED ||
           req->state == HGFS_REQ_STATE_SUBMITTED ||
           req->state == HGFS_REQ_STATE_UNSENT);
 
-   pthread_mutex_unlock(&gHgfsActiveChannelLock);
+   pthread_rwlock_unlock(&gHgfsActiveChannelLock);
 
    if (ret < 0) {
-      HgfsTransportDequeueRequest(req);
+      if (queued) {
+         HgfsTransportDequeueRequest(req);
+      }
+      if (!retried) {
+         LOG(4, ("Send failed, status = %d. Try reopening the channel ...\n",
+                 ret));
+         pthread_rwlock_wrlock(&gHgfsActiveChannelLock);
+         if (generation == gHgfsActiveChannelGeneration) {
+            /* No other sender has reset it in the meantime. */
+            HgfsTransportChannelReset(&gHgfsActiveChannel);
+            gHgfsActiveChannelGeneration++;
+         }
+         pthread_rwlock_unlock(&gHgfsActiveChannelLock);
+         retried = TRUE;
+         goto retry;
+      }
    }
 
    return ret;
@@ -387,11 +427,14 @@ int
 HgfsTransportInit(void)
 {
    int res;
+   int i;
 
    gHgfsActiveChannel = NULL;
    gHgfsPendingRequestsLockInited = FALSE;
    gHgfsActiveChannelLockInited = FALSE;
-   INIT_LIST_HEAD(&gHgfsPendingRequests);
+   for (i = 0; i < HGFS_PENDING_BUCKETS; i++) {
+      INIT_LIST_HEAD(&gHgfsPendingRequests[i]);
+   }
 
    res = pthread_mutex_init(&gHgfsPendingRequestsLock, NULL);
    if (res != 0) {
@@ -400,7 +443,7 @@ HgfsTransportInit(void)
    }
    gHgfsPendingRequestsLockInited = TRUE;
 
-   res = pthread_mutex_init(&gHgfsActiveChannelLock, NULL);
+   res = pthread_rwlock_init(&gHgfsActiveChannelLock, NULL);
    if (res != 0) {
       res = -res;
       goto exit;
@@ -408,6 +451,7 @@ HgfsTransportInit(void)
    gHgfsActiveChannelLockInited = TRUE;
 
    res = HgfsTransportChannelOpen(&gHgfsActiveChannel);
+   gHgfsActiveChannelGeneration++;
 
 exit:
    if (res != 0) {
@@ -436,18 +480,22 @@ exit:
 void
 HgfsTransportExit(void)
 {
+   int i;
+
    LOG(8, ("Entered.\n"));
 
    if (gHgfsActiveChannelLockInited) {
-      pthread_mutex_lock(&gHgfsActiveChannelLock);
+      pthread_rwlock_wrlock(&gHgfsActiveChannelLock);
       HgfsTransportChannelClose(&gHgfsActiveChannel);
-      pthread_mutex_unlock(&gHgfsActiveChannelLock);
+      pthread_rwlock_unlock(&gHgfsActiveChannelLock);
 
-      pthread_mutex_destroy(&gHgfsActiveChannelLock);
+      pthread_rwlock_destroy(&gHgfsActiveChannelLock);
       gHgfsActiveChannelLockInited = FALSE;
    }
 
-   ASSERT(list_empty(&gHgfsPendingRequests));
+   for (i = 0; i < HGFS_PENDING_BUCKETS; i++) {
+      ASSERT(list_empty(&gHgfsPendingRequests[i]));
+   }
 
    if (gHgfsPendingRequestsLockInited) {
       pthread_mutex_destroy(&gHgfsPendingRequestsLock);